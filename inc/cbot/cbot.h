@@ -18,6 +18,7 @@
 struct cbot;
 
 struct cbot_handler;
+struct cbot_backend;
 
 /**
  * An enumeration of possible events that can be handled by a plugin.
@@ -67,6 +68,8 @@ struct cbot_message_event {
 	bool is_action;
 	size_t *indices;
 	int num_captures;
+	/* The backend which received the message (see cbot_backend_name()) */
+	struct cbot_backend *backend;
 };
 struct cbot_user_event {
 	struct cbot *bot;
@@ -74,6 +77,7 @@ struct cbot_user_event {
 	enum cbot_event_type type; /* CBOT_JOIN, CBOT_PART */
 	const char *channel;
 	const char *username;
+	struct cbot_backend *backend;
 };
 struct cbot_nick_event {
 	struct cbot *bot;
@@ -81,6 +85,7 @@ struct cbot_nick_event {
 	enum cbot_event_type type; /* CBOT_NICK, CBOT_BOT_NAME */
 	const char *old_username;
 	const char *new_username;
+	struct cbot_backend *backend;
 };
 struct cbot_http_event {
 	struct cbot *bot;
@@ -333,6 +338,35 @@ struct cbot_handler *cbot_register2(struct cbot_plugin *plugin,
                                     cbot_handler_t handler, void *user,
                                     char *regex, int re_flags);
 
+/* Flags for cbot_register_scoped() */
+#define CBOT_SCOPE_DM 0x1
+
+/**
+ * @brief Register a handler for events in particular channels
+ *
+ * Like cbot_register2(), but the handler only receives events from the given
+ * channels, and from direct messages if @a flags includes CBOT_SCOPE_DM. Events
+ * from anywhere else skip it entirely, without running its regex. Only
+ * CBOT_MESSAGE, CBOT_ADDRESSED, CBOT_JOIN and CBOT_PART handlers may be scoped.
+ *
+ * @param plugin The plugin of this event
+ * @param event Event type you are registering to handle
+ * @param handler Event handler callback
+ * @param user User pointer for this function
+ * @param regex Regular expression (if applicable)
+ * @param re_flags Flags passed to sc_regex_compile2()
+ * @param channels NULL-terminated list of channels (may be NULL)
+ * @param flags CBOT_SCOPE_DM, or 0
+ * @returns The "cbot_handler" pointer, or NULL if the event type can't be
+ *   scoped.
+ */
+struct cbot_handler *cbot_register_scoped(struct cbot_plugin *plugin,
+                                          enum cbot_event_type type,
+                                          cbot_handler_t handler, void *user,
+                                          char *regex, int re_flags,
+                                          const char *const *channels,
+                                          int flags);
+
 /**
  * @brief Deregister an existing handler
  * @param bot The bot instance
@@ -400,6 +434,19 @@ void cbot_user_info_free_all(struct sc_list_head *head);
  */
 const char *cbot_get_name(struct cbot *bot);
 
+/**
+ * Return the name of a backend.
+ *
+ * A bot may run several backends at once. Each is named by the section which
+ * configures it (e.g. "irc" or "signal"), and events carry the backend they
+ * came from. Messages which the bot sends are routed to the backend of their
+ * destination, so plugins rarely need to care.
+ *
+ * @param backend Backend from an event
+ * @returns Name of the backend's configuration section
+ */
+const char *cbot_backend_name(const struct cbot_backend *backend);
+
 /**
  * Return the bot's lightweight thread context.
  *
@@ -533,6 +580,49 @@ extern const cbot_formatter_ops_t cbot_default_formatters[];
 #define cbot_dfmt(cb, fmt, ...)                                                \
 	cbot_format2(cb, fmt, cbot_default_formatters, ##__VA_ARGS__)
 
+/**
+ * A format string, compiled for repeated rendering.
+ *
+ * cbot_format() and cbot_format2() keep a small cache of compiled templates,
+ * but they must still hash the format string on each call. A plugin which
+ * renders the same strings many times (e.g. configured responses) can compile
+ * them once, at which point rendering is a loop which neither scans the format
+ * string nor allocates (beyond what the formatters and output buffer need).
+ */
+struct cbot_template;
+
+/**
+ * Compile a format string for cbot_template_render().
+ *
+ * Each token's formatter is looked up in @a ops now, rather than at render
+ * time.
+ *
+ * @param fmt Format string with "{prefix:suffix}" tokens
+ * @param ops Array of formatter operations, terminated by NULL prefix
+ * @returns The compiled template, or NULL if the format string is invalid or
+ *   uses a formatter not in @a ops
+ */
+struct cbot_template *cbot_template_compile(const char *fmt,
+                                            const cbot_formatter_ops_t *ops);
+
+/**
+ * Render a compiled template, as cbot_format2() would.
+ *
+ * @param cb Output buffer
+ * @param t Compiled template
+ * @param ... Variable arguments consumed by formatters
+ * @returns Number of format tokens processed, or negative on error
+ */
+int cbot_template_render(struct sc_charbuf *cb, const struct cbot_template *t,
+                         ...);
+int cbot_template_vrender(struct sc_charbuf *cb, const struct cbot_template *t,
+                          va_list args);
+
+/**
+ * Free a template from cbot_template_compile().
+ */
+void cbot_template_free(struct cbot_template *t);
+
 /******************
  * HTTP Utilities
  ******************/
@@ -633,11 +723,41 @@ void cbot_set_log_level(int level);
 int cbot_get_log_level(void);
 void cbot_set_log_file(FILE *f);
 int cbot_lookup_level(const char *str);
+/* Return the name of a level, e.g. "INFO", or "" if it has none */
+const char *cbot_level_name(int level);
 
-#define CL_CRIT(...)  cbot_log(CRIT, " CRIT: " __VA_ARGS__)
-#define CL_WARN(...)  cbot_log(WARN, " WARN: " __VA_ARGS__)
-#define CL_INFO(...)  cbot_log(INFO, " INFO: " __VA_ARGS__)
-#define CL_DEBUG(...) cbot_log(DEBUG, "DEBUG: " __VA_ARGS__)
-#define CL_VERB(...)  cbot_log(VERB, "VERB: " __VA_ARGS__)
+/* The runtime log level. Read by the CL_ macros; use cbot_set_log_level(). */
+extern int cbot_current_log_level;
+
+/*
+ * Messages below this level are compiled out entirely. The build sets it via
+ * the "min_log_level" meson option.
+ */
+#ifndef CBOT_LOG_MIN_LEVEL
+#define CBOT_LOG_MIN_LEVEL VERB
+#endif
+
+/*
+ * True if messages at this level are logged. Use it to skip work which is only
+ * done to build a log message.
+ */
+#define CL_ENABLED(level)                                                      \
+	((level) >= CBOT_LOG_MIN_LEVEL && (level) >= cbot_current_log_level)
+
+/*
+ * The level is checked before calling into the logger, so filtered messages
+ * cost a comparison, and their arguments are never evaluated or formatted.
+ */
+#define CL_LOG(level, ...)                                                     \
+	do {                                                                   \
+		if (CL_ENABLED(level))                                         \
+			cbot_log((level), __VA_ARGS__);                        \
+	} while (0)
+
+#define CL_CRIT(...)  CL_LOG(CRIT, " CRIT: " __VA_ARGS__)
+#define CL_WARN(...)  CL_LOG(WARN, " WARN: " __VA_ARGS__)
+#define CL_INFO(...)  CL_LOG(INFO, " INFO: " __VA_ARGS__)
+#define CL_DEBUG(...) CL_LOG(DEBUG, "DEBUG: " __VA_ARGS__)
+#define CL_VERB(...)  CL_LOG(VERB, "VERB: " __VA_ARGS__)
 
 #endif // CBOT_H
@@ -4,6 +4,8 @@
 #include "cbot/cbot.h"
 #include "sc-collections.h"
 #include <curl/curl.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 /**
  * @brief Use this instead of curl_easy_perform in order to make a request.
@@ -22,6 +24,54 @@
  */
 CURLcode cbot_curl_perform(struct cbot *bot, CURL *handle);
 
+/**
+ * @brief When should cbot_curl_perform_many() return?
+ */
+enum cbot_curl_wait {
+	/** Once every request has completed */
+	CBOT_CURL_WAIT_ALL,
+	/** As soon as any one request has completed */
+	CBOT_CURL_WAIT_ANY,
+};
+
+/**
+ * @brief One request in a batch for cbot_curl_perform_many()
+ */
+struct cbot_curl_req {
+	/** Easy handle for the request (set by caller) */
+	CURL *handle;
+	/** True if the request completed before we returned */
+	bool done;
+	/** Result as curl_easy_perform would have returned it */
+	CURLcode result;
+	/** Milliseconds from the start of the batch until completion */
+	long elapsed_ms;
+};
+
+/**
+ * @brief Perform several requests concurrently, blocking the current lwt
+ *
+ * All handles are added to the curl multi instance at once, so the batch
+ * takes roughly as long as its slowest request, not the sum of them. The
+ * current lwt resumes according to @a mode, or when @a timeout_ms passes.
+ * Any request not done at that point is cancelled: its done field is false and
+ * its result is CURLE_OPERATION_TIMEDOUT. Either way, every handle is removed
+ * from the multi instance by the time this returns, so the caller owns them
+ * again.
+ *
+ * Like cbot_curl_perform(), this uses CURLOPT_PRIVATE on each handle.
+ *
+ * @param bot Bot which is being used
+ * @param reqs Array of requests, with the handle field filled in
+ * @param n Number of requests
+ * @param mode Whether to wait for all requests, or the first to complete
+ * @param timeout_ms Deadline in milliseconds, or negative for none
+ * @returns The number of requests which completed
+ */
+size_t cbot_curl_perform_many(struct cbot *bot, struct cbot_curl_req *reqs,
+                              size_t n, enum cbot_curl_wait mode,
+                              long timeout_ms);
+
 /**
  * @brief Use this to configure your CURL handle to write response to a charbuf
  *
@@ -32,13 +82,196 @@ CURLcode cbot_curl_perform(struct cbot *bot, CURL *handle);
  */
 void cbot_curl_charbuf_response(CURL *easy, struct sc_charbuf *buf);
 
+/**
+ * @brief Consumer for a streamed response body
+ *
+ * Called with each chunk of the response body as it arrives. The data is not
+ * NUL terminated. Return 0 to continue the transfer, or non-zero to abort it
+ * (e.g. once you have found what you were looking for).
+ */
+typedef int (*cbot_curl_chunk_cb)(const char *data, size_t len, void *arg);
+
+/**
+ * @brief Consumer for a streamed response body, one line at a time
+ *
+ * Called with each line of the response body, NUL terminated, with the line
+ * ending ("\n" or "\r\n") removed. The line buffer may be modified, but it is
+ * reused after the callback returns. Return 0 to continue the transfer, or
+ * non-zero to abort it.
+ */
+typedef int (*cbot_curl_line_cb)(char *line, size_t len, void *arg);
+
+/**
+ * @brief State for a streamed response. Treat the contents as private.
+ */
+struct cbot_curl_stream {
+	cbot_curl_chunk_cb chunk;
+	cbot_curl_line_cb line;
+	void *arg;
+	struct sc_charbuf partial;
+	bool aborted;
+};
+
+/**
+ * @brief Configure a CURL handle to pass the response to a chunk consumer
+ *
+ * The body is handed to @a cb as it is received, rather than being buffered,
+ * so parsing overlaps with the download and memory use is bounded. After the
+ * transfer, you must call cbot_curl_stream_finish().
+ *
+ * @param easy Handle
+ * @param stream Stream state, which must live until the transfer completes
+ * @param cb Consumer for each chunk
+ * @param arg Argument passed to @a cb
+ */
+void cbot_curl_stream_response(CURL *easy, struct cbot_curl_stream *stream,
+                               cbot_curl_chunk_cb cb, void *arg);
+
+/**
+ * @brief Configure a CURL handle to pass the response to a line consumer
+ *
+ * Just like cbot_curl_stream_response(), but the body is split into lines.
+ * Lines longer than CBOT_CURL_MAX_LINE bytes are truncated.
+ */
+void cbot_curl_line_response(CURL *easy, struct cbot_curl_stream *stream,
+                             cbot_curl_line_cb cb, void *arg);
+
+#define CBOT_CURL_MAX_LINE 8192
+
+/**
+ * @brief Complete a streamed response and free its resources
+ *
+ * For line streams, this delivers any final line which was not terminated by a
+ * newline. A transfer which the consumer aborted is not treated as an error.
+ *
+ * @param stream Stream state
+ * @param rv The result of cbot_curl_perform()
+ * @returns 0 on success (or consumer abort), -1 on error (which is logged)
+ */
+int cbot_curl_stream_finish(struct cbot_curl_stream *stream, CURLcode rv);
+
+/**
+ * @brief Make a HTTP request to a URL, streaming the response line by line
+ *
+ * This is the streaming analogue of cbot_curl_get(). The response is not
+ * cached.
+ *
+ * @param bot Bot to make the request with
+ * @param cb Consumer for each line of the response
+ * @param arg Argument passed to @a cb
+ * @param url Format string for the URL
+ * @returns 0 on success (or consumer abort), -1 on error (which is logged)
+ */
+int cbot_curl_get_lines(struct cbot *bot, cbot_curl_line_cb cb, void *arg,
+                        const char *url, ...);
+
+/**
+ * @brief Validators for conditional requests to one URL
+ *
+ * Keep one of these alongside whatever you derived from the last response to
+ * the URL, zero-initialized to begin with. The etag and last_modified fields
+ * may be read, but treat the rest as private.
+ */
+struct cbot_curl_validators {
+	/** ETag of the last response, or NULL */
+	char *etag;
+	/** Last-Modified of the last response, or NULL */
+	char *last_modified;
+	/* State of the request in progress */
+	char *new_etag;
+	char *new_last_modified;
+	struct curl_slist *headers;
+};
+
+/**
+ * @brief The outcome of a conditional request
+ */
+enum cbot_curl_cond {
+	/** The request failed, or the response was neither 200 nor 304 */
+	CBOT_CURL_FAILED,
+	/** The resource has changed (200), and its new validators are stored */
+	CBOT_CURL_MODIFIED,
+	/** The resource is unchanged (304), so there is no body */
+	CBOT_CURL_NOT_MODIFIED,
+};
+
+/**
+ * @brief Make a request conditional on the validators of the last response
+ *
+ * Sends If-None-Match and If-Modified-Since for whichever validators @a val
+ * holds (none, for the first request), and collects the validators of the
+ * response. This uses CURLOPT_HTTPHEADER and CURLOPT_HEADERFUNCTION. After the
+ * transfer, and before cleaning up the handle, you must call
+ * cbot_curl_conditional_finish().
+ *
+ * Unlike cbot_curl_get(), this keeps no copy of the body, so it suits large
+ * responses which the caller parses as they arrive (see
+ * cbot_curl_line_response()), and which would not fit in the response cache.
+ *
+ * @param easy Handle
+ * @param val Validators, which must live until the transfer completes
+ */
+void cbot_curl_conditional(CURL *easy, struct cbot_curl_validators *val);
+
+/**
+ * @brief Complete a conditional request
+ *
+ * On CBOT_CURL_MODIFIED, the validators now describe the new response: if you
+ * end up discarding it, call cbot_curl_validators_free() so that the next
+ * request is unconditional. On CBOT_CURL_NOT_MODIFIED, whatever you derived
+ * from the last response is still current. On CBOT_CURL_FAILED, the
+ * validators are unchanged.
+ *
+ * @param easy Handle
+ * @param val Validators passed to cbot_curl_conditional()
+ * @param rv The result of the transfer
+ * @returns The outcome of the request
+ */
+enum cbot_curl_cond
+cbot_curl_conditional_finish(CURL *easy, struct cbot_curl_validators *val,
+                             CURLcode rv);
+
+/**
+ * @brief Free and forget a set of validators
+ */
+void cbot_curl_validators_free(struct cbot_curl_validators *val);
+
 /**
  * @brief Make a HTTP request to a URL and return the result
  *
  * This is as simple as it gets. On error, NULL is returned and a message is
  * logged to cbot's logging. On success, a malloc-allocated buffer is returned
  * with the contents of the response.
+ *
+ * Responses are cached in memory by URL, honoring Cache-Control (max-age,
+ * no-cache, no-store) and revalidating stale entries via ETag/Last-Modified.
+ * Responses with no Cache-Control header are kept for the configured default
+ * TTL. If another LWT is already fetching the same URL, this waits for that
+ * request rather than making a new one. Each caller receives its own copy of
+ * the body. Use cbot_curl_perform() if you need to bypass the cache.
  */
 char *cbot_curl_get(struct cbot *bot, const char *url, ...);
 
+/**
+ * @brief Fetch several URLs concurrently and return their bodies
+ *
+ * The batch analogue of cbot_curl_get(), built on cbot_curl_perform_many().
+ * Responses go through the same cache: fresh entries are returned without a
+ * request, and a URL which another LWT is already fetching is waited on (with
+ * the same mode and deadline as the rest of the batch). On return, bodies[i]
+ * is a malloc-allocated buffer with the response to urls[i], or NULL if that
+ * request failed or did not complete in time.
+ *
+ * @param bot Bot to make the requests with
+ * @param n Number of URLs
+ * @param urls Array of URLs
+ * @param bodies Array of n pointers which receive the results
+ * @param mode Whether to wait for all requests, or the first to complete
+ * @param timeout_ms Deadline in milliseconds, or negative for none
+ * @returns Number of requests which succeeded
+ */
+int cbot_curl_get_many(struct cbot *bot, size_t n, const char *const *urls,
+                       char **bodies, enum cbot_curl_wait mode,
+                       long timeout_ms);
+
 #endif
@@ -40,29 +40,19 @@ static void handle_query(void *data)
 	struct aqi_query *query = data;
 	struct aqi *aqi = query->aqi;
 	struct cbot_plugin *plugin = aqi->plugin;
-	struct sc_charbuf urlbuf, respbuf;
-	CURL *easy;
+	struct sc_charbuf urlbuf;
+	char *resp;
 	struct json_easy *json;
 	uint32_t idx;
 	int rv, aqival;
 
 	sc_cb_init(&urlbuf, 256);
-	sc_cb_init(&respbuf, 512);
-	sc_cb_printf(&urlbuf, URLFMT, query->location, aqi->token);
-
-	easy = curl_easy_init();
-	curl_easy_setopt(easy, CURLOPT_URL, urlbuf.buf);
-	// curl_easy_setopt(easy, CURLOPT_VERBOSE, 1L);
-	cbot_curl_charbuf_response(easy, &respbuf);
-	rv = cbot_curl_perform(plugin->bot, easy);
-	if (rv != CURLE_OK) {
-		fprintf(stderr, "aqi: curl error: %s\n",
-		        curl_easy_strerror(rv));
+
+	resp = cbot_curl_get(plugin->bot, URLFMT, query->location, aqi->token);
+	if (!resp)
 		goto out_curl;
-	}
-	// printf("RESULT\n%s\nENDRESULT\n", respbuf.buf);
 
-	json = json_easy_new(respbuf.buf);
+	json = json_easy_new(resp);
 	rv = json_easy_parse(json);
 	if (rv != JSON_OK) {
 		fprintf(stderr, "aqi: nosj error: %s\n", json_strerror(rv));
@@ -78,7 +68,7 @@ static void handle_query(void *data)
 		bool freemsg = false;
 		rv = json_easy_lookup(json, 0, "data", &idx);
 		if (!rv) {
-			rv = json_easy_string_get(easy, idx, &msg);
+			rv = json_easy_string_get(json, idx, &msg);
 			if (!rv)
 				freemsg = true;
 		}
@@ -108,11 +98,10 @@ out_api:
 	json_easy_free(json);
 out_curl:
 	sc_cb_destroy(&urlbuf);
-	sc_cb_destroy(&respbuf);
+	free(resp);
 	free(query->channel);
 	free(query->location);
 	free(query);
-	curl_easy_cleanup(easy);
 	aqi->query_count--;
 }
 
@@ -1,5 +1,14 @@
 /*
  * events.c: warning about events at local venues
+ *
+ * Each venue's iCal feed is parsed once per refresh into an array of events
+ * sorted by start time, so that a query is just a binary search. Feeds are
+ * refreshed at most every FEED_MAX_AGE seconds, all at once, with a
+ * conditional GET, so an unchanged feed is neither downloaded nor parsed
+ * again. The feeds are too large for the response cache, so we keep their
+ * validators ourselves, and parse each feed line by line as it downloads
+ * rather than holding the whole body. A response which isn't a calendar (such
+ * as an error page) is abandoned at its first line.
  */
 #include <stdbool.h>
 #include <stdint.h>
@@ -21,23 +30,98 @@ int WDAY = 3;
 int HOUR = 14;
 int MIN = 0;
 
-// Chase Center Calendar (Warriors, Valkyries, and other events)
-const char *CHASE_CENTER_ICAL =
-        "https://www.chasecentercalendar.com/chasecenter.ics";
+/* How long a parsed feed is used before we revalidate it (seconds) */
+#define FEED_MAX_AGE 300
 
-// Oracle Park Calendar (Giants and other events)
-const char *ORACLE_PARK_ICAL =
-        "https://www.chasecentercalendar.com/oraclepark.ics";
+struct ical_event {
+	time_t start, end;
+	size_t summary; /* offset into ical_feed.strings */
+};
+
+struct ical_feed {
+	const char *name;
+	const char *url;
+	/* Parsed events, sorted by start, and the strings they refer to */
+	struct sc_array events;
+	struct sc_charbuf strings;
+	/* The longest event, which bounds how far back a search must look */
+	time_t max_duration;
+	/* Validators of the feed we parsed */
+	struct cbot_curl_validators val;
+	time_t checked;
+	bool loaded;
+};
 
-// Parse iCal time format (YYYYMMDDTHHMMSSZ) to local time
-static time_t parse_ical_time(const char *ical_time)
+/* An LWT waiting for another's refresh of the feeds */
+struct refresh_waiter {
+	struct sc_list_head list;
+	struct sc_lwt *thread;
+	bool done;
+};
+
+static bool refreshing;
+static bool refresh_failed;
+static struct sc_list_head refresh_waiters;
+
+#define NFEEDS 2
+
+static struct ical_feed feeds[NFEEDS] = {
+	// Chase Center Calendar (Warriors, Valkyries, and other events)
+	{
+	        .name = "Chase Center",
+	        .url = "https://www.chasecentercalendar.com/chasecenter.ics",
+	},
+	// Oracle Park Calendar (Giants and other events)
+	{
+	        .name = "Oracle Park",
+	        .url = "https://www.chasecentercalendar.com/oraclepark.ics",
+	},
+};
+
+/* Days since 1970-01-01 of a proleptic Gregorian date (month is 1-12) */
+static long days_from_civil(int y, int m, int d)
+{
+	y -= m <= 2;
+	long era = (y >= 0 ? y : y - 399) / 400;
+	long yoe = y - era * 400;
+	long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+static int ical_digits(const char *s, int n)
 {
-	struct tm tm = { 0 };
-	char *endptr = strptime(ical_time, "%Y%m%dT%H%M%SZ", &tm);
-	if (!endptr || *endptr) {
-		return 0; // Parse error
+	int v = 0;
+	for (int i = 0; i < n; i++) {
+		if (s[i] < '0' || s[i] > '9')
+			return -1;
+		v = v * 10 + s[i] - '0';
 	}
-	return timegm(&tm); // Convert UTC to time_t
+	return v;
+}
+
+/*
+ * Parse iCal UTC time format (YYYYMMDDTHHMMSSZ). This is called for every
+ * event on every refresh, so rather than strptime() and timegm(), do the
+ * arithmetic directly. Returns -1 on a parse error.
+ */
+static time_t parse_ical_time(const char *s)
+{
+	int y, mo, d, h, mi, sec;
+
+	if (strlen(s) != 16 || s[8] != 'T' || s[15] != 'Z')
+		return -1;
+	y = ical_digits(s, 4);
+	mo = ical_digits(s + 4, 2);
+	d = ical_digits(s + 6, 2);
+	h = ical_digits(s + 9, 2);
+	mi = ical_digits(s + 11, 2);
+	sec = ical_digits(s + 13, 2);
+	if (y < 0 || mo < 1 || mo > 12 || d < 1 || d > 31 || h < 0 ||
+	    h > 23 || mi < 0 || mi > 59 || sec < 0 || sec > 60)
+		return -1;
+	return (time_t)days_from_civil(y, mo, d) * 86400 + h * 3600 +
+	       mi * 60 + sec;
 }
 
 // chasecentercalendar.com includes away games for Warriors and Valkyries. See
@@ -51,83 +135,345 @@ static bool is_away_game(const char *desc)
 	        strncmp(desc, "Valkyries at ", 13) == 0);
 }
 
-static int search_ical_events(const char *ical_data, time_t range_start,
-                              time_t range_end, struct sc_charbuf *events)
+/* State while parsing one feed. The result replaces the feed's events. */
+struct ical_parse {
+	struct sc_charbuf line; /* the current line, after unfolding */
+	struct sc_charbuf summary;
+	time_t start, end;
+	bool in_event;
+	int nested; /* depth of components (e.g. VALARM) within the event */
+	struct sc_array events;
+	struct sc_charbuf strings;
+	time_t max_duration;
+};
+
+static void ical_parse_init(struct ical_parse *p)
+{
+	sc_cb_init(&p->line, 256);
+	sc_cb_init(&p->summary, 128);
+	sc_arr_init(&p->events, struct ical_event, 256);
+	sc_cb_init(&p->strings, 8192);
+	p->in_event = false;
+	p->nested = 0;
+	p->max_duration = 0;
+}
+
+static void ical_parse_destroy(struct ical_parse *p)
 {
-	const char *line = ical_data;
-	const char *next_line;
-	char current_event[512] = { 0 };
-	time_t current_start = 0, current_end = 0;
-	int found_events = 0;
-
-	while ((next_line = strchr(line, '\n')) != NULL) {
-		size_t line_len = next_line - line;
-		char line_buf[sizeof(current_event)];
-		if (line_len >= sizeof(line_buf) - 1) {
-			line = next_line + 1;
+	sc_cb_destroy(&p->line);
+	sc_cb_destroy(&p->summary);
+	sc_arr_destroy(&p->events);
+	sc_cb_destroy(&p->strings);
+}
+
+/* Undo TEXT value escaping (RFC 5545 3.3.11), onto a single line */
+static void ical_unescape(struct sc_charbuf *cb, const char *value)
+{
+	sc_cb_clear(cb);
+	for (; *value; value++) {
+		if (*value != '\\' || !value[1]) {
+			sc_cb_append(cb, *value);
 			continue;
 		}
+		value++;
+		if (*value == 'n' || *value == 'N')
+			sc_cb_append(cb, ' ');
+		else
+			sc_cb_append(cb, *value);
+	}
+}
+
+static void ical_add_event(struct ical_parse *p)
+{
+	struct ical_event ev;
+
+	/* A missing DTEND means the event ends when it starts */
+	if (p->end < 0)
+		p->end = p->start;
+	if (!p->summary.length || p->start < 0 || p->end < p->start ||
+	    is_away_game(p->summary.buf))
+		return;
+
+	ev.start = p->start;
+	ev.end = p->end;
+	ev.summary = p->strings.length;
+	sc_cb_concat(&p->strings, p->summary.buf);
+	sc_cb_append(&p->strings, '\0');
+	sc_arr_append(&p->events, struct ical_event, ev);
+	if (ev.end - ev.start > p->max_duration)
+		p->max_duration = ev.end - ev.start;
+}
 
-		strncpy(line_buf, line, line_len);
-		line_buf[line_len] = '\0';
-
-		// Remove carriage return if present
-		if (line_len > 0 && line_buf[line_len - 1] == '\r')
-			line_buf[line_len - 1] = '\0';
-
-		if (strcmp(line_buf, "BEGIN:VEVENT") == 0) {
-			current_event[0] = '\0';
-			current_start = current_end = 0;
-		} else if (strncmp(line_buf, "SUMMARY:", 8) == 0) {
-			strncpy(current_event, line_buf + 8,
-			        sizeof(current_event) - 1);
-			current_event[sizeof(current_event) - 1] = '\0';
-		} else if (strncmp(line_buf, "DTSTART:", 8) == 0) {
-			current_start = parse_ical_time(line_buf + 8);
-		} else if (strncmp(line_buf, "DTEND:", 6) == 0) {
-			current_end = parse_ical_time(line_buf + 6);
-		} else if (strcmp(line_buf, "END:VEVENT") == 0 &&
-		           current_event[0] && range_end >= current_start &&
-		           range_start <= current_end &&
-		           !is_away_game(current_event)) {
-			if (found_events > 0)
-				sc_cb_concat(events, " Also, ");
-			cbot_dfmt(events,
-			          "{%s} at {timel:%l:%M%P}--{timel:%l:%M%P}.",
-			          current_event, current_start, current_end);
-			found_events++;
+/* Handle one complete (unfolded) content line: NAME *(;PARAM) : VALUE */
+static void ical_property(struct ical_parse *p)
+{
+	char *name = p->line.buf, *value;
+	bool quoted = false;
+
+	for (value = name; *value; value++) {
+		if (*value == '"')
+			quoted = !quoted;
+		else if (*value == ':' && !quoted)
+			break;
+	}
+	if (!*value)
+		return;
+	*value++ = '\0';
+	name[strcspn(name, ";")] = '\0';
+
+	if (strcmp(name, "BEGIN") == 0) {
+		if (p->in_event) {
+			p->nested++;
+		} else if (strcmp(value, "VEVENT") == 0) {
+			p->in_event = true;
+			p->nested = 0;
+			p->start = p->end = -1;
+			sc_cb_clear(&p->summary);
+		}
+	} else if (!p->in_event) {
+		return;
+	} else if (strcmp(name, "END") == 0) {
+		if (p->nested) {
+			p->nested--;
+		} else {
+			p->in_event = false;
+			ical_add_event(p);
 		}
+	} else if (p->nested) {
+		return;
+	} else if (strcmp(name, "SUMMARY") == 0) {
+		ical_unescape(&p->summary, value);
+	} else if (strcmp(name, "DTSTART") == 0) {
+		p->start = parse_ical_time(value);
+	} else if (strcmp(name, "DTEND") == 0) {
+		p->end = parse_ical_time(value);
+	}
+}
 
-		line = next_line + 1;
+/*
+ * Handle one line of the feed. Long content lines are folded onto
+ * continuation lines beginning with a space or tab, so we only know a line is
+ * complete once the next one begins.
+ */
+static void ical_line(struct ical_parse *p, const char *line, size_t len)
+{
+	if (len && (line[0] == ' ' || line[0] == '\t')) {
+		sc_cb_memcpy(&p->line, line + 1, len - 1);
+		return;
 	}
+	if (p->line.length)
+		ical_property(p);
+	sc_cb_clear(&p->line);
+	sc_cb_memcpy(&p->line, line, len);
+}
+
+static int event_cmp(const void *l, const void *r)
+{
+	const struct ical_event *a = l, *b = r;
+	return (a->start > b->start) - (a->start < b->start);
+}
 
-	return found_events;
+/* Index of the first event starting at or after t */
+static size_t feed_lower_bound(struct ical_feed *feed, time_t t)
+{
+	struct ical_event *events = sc_arr(&feed->events, struct ical_event);
+	size_t lo = 0, hi = feed->events.len, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (events[mid].start < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
 }
 
-static int check_chase_center(struct cbot *bot, time_t range_start,
-                              time_t range_end, struct sc_charbuf *events)
+/* Describe events overlapping [start, end] into out. Returns the count. */
+static int feed_search(struct ical_feed *feed, time_t start, time_t end,
+                       struct sc_charbuf *out)
 {
-	char *data = cbot_curl_get(bot, "%s", CHASE_CENTER_ICAL);
-	if (!data)
-		return -1;
+	struct ical_event *events = sc_arr(&feed->events, struct ical_event);
+	size_t i = feed_lower_bound(feed, start - feed->max_duration);
+	int found = 0;
 
-	int ret = search_ical_events(data, range_start, range_end, events);
-	free(data);
-	return ret;
+	for (; i < feed->events.len && events[i].start <= end; i++) {
+		if (events[i].end < start)
+			continue;
+		if (found > 0)
+			sc_cb_concat(out, " Also, ");
+		cbot_dfmt(out, "{%s} at {timel:%l:%M%P}--{timel:%l:%M%P}.",
+		          feed->strings.buf + events[i].summary,
+		          events[i].start, events[i].end);
+		found++;
+	}
+	return found;
 }
 
-// Oracle Park events (Giants and other events)
+static void feed_clear(struct ical_feed *feed)
+{
+	if (feed->loaded) {
+		sc_arr_destroy(&feed->events);
+		sc_cb_destroy(&feed->strings);
+	}
+	feed->loaded = false;
+	feed->checked = 0;
+}
 
-static int check_oracle_park(struct cbot *bot, time_t range_start,
-                             time_t range_end, struct sc_charbuf *events)
+static void feed_free(struct ical_feed *feed)
 {
-	char *data = cbot_curl_get(bot, "%s", ORACLE_PARK_ICAL);
-	if (!data)
-		return -1;
+	feed_clear(feed);
+	cbot_curl_validators_free(&feed->val);
+}
+
+/* Replace the feed's events with those of a complete parse */
+static void feed_load(struct ical_feed *feed, struct ical_parse *p)
+{
+	/* The last line is only known to be complete at the end */
+	if (p->line.length)
+		ical_property(p);
+	qsort(p->events.arr, p->events.len, sizeof(struct ical_event),
+	      event_cmp);
+	feed_clear(feed);
+	feed->events = p->events;
+	feed->strings = p->strings;
+	feed->max_duration = p->max_duration;
+	feed->loaded = true;
+	feed->checked = time(NULL);
+	sc_cb_destroy(&p->line);
+	sc_cb_destroy(&p->summary);
+	CL_DEBUG("events: parsed %zu %s events\n", feed->events.len,
+	         feed->name);
+}
+
+/* A refresh of one feed. Several of these run concurrently. */
+struct feed_fetch {
+	struct ical_feed *feed;
+	struct ical_parse parse;
+	struct cbot_curl_stream stream;
+	bool calendar;
+};
+
+/* Line consumer for the streamed feed */
+static int feed_fetch_line(char *line, size_t len, void *arg)
+{
+	struct feed_fetch *f = arg;
+
+	/* Don't download the rest of something which isn't a calendar */
+	if (!f->calendar && strncmp(line, "BEGIN:VCALENDAR", 15) != 0)
+		return 1;
+	f->calendar = true;
+	ical_line(&f->parse, line, len);
+	return 0;
+}
+
+static CURL *feed_fetch_start(struct feed_fetch *f, struct ical_feed *feed)
+{
+	CURL *easy = curl_easy_init();
+
+	f->feed = feed;
+	f->calendar = false;
+	ical_parse_init(&f->parse);
+	/* Only ask whether the feed changed if we still have it */
+	if (!feed->loaded)
+		cbot_curl_validators_free(&feed->val);
+	curl_easy_setopt(easy, CURLOPT_URL, feed->url);
+	cbot_curl_line_response(easy, &f->stream, feed_fetch_line, f);
+	cbot_curl_conditional(easy, &feed->val);
+	return easy;
+}
+
+/* Returns true if the feed could not be refreshed */
+static bool feed_fetch_finish(struct feed_fetch *f, struct cbot_curl_req *req)
+{
+	struct ical_feed *feed = f->feed;
+	enum cbot_curl_cond cond;
+	bool err = false;
+
+	/* Delivers the final line, if it had no line ending */
+	cbot_curl_stream_finish(&f->stream, req->result);
+	cond = cbot_curl_conditional_finish(req->handle, &feed->val,
+	                                    req->result);
+	curl_easy_cleanup(req->handle);
+	if (cond == CBOT_CURL_NOT_MODIFIED) {
+		CL_DEBUG("events: %s not modified (%ld ms)\n", feed->name,
+		         req->elapsed_ms);
+		feed->checked = time(NULL);
+		ical_parse_destroy(&f->parse);
+	} else if (cond == CBOT_CURL_MODIFIED && f->calendar) {
+		feed_load(feed, &f->parse);
+	} else {
+		/*
+		 * Keep the old events. An aborted or failed transfer leaves the
+		 * validators alone, but an empty 200 would replace them.
+		 */
+		CL_WARN("events: failed to refresh %s\n", feed->url);
+		if (cond == CBOT_CURL_MODIFIED)
+			cbot_curl_validators_free(&feed->val);
+		ical_parse_destroy(&f->parse);
+		err = true;
+	}
+	return err;
+}
+
+static bool refresh_wait(void)
+{
+	struct refresh_waiter wait;
+
+	wait.thread = sc_lwt_current();
+	wait.done = false;
+	sc_list_insert_end(&refresh_waiters, &wait.list);
+	while (!wait.done) {
+		sc_lwt_set_state(wait.thread, SC_LWT_BLOCKED);
+		sc_lwt_yield();
+	}
+	return refresh_failed;
+}
+
+static void refresh_wake(void)
+{
+	struct refresh_waiter *wait, *next;
+
+	sc_list_for_each_safe(wait, next, &refresh_waiters, list,
+	                      struct refresh_waiter)
+	{
+		sc_list_remove(&wait->list);
+		wait->done = true;
+		sc_lwt_set_state(wait->thread, SC_LWT_RUNNABLE);
+	}
+}
+
+/*
+ * Bring every feed up to date, fetching them all at once rather than one after
+ * the other. If another LWT is already doing so, wait for it instead. Returns
+ * true if any feed could not be refreshed.
+ */
+static bool feeds_refresh(struct cbot *bot)
+{
+	struct feed_fetch fetch[NFEEDS];
+	struct cbot_curl_req reqs[NFEEDS];
+	time_t now = time(NULL);
+	size_t i, n = 0;
+	bool err = false;
 
-	int ret = search_ical_events(data, range_start, range_end, events);
-	free(data);
-	return ret;
+	if (refreshing)
+		return refresh_wait();
+	for (i = 0; i < NFEEDS; i++) {
+		if (feeds[i].loaded && now - feeds[i].checked < FEED_MAX_AGE)
+			continue;
+		reqs[n].handle = feed_fetch_start(&fetch[n], &feeds[i]);
+		n++;
+	}
+	if (!n)
+		return false;
+	refreshing = true;
+	cbot_curl_perform_many(bot, reqs, n, CBOT_CURL_WAIT_ALL, -1);
+	for (i = 0; i < n; i++)
+		err |= feed_fetch_finish(&fetch[i], &reqs[i]);
+	refreshing = false;
+	refresh_failed = err;
+	refresh_wake();
+	return err;
 }
 
 struct arg {
@@ -139,25 +485,24 @@ struct arg {
 static void run_thread(void *varg)
 {
 	struct arg *arg = varg;
-	struct sc_charbuf chase_events, oracle_events, msg;
-	bool err = false;
+	struct sc_charbuf events, msg;
+	bool err;
+	int count;
 
-	sc_cb_init(&chase_events, 256);
-	sc_cb_init(&oracle_events, 256);
+	sc_cb_init(&events, 256);
 	sc_cb_init(&msg, 512);
 
-	int chase_count = check_chase_center(arg->bot, arg->start, arg->end,
-	                                     &chase_events);
-	int oracle_count = check_oracle_park(arg->bot, arg->start, arg->end,
-	                                     &oracle_events);
-
-	if (chase_count > 0) {
-		sc_cb_printf(&msg, "Chase Center events: %s", chase_events.buf);
-	}
-	if (oracle_count > 0) {
+	err = feeds_refresh(arg->bot);
+	for (size_t i = 0; i < NFEEDS; i++) {
+		if (!feeds[i].loaded)
+			continue;
+		sc_cb_clear(&events);
+		count = feed_search(&feeds[i], arg->start, arg->end, &events);
+		if (!count)
+			continue;
 		if (msg.length)
 			sc_cb_concat(&msg, " ");
-		sc_cb_printf(&msg, "Oracle Park events: %s", oracle_events.buf);
+		sc_cb_printf(&msg, "%s events: %s", feeds[i].name, events.buf);
 	}
 	if (!msg.length) {
 		cbot_dfmt(&msg,
@@ -172,8 +517,7 @@ static void run_thread(void *varg)
 		             "details.");
 
 	cbot_send(arg->bot, arg->channel, "%s", msg.buf);
-	sc_cb_destroy(&chase_events);
-	sc_cb_destroy(&oracle_events);
+	sc_cb_destroy(&events);
 	sc_cb_destroy(&msg);
 	free(arg->channel);
 	free(arg);
@@ -260,6 +604,8 @@ static int load(struct cbot_plugin *plugin, config_setting_t *conf)
 {
 	const char *channel = NULL;
 	int rv = config_setting_lookup_string(conf, "channel", &channel);
+
+	sc_list_init(&refresh_waiters);
 	if (rv != CONFIG_FALSE) {
 		CHANNEL = strdup(channel);
 		config_setting_lookup_int(conf, "weekday", &WDAY);
@@ -279,6 +625,8 @@ static void unload(struct cbot_plugin *plugin)
 	free(CHANNEL);
 	if (plugin->data)
 		cbot_cancel_callback(plugin->data);
+	for (int i = 0; i < NFEEDS; i++)
+		feed_free(&feeds[i]);
 }
 
 static void help(struct cbot_plugin *plugin, struct sc_charbuf *cb)
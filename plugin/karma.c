@@ -1,133 +1,437 @@
 /**
  * karma.c: CBot plugin which tracks karma (++ and --)
+ *
+ * Entries live in an open-addressing hash table keyed by word, and are also
+ * kept in an indexed max-heap ordered by karma. A change moves its entry at
+ * most O(log n) places in the heap, and the leaderboard is read off the top of
+ * the heap without sorting.
+ *
+ * If a snapshot file is configured, karma is saved to it (written through a
+ * shared memory mapping and renamed into place) shortly after it changes, and
+ * when the plugin is unloaded. It is read back at load time. Otherwise, karma
+ * only lasts until the bot exits.
+ *
+ * Configuration (all optional):
+ *   snapshot = "karma.snapshot"; // default: none, karma is not saved
+ *   snapshot_interval = 60;      // seconds between a change and its save
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <libconfig.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "cbot/cbot.h"
 #include "sc-collections.h"
 #include "sc-regex.h"
 
 /**
- * A type representing a single karma entry, which is a word, number pair.
+ * A single karma entry, which is a word, number pair.
  */
-typedef struct {
-	int karma;
+struct karma_entry {
 	char *word;
-} karma_t;
+	uint32_t hash;
+	int karma;
+	/** Index of this entry in the heap. */
+	size_t heap;
+};
 
 /**
- * Pointer to the karma array.
+ * Hash table of entries, using linear probing. The size is a power of two.
  */
-static karma_t *karma = NULL;
+static struct karma_entry **table = NULL;
+static size_t table_size = 0;
 /**
- * Number of karma allocated.
+ * Max-heap of the same entries, ordered by karma.
  */
-static size_t karma_alloc = 128;
+static struct karma_entry **heap = NULL;
+static size_t heap_alloc = 0;
 /**
- * Number of karma in the array.
+ * Number of karma entries.
  */
 static size_t nkarma = 0;
 
 /**
- * @brief Return the index of a word in the karma array, or -1.
- * @param word The word to look up.
- * @returns The word's index, or -1 if it is not present in the array.
+ * Snapshot state: the file name (NULL if disabled), and whether there are
+ * changes which have not been saved.
  */
-static ssize_t find_karma(const char *word)
+static char *snapshot_path = NULL;
+#define SNAPSHOT_INTERVAL 60
+static int snapshot_interval;
+static bool snapshot_dirty = false;
+static struct cbot_callback *snapshot_cb = NULL;
+
+#define SNAPSHOT_MAGIC "CBKARMA1"
+
+/**
+ * Snapshot file header. It is followed by count records, each of which is a
+ * 32-bit karma value, a 32-bit word length, and the word (not NUL-terminated),
+ * all in native byte order.
+ */
+struct snapshot_header {
+	char magic[8];
+	uint32_t count;
+	uint32_t reserved;
+};
+
+static uint32_t hash_word(const char *word)
 {
+	uint32_t hash = 2166136261u;
+	for (; *word; word++) {
+		hash ^= (unsigned char)*word;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * @brief Return the table slot for a word: either the slot holding it, or the
+ * empty slot where it would be inserted.
+ */
+static size_t table_slot(const char *word, uint32_t hash)
+{
+	size_t mask = table_size - 1;
+	size_t i = hash & mask;
+
+	while (table[i] &&
+	       (table[i]->hash != hash || strcmp(table[i]->word, word) != 0))
+		i = (i + 1) & mask;
+	return i;
+}
+
+/**
+ * @brief Make room for at least one more entry, keeping the load factor at or
+ * below 3/4.
+ */
+static void table_reserve(void)
+{
+	struct karma_entry **old = table;
+	size_t old_size = table_size;
 	size_t i;
-	for (i = 0; i < nkarma; i++) {
-		if (strcmp(karma[i].word, word) == 0) {
-			return i;
-		}
+
+	if (table && (nkarma + 1) * 4 <= table_size * 3)
+		return;
+
+	table_size = table_size ? table_size * 2 : 128;
+	table = calloc(table_size, sizeof(*table));
+	for (i = 0; i < old_size; i++)
+		if (old[i])
+			table[table_slot(old[i]->word, old[i]->hash)] = old[i];
+	free(old);
+}
+
+static void heap_swap(size_t a, size_t b)
+{
+	struct karma_entry *tmp = heap[a];
+	heap[a] = heap[b];
+	heap[b] = tmp;
+	heap[a]->heap = a;
+	heap[b]->heap = b;
+}
+
+/**
+ * @brief Restore the heap property for the entry at index i, after its karma
+ * changed (or it was moved there).
+ */
+static void heap_fix(size_t i)
+{
+	size_t parent, child;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (heap[parent]->karma >= heap[i]->karma)
+			break;
+		heap_swap(i, parent);
+		i = parent;
+	}
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= nkarma)
+			break;
+		if (child + 1 < nkarma &&
+		    heap[child + 1]->karma > heap[child]->karma)
+			child++;
+		if (heap[i]->karma >= heap[child]->karma)
+			break;
+		heap_swap(i, child);
+		i = child;
 	}
-	return -1;
 }
 
 /**
- * @brief Copy a string.
- * @param word The word to copy.
- * @returns A newly allocated copy of the string.
+ * @brief Return the entry for a word, or NULL.
+ * @param word The word to look up.
+ * @returns The word's entry, or NULL if it is not present.
  */
-static char *copy_string(const char *word)
+static struct karma_entry *find_karma(const char *word)
 {
-	char *newword;
-	size_t length = strlen(word);
-	newword = malloc(length + 1);
-	strncpy(newword, word, length + 1);
-	newword[length] = '\0';
-	return newword;
+	if (!table)
+		return NULL;
+	return table[table_slot(word, hash_word(word))];
 }
 
 /**
- * @brief Return the index of any word in the karma array.
+ * @brief Return the entry for any word.
  *
- * This function will locate an existing word in the karma array and return its
- * index. If the word doesn't exist, it will copy it, add it to the karma array,
- * set its karma to zero, and return its index.
+ * This function will locate an existing word and return its entry. If the word
+ * doesn't exist, it will copy it, add it with zero karma, and return the new
+ * entry.
  *
  * @param word Word to find karma of.  Never modified.
- * @returns Index of the word in the karma array.
+ * @returns The word's entry.
  */
-static size_t find_or_create_karma(const char *word)
+static struct karma_entry *find_or_create_karma(const char *word)
 {
-	ssize_t idx;
-	if (karma == NULL) {
-		karma = calloc(karma_alloc, sizeof(karma_t));
-		nkarma = 0;
-	}
-	idx = find_karma(word);
-	if (idx < 0) {
-		if (nkarma == karma_alloc) {
-			karma_alloc *= 2;
-			karma = realloc(karma, karma_alloc * sizeof(karma_t));
-		}
-		idx = nkarma++;
-		karma[idx] = (karma_t){ .word = copy_string(word), .karma = 0 };
+	struct karma_entry *entry;
+	uint32_t hash = hash_word(word);
+	size_t slot;
+
+	table_reserve();
+	slot = table_slot(word, hash);
+	if (table[slot])
+		return table[slot];
+
+	entry = calloc(1, sizeof(*entry));
+	entry->word = strdup(word);
+	entry->hash = hash;
+	table[slot] = entry;
+
+	if (nkarma == heap_alloc) {
+		heap_alloc = heap_alloc ? heap_alloc * 2 : 128;
+		heap = realloc(heap, heap_alloc * sizeof(*heap));
 	}
-	return idx;
+	entry->heap = nkarma;
+	heap[nkarma++] = entry;
+	heap_fix(entry->heap);
+	return entry;
 }
 
 /**
- * @brief Removes a word from the karma array if it exists
+ * @brief Set the karma of an entry, keeping the heap in order.
+ */
+static void set_karma(struct karma_entry *entry, int value)
+{
+	entry->karma = value;
+	heap_fix(entry->heap);
+}
+
+/**
+ * @brief Removes a word from the karma table if it exists
  *
  * @param word Word to find and delete
  * @returns 1 if deleted, zero if not
  */
 static size_t delete_if_exists(const char *word)
 {
-	ssize_t idx;
-	if (karma == NULL) {
-		karma = calloc(karma_alloc, sizeof(karma_t));
-		nkarma = 0;
+	struct karma_entry *entry;
+	size_t mask = table_size - 1;
+	size_t i, j, home;
+
+	if (!table)
+		return 0;
+	i = table_slot(word, hash_word(word));
+	entry = table[i];
+	if (!entry)
+		return 0;
+
+	/*
+	 * Backward-shift deletion: pull later entries of the probe run into the
+	 * hole, unless their home slot lies cyclically within (hole, j].
+	 */
+	table[i] = NULL;
+	for (j = (i + 1) & mask; table[j]; j = (j + 1) & mask) {
+		home = table[j]->hash & mask;
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		table[i] = table[j];
+		table[j] = NULL;
+		i = j;
 	}
-	idx = find_karma(word);
-	if (idx >= 0) {
-		free(karma[idx].word);
-		karma[idx] = karma[--nkarma];
-		return 1;
+
+	i = entry->heap;
+	nkarma--;
+	if (i != nkarma) {
+		heap[i] = heap[nkarma];
+		heap[i]->heap = i;
+		heap_fix(i);
 	}
-	return 0;
+	free(entry->word);
+	free(entry);
+	return 1;
+}
+
+static void free_karma(void)
+{
+	size_t i;
+	for (i = 0; i < nkarma; i++) {
+		free(heap[i]->word);
+		free(heap[i]);
+	}
+	free(heap);
+	free(table);
+	heap = NULL;
+	table = NULL;
+	heap_alloc = table_size = nkarma = 0;
+}
+
+/**
+ * @brief Read the snapshot file, if there is one, into the table.
+ * @returns 0 on success (including when there is no snapshot), -1 on error.
+ */
+static int snapshot_load(const char *path)
+{
+	struct snapshot_header hdr;
+	struct karma_entry *entry;
+	struct stat st;
+	const char *map, *pos, *end;
+	int32_t value;
+	uint32_t len, i;
+	char *word;
+	int fd, rv = -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		CL_CRIT("karma: can't open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(hdr)) {
+		CL_CRIT("karma: snapshot %s is truncated\n", path);
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		CL_CRIT("karma: can't map %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	memcpy(&hdr, map, sizeof(hdr));
+	if (memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0) {
+		CL_CRIT("karma: %s is not a karma snapshot\n", path);
+		goto out;
+	}
+	pos = map + sizeof(hdr);
+	end = map + st.st_size;
+	for (i = 0; i < hdr.count; i++) {
+		if (end - pos < 8)
+			break;
+		memcpy(&value, pos, 4);
+		memcpy(&len, pos + 4, 4);
+		pos += 8;
+		if ((size_t)(end - pos) < len)
+			break;
+		word = strndup(pos, len);
+		pos += len;
+		entry = find_or_create_karma(word);
+		set_karma(entry, value);
+		free(word);
+	}
+	if (i != hdr.count) {
+		CL_CRIT("karma: snapshot %s is truncated\n", path);
+		goto out;
+	}
+	CL_INFO("karma: loaded %u entries from %s\n", hdr.count, path);
+	rv = 0;
+out:
+	munmap((void *)map, st.st_size);
+	return rv;
 }
 
-/*
- *These functions are for sorting karma entries using C's built in qsort!
+/**
+ * @brief Write every entry to a new snapshot file, replacing the old one.
  */
+static int snapshot_write(const char *path)
+{
+	struct snapshot_header hdr = { 0 };
+	struct sc_charbuf tmp;
+	size_t size = sizeof(hdr);
+	int32_t value;
+	uint32_t len;
+	char *map, *pos;
+	size_t i;
+	int fd, rv = -1;
 
-static int karma_compare(const void *l, const void *r)
+	for (i = 0; i < nkarma; i++)
+		size += 8 + strlen(heap[i]->word);
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.count = nkarma;
+
+	sc_cb_init(&tmp, 64);
+	sc_cb_printf(&tmp, "%s.tmp", path);
+	fd = open(tmp.buf, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		CL_WARN("karma: can't create %s: %s\n", tmp.buf,
+		        strerror(errno));
+		goto out;
+	}
+	if (ftruncate(fd, size) < 0) {
+		CL_WARN("karma: can't size %s: %s\n", tmp.buf, strerror(errno));
+		goto out_close;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		CL_WARN("karma: can't map %s: %s\n", tmp.buf, strerror(errno));
+		goto out_close;
+	}
+
+	memcpy(map, &hdr, sizeof(hdr));
+	pos = map + sizeof(hdr);
+	for (i = 0; i < nkarma; i++) {
+		value = heap[i]->karma;
+		len = strlen(heap[i]->word);
+		memcpy(pos, &value, 4);
+		memcpy(pos + 4, &len, 4);
+		memcpy(pos + 8, heap[i]->word, len);
+		pos += 8 + len;
+	}
+	if (msync(map, size, MS_SYNC) < 0)
+		CL_WARN("karma: msync %s: %s\n", tmp.buf, strerror(errno));
+	else if (rename(tmp.buf, path) < 0)
+		CL_WARN("karma: can't rename %s: %s\n", tmp.buf,
+		        strerror(errno));
+	else
+		rv = 0;
+	munmap(map, size);
+out_close:
+	close(fd);
+	if (rv < 0)
+		unlink(tmp.buf);
+out:
+	sc_cb_destroy(&tmp);
+	return rv;
+}
+
+static void snapshot_cb_func(struct cbot_plugin *plugin, void *arg)
 {
-	const karma_t *lhs = l, *rhs = r;
-	return rhs->karma - lhs->karma;
+	/* The callback is freed once we return */
+	snapshot_cb = NULL;
+	if (snapshot_dirty && snapshot_write(snapshot_path) == 0)
+		snapshot_dirty = false;
 }
 
-static void karma_sort()
+/**
+ * @brief Note that karma changed, and schedule a snapshot if needed.
+ */
+static void karma_changed(struct cbot_plugin *plugin)
 {
-	qsort(karma, nkarma, sizeof(karma_t), karma_compare);
+	if (!snapshot_path)
+		return;
+	snapshot_dirty = true;
+	if (!snapshot_cb)
+		snapshot_cb = cbot_schedule_callback(
+		        plugin, snapshot_cb_func, NULL,
+		        time(NULL) + snapshot_interval);
 }
 
 /**
@@ -137,21 +441,40 @@ static void karma_sort()
 
 /**
  * @brief Print the top KARMA_BEST words.
+ *
+ * The best entry is the heap root, and each next-best entry is a child of one
+ * already printed, so we only ever consider KARMA_TOP + 1 candidates.
+ *
  * @param event The event we're responding to.
  */
 static void karma_best(struct cbot_message_event *event)
 {
-	size_t i;
-	karma_sort();
-	for (i = 0; i < (nkarma > KARMA_TOP ? KARMA_TOP : nkarma); i++) {
+	size_t cand[KARMA_TOP + 1];
+	size_t ncand = 0, best, idx, child, i;
+	int rank;
+
+	if (nkarma)
+		cand[ncand++] = 0;
+	for (rank = 1; rank <= KARMA_TOP && ncand; rank++) {
+		best = 0;
+		for (i = 1; i < ncand; i++)
+			if (heap[cand[i]]->karma > heap[cand[best]]->karma)
+				best = i;
+		idx = cand[best];
+		cand[best] = cand[--ncand];
+
 		cbot_send_rl(event->bot, event->channel, "%d. %s (%d karma)",
-		             i + 1, karma[i].word, karma[i].karma);
+		             rank, heap[idx]->word, heap[idx]->karma);
+
+		for (child = 2 * idx + 1; child <= 2 * idx + 2; child++)
+			if (child < nkarma && ncand < KARMA_TOP + 1)
+				cand[ncand++] = child;
 	}
 }
 
 static void karma_check(struct cbot_message_event *event, void *user)
 {
-	ssize_t index;
+	struct karma_entry *entry;
 	char *word = sc_regex_get_capture(event->message, event->indices, 1);
 
 	// An empty capture means we should list out the best karma.
@@ -161,13 +484,13 @@ static void karma_check(struct cbot_message_event *event, void *user)
 		return;
 	}
 
-	index = find_karma(word);
-	if (index < 0) {
+	entry = find_karma(word);
+	if (!entry) {
 		cbot_send(event->bot, event->channel, "%s has no karma yet",
 		          word);
 	} else {
 		cbot_send(event->bot, event->channel, "%s has %d karma", word,
-		          karma[index].karma);
+		          entry->karma);
 	}
 	free(word);
 }
@@ -176,8 +499,9 @@ static void karma_change(struct cbot_message_event *event, void *user)
 {
 	char *word = sc_regex_get_capture(event->message, event->indices, 0);
 	char *op = sc_regex_get_capture(event->message, event->indices, 1);
-	int index = find_or_create_karma(word);
-	karma[index].karma += (strcmp(op, "++") == 0 ? 1 : -1);
+	struct karma_entry *entry = find_or_create_karma(word);
+	set_karma(entry, entry->karma + (strcmp(op, "++") == 0 ? 1 : -1));
+	karma_changed(event->plugin);
 	free(word);
 	free(op);
 }
@@ -185,7 +509,6 @@ static void karma_change(struct cbot_message_event *event, void *user)
 static void karma_set(struct cbot_message_event *event, void *user)
 {
 	char *word, *value;
-	int index;
 	if (!cbot_is_authorized(event->bot, event->username, event->message)) {
 		cbot_send(event->bot, event->channel,
 		          "sorry, you're not authorized to do that!");
@@ -194,19 +517,39 @@ static void karma_set(struct cbot_message_event *event, void *user)
 
 	word = sc_regex_get_capture(event->message, event->indices, 0);
 	value = sc_regex_get_capture(event->message, event->indices, 1);
-	index = find_or_create_karma(word);
-	karma[index].karma = atoi(value);
+	set_karma(find_or_create_karma(word), atoi(value));
+	karma_changed(event->plugin);
 	free(word);
 	free(value);
 }
 
 static void karma_forget(struct cbot_message_event *event, void *user)
 {
-	delete_if_exists(event->username);
+	if (delete_if_exists(event->username))
+		karma_changed(event->plugin);
 }
 
 static int load(struct cbot_plugin *plugin, config_setting_t *conf)
 {
+	const char *path = "";
+
+	/* Don't keep settings from before a reload */
+	snapshot_interval = SNAPSHOT_INTERVAL;
+	if (conf) {
+		config_setting_lookup_string(conf, "snapshot", &path);
+		config_setting_lookup_int(conf, "snapshot_interval",
+		                          &snapshot_interval);
+	}
+	if (snapshot_interval < 1)
+		snapshot_interval = 1;
+	if (path[0]) {
+		if (snapshot_load(path) < 0) {
+			free_karma();
+			return -1;
+		}
+		snapshot_path = strdup(path);
+	}
+
 #define KARMA_WORD     "^ \t\n"
 #define NOT_KARMA_WORD " \t\n"
 	cbot_register(plugin, CBOT_ADDRESSED, (cbot_handler_t)karma_check, NULL,
@@ -220,6 +563,19 @@ static int load(struct cbot_plugin *plugin, config_setting_t *conf)
 	return 0;
 }
 
+static void unload(struct cbot_plugin *plugin)
+{
+	if (snapshot_cb)
+		cbot_cancel_callback(snapshot_cb);
+	snapshot_cb = NULL;
+	if (snapshot_dirty)
+		snapshot_write(snapshot_path);
+	snapshot_dirty = false;
+	free(snapshot_path);
+	snapshot_path = NULL;
+	free_karma();
+}
+
 static void help(struct cbot_plugin *plugin, struct sc_charbuf *cb)
 {
 	sc_cb_concat(
@@ -233,5 +589,6 @@ static void help(struct cbot_plugin *plugin, struct sc_charbuf *cb)
 struct cbot_plugin_ops ops = {
 	.description = "track karma (++ or --) in a channel",
 	.load = load,
+	.unload = unload,
 	.help = help,
 };
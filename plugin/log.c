@@ -1,95 +1,1696 @@
 /**
  * log.c: CBot plugin which logs channel messages
+ *
+ * Each message is appended as a single-line JSON object to a file of the form
+ * CHANNEL-YYYY-MM-DD.log. Rather than opening the file for every message, we
+ * keep one open descriptor and an output buffer per channel. Buffers are
+ * written out once they reach flush_size bytes, or flush_interval seconds after
+ * they first become dirty. Files are closed and reopened under the new name at
+ * local midnight.
+ *
+ * With format = "archive", the same lines are instead collected into blocks,
+ * which are zlib-compressed and appended to CHANNEL-YYYY-MM-DD.arc segments.
+ * Each block is indexed in the database by channel, time range, sender and the
+ * words it contains, so that searches only decompress the blocks which could
+ * match. A block is sealed under the same rules as a buffer flush, so in this
+ * mode flush_size and flush_interval bound the size and age of a block.
+ *
+ * Segment layout: a sequence of blocks, each a 12 byte header ("CBLK", the
+ * uncompressed length and the compressed length, big-endian 32-bit) followed by
+ * the compressed data. Segments can be re-indexed from this alone, which the
+ * "log reindex" command does for any blocks missing from the index.
+ *
+ * Anybody may search the channel they are in; searching another channel is for
+ * admins. The HTTP search is only served for the channels listed in
+ * http_search, since it has no authentication of its own. The archive format
+ * is only available when CBot is built with zlib.
+ *
+ * Configuration (all optional):
+ *   format = "json";         // or "archive"
+ *   flush_interval = 2;      // seconds before buffered lines are written
+ *                            // (archive default: 300)
+ *   flush_size = 8192;       // bytes buffered before an immediate write
+ *                            // (archive default: 65536)
+ *   max_buffer = 262144;     // per-channel cap; lines beyond it are dropped
+ *   fsync = "never";         // or "rollover" or "flush"
+ *   http_search = ["#chan"]; // channels which /logs/search may serve
+ *                            // (default: none, and it is not registered)
  */
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <libconfig.h>
-
+#include <microhttpd.h>
+#include <nosj.h>
 #include <sc-collections.h>
+#include <sc-lwt.h>
+#include <sc-regex.h>
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
 
 #include "cbot/cbot.h"
+#include "cbot/db.h"
+#include "cbot/json.h"
+
+#define NSEC_PER_SEC 1000000000.0
+
+#define ARC_MAGIC         "CBLK"
+#define ARC_HEADER        12
+#define ARC_TOKEN_MAX     32
+/* Most blocks a single search will decompress */
+#define ARC_SEARCH_BLOCKS 64
+#define ARC_CHAT_HITS     5
+#define ARC_HTTP_HITS     100
+/* Largest uncompressed block we write, or trust a block header to claim */
+#define ARC_BLOCK_MAX     (16 * 1024 * 1024)
+/* Lines an import (or blocks a reindex) processes before yielding */
+#define ARC_IMPORT_BATCH  256
+/* Older versions wrote the action key without quotes */
+#define ARC_LEGACY_ACTION ", action: true}"
+#define ARC_HTTP_USAGE    "usage: /logs/search?channel=CHANNEL&q=QUERY\n"
+
+enum log_fsync {
+	LOG_FSYNC_NEVER,
+	LOG_FSYNC_ROLLOVER,
+	LOG_FSYNC_FLUSH,
+};
+
+/* Index information for the block of lines being collected in a buffer */
+struct arc_block {
+	struct sc_array tokens; /* char *, duplicates are removed on seal */
+	double start;
+	double end;
+	int count;
+};
+
+struct log_channel {
+	struct sc_list_head list;
+	char *name;
+	int fd;
+	struct sc_charbuf buf;
+	struct arc_block blk;
+	unsigned long dropped;
+	bool open_failed;
+};
+
+struct log_plugin {
+	struct cbot *bot;
+	struct sc_list_head channels;
+	struct sc_list_head imports;
+	/* Local day which the open files belong to: [day_start, day_end) */
+	time_t day_start;
+	time_t day_end;
+	char day[16];
+
+	bool archive;
+	int flush_interval;
+	int flush_size;
+	int max_buffer;
+	enum log_fsync fsync;
+	/* Channels which /logs/search may serve (char *) */
+	struct sc_array http_search;
+
+	struct cbot_callback *flush_cb;
+	struct cbot_callback *midnight_cb;
+};
 
-static void write_string(FILE *f, const char *str)
+const char *tbl_log_block_alters[] = {};
+
+const struct cbot_db_table tbl_log_block = {
+	.name = "log_block",
+	.version = 0,
+	.create = "CREATE TABLE log_block ( "
+	          "  id INTEGER PRIMARY KEY ASC, "
+	          "  channel TEXT NOT NULL, "
+	          "  segment TEXT NOT NULL, "
+	          "  offset INTEGER NOT NULL, "
+	          "  length INTEGER NOT NULL, "
+	          "  raw_length INTEGER NOT NULL, "
+	          "  start_ts REAL NOT NULL, "
+	          "  end_ts REAL NOT NULL, "
+	          "  count INTEGER NOT NULL "
+	          "); "
+	          "CREATE INDEX log_block_time ON log_block(channel, end_ts);",
+	.alters = tbl_log_block_alters,
+};
+
+const char *tbl_log_posting_alters[] = {};
+
+const struct cbot_db_table tbl_log_posting = {
+	.name = "log_posting",
+	.version = 0,
+	.create = "CREATE TABLE log_posting ( "
+	          "  token TEXT NOT NULL, "
+	          "  block INTEGER NOT NULL REFERENCES log_block(id), "
+	          "  PRIMARY KEY (token, block) "
+	          ") WITHOUT ROWID;",
+	.alters = tbl_log_posting_alters,
+};
+
+static int log_block_insert(struct cbot *bot, char *channel, char *segment,
+                            sqlite3_int64 offset, int length, int raw_length,
+                            double start_ts, double end_ts, int count)
 {
-	size_t i;
-	fputc('"', f);
-	for (i = 0; str[i]; i++) {
-		switch (str[i]) {
+	CBOTDB_QUERY_FUNC_BEGIN(
+	        bot, void,
+	        "INSERT INTO log_block(channel, segment, offset, length, "
+	        "  raw_length, start_ts, end_ts, count) "
+	        "VALUES ($channel, $segment, $offset, $length, $raw_length, "
+	        "  $start_ts, $end_ts, $count);");
+	CBOTDB_BIND_ARG(text, channel);
+	CBOTDB_BIND_ARG(text, segment);
+	CBOTDB_BIND_ARG(int64, offset);
+	CBOTDB_BIND_ARG(int, length);
+	CBOTDB_BIND_ARG(int, raw_length);
+	CBOTDB_BIND_ARG(double, start_ts);
+	CBOTDB_BIND_ARG(double, end_ts);
+	CBOTDB_BIND_ARG(int, count);
+	CBOTDB_INSERT_RESULT(bot);
+}
+
+static int log_block_exists(struct cbot *bot, char *channel, char *segment,
+                            sqlite3_int64 offset)
+{
+	CBOTDB_QUERY_FUNC_BEGIN(bot, void,
+	                        "SELECT COUNT(*) FROM log_block "
+	                        "WHERE channel = $channel "
+	                        "AND segment = $segment AND offset = $offset;");
+	CBOTDB_BIND_ARG(text, channel);
+	CBOTDB_BIND_ARG(text, segment);
+	CBOTDB_BIND_ARG(int64, offset);
+	CBOTDB_SINGLE_INTEGER_RESULT();
+}
+
+static int log_posting_insert(struct cbot *bot, char *token, int block)
+{
+	CBOTDB_QUERY_FUNC_BEGIN(bot, void,
+	                        "INSERT OR IGNORE INTO "
+	                        "log_posting(token, block) "
+	                        "VALUES ($token, $block);");
+	CBOTDB_BIND_ARG(text, token);
+	CBOTDB_BIND_ARG(int, block);
+	CBOTDB_NO_RESULT();
+}
+
+static void write_string(struct sc_charbuf *cb, const char *str)
+{
+	const char *run = str;
+	unsigned char c;
+
+	sc_cb_append(cb, '"');
+	for (; *str; str++) {
+		c = *str;
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+		sc_cb_memcpy(cb, run, str - run);
+		run = str + 1;
+		switch (c) {
 		case '\n':
-			fprintf(f, "\\n");
+			sc_cb_concat(cb, "\\n");
+			break;
+		case '\r':
+			sc_cb_concat(cb, "\\r");
+			break;
+		case '\t':
+			sc_cb_concat(cb, "\\t");
 			break;
 		case '"':
-			fprintf(f, "\"");
+			sc_cb_concat(cb, "\\\"");
+			break;
+		case '\\':
+			sc_cb_concat(cb, "\\\\");
 			break;
 		default:
-			fputc(str[i], f);
+			sc_cb_printf(cb, "\\u%04x", c);
 		}
 	}
-	fputc('"', f);
+	sc_cb_memcpy(cb, run, str - run);
+	sc_cb_append(cb, '"');
 }
 
 /*
- * For every channel message, get the current timestamp, open a file of the
- * form: CHANNEL-YYYY-MM-DD.log In append mode, and write out a single-line JSON
- * object, containing:
+ * Append a single-line JSON object to @a cb, containing:
  * - timestamp: seconds since the epoch, as a float
  * - username: sender of the message
  * - message: content of message
+ * - action: true, only for actions
+ */
+static void write_line(struct sc_charbuf *cb, double ts, const char *username,
+                       const char *message, bool action)
+{
+	sc_cb_printf(cb, "{\"timestamp\": %f, \"username\": ", ts);
+	write_string(cb, username);
+	sc_cb_concat(cb, ", \"message\": ");
+	write_string(cb, message);
+	if (action)
+		sc_cb_concat(cb, ", \"action\": true");
+	sc_cb_concat(cb, "}\n");
+}
+
+/* Parse a line written by write_line(). Strings are allocated. */
+static int parse_line(const char *line, double *ts, char **username,
+                      char **message, bool *action)
+{
+	struct json_easy *json = json_easy_new(line);
+	uint32_t idx;
+	int rv = -1;
+
+	*username = *message = NULL;
+	*action = false;
+	if (json_easy_parse(json) != JSON_OK)
+		goto out;
+	if (json_easy_lookup(json, 0, "timestamp", &idx) != JSON_OK ||
+	    json_easy_number_get(json, idx, ts) != JSON_OK)
+		goto out;
+	if (je_get_string(json, 0, "username", username) != JSON_OK ||
+	    je_get_string(json, 0, "message", message) != JSON_OK)
+		goto out;
+	je_get_bool(json, 0, "action", action);
+	rv = 0;
+out:
+	if (rv < 0) {
+		free(*username);
+		free(*message);
+		*username = *message = NULL;
+	}
+	json_easy_free(json);
+	return rv;
+}
+
+/******
+ * Archive tokens and blocks
+ */
+
+static bool arc_word_char(unsigned char c)
+{
+	return c >= 0x80 || isalnum(c);
+}
+
+/*
+ * Find the next indexable word at or after *text, storing its lowercased form
+ * (truncated to ARC_TOKEN_MAX bytes) in @a out. Words are runs of letters,
+ * digits and non-ASCII bytes which are at least two bytes long.
+ */
+static bool arc_next_word(const char **text, char *out)
+{
+	const unsigned char *s = (const unsigned char *)*text;
+	size_t n;
+
+	for (;;) {
+		while (*s && !arc_word_char(*s))
+			s++;
+		if (!*s) {
+			*text = (const char *)s;
+			return false;
+		}
+		for (n = 0; arc_word_char(*s); s++)
+			if (n < ARC_TOKEN_MAX)
+				out[n++] = tolower(*s);
+		out[n] = '\0';
+		if (n >= 2) {
+			*text = (const char *)s;
+			return true;
+		}
+	}
+}
+
+static char *arc_token(const char *prefix, const char *word)
+{
+	struct sc_charbuf cb;
+	const char *c;
+
+	sc_cb_init(&cb, 40);
+	sc_cb_concat(&cb, prefix);
+	for (c = word; *c && c - word < ARC_TOKEN_MAX; c++)
+		sc_cb_append(&cb, tolower((unsigned char)*c));
+	return cb.buf;
+}
+
+static void arc_block_init(struct arc_block *blk)
+{
+	sc_arr_init(&blk->tokens, char *, 64);
+	blk->count = 0;
+}
+
+static void arc_block_reset(struct arc_block *blk)
+{
+	char **tokens = sc_arr(&blk->tokens, char *);
+	size_t i;
+
+	for (i = 0; i < blk->tokens.len; i++)
+		free(tokens[i]);
+	blk->tokens.len = 0;
+	blk->count = 0;
+}
+
+static void arc_block_destroy(struct arc_block *blk)
+{
+	arc_block_reset(blk);
+	sc_arr_destroy(&blk->tokens);
+}
+
+/* Record a line which was just appended to the block's buffer */
+static void arc_block_add(struct arc_block *blk, double ts,
+                          const char *username, const char *message)
+{
+	char word[ARC_TOKEN_MAX + 1];
+
+	if (!blk->count || ts < blk->start)
+		blk->start = ts;
+	if (!blk->count || ts > blk->end)
+		blk->end = ts;
+	blk->count++;
+
+	sc_arr_append(&blk->tokens, char *, arc_token("u:", username));
+	while (arc_next_word(&message, word))
+		sc_arr_append(&blk->tokens, char *, arc_token("w:", word));
+}
+
+static int cmp_token(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void arc_put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t arc_get32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8 | p[3];
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t rv;
+
+	while (len) {
+		rv = write(fd, p, len);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv < 0)
+			return -1;
+		p += rv;
+		len -= rv;
+	}
+	return 0;
+}
+
+static int arc_index(struct cbot *bot, char *channel, char *segment,
+                     off_t offset, int length, int raw_length,
+                     struct arc_block *blk)
+{
+	sqlite3 *db = cbot_db_conn(bot);
+	char **tokens = sc_arr(&blk->tokens, char *);
+	size_t i;
+	int id;
+
+	sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+	id = log_block_insert(bot, channel, segment, offset, length,
+	                      raw_length, blk->start, blk->end, blk->count);
+	if (id < 0)
+		goto err;
+	qsort(tokens, blk->tokens.len, sizeof(char *), cmp_token);
+	for (i = 0; i < blk->tokens.len; i++) {
+		if (i && strcmp(tokens[i], tokens[i - 1]) == 0)
+			continue;
+		if (log_posting_insert(bot, tokens[i], id) < 0)
+			goto err;
+	}
+	sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+	return id;
+err:
+	sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+	return -1;
+}
+
+#ifdef WITH_ZLIB
+/*
+ * Compress @a len bytes at @a src into a new buffer, leaving room for a block
+ * header before the data. Returns the buffer and sets @a out to the compressed
+ * length, or returns NULL.
+ */
+static unsigned char *arc_compress(const char *src, size_t len, uint32_t *out)
+{
+	uLongf clen = compressBound(len);
+	unsigned char *data = malloc(ARC_HEADER + clen);
+
+	if (compress2(data + ARC_HEADER, &clen, (const Bytef *)src, len,
+	              Z_DEFAULT_COMPRESSION) != Z_OK) {
+		free(data);
+		return NULL;
+	}
+	*out = clen;
+	return data;
+}
+
+/* Decompress into exactly @a len bytes at @a dst */
+static int arc_uncompress(char *dst, uint32_t len, const unsigned char *src,
+                          uint32_t srclen)
+{
+	uLongf dstlen = len;
+
+	if (uncompress((Bytef *)dst, &dstlen, src, srclen) != Z_OK ||
+	    dstlen != len)
+		return -1;
+	return 0;
+}
+#else
+/* load() refuses the archive format, so these are never reached */
+static unsigned char *arc_compress(const char *src, size_t len, uint32_t *out)
+{
+	return NULL;
+}
+
+static int arc_uncompress(char *dst, uint32_t len, const unsigned char *src,
+                          uint32_t srclen)
+{
+	return -1;
+}
+#endif
+
+/*
+ * Compress the lines in @a raw, append them as a block to the segment open at
+ * @a fd, and index the block. On success, @a raw and @a blk are cleared for
+ * the next block. On failure they are left alone so that the caller may retry.
+ */
+static int arc_seal(struct cbot *bot, int fd, char *channel, char *segment,
+                    struct sc_charbuf *raw, struct arc_block *blk)
+{
+	unsigned char *data;
+	uint32_t len;
+	off_t offset;
+	int rv = -1;
+
+	if (!blk->count)
+		return 0;
+	if (raw->length > ARC_BLOCK_MAX) {
+		/* Readers would take it for a corrupt block */
+		CL_WARN("log: block for %s is too large (%d bytes)\n", channel,
+		        raw->length);
+		return -1;
+	}
+
+	data = arc_compress(raw->buf, raw->length, &len);
+	if (!data) {
+		CL_WARN("log: failed to compress block for %s\n", channel);
+		return -1;
+	}
+	memcpy(data, ARC_MAGIC, 4);
+	arc_put32(data + 4, raw->length);
+	arc_put32(data + 8, len);
+
+	offset = lseek(fd, 0, SEEK_END);
+	if (offset < 0 || write_all(fd, data, ARC_HEADER + len) < 0) {
+		CL_WARN("log: write to %s failed: %s\n", segment,
+		        strerror(errno));
+		/* Don't leave a partial block for readers to trip over */
+		if (offset >= 0)
+			(void)!ftruncate(fd, offset);
+		goto out;
+	}
+
+	/*
+	 * The block is safely in the segment, so even if indexing fails we
+	 * move on: the segment remains the source of truth, and "log reindex"
+	 * can add the block to the index later.
+	 */
+	if (arc_index(bot, channel, segment, offset, len, raw->length, blk) <
+	    0)
+		CL_WARN("log: failed to index block in %s at %lld, "
+		        "use \"log reindex %s\" to retry\n",
+		        segment, (long long)offset, segment);
+	sc_cb_clear(raw);
+	arc_block_reset(blk);
+	rv = 0;
+out:
+	free(data);
+	return rv;
+}
+
+/* Read and decompress a block. Returns a NUL-terminated buffer, or NULL. */
+static char *arc_load(const char *segment, off_t offset, uint32_t length,
+                      uint32_t raw_length)
+{
+	unsigned char hdr[ARC_HEADER];
+	unsigned char *data = NULL;
+	char *raw = NULL;
+	struct stat st;
+	int fd;
+
+	fd = open(segment, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		CL_WARN("log: failed to open %s: %s\n", segment,
+		        strerror(errno));
+		return NULL;
+	}
+	if (pread(fd, hdr, sizeof(hdr), offset) != sizeof(hdr) ||
+	    memcmp(hdr, ARC_MAGIC, 4) != 0 ||
+	    arc_get32(hdr + 4) != raw_length || arc_get32(hdr + 8) != length) {
+		CL_WARN("log: bad block header in %s at %lld\n", segment,
+		        (long long)offset);
+		goto out;
+	}
+	/* The header's lengths can't be trusted until they're checked */
+	if (fstat(fd, &st) < 0 || raw_length > ARC_BLOCK_MAX ||
+	    length > st.st_size || offset + ARC_HEADER > st.st_size - length) {
+		CL_WARN("log: corrupt block in %s at %lld\n", segment,
+		        (long long)offset);
+		goto out;
+	}
+	data = malloc(length);
+	raw = malloc(raw_length + 1);
+	if (!data || !raw) {
+		CL_WARN("log: out of memory loading block in %s at %lld\n",
+		        segment, (long long)offset);
+		free(raw);
+		raw = NULL;
+		goto out;
+	}
+	if (pread(fd, data, length, offset + ARC_HEADER) != (ssize_t)length ||
+	    arc_uncompress(raw, raw_length, data, length) < 0) {
+		CL_WARN("log: corrupt block in %s at %lld\n", segment,
+		        (long long)offset);
+		free(raw);
+		raw = NULL;
+		goto out;
+	}
+	raw[raw_length] = '\0';
+out:
+	free(data);
+	close(fd);
+	return raw;
+}
+
+/******
+ * Archive search
+ */
+
+struct arc_hit {
+	double ts;
+	char *username;
+	char *message;
+	bool action;
+};
+
+struct arc_search {
+	char *channel;
+	char *user;
+	double since;
+	double until;
+	struct sc_array words; /* char *, distinct */
+	struct sc_array hits;  /* struct arc_hit, newest first */
+	size_t limit;
+};
+
+static void arc_search_init(struct arc_search *s, size_t limit)
+{
+	memset(s, 0, sizeof(*s));
+	s->until = DBL_MAX;
+	s->limit = limit;
+	sc_arr_init(&s->words, char *, 8);
+	sc_arr_init(&s->hits, struct arc_hit, limit);
+}
+
+static void arc_search_destroy(struct arc_search *s)
+{
+	struct arc_hit *hits = sc_arr(&s->hits, struct arc_hit);
+	char **words = sc_arr(&s->words, char *);
+	size_t i;
+
+	for (i = 0; i < s->words.len; i++)
+		free(words[i]);
+	for (i = 0; i < s->hits.len; i++) {
+		free(hits[i].username);
+		free(hits[i].message);
+	}
+	sc_arr_destroy(&s->words);
+	sc_arr_destroy(&s->hits);
+	free(s->channel);
+	free(s->user);
+}
+
+/* Parse YYYY-MM-DD as local midnight at the start (or end) of the day */
+static int arc_parse_date(const char *str, double *out, bool end)
+{
+	struct tm tm = { 0 };
+
+	if (sscanf(str, "%d-%d-%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday) != 3)
+		return -1;
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	if (end)
+		tm.tm_mday += 1;
+	tm.tm_isdst = -1;
+	*out = mktime(&tm);
+	return 0;
+}
+
+/*
+ * Parse a query: a list of words which must all appear, with optional terms
+ * #channel, from:USER, since:YYYY-MM-DD and until:YYYY-MM-DD.
+ */
+static int arc_search_parse(struct arc_search *s, const char *query,
+                            const char **err)
+{
+	char word[ARC_TOKEN_MAX + 1];
+	char *copy = strdup(query);
+	char *term, *save = NULL;
+	const char *text;
+	char **words;
+	size_t i;
+	int rv = -1;
+
+	for (term = strtok_r(copy, " \t", &save); term;
+	     term = strtok_r(NULL, " \t", &save)) {
+		if (term[0] == '#') {
+			free(s->channel);
+			s->channel = strdup(term);
+		} else if (strncmp(term, "from:", 5) == 0 && term[5]) {
+			free(s->user);
+			s->user = strdup(term + 5);
+		} else if (strncmp(term, "since:", 6) == 0) {
+			if (arc_parse_date(term + 6, &s->since, false) < 0) {
+				*err = "since: expects a date like 2024-01-31";
+				goto out;
+			}
+		} else if (strncmp(term, "until:", 6) == 0) {
+			if (arc_parse_date(term + 6, &s->until, true) < 0) {
+				*err = "until: expects a date like 2024-01-31";
+				goto out;
+			}
+		} else {
+			text = term;
+			while (arc_next_word(&text, word)) {
+				words = sc_arr(&s->words, char *);
+				for (i = 0; i < s->words.len; i++)
+					if (strcmp(words[i], word) == 0)
+						break;
+				if (i == s->words.len)
+					sc_arr_append(&s->words, char *,
+					              strdup(word));
+			}
+		}
+	}
+	if (!s->words.len && !s->user) {
+		*err = "give me some words, or from:USER, to search for";
+		goto out;
+	}
+	rv = 0;
+out:
+	free(copy);
+	return rv;
+}
+
+static bool arc_has_word(const char *message, const char *want)
+{
+	char word[ARC_TOKEN_MAX + 1];
+
+	while (arc_next_word(&message, word))
+		if (strcmp(word, want) == 0)
+			return true;
+	return false;
+}
+
+static bool arc_match(struct arc_search *s, struct arc_hit *hit)
+{
+	char **words = sc_arr(&s->words, char *);
+	size_t i;
+
+	if (hit->ts < s->since || hit->ts >= s->until)
+		return false;
+	if (s->user && strcasecmp(s->user, hit->username) != 0)
+		return false;
+	for (i = 0; i < s->words.len; i++)
+		if (!arc_has_word(hit->message, words[i]))
+			return false;
+	return true;
+}
+
+/* Scan a buffer of lines (oldest first), modifying it in place. */
+static void arc_scan(struct arc_search *s, char *lines)
+{
+	struct sc_array found;
+	struct arc_hit hit, *hits;
+	char *line, *next;
+	size_t i;
+
+	sc_arr_init(&found, struct arc_hit, 16);
+	for (line = lines; *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		else
+			next = line + strlen(line);
+		if (parse_line(line, &hit.ts, &hit.username, &hit.message,
+		               &hit.action) < 0)
+			continue;
+		if (arc_match(s, &hit)) {
+			sc_arr_append(&found, struct arc_hit, hit);
+		} else {
+			free(hit.username);
+			free(hit.message);
+		}
+	}
+
+	hits = sc_arr(&found, struct arc_hit);
+	for (i = found.len; i > 0; i--) {
+		if (s->hits.len < s->limit) {
+			sc_arr_append(&s->hits, struct arc_hit, hits[i - 1]);
+		} else {
+			free(hits[i - 1].username);
+			free(hits[i - 1].message);
+		}
+	}
+	sc_arr_destroy(&found);
+}
+
+/*
+ * Scan the indexed blocks which may contain matches, newest first. Only blocks
+ * containing the sender and every word are candidates, so the posting lists do
+ * the work of narrowing down which blocks must be decompressed.
+ */
+static void arc_scan_blocks(struct cbot *bot, struct arc_search *s)
+{
+	sqlite3 *db = cbot_db_conn(bot);
+	struct sc_charbuf sql;
+	sqlite3_stmt *stmt = NULL;
+	char **words = sc_arr(&s->words, char *);
+	char *token, *segment, *raw;
+	size_t ntok = s->words.len + (s->user ? 1 : 0);
+	size_t i;
+	int rv, param = 4;
+
+	sc_cb_init(&sql, 512);
+	sc_cb_concat(&sql, "SELECT segment, offset, length, raw_length "
+	                   "FROM log_block "
+	                   "WHERE channel = ?1 AND end_ts >= ?2 "
+	                   "AND start_ts < ?3 ");
+	if (ntok) {
+		sc_cb_concat(&sql, "AND id IN (SELECT block FROM log_posting "
+		                   "WHERE token IN (");
+		for (i = 0; i < ntok; i++)
+			sc_cb_printf(&sql, "%s?%zu", i ? ", " : "", i + 4);
+		sc_cb_printf(&sql, ") GROUP BY block HAVING COUNT(*) = %zu) ",
+		             ntok);
+	}
+	sc_cb_printf(&sql, "ORDER BY start_ts DESC LIMIT %d;",
+	             ARC_SEARCH_BLOCKS);
+
+	rv = sqlite3_prepare_v2(db, sql.buf, -1, &stmt, NULL);
+	if (rv != SQLITE_OK) {
+		CL_WARN("log: search prepare: %s\n", sqlite3_errmsg(db));
+		goto out;
+	}
+	sqlite3_bind_text(stmt, 1, s->channel, -1, SQLITE_STATIC);
+	sqlite3_bind_double(stmt, 2, s->since);
+	sqlite3_bind_double(stmt, 3, s->until);
+	if (s->user)
+		sqlite3_bind_text(stmt, param++, arc_token("u:", s->user), -1,
+		                  free);
+	for (i = 0; i < s->words.len; i++) {
+		token = arc_token("w:", words[i]);
+		sqlite3_bind_text(stmt, param++, token, -1, free);
+	}
+
+	while (s->hits.len < s->limit &&
+	       (rv = sqlite3_step(stmt)) == SQLITE_ROW) {
+		segment = (char *)sqlite3_column_text(stmt, 0);
+		raw = arc_load(segment, sqlite3_column_int64(stmt, 1),
+		               sqlite3_column_int(stmt, 2),
+		               sqlite3_column_int(stmt, 3));
+		if (raw)
+			arc_scan(s, raw);
+		free(raw);
+	}
+	if (rv != SQLITE_ROW && rv != SQLITE_DONE)
+		CL_WARN("log: search step: %s\n", sqlite3_errmsg(db));
+out:
+	sqlite3_finalize(stmt);
+	sc_cb_destroy(&sql);
+}
+
+static void arc_search_run(struct log_plugin *lp, struct arc_search *s)
+{
+	struct log_channel *ch;
+	char *copy;
+
+	/* Lines which are not yet sealed are the newest of all */
+	sc_list_for_each_entry(ch, &lp->channels, list, struct log_channel)
+	{
+		if (strcmp(ch->name, s->channel) != 0 || !ch->buf.length)
+			continue;
+		copy = strdup(ch->buf.buf);
+		arc_scan(s, copy);
+		free(copy);
+	}
+	if (s->hits.len < s->limit)
+		arc_scan_blocks(lp->bot, s);
+}
+
+static void arc_format_time(double ts, char *buf, size_t len)
+{
+	time_t t = (time_t)ts;
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	strftime(buf, len, "%Y-%m-%d %H:%M", &tm);
+}
+
+static void cmd_log_search(struct cbot_message_event *event, void *user)
+{
+	struct log_plugin *lp = event->plugin->data;
+	struct arc_search s;
+	struct arc_hit *hits;
+	struct sc_charbuf cb;
+	const char *err;
+	char *query, when[32];
+	size_t i;
+
+	query = sc_regex_get_capture(event->message, event->indices, 0);
+	arc_search_init(&s, ARC_CHAT_HITS);
+	if (arc_search_parse(&s, query, &err) < 0) {
+		cbot_send(event->bot, event->channel, "%s", err);
+		goto out;
+	}
+	if (!s.channel) {
+		s.channel = strdup(event->channel);
+	} else if (strcmp(s.channel, event->channel) != 0 &&
+	           !cbot_is_authorized(event->bot, event->username,
+	                               event->message)) {
+		cbot_send(event->bot, event->channel,
+		          "sorry, only admins may search other channels");
+		goto out;
+	}
+	arc_search_run(lp, &s);
+
+	if (!s.hits.len) {
+		cbot_send(event->bot, event->channel,
+		          "No matching messages in %s", s.channel);
+		goto out;
+	}
+	sc_cb_init(&cb, 512);
+	hits = sc_arr(&s.hits, struct arc_hit);
+	for (i = 0; i < s.hits.len; i++) {
+		arc_format_time(hits[i].ts, when, sizeof(when));
+		if (hits[i].action)
+			sc_cb_printf(&cb, "[%s] * %s %s\n", when,
+			             hits[i].username, hits[i].message);
+		else
+			sc_cb_printf(&cb, "[%s] <%s> %s\n", when,
+			             hits[i].username, hits[i].message);
+	}
+	cbot_send_rl(event->bot, event->channel, "%s", cb.buf);
+	sc_cb_destroy(&cb);
+out:
+	arc_search_destroy(&s);
+	free(query);
+}
+
+static bool arc_http_allowed(struct log_plugin *lp, const char *channel)
+{
+	char **channels = sc_arr(&lp->http_search, char *);
+	size_t i;
+
+	for (i = 0; i < lp->http_search.len; i++)
+		if (strcmp(channels[i], channel) == 0)
+			return true;
+	return false;
+}
+
+/* GET /logs/search?channel=CHANNEL&q=QUERY, for channels in http_search */
+static void cmd_log_http_search(struct cbot_http_event *event, void *user)
+{
+	struct log_plugin *lp = event->plugin->data;
+	struct arc_search s;
+	struct arc_hit *hits;
+	struct sc_charbuf cb;
+	const char *channel, *query, *err = "";
+	char when[32];
+	size_t i;
+
+	cbot_http_plainresp_start(&cb, "Log search");
+	arc_search_init(&s, ARC_HTTP_HITS);
+	channel = MHD_lookup_connection_value(event->connection,
+	                                      MHD_GET_ARGUMENT_KIND, "channel");
+	query = MHD_lookup_connection_value(event->connection,
+	                                    MHD_GET_ARGUMENT_KIND, "q");
+	if (!query || arc_search_parse(&s, query, &err) < 0) {
+		sc_cb_concat(&cb, ARC_HTTP_USAGE);
+		if (query)
+			sc_cb_concat_http_esc(&cb, err);
+		cbot_http_plainresp_send(&cb, event, MHD_HTTP_BAD_REQUEST);
+		goto out;
+	}
+	if (!s.channel && channel)
+		s.channel = strdup(channel);
+	if (!s.channel) {
+		sc_cb_concat(&cb, ARC_HTTP_USAGE);
+		cbot_http_plainresp_send(&cb, event, MHD_HTTP_BAD_REQUEST);
+		goto out;
+	}
+	if (!arc_http_allowed(lp, s.channel)) {
+		sc_cb_concat(&cb, "searching ");
+		sc_cb_concat_http_esc(&cb, s.channel);
+		sc_cb_concat(&cb, " is not allowed here\n");
+		cbot_http_plainresp_send(&cb, event, MHD_HTTP_FORBIDDEN);
+		goto out;
+	}
+	arc_search_run(lp, &s);
+
+	sc_cb_printf(&cb, "%zu matching messages in ", s.hits.len);
+	sc_cb_concat_http_esc(&cb, s.channel);
+	sc_cb_concat(&cb, "\n\n");
+	hits = sc_arr(&s.hits, struct arc_hit);
+	for (i = 0; i < s.hits.len; i++) {
+		arc_format_time(hits[i].ts, when, sizeof(when));
+		sc_cb_printf(&cb, "[%s] %s", when,
+		             hits[i].action ? "* " : "&lt;");
+		sc_cb_concat_http_esc(&cb, hits[i].username);
+		sc_cb_concat(&cb, hits[i].action ? " " : "&gt; ");
+		sc_cb_concat_http_esc(&cb, hits[i].message);
+		sc_cb_append(&cb, '\n');
+	}
+	cbot_http_plainresp_send(&cb, event, MHD_HTTP_OK);
+out:
+	arc_search_destroy(&s);
+}
+
+/******
+ * Importing JSON logs into the archive, and re-indexing segments
+ */
+
+/* An import or reindex task, which runs in its own LWT */
+struct arc_import {
+	struct sc_list_head list;
+	struct log_plugin *lp;
+	struct cbot *bot;
+	FILE *file;
+	char *path;
+	char *channel;
+	char *segment;
+	char *reply_to;
+	int block_size;
+	/* Set when the plugin unloads: we may no longer touch lp */
+	bool cancelled;
+};
+
+static void arc_import_free(struct arc_import *imp)
+{
+	if (imp->file)
+		fclose(imp->file);
+	free(imp->path);
+	free(imp->channel);
+	free(imp->segment);
+	free(imp->reply_to);
+	free(imp);
+}
+
+static void arc_import_run(void *arg)
+{
+	struct arc_import *imp = arg;
+	struct sc_charbuf buf, fixed;
+	struct arc_block blk;
+	unsigned long lines = 0, imported = 0, skipped = 0;
+	char *line = NULL, *username, *message, *legacy;
+	size_t cap = 0;
+	ssize_t len;
+	double ts;
+	bool action, failed = false;
+	int fd;
+
+	fd = open(imp->segment, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+	          0644);
+	if (fd < 0) {
+		cbot_send(imp->bot, imp->reply_to, "log: can't open %s: %s",
+		          imp->segment, strerror(errno));
+		goto out;
+	}
+	sc_cb_init(&buf, imp->block_size + 1024);
+	sc_cb_init(&fixed, 1024);
+	arc_block_init(&blk);
+
+	while ((len = getline(&line, &cap, imp->file)) >= 0) {
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		legacy = strstr(line, ARC_LEGACY_ACTION);
+		if (legacy) {
+			sc_cb_clear(&fixed);
+			sc_cb_memcpy(&fixed, line, legacy - line);
+			sc_cb_concat(&fixed, ", \"action\": true}");
+			sc_cb_concat(&fixed,
+			             legacy + strlen(ARC_LEGACY_ACTION));
+		}
+		if (len && parse_line(legacy ? fixed.buf : line, &ts, &username,
+		                      &message, &action) == 0) {
+			write_line(&buf, ts, username, message, action);
+			arc_block_add(&blk, ts, username, message);
+			free(username);
+			free(message);
+			imported++;
+		} else if (len) {
+			skipped++;
+		}
+		if (buf.length >= imp->block_size &&
+		    arc_seal(imp->bot, fd, imp->channel, imp->segment, &buf,
+		             &blk) < 0) {
+			failed = true;
+			break;
+		}
+		if (++lines % ARC_IMPORT_BATCH == 0) {
+			sc_lwt_yield();
+			if (imp->cancelled || sc_lwt_shutting_down())
+				break;
+		}
+	}
+	if (!failed && !imp->cancelled &&
+	    arc_seal(imp->bot, fd, imp->channel, imp->segment, &buf, &blk) < 0)
+		failed = true;
+
+	if (!imp->cancelled)
+		cbot_send(imp->bot, imp->reply_to,
+		          "log: %s %s: %lu messages imported, "
+		          "%lu lines skipped",
+		          failed ? "failed importing" : "imported", imp->path,
+		          imported, skipped);
+	free(line);
+	arc_block_destroy(&blk);
+	sc_cb_destroy(&fixed);
+	sc_cb_destroy(&buf);
+	close(fd);
+out:
+	if (!imp->cancelled)
+		sc_list_remove(&imp->list);
+	arc_import_free(imp);
+}
+
+/*
+ * Check that the file at @a path is named CHANNEL-YYYY-MM-DD@a ext (where the
+ * extension is four bytes, including the dot), and return the name.
+ */
+static const char *arc_file_name(const char *path, const char *ext)
+{
+	const char *base = strrchr(path, '/');
+	size_t len;
+	int y, m, d;
+
+	base = base ? base + 1 : path;
+	len = strlen(base);
+	if (len <= 15 || strcmp(base + len - 4, ext) != 0 ||
+	    sscanf(base + len - 15, "-%4d-%2d-%2d.", &y, &m, &d) != 3)
+		return NULL;
+	return base;
+}
+
+/*
+ * log import PATH: index an existing CHANNEL-YYYY-MM-DD.log file into the
+ * archive segment for the same channel and day.
+ */
+static void cmd_log_import(struct cbot_message_event *event, void *user)
+{
+	struct log_plugin *lp = event->plugin->data;
+	struct arc_import *imp;
+	const char *base;
+	char *path;
+	size_t len;
+
+	if (!cbot_is_authorized(event->bot, event->username, event->message)) {
+		cbot_send(event->bot, event->channel,
+		          "sorry, you're not authorized to do that!");
+		return;
+	}
+	path = sc_regex_get_capture(event->message, event->indices, 0);
+	base = arc_file_name(path, ".log");
+	if (!base) {
+		cbot_send(event->bot, event->channel,
+		          "expected a file named CHANNEL-YYYY-MM-DD.log");
+		free(path);
+		return;
+	}
+	len = strlen(base);
+
+	imp = calloc(1, sizeof(*imp));
+	imp->file = fopen(path, "r");
+	if (!imp->file) {
+		cbot_send(event->bot, event->channel, "can't open %s: %s", path,
+		          strerror(errno));
+		free(path);
+		free(imp);
+		return;
+	}
+	imp->lp = lp;
+	imp->bot = event->bot;
+	imp->path = path;
+	imp->channel = strndup(base, len - 15);
+	imp->segment = malloc(len + 1);
+	snprintf(imp->segment, len + 1, "%s-%.10s.arc", imp->channel,
+	         base + len - 14);
+	imp->reply_to = strdup(event->channel);
+	imp->block_size = lp->flush_size;
+	sc_list_insert_end(&lp->imports, &imp->list);
+	sc_lwt_create_task(cbot_get_lwt_ctx(event->bot), arc_import_run, imp);
+	cbot_send(event->bot, event->channel, "importing %s into the archive",
+	          path);
+}
+
+/* Index the block at @a offset, which is missing from the index */
+static int arc_reindex_block(struct arc_import *imp, off_t offset,
+                             uint32_t length, uint32_t raw_length)
+{
+	struct arc_block blk;
+	char *raw, *line, *next, *username, *message;
+	double ts;
+	bool action;
+	int rv;
+
+	raw = arc_load(imp->path, offset, length, raw_length);
+	if (!raw)
+		return -1;
+	arc_block_init(&blk);
+	for (line = raw; *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		else
+			next = line + strlen(line);
+		if (parse_line(line, &ts, &username, &message, &action) < 0)
+			continue;
+		arc_block_add(&blk, ts, username, message);
+		free(username);
+		free(message);
+	}
+	rv = arc_index(imp->bot, imp->channel, imp->segment, offset, length,
+	               raw_length, &blk);
+	arc_block_destroy(&blk);
+	free(raw);
+	return rv;
+}
+
+/*
+ * Walk the block headers of a segment, indexing each block which the index
+ * doesn't have. Blocks which were indexed as they were sealed are skipped.
+ */
+static void arc_reindex_run(void *arg)
+{
+	struct arc_import *imp = arg;
+	unsigned char hdr[ARC_HEADER];
+	unsigned long blocks = 0, indexed = 0;
+	uint32_t length, raw_length;
+	off_t offset = 0;
+	bool failed = false;
+	int fd = fileno(imp->file);
+	int rv;
+
+	while (pread(fd, hdr, sizeof(hdr), offset) == sizeof(hdr)) {
+		if (memcmp(hdr, ARC_MAGIC, 4) != 0) {
+			CL_WARN("log: bad block header in %s at %lld\n",
+			        imp->path, (long long)offset);
+			failed = true;
+			break;
+		}
+		raw_length = arc_get32(hdr + 4);
+		length = arc_get32(hdr + 8);
+		rv = log_block_exists(imp->bot, imp->channel, imp->segment,
+		                      offset);
+		if (rv == 0) {
+			rv = arc_reindex_block(imp, offset, length,
+			                       raw_length);
+			indexed += rv >= 0;
+		}
+		if (rv < 0) {
+			failed = true;
+			break;
+		}
+		blocks++;
+		offset += ARC_HEADER + length;
+		if (blocks % ARC_IMPORT_BATCH == 0) {
+			sc_lwt_yield();
+			if (imp->cancelled || sc_lwt_shutting_down())
+				break;
+		}
+	}
+
+	if (!imp->cancelled) {
+		cbot_send(imp->bot, imp->reply_to,
+		          "log: %s %s: %lu blocks, %lu newly indexed",
+		          failed ? "failed reindexing" : "reindexed", imp->path,
+		          blocks, indexed);
+		sc_list_remove(&imp->list);
+	}
+	arc_import_free(imp);
+}
+
+/*
+ * log reindex PATH: index any blocks of the CHANNEL-YYYY-MM-DD.arc segment at
+ * PATH which are missing from the index, as when indexing failed at seal time.
+ */
+static void cmd_log_reindex(struct cbot_message_event *event, void *user)
+{
+	struct log_plugin *lp = event->plugin->data;
+	struct arc_import *imp;
+	const char *base;
+	char *path;
+
+	if (!cbot_is_authorized(event->bot, event->username, event->message)) {
+		cbot_send(event->bot, event->channel,
+		          "sorry, you're not authorized to do that!");
+		return;
+	}
+	path = sc_regex_get_capture(event->message, event->indices, 0);
+	base = arc_file_name(path, ".arc");
+	if (!base) {
+		cbot_send(event->bot, event->channel,
+		          "expected a file named CHANNEL-YYYY-MM-DD.arc");
+		free(path);
+		return;
+	}
+
+	imp = calloc(1, sizeof(*imp));
+	imp->file = fopen(path, "r");
+	if (!imp->file) {
+		cbot_send(event->bot, event->channel, "can't open %s: %s", path,
+		          strerror(errno));
+		free(path);
+		free(imp);
+		return;
+	}
+	imp->lp = lp;
+	imp->bot = event->bot;
+	imp->path = path;
+	imp->channel = strndup(base, strlen(base) - 15);
+	/* Blocks are indexed under the name the channel writer uses */
+	imp->segment = strdup(base);
+	imp->reply_to = strdup(event->channel);
+	sc_list_insert_end(&lp->imports, &imp->list);
+	sc_lwt_create_task(cbot_get_lwt_ctx(event->bot), arc_reindex_run, imp);
+	cbot_send(event->bot, event->channel, "reindexing %s", path);
+}
+
+/******
+ * Channel files
+ */
+
+static int log_open(struct log_plugin *lp, struct log_channel *ch)
+{
+	struct sc_charbuf filename;
+
+	sc_cb_init(&filename, 40);
+	sc_cb_printf(&filename, "%s-%s.%s", ch->name, lp->day,
+	             lp->archive ? "arc" : "log");
+	ch->fd = open(filename.buf, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+	              0644);
+	if (ch->fd < 0 && !ch->open_failed)
+		CL_WARN("log: failed to open %s: %s\n", filename.buf,
+		        strerror(errno));
+	ch->open_failed = ch->fd < 0;
+	sc_cb_destroy(&filename);
+	return ch->fd;
+}
+
+static void log_write_channel(struct log_plugin *lp, struct log_channel *ch)
+{
+	ssize_t rv;
+	size_t off = 0;
+
+	while (off < (size_t)ch->buf.length) {
+		rv = write(ch->fd, ch->buf.buf + off, ch->buf.length - off);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv < 0) {
+			CL_WARN("log: write to %s failed: %s\n", ch->name,
+			        strerror(errno));
+			break;
+		}
+		off += rv;
+	}
+	if (off == (size_t)ch->buf.length) {
+		sc_cb_clear(&ch->buf);
+	} else {
+		memmove(ch->buf.buf, ch->buf.buf + off, ch->buf.length - off);
+		ch->buf.length -= off;
+		ch->buf.buf[ch->buf.length] = '\0';
+	}
+}
+
+static void log_seal_channel(struct log_plugin *lp, struct log_channel *ch)
+{
+	struct sc_charbuf segment;
+
+	sc_cb_init(&segment, 40);
+	sc_cb_printf(&segment, "%s-%s.arc", ch->name, lp->day);
+	arc_seal(lp->bot, ch->fd, ch->name, segment.buf, &ch->buf, &ch->blk);
+	sc_cb_destroy(&segment);
+}
+
+static void log_flush_channel(struct log_plugin *lp, struct log_channel *ch)
+{
+	if (!ch->buf.length)
+		return;
+	if (ch->fd < 0 && log_open(lp, ch) < 0)
+		return; /* keep the data buffered, up to max_buffer */
+
+	if (lp->archive)
+		log_seal_channel(lp, ch);
+	else
+		log_write_channel(lp, ch);
+	if (lp->fsync == LOG_FSYNC_FLUSH)
+		fsync(ch->fd);
+	if (ch->dropped) {
+		CL_WARN("log: dropped %lu messages for %s (buffer full)\n",
+		        ch->dropped, ch->name);
+		ch->dropped = 0;
+	}
+}
+
+static void log_close_channel(struct log_plugin *lp, struct log_channel *ch)
+{
+	log_flush_channel(lp, ch);
+	if (ch->fd >= 0) {
+		if (lp->fsync != LOG_FSYNC_NEVER)
+			fsync(ch->fd);
+		close(ch->fd);
+	}
+	ch->fd = -1;
+	ch->open_failed = false;
+}
+
+static void log_flush_all(struct log_plugin *lp)
+{
+	struct log_channel *ch;
+	sc_list_for_each_entry(ch, &lp->channels, list, struct log_channel)
+	{
+		log_flush_channel(lp, ch);
+	}
+}
+
+static void log_flush_cb(struct cbot_plugin *plugin, void *arg)
+{
+	struct log_plugin *lp = plugin->data;
+	/* The callback is freed once we return */
+	lp->flush_cb = NULL;
+	log_flush_all(lp);
+}
+
+static void log_midnight_cb(struct cbot_plugin *plugin, void *arg);
+
+/*
+ * Close every file and compute the local day containing @a now, so that files
+ * are reopened with the new date on their next write.
+ */
+static void log_rollover(struct cbot_plugin *plugin, time_t now)
+{
+	struct log_plugin *lp = plugin->data;
+	struct log_channel *ch;
+	struct tm tm;
+
+	sc_list_for_each_entry(ch, &lp->channels, list, struct log_channel)
+	{
+		log_close_channel(lp, ch);
+	}
+
+	localtime_r(&now, &tm);
+	strftime(lp->day, sizeof(lp->day), "%Y-%m-%d", &tm);
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	lp->day_start = mktime(&tm);
+	tm.tm_mday += 1;
+	tm.tm_isdst = -1;
+	lp->day_end = mktime(&tm);
+
+	if (lp->midnight_cb)
+		cbot_cancel_callback(lp->midnight_cb);
+	lp->midnight_cb = cbot_schedule_callback(plugin, log_midnight_cb, NULL,
+	                                         lp->day_end);
+}
+
+static void log_midnight_cb(struct cbot_plugin *plugin, void *arg)
+{
+	struct log_plugin *lp = plugin->data;
+	/* The callback is freed once we return */
+	lp->midnight_cb = NULL;
+	log_rollover(plugin, time(NULL));
+}
+
+static struct log_channel *log_channel_get(struct log_plugin *lp,
+                                           const char *name)
+{
+	struct log_channel *ch;
+	sc_list_for_each_entry(ch, &lp->channels, list, struct log_channel)
+	{
+		if (strcmp(ch->name, name) == 0)
+			return ch;
+	}
+	ch = calloc(1, sizeof(*ch));
+	ch->name = strdup(name);
+	ch->fd = -1;
+	sc_cb_init(&ch->buf, 1024);
+	arc_block_init(&ch->blk);
+	sc_list_insert_end(&lp->channels, &ch->list);
+	return ch;
+}
+
+/*
+ * For every channel message, append a line to the channel's buffer (see
+ * write_line()), and in archive mode note it in the block index.
  */
 static void cbot_log_message(struct cbot_message_event *event, void *user)
 {
-#define NSEC_PER_SEC 10000000000.0
+	struct cbot_plugin *plugin = event->plugin;
+	struct log_plugin *lp = plugin->data;
+	struct log_channel *ch;
 	struct timespec now;
-	struct tm *tm;
 	double time_float;
-	struct sc_charbuf filename;
-	FILE *f;
 
-	/*
-	 * First get timestamp.
-	 */
 	clock_gettime(CLOCK_REALTIME, &now);
-	tm = localtime(&now.tv_sec);
+	if (now.tv_sec >= lp->day_end || now.tv_sec < lp->day_start)
+		log_rollover(plugin, now.tv_sec);
 	time_float = now.tv_sec + now.tv_nsec / NSEC_PER_SEC;
 
-	/*
-	 * Create filename and open it.
-	 */
-	sc_cb_init(&filename, 40);
-	sc_cb_printf(&filename, "%s-%04d-%02d-%02d.log", event->channel,
-	             tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday);
-	f = fopen(filename.buf, "a");
-
-	if (f) {
-		/*
-		 * Write log line.
-		 */
-		fprintf(f, "{\"timestamp\": %f, \"username\": ", time_float);
-		write_string(f, event->username);
-		fprintf(f, ", \"message\": ");
-		write_string(f, event->message);
-		if (event->is_action)
-			fprintf(f, ", action: true");
-		fprintf(f, "}\n");
-
-		/*
-		 * Cleanup
-		 */
-		fclose(f);
+	ch = log_channel_get(lp, event->channel);
+	if (ch->buf.length >= lp->max_buffer) {
+		ch->dropped++;
+		return;
 	}
-	sc_cb_destroy(&filename);
+
+	write_line(&ch->buf, time_float, event->username, event->message,
+	           event->is_action);
+	if (lp->archive)
+		arc_block_add(&ch->blk, time_float, event->username,
+		              event->message);
+
+	if (ch->buf.length >= lp->flush_size)
+		log_flush_channel(lp, ch);
+	else if (!lp->flush_cb)
+		lp->flush_cb = cbot_schedule_callback(
+		        plugin, log_flush_cb, NULL,
+		        now.tv_sec + lp->flush_interval);
+}
+
+/* Read the optional list of channels which /logs/search may serve */
+static int log_load_http_search(struct log_plugin *lp, config_setting_t *conf)
+{
+	config_setting_t *list;
+	const char *channel;
+	int i;
+
+	if (!conf || !(list = config_setting_lookup(conf, "http_search")))
+		return 0;
+	if (!config_setting_is_array(list) && !config_setting_is_list(list)) {
+		CL_CRIT("log: http_search must be a list of channels\n");
+		return -1;
+	}
+	for (i = 0; i < config_setting_length(list); i++) {
+		channel = config_setting_get_string_elem(list, i);
+		if (!channel) {
+			CL_CRIT("log: http_search[%d] is not a string\n", i);
+			return -1;
+		}
+		sc_arr_append(&lp->http_search, char *, strdup(channel));
+	}
+	return 0;
+}
+
+static void log_free_http_search(struct log_plugin *lp)
+{
+	char **channels = sc_arr(&lp->http_search, char *);
+	size_t i;
+
+	for (i = 0; i < lp->http_search.len; i++)
+		free(channels[i]);
+	sc_arr_destroy(&lp->http_search);
 }
 
 static int load(struct cbot_plugin *plugin, config_setting_t *conf)
 {
+	struct log_plugin *lp = calloc(1, sizeof(*lp));
+	const char *fsync_policy = "never";
+	const char *format = "json";
+	int rv;
+
+	sc_list_init(&lp->channels);
+	sc_list_init(&lp->imports);
+	lp->bot = plugin->bot;
+	if (conf)
+		config_setting_lookup_string(conf, "format", &format);
+	if (strcmp(format, "json") == 0) {
+		lp->flush_interval = 2;
+		lp->flush_size = 8192;
+	} else if (strcmp(format, "archive") == 0) {
+#ifndef WITH_ZLIB
+		CL_CRIT("log: format \"archive\" needs CBot built with zlib\n");
+		free(lp);
+		return -1;
+#endif
+		lp->archive = true;
+		lp->flush_interval = 300;
+		lp->flush_size = 64 * 1024;
+	} else {
+		CL_CRIT("log: unknown format \"%s\"\n", format);
+		free(lp);
+		return -1;
+	}
+	lp->max_buffer = 256 * 1024;
+	if (conf) {
+		config_setting_lookup_int(conf, "flush_interval",
+		                          &lp->flush_interval);
+		config_setting_lookup_int(conf, "flush_size", &lp->flush_size);
+		config_setting_lookup_int(conf, "max_buffer", &lp->max_buffer);
+		config_setting_lookup_string(conf, "fsync", &fsync_policy);
+	}
+	/* Blocks grow to one of these, plus a line, so keep them in bounds */
+	if (lp->archive && (lp->flush_size > ARC_BLOCK_MAX / 2 ||
+	                    lp->max_buffer > ARC_BLOCK_MAX / 2)) {
+		CL_WARN("log: flush_size and max_buffer are limited to %d in "
+		        "archive format\n",
+		        ARC_BLOCK_MAX / 2);
+		if (lp->flush_size > ARC_BLOCK_MAX / 2)
+			lp->flush_size = ARC_BLOCK_MAX / 2;
+		if (lp->max_buffer > ARC_BLOCK_MAX / 2)
+			lp->max_buffer = ARC_BLOCK_MAX / 2;
+	}
+
+	if (strcmp(fsync_policy, "never") == 0) {
+		lp->fsync = LOG_FSYNC_NEVER;
+	} else if (strcmp(fsync_policy, "rollover") == 0) {
+		lp->fsync = LOG_FSYNC_ROLLOVER;
+	} else if (strcmp(fsync_policy, "flush") == 0) {
+		lp->fsync = LOG_FSYNC_FLUSH;
+	} else {
+		CL_CRIT("log: unknown fsync policy \"%s\"\n", fsync_policy);
+		free(lp);
+		return -1;
+	}
+	if (lp->flush_interval < 1)
+		lp->flush_interval = 1;
+
+	sc_arr_init(&lp->http_search, char *, 4);
+	if (lp->archive) {
+		rv = cbot_db_register(plugin, &tbl_log_block);
+		if (rv >= 0)
+			rv = cbot_db_register(plugin, &tbl_log_posting);
+		if (rv >= 0)
+			rv = log_load_http_search(lp, conf);
+		if (rv < 0) {
+			log_free_http_search(lp);
+			free(lp);
+			return rv;
+		}
+		cbot_register(plugin, CBOT_ADDRESSED,
+		              (cbot_handler_t)cmd_log_search, NULL,
+		              "log search (.+)");
+		cbot_register(plugin, CBOT_ADDRESSED,
+		              (cbot_handler_t)cmd_log_import, NULL,
+		              "log import (.+)");
+		cbot_register(plugin, CBOT_ADDRESSED,
+		              (cbot_handler_t)cmd_log_reindex, NULL,
+		              "log reindex (.+)");
+		if (lp->http_search.len)
+			cbot_register(plugin, CBOT_HTTP_GET,
+			              (cbot_handler_t)cmd_log_http_search,
+			              NULL, "/logs/search");
+	}
+
+	plugin->data = lp;
+	log_rollover(plugin, time(NULL));
 	cbot_register(plugin, CBOT_MESSAGE, (cbot_handler_t)cbot_log_message,
 	              NULL, NULL);
 	return 0;
 }
 
+static void unload(struct cbot_plugin *plugin)
+{
+	struct log_plugin *lp = plugin->data;
+	struct log_channel *ch, *next;
+	struct arc_import *imp, *inext;
+
+	if (lp->flush_cb)
+		cbot_cancel_callback(lp->flush_cb);
+	if (lp->midnight_cb)
+		cbot_cancel_callback(lp->midnight_cb);
+	/* Running imports notice this at their next yield, and clean up */
+	sc_list_for_each_safe(imp, inext, &lp->imports, list,
+	                      struct arc_import)
+	{
+		imp->cancelled = true;
+		sc_list_remove(&imp->list);
+	}
+	sc_list_for_each_safe(ch, next, &lp->channels, list,
+	                      struct log_channel)
+	{
+		log_close_channel(lp, ch);
+		sc_list_remove(&ch->list);
+		sc_cb_destroy(&ch->buf);
+		arc_block_destroy(&ch->blk);
+		free(ch->name);
+		free(ch);
+	}
+	log_free_http_search(lp);
+	free(lp);
+}
+
+static void help(struct cbot_plugin *plugin, struct sc_charbuf *cb)
+{
+	struct log_plugin *lp = plugin->data;
+
+	if (!lp->archive)
+		return;
+	sc_cb_concat(cb, "- log search [#CHANNEL] [from:USER] "
+	                 "[since:YYYY-MM-DD] [until:YYYY-MM-DD] WORDS...: "
+	                 "search the channel logs (other channels: admin)\n");
+	sc_cb_concat(cb, "- log import PATH: add an old "
+	                 "CHANNEL-YYYY-MM-DD.log file to the archive "
+	                 "(admin)\n");
+	sc_cb_concat(cb, "- log reindex PATH: index any blocks of a "
+	                 "CHANNEL-YYYY-MM-DD.arc segment which are missing "
+	                 "from the index (admin)\n");
+	if (lp->http_search.len)
+		sc_cb_printf(cb, "- %s/logs/search?channel=CHANNEL&q=QUERY: "
+		                 "search the channel logs\n",
+		             cbot_http_geturl(plugin->bot));
+}
+
 struct cbot_plugin_ops ops = {
 	.description = "logs messages to a file",
 	.load = load,
+	.unload = unload,
+	.help = help,
 };
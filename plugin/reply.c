@@ -1,10 +1,18 @@
 /**
  * reply.c: CBot plugin which replies to configured triggers with configured
  * responses
+ *
+ * Rather than registering a handler (and thus a regex execution) for every
+ * trigger, we register one handler for each kind of message, and index the
+ * triggers by their literal prefix in a trie. Since a trigger must match the
+ * whole message, only triggers whose prefix the message begins with can match.
+ * One walk down the trie finds those candidates, and only their regexes run.
  */
+#include <ctype.h>
 #include <libconfig.h>
 #include <sc-collections.h>
 #include <sc-regex.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,71 +21,286 @@
 #include "cbot/cbot.h"
 
 struct rep {
-	struct sc_list_head list;
-	struct cbot_handler *hdlr;
+	struct sc_regex *re;
 	char *regex;
 	int kind;
+	int index;
+	int next; /* next rep in the same trie node, or -1 */
+	unsigned long hits;
 	int count;
-	char *replies[0];
+	struct cbot_template *replies[0];
+};
+
+/*
+ * Children of a node are a linked list of siblings. Node 0 is the root, which
+ * holds the triggers with no literal prefix.
+ */
+struct trie_node {
+	int child;
+	int sibling;
+	int reps; /* first rep ending at this node, or -1 */
+	unsigned char c;
+};
+
+/* The triggers for one kind of message (CBOT_MESSAGE or CBOT_ADDRESSED) */
+struct matcher {
+	struct sc_array nodes; /* struct trie_node */
+	struct cbot_handler *hdlr;
+	struct priv *priv;
+	int kind;
 };
 
 struct priv {
 	struct cbot_plugin *plugin;
-	struct sc_list_head replies;
+	struct sc_array replies; /* struct rep *, in config order */
+	bool *candidate;         /* scratch space, indexed like replies */
+	struct matcher matchers[2];
 };
 
-static int formatter(struct sc_charbuf *buf, char *key, void *user)
-{
-	struct cbot_message_event *event = user;
-	char *s;
-	const char *cs;
-	int cap, rv = 0;
-	if (strcmp(key, "sender") == 0) {
-		sc_cb_concat(buf, event->username);
-	} else if (strcmp(key, "channel") == 0) {
-		sc_cb_concat(buf, event->channel);
-	} else if (strcmp(key, "bot") == 0) {
-		cs = cbot_get_name(event->bot);
-		sc_cb_concat(buf, cs);
-	} else if (sscanf(key, "cap:%d", &cap) == 1) {
-		if (cap < 0 || cap >= event->num_captures)
-			return -1;
-		s = sc_regex_get_capture(event->message, event->indices, 0);
-		sc_cb_concat(buf, s);
-		free(s);
-	} else {
-		rv = -1;
-	}
-	return rv;
+/*
+ * Response formatters. Each one is passed the message event as its argument,
+ * and consumes no arguments, so that every formatter sees the same event.
+ */
+static int fmt_sender(struct sc_charbuf *cb, const char *suffix, va_list *args)
+{
+	struct cbot_message_event *event =
+	        va_arg(*args, struct cbot_message_event *);
+	if (*suffix)
+		return -1;
+	sc_cb_concat(cb, event->username);
+	return 0;
+}
+
+static int fmt_channel(struct sc_charbuf *cb, const char *suffix,
+                       va_list *args)
+{
+	struct cbot_message_event *event =
+	        va_arg(*args, struct cbot_message_event *);
+	if (*suffix)
+		return -1;
+	sc_cb_concat(cb, event->channel);
+	return 0;
 }
 
-static void handle_match(struct cbot_message_event *event, void *user)
+static int fmt_bot(struct sc_charbuf *cb, const char *suffix, va_list *args)
 {
-	struct rep *rep = user;
-	int response = rand() % rep->count;
+	struct cbot_message_event *event =
+	        va_arg(*args, struct cbot_message_event *);
+	if (*suffix)
+		return -1;
+	sc_cb_concat(cb, cbot_get_name(event->bot));
+	return 0;
+}
+
+static int fmt_cap(struct sc_charbuf *cb, const char *suffix, va_list *args)
+{
+	struct cbot_message_event *event =
+	        va_arg(*args, struct cbot_message_event *);
+	char *end, *s;
+	long cap = strtol(suffix, &end, 10);
+
+	if (end == suffix || *end || cap < 0 || cap >= event->num_captures)
+		return -1;
+	s = sc_regex_get_capture(event->message, event->indices, cap);
+	sc_cb_concat(cb, s);
+	free(s);
+	return 0;
+}
+
+static const cbot_formatter_ops_t formatters[] = {
+	{ "sender", fmt_sender },
+	{ "channel", fmt_channel },
+	{ "bot", fmt_bot },
+	{ "cap:", fmt_cap },
+	{ NULL, NULL },
+};
+
+static void reply(struct rep *rep, struct cbot_message_event *event)
+{
+	struct cbot_template *tmpl = rep->replies[rand() % rep->count];
 	struct sc_charbuf cb;
-	int rv;
 
+	/* Invalid responses were reported at load time */
+	if (!tmpl)
+		return;
 	sc_cb_init(&cb, 256);
-	rv = cbot_format(&cb, rep->replies[response], formatter, event);
-	if (rv >= 0)
+	if (cbot_template_render(&cb, tmpl, event) >= 0)
 		cbot_send(event->bot, event->channel, "%s", cb.buf);
 	sc_cb_destroy(&cb);
 }
 
-static void destroy_replies(struct priv *priv)
+/*
+ * Return the number of leading bytes of regex which any match must begin with
+ * (ignoring case). Escapes and character classes end the prefix, and a
+ * top-level alternation means there is no common prefix at all.
+ */
+static size_t literal_prefix(const char *regex)
 {
-	struct rep *rep, *next;
+	size_t i, len = strcspn(regex, "\\.[]()*+?|^${}");
+	int depth = 0;
+	bool class = false;
+
+	for (i = 0; regex[i]; i++) {
+		if (regex[i] == '\\' && regex[i + 1])
+			i++;
+		else if (class)
+			class = regex[i] != ']';
+		else if (regex[i] == '[')
+			class = true;
+		else if (regex[i] == '(')
+			depth++;
+		else if (regex[i] == ')')
+			depth--;
+		else if (regex[i] == '|' && depth == 0)
+			return 0;
+	}
+	/* A quantifier makes the preceding character optional or repeated */
+	if (len && (regex[len] == '*' || regex[len] == '?' ||
+	            regex[len] == '{' || regex[len] == '+'))
+		len--;
+	return len;
+}
+
+static int trie_new_node(struct matcher *m, unsigned char c)
+{
+	struct trie_node node = { .child = -1, .sibling = -1, .reps = -1 };
+	node.c = c;
+	sc_arr_append(&m->nodes, struct trie_node, node);
+	return m->nodes.len - 1;
+}
+
+static int trie_child(struct matcher *m, int parent, unsigned char c)
+{
+	struct trie_node *nodes = sc_arr(&m->nodes, struct trie_node);
 	int i;
-	sc_list_for_each_safe(rep, next, &priv->replies, list, struct rep)
-	{
-		cbot_deregister(priv->plugin->bot, rep->hdlr);
-		for (i = 0; i < rep->count; i++) {
-			free(rep->replies[i]);
+	for (i = nodes[parent].child; i >= 0; i = nodes[i].sibling)
+		if (nodes[i].c == c)
+			return i;
+	return -1;
+}
+
+static void trie_insert(struct matcher *m, struct rep *rep)
+{
+	struct trie_node *nodes;
+	size_t i, len = literal_prefix(rep->regex);
+	int node = 0, next;
+	unsigned char c;
+
+	for (i = 0; i < len; i++) {
+		c = tolower((unsigned char)rep->regex[i]);
+		next = trie_child(m, node, c);
+		if (next < 0) {
+			next = trie_new_node(m, c);
+			nodes = sc_arr(&m->nodes, struct trie_node);
+			nodes[next].sibling = nodes[node].child;
+			nodes[node].child = next;
 		}
-		free(rep->regex);
-		free(rep);
+		node = next;
+	}
+	nodes = sc_arr(&m->nodes, struct trie_node);
+	rep->next = nodes[node].reps;
+	nodes[node].reps = rep->index;
+}
+
+static void mark_candidates(struct priv *priv, struct trie_node *nodes,
+                            int node)
+{
+	struct rep **reps = sc_arr(&priv->replies, struct rep *);
+	int i;
+	for (i = nodes[node].reps; i >= 0; i = reps[i]->next)
+		priv->candidate[i] = true;
+}
+
+static void handle_message(struct cbot_message_event *event, void *user)
+{
+	struct matcher *m = user;
+	struct priv *priv = m->priv;
+	struct rep **reps = sc_arr(&priv->replies, struct rep *);
+	struct trie_node *nodes = sc_arr(&m->nodes, struct trie_node);
+	const char *msg = event->message;
+	struct rep *rep;
+	size_t *indices;
+	ssize_t result;
+	int i, node = 0;
+
+	/* Walk the trie along the message, collecting candidates */
+	mark_candidates(priv, nodes, 0);
+	for (i = 0; msg[i]; i++) {
+		node = trie_child(m, node, tolower((unsigned char)msg[i]));
+		if (node < 0)
+			break;
+		mark_candidates(priv, nodes, node);
+	}
+
+	/* Then check them in config order, like separate handlers would */
+	for (i = 0; i < (int)priv->replies.len; i++) {
+		if (!priv->candidate[i])
+			continue;
+		priv->candidate[i] = false;
+		rep = reps[i];
+		result = sc_regex_exec(rep->re, msg, &indices);
+		if (result == -1)
+			continue;
+		if (msg[result] == '\0') {
+			rep->hits++;
+			event->indices = indices;
+			event->num_captures = sc_regex_num_captures(rep->re);
+			reply(rep, event);
+		}
+		free(indices);
+	}
+	event->indices = NULL;
+	event->num_captures = 0;
+}
+
+static void free_reply(struct rep *rep, int count)
+{
+	for (int i = 0; i < count; i++)
+		cbot_template_free(rep->replies[i]);
+	if (rep->re)
+		sc_regex_free(rep->re);
+	free(rep->regex);
+	free(rep);
+}
+
+static void destroy_replies(struct priv *priv)
+{
+	struct rep **reps = sc_arr(&priv->replies, struct rep *);
+	size_t j;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (priv->matchers[i].hdlr)
+			cbot_deregister(priv->plugin->bot,
+			                priv->matchers[i].hdlr);
+		sc_arr_destroy(&priv->matchers[i].nodes);
 	}
+	for (j = 0; j < priv->replies.len; j++)
+		free_reply(reps[j], reps[j]->count);
+	sc_arr_destroy(&priv->replies);
+	free(priv->candidate);
+}
+
+static struct rep *new_reply(const char *trigger, int kind, int flags,
+                             int count)
+{
+	struct rep *rep = calloc(1, sizeof(*rep) + count * sizeof(char *));
+	rep->re = sc_regex_compile2(trigger, flags);
+	rep->regex = strdup(trigger);
+	rep->kind = kind;
+	rep->count = count;
+	return rep;
+}
+
+static struct cbot_template *compile_response(const char *resp, int idx)
+{
+	struct cbot_template *tmpl = cbot_template_compile(resp, formatters);
+	if (!tmpl)
+		fprintf(stderr,
+		        "plugin.reply.responses[%d]: invalid response \"%s\", "
+		        "ignoring it\n",
+		        idx, resp);
+	return tmpl;
 }
 
 static struct rep *add_reply(struct priv *priv, config_setting_t *conf, int idx)
@@ -121,13 +344,7 @@ static struct rep *add_reply(struct priv *priv, config_setting_t *conf, int idx)
 			return NULL;
 		}
 		reply_count = config_setting_length(replies);
-		rep = calloc(1, sizeof(*rep) + reply_count * sizeof(char *));
-		rep->regex = strdup(trigger);
-		rep->kind = kind;
-		rep->count = reply_count;
-		rep->hdlr = cbot_register2(priv->plugin, kind,
-		                           (cbot_handler_t)handle_match, rep,
-		                           (char *)trigger, flags);
+		rep = new_reply(trigger, kind, flags, reply_count);
 		for (i = 0; i < reply_count; i++) {
 			el = config_setting_get_elem(replies, i);
 			resp = config_setting_get_string(el);
@@ -136,24 +353,48 @@ static struct rep *add_reply(struct priv *priv, config_setting_t *conf, int idx)
 				        "plugin.reply.responses[%d]"
 				        ".responses[%d] is not a string",
 				        idx, i);
-				free(rep);
+				free_reply(rep, i);
 				return NULL;
 			}
-			rep->replies[i] = strdup(resp);
+			rep->replies[i] = compile_response(resp, idx);
 		}
-		sc_list_insert_end(&priv->replies, &rep->list);
-		return rep;
 	} else {
-		rep = calloc(1, sizeof(*rep) + 1 * sizeof(char *));
-		rep->regex = strdup(trigger);
-		rep->kind = kind;
-		rep->count = 1;
-		rep->replies[0] = strdup(resp);
-		rep->hdlr = cbot_register2(priv->plugin, kind,
-		                           (cbot_handler_t)handle_match, rep,
-		                           (char *)trigger, flags);
-		sc_list_insert_end(&priv->replies, &rep->list);
-		return rep;
+		rep = new_reply(trigger, kind, flags, 1);
+		rep->replies[0] = compile_response(resp, idx);
+	}
+	if (!rep->re) {
+		fprintf(stderr,
+		        "plugin.reply.responses[%d].trigger is not a valid "
+		        "regex\n",
+		        idx);
+		free_reply(rep, rep->count);
+		return NULL;
+	}
+	rep->index = priv->replies.len;
+	sc_arr_append(&priv->replies, struct rep *, rep);
+	return rep;
+}
+
+static void build_matchers(struct priv *priv)
+{
+	struct rep **reps = sc_arr(&priv->replies, struct rep *);
+	struct trie_node *root;
+	struct matcher *m;
+	size_t i;
+
+	priv->candidate = calloc(priv->replies.len + 1, sizeof(bool));
+	for (i = 0; i < priv->replies.len; i++) {
+		m = &priv->matchers[reps[i]->kind == CBOT_ADDRESSED];
+		trie_insert(m, reps[i]);
+	}
+	for (i = 0; i < 2; i++) {
+		m = &priv->matchers[i];
+		root = sc_arr(&m->nodes, struct trie_node);
+		if (root->child < 0 && root->reps < 0)
+			continue; /* no triggers of this kind */
+		m->hdlr = cbot_register(priv->plugin, m->kind,
+		                        (cbot_handler_t)handle_message, m,
+		                        NULL);
 	}
 }
 
@@ -165,13 +406,19 @@ static int load(struct cbot_plugin *plugin, config_setting_t *conf)
 	int i, len;
 	priv->plugin = plugin;
 	plugin->data = priv;
-	sc_list_init(&priv->replies);
+	sc_arr_init(&priv->replies, struct rep *, 16);
+	for (i = 0; i < 2; i++) {
+		priv->matchers[i].priv = priv;
+		priv->matchers[i].kind = i ? CBOT_ADDRESSED : CBOT_MESSAGE;
+		sc_arr_init(&priv->matchers[i].nodes, struct trie_node, 64);
+		trie_new_node(&priv->matchers[i], 0);
+	}
 
 	arr = config_setting_lookup(conf, "responses");
 	if (!arr || !config_setting_is_list(arr)) {
 		fprintf(stderr, "plugins.reply.responses does not exist or is "
 		                "not a list\n");
-		goto err;
+		goto cleanup;
 	}
 
 	len = config_setting_length(arr);
@@ -189,11 +436,11 @@ static int load(struct cbot_plugin *plugin, config_setting_t *conf)
 			goto cleanup;
 	}
 
+	build_matchers(priv);
 	return 0;
 
 cleanup:
 	destroy_replies(priv);
-err:
 	free(priv);
 	return -1;
 }
@@ -208,15 +455,17 @@ static void unload(struct cbot_plugin *plugin)
 static void help(struct cbot_plugin *plugin, struct sc_charbuf *cb)
 {
 	struct priv *priv = plugin->data;
-	struct rep *r;
+	struct rep **reps = sc_arr(&priv->replies, struct rep *);
+	size_t i;
 
-	sc_cb_concat(cb, "This plugin will reply to the following triggers:\n");
-	sc_list_for_each_entry(r, &priv->replies, list, struct rep)
-	{
-		sc_cb_printf(cb, "- %s%s\n", r->regex,
-		             (r->kind == CBOT_ADDRESSED)
+	sc_cb_concat(cb, "This plugin will reply to the following triggers "
+	                 "(with the number of times each has matched):\n");
+	for (i = 0; i < priv->replies.len; i++) {
+		sc_cb_printf(cb, "- %s%s [%lu]\n", reps[i]->regex,
+		             (reps[i]->kind == CBOT_ADDRESSED)
 		                     ? " (only when @mentioned)"
-		                     : "");
+		                     : "",
+		             reps[i]->hits);
 	}
 }
 
@@ -1,6 +1,12 @@
 /**
  * sqlkarma.c: CBot plugin which can track karma in SQL
+ *
+ * Every channel message is checked for WORD++ or WORD-- by a simple scanner
+ * rather than a regex, since nearly all messages contain neither. The top
+ * KARMA_TOP entries are cached in memory, and each update adjusts the cache
+ * instead of re-running the ORDER BY query.
  */
+#include <limits.h>
 #include <libconfig.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +38,19 @@ struct karma {
 
 #define KARMA_TOP 5
 
+/*
+ * Cache of the KARMA_TOP best entries, in descending order. Every item which
+ * is not in the cache has karma no greater than "rest" (INT_MIN when there are
+ * no other items). When a change could let an unknown item into the top, we
+ * just drop the cache and query again next time.
+ */
+struct karma_top {
+	bool valid;
+	int len;
+	int rest;
+	struct karma entries[KARMA_TOP];
+};
+
 static int karma_query_get(struct cbot *bot, char *word, int *karma)
 {
 	CBOTDB_QUERY_FUNC_BEGIN(bot, void,
@@ -85,22 +104,130 @@ static int karma_query_top(struct cbot *bot, int limit,
 	                   CBOTDB_OUTPUT(int, 1, karma););
 }
 
-static void karma_best(struct cbot_message_event *event)
+static void top_clear(struct karma_top *top)
+{
+	int i;
+	for (i = 0; i < top->len; i++)
+		free(top->entries[i].word);
+	top->len = 0;
+	top->valid = false;
+}
+
+static void top_load(struct cbot *bot, struct karma_top *top)
 {
 	struct sc_list_head res;
 	struct karma *k, *n;
 
+	top_clear(top);
+	top->rest = INT_MIN;
 	sc_list_init(&res);
-	karma_query_top(event->bot, KARMA_TOP, &res);
+	/* One extra row tells us the bound on everything outside the cache */
+	if (karma_query_top(bot, KARMA_TOP + 1, &res) >= 0)
+		top->valid = true;
 	sc_list_for_each_safe(k, n, &res, list, struct karma)
 	{
-		cbot_send_rl(event->bot, event->channel, "%s: %d", k->word,
-		             k->karma);
-		free(k->word);
+		if (top->len < KARMA_TOP) {
+			top->entries[top->len].word = k->word;
+			top->entries[top->len++].karma = k->karma;
+		} else {
+			top->rest = k->karma;
+			free(k->word);
+		}
 		free(k);
 	}
 }
 
+static int top_find(struct karma_top *top, const char *word)
+{
+	int i;
+	for (i = 0; i < top->len; i++)
+		if (strcmp(top->entries[i].word, word) == 0)
+			return i;
+	return -1;
+}
+
+/* Move entry i up or down until the cache is in order again */
+static void top_resort(struct karma_top *top, int i)
+{
+	struct karma tmp;
+
+	while (i > 0 && top->entries[i - 1].karma < top->entries[i].karma) {
+		tmp = top->entries[i - 1];
+		top->entries[i - 1] = top->entries[i];
+		top->entries[i] = tmp;
+		i--;
+	}
+	while (i + 1 < top->len &&
+	       top->entries[i + 1].karma > top->entries[i].karma) {
+		tmp = top->entries[i + 1];
+		top->entries[i + 1] = top->entries[i];
+		top->entries[i] = tmp;
+		i++;
+	}
+}
+
+/* Account for @a word now having @a karma */
+static void top_update(struct karma_top *top, const char *word, int karma)
+{
+	int i;
+
+	if (!top->valid)
+		return;
+	i = top_find(top, word);
+	if (i >= 0) {
+		top->entries[i].karma = karma;
+		if (karma < top->rest)
+			top_clear(top); /* someone outside may overtake it */
+		else
+			top_resort(top, i);
+		return;
+	}
+	if (top->len < KARMA_TOP) {
+		i = top->len++;
+	} else if (karma > top->entries[top->len - 1].karma) {
+		i = top->len - 1;
+		if (top->entries[i].karma > top->rest)
+			top->rest = top->entries[i].karma;
+		free(top->entries[i].word);
+	} else {
+		if (karma > top->rest)
+			top->rest = karma;
+		return;
+	}
+	top->entries[i].word = strdup(word);
+	top->entries[i].karma = karma;
+	top_resort(top, i);
+}
+
+static void top_remove(struct karma_top *top, const char *word)
+{
+	int i = top_find(top, word);
+
+	if (i < 0)
+		return;
+	if (top->rest != INT_MIN) {
+		/* We don't know what would take its place */
+		top_clear(top);
+		return;
+	}
+	free(top->entries[i].word);
+	top->len--;
+	memmove(&top->entries[i], &top->entries[i + 1],
+	        (top->len - i) * sizeof(top->entries[0]));
+}
+
+static void karma_best(struct cbot_message_event *event)
+{
+	struct karma_top *top = event->plugin->data;
+	int i;
+
+	if (!top->valid)
+		top_load(event->bot, top);
+	for (i = 0; i < top->len; i++)
+		cbot_send_rl(event->bot, event->channel, "%s: %d",
+		             top->entries[i].word, top->entries[i].karma);
+}
+
 static void karma_check(struct cbot_message_event *event, void *user)
 {
 	int rv, karma = 0;
@@ -124,14 +251,44 @@ static void karma_check(struct cbot_message_event *event, void *user)
 	free(word);
 }
 
-static void karma_change(struct cbot_message_event *event, void *user)
+static void karma_adjust(struct cbot_message_event *event, const char *start,
+                         size_t len, int adj)
 {
-	char *word = sc_regex_get_capture(event->message, event->indices, 0);
-	char *op = sc_regex_get_capture(event->message, event->indices, 1);
-	int adj = (strcmp(op, "++") == 0 ? 1 : -1);
-	karma_query_update_by(event->bot, word, adj);
+	struct karma_top *top = event->plugin->data;
+	char *word = strndup(start, len);
+	int karma;
+
+	if (karma_query_update_by(event->bot, word, adj) == 0 && top->valid &&
+	    karma_query_get(event->bot, word, &karma) == 0)
+		top_update(top, word, karma);
 	free(word);
-	free(op);
+}
+
+/*
+ * Find every WORD++ and WORD-- in a message. A word is a run of
+ * non-whitespace characters, and the operator is the last two characters of a
+ * run of '+' or '-' which ends it. So "c+++" is an increment of "c+", and
+ * "a++b--" adjusts both "a" and "b".
+ */
+static void karma_change(struct cbot_message_event *event, void *user)
+{
+	const char *msg = event->message;
+	const char *word = msg, *op, *end;
+
+	while ((op = strpbrk(msg, "+-"))) {
+		for (; msg < op; msg++)
+			if (*msg == ' ' || *msg == '\t' || *msg == '\n')
+				word = msg + 1;
+		for (end = op; *end == *op; end++)
+			;
+		msg = end;
+		if (end - op < 2)
+			continue; /* a lone '+' or '-' is part of the word */
+		if (end - 2 > word)
+			karma_adjust(event, word, end - 2 - word,
+			             *op == '+' ? 1 : -1);
+		word = end;
+	}
 }
 
 static void karma_set(struct cbot_message_event *event, void *user)
@@ -145,14 +302,16 @@ static void karma_set(struct cbot_message_event *event, void *user)
 
 	word = sc_regex_get_capture(event->message, event->indices, 0);
 	value = sc_regex_get_capture(event->message, event->indices, 1);
-	karma_query_set(event->bot, word, atoi(value));
+	if (karma_query_set(event->bot, word, atoi(value)) == 0)
+		top_update(event->plugin->data, word, atoi(value));
 	free(word);
 	free(value);
 }
 
 static void karma_forget(struct cbot_message_event *event, void *user)
 {
-	karma_query_del(event->bot, (char *)event->username);
+	if (karma_query_del(event->bot, (char *)event->username) == 0)
+		top_remove(event->plugin->data, event->username);
 }
 
 static int load(struct cbot_plugin *plugin, config_setting_t *conf)
@@ -164,13 +323,14 @@ static int load(struct cbot_plugin *plugin, config_setting_t *conf)
 	rv = cbot_db_register(plugin, &tbl_karma);
 	if (rv < 0)
 		return rv;
+	plugin->data = calloc(1, sizeof(struct karma_top));
 
 #define KARMA_WORD     "^ \t\n"
 #define NOT_KARMA_WORD " \t\n"
 	cbot_register(plugin, CBOT_ADDRESSED, (cbot_handler_t)karma_check, NULL,
 	              "karma(\\s+([" KARMA_WORD "]+))?");
 	cbot_register(plugin, CBOT_MESSAGE, (cbot_handler_t)karma_change, NULL,
-	              ".*?([" KARMA_WORD "]+)(\\+\\+|--).*?");
+	              NULL);
 	cbot_register(plugin, CBOT_ADDRESSED, (cbot_handler_t)karma_set, NULL,
 	              "set-karma +([" KARMA_WORD "]+) +(-?\\d+) *.*");
 	cbot_register(plugin, CBOT_ADDRESSED, (cbot_handler_t)karma_forget,
@@ -179,6 +339,12 @@ static int load(struct cbot_plugin *plugin, config_setting_t *conf)
 	return 0;
 }
 
+static void unload(struct cbot_plugin *plugin)
+{
+	top_clear(plugin->data);
+	free(plugin->data);
+}
+
 static void help(struct cbot_plugin *plugin, struct sc_charbuf *cb)
 {
 	sc_cb_concat(cb, "This plugin is backed by the sqlite database, so any "
@@ -195,5 +361,6 @@ static void help(struct cbot_plugin *plugin, struct sc_charbuf *cb)
 struct cbot_plugin_ops ops = {
 	.description = "track karma (++ or --) in a channel",
 	.load = load,
+	.unload = unload,
 	.help = help,
 };
@@ -1,6 +1,17 @@
 /**
  * sqlknow.c: CBot plugin which remembers things
+ *
+ * Besides exact lookups, knowledge is indexed by an FTS5 table over the keys
+ * and values, which triggers keep in sync with the knowledge table. This backs
+ * ranked searches, suggestions when an exact lookup misses, and prefix
+ * completion of keys.
+ *
+ * FTS5 is a compile-time option of SQLite, which not every build has (the
+ * vendored fallback in particular). Without it, or with "fts = false" in the
+ * plugin's configuration, only exact lookups are available. The triggers are
+ * dropped, and the index is rebuilt when it is next enabled.
  */
+#include <ctype.h>
 #include <libconfig.h>
 #include <stdlib.h>
 
@@ -11,12 +22,58 @@
 
 struct cbot;
 
-const char *tbl_knowledge_alters[] = {};
+/*
+ * The FTS index uses the knowledge table as external content, so it needs a
+ * stable rowid: hence the explicit id column, which version 0 lacked (implicit
+ * rowids may be renumbered by VACUUM). It is created at load time rather than
+ * with the table, since it needs FTS5.
+ */
+#define KNOWLEDGE_FTS                                                          \
+	"CREATE VIRTUAL TABLE IF NOT EXISTS knowledge_fts USING fts5( "        \
+	"  key, value, content='knowledge', content_rowid='id', "              \
+	"  tokenize='unicode61 remove_diacritics 2', prefix='2 3' "            \
+	"); "                                                                  \
+	"CREATE TRIGGER knowledge_ai AFTER INSERT ON knowledge BEGIN "         \
+	"  INSERT INTO knowledge_fts(rowid, key, value) "                      \
+	"  VALUES (new.id, new.key, new.value); "                              \
+	"END; "                                                                \
+	"CREATE TRIGGER knowledge_ad AFTER DELETE ON knowledge BEGIN "         \
+	"  INSERT INTO knowledge_fts(knowledge_fts, rowid, key, value) "       \
+	"  VALUES ('delete', old.id, old.key, old.value); "                    \
+	"END; "                                                                \
+	"CREATE TRIGGER knowledge_au AFTER UPDATE ON knowledge BEGIN "         \
+	"  INSERT INTO knowledge_fts(knowledge_fts, rowid, key, value) "       \
+	"  VALUES ('delete', old.id, old.key, old.value); "                    \
+	"  INSERT INTO knowledge_fts(rowid, key, value) "                      \
+	"  VALUES (new.id, new.key, new.value); "                              \
+	"END; "                                                                \
+	"INSERT INTO knowledge_fts(knowledge_fts) VALUES ('rebuild'); "
+
+#define KNOWLEDGE_FTS_DROP                                                     \
+	"DROP TRIGGER IF EXISTS knowledge_ai; "                                \
+	"DROP TRIGGER IF EXISTS knowledge_ad; "                                \
+	"DROP TRIGGER IF EXISTS knowledge_au; "
+
+const char *tbl_knowledge_alters[] = {
+	/* version 0 -> 1: add the id column, for the full-text index */
+	"CREATE TABLE knowledge_v1 ( "
+	"  id INTEGER PRIMARY KEY, "
+	"  key TEXT NOT NULL UNIQUE, "
+	"  value TEXT NOT NULL, "
+	"  nick TEXT NOT NULL, "
+	"  change_count INT NOT NULL "
+	"); "
+	"INSERT INTO knowledge_v1(key, value, nick, change_count) "
+	"  SELECT key, value, nick, change_count FROM knowledge; "
+	"DROP TABLE knowledge; "
+	"ALTER TABLE knowledge_v1 RENAME TO knowledge;",
+};
 
 const struct cbot_db_table tbl_knowledge = {
 	.name = "knowledge",
-	.version = 0,
+	.version = 1,
 	.create = "CREATE TABLE knowledge ( "
+	          "  id INTEGER PRIMARY KEY, "
 	          "  key TEXT NOT NULL UNIQUE, "
 	          "  value TEXT NOT NULL, "
 	          "  nick TEXT NOT NULL, "
@@ -30,8 +87,16 @@ struct knowledge {
 	char *value;
 	char *nick;
 	int change_count;
+	struct sc_list_head list;
 };
 
+/* How many results to show for searches and completions */
+#define KNOWLEDGE_SEARCH   5
+#define KNOWLEDGE_COMPLETE 10
+
+/* Whether the full-text index is available */
+static bool fts;
+
 static void knowledge_free(struct knowledge *k)
 {
 	free(k->key);
@@ -80,14 +145,126 @@ static int knowledge_query_delete(struct cbot *bot, char *key)
 	CBOTDB_NO_RESULT();
 }
 
+/*
+ * Find entries matching an FTS5 query, best first. Matches in the key count
+ * for much more than matches in the value.
+ */
+static int knowledge_query_search(struct cbot *bot, char *match, int limit,
+                                  struct sc_list_head *res)
+{
+	CBOTDB_QUERY_FUNC_BEGIN(bot, struct knowledge,
+	                        "SELECT k.key, k.value "
+	                        "FROM knowledge_fts f "
+	                        "JOIN knowledge k ON k.id = f.rowid "
+	                        "WHERE knowledge_fts MATCH $match "
+	                        "ORDER BY bm25(knowledge_fts, 10.0, 1.0) "
+	                        "LIMIT $limit;");
+	CBOTDB_BIND_ARG(text, match);
+	CBOTDB_BIND_ARG(int, limit);
+	CBOTDB_LIST_RESULT(bot, res,
+	                   /* noformat */
+	                   CBOTDB_OUTPUT(text, 0, key);
+	                   CBOTDB_OUTPUT(text, 1, value););
+}
+
+/*
+ * Build an FTS5 query from free text. Each word becomes a quoted string (so
+ * that punctuation and FTS operators in the text are harmless), joined with
+ * @a op. With @a prefix, the last word matches as a prefix. Returns NULL if
+ * the text contains no words.
+ */
+static char *knowledge_match(const char *text, const char *op, bool prefix)
+{
+	struct sc_charbuf cb;
+	const unsigned char *c = (const unsigned char *)text;
+	int words = 0;
+
+	sc_cb_init(&cb, 64);
+	while (*c) {
+		if (!isalnum(*c) && *c < 0x80) {
+			c++;
+			continue;
+		}
+		if (words++)
+			sc_cb_concat(&cb, op);
+		sc_cb_append(&cb, '"');
+		while (isalnum(*c) || *c >= 0x80)
+			sc_cb_append(&cb, *c++);
+		sc_cb_append(&cb, '"');
+	}
+	if (!words) {
+		sc_cb_destroy(&cb);
+		return NULL;
+	}
+	if (prefix)
+		sc_cb_append(&cb, '*');
+	return cb.buf;
+}
+
+static int knowledge_search(struct cbot *bot, const char *text, bool complete,
+                            struct sc_list_head *res)
+{
+	struct sc_charbuf cb;
+	char *match;
+	int rv;
+
+	sc_list_init(res);
+	match = knowledge_match(text, complete ? " " : " OR ", complete);
+	if (!match)
+		return 0;
+	if (complete) {
+		/* Completions only look at keys */
+		sc_cb_init(&cb, 64);
+		sc_cb_printf(&cb, "key : (%s)", match);
+		free(match);
+		match = cb.buf;
+	}
+	rv = knowledge_query_search(bot, match,
+	                            complete ? KNOWLEDGE_COMPLETE
+	                                     : KNOWLEDGE_SEARCH,
+	                            res);
+	free(match);
+	return rv;
+}
+
+static void knowledge_list_free(struct sc_list_head *res)
+{
+	struct knowledge *k, *n;
+	sc_list_for_each_safe(k, n, res, list, struct knowledge)
+	{
+		sc_list_remove(&k->list);
+		knowledge_free(k);
+	}
+}
+
 #define GET_VALUE ((void *)1)
 #define GET_WHO   ((void *)2)
 
+#define FIND_SEARCH   ((void *)1)
+#define FIND_COMPLETE ((void *)2)
+
 static void knowledge_get(struct cbot_message_event *event, void *user)
 {
 	char *key = sc_regex_get_capture(event->message, event->indices, 0);
 	struct knowledge *k = knowledge_query_get(event->bot, key);
-	if (!k) {
+	struct sc_list_head res;
+	struct sc_charbuf cb;
+	struct knowledge *m;
+
+	if (!k && fts && knowledge_search(event->bot, key, false, &res) > 0) {
+		sc_cb_init(&cb, 256);
+		sc_list_for_each_entry(m, &res, list, struct knowledge)
+		{
+			sc_cb_printf(&cb, "%s%s", cb.length ? ", " : "",
+			             m->key);
+		}
+		cbot_send(event->bot, event->channel,
+		          "Sorry, I don't know anything about %s. "
+		          "Did you mean: %s?",
+		          key, cb.buf);
+		sc_cb_destroy(&cb);
+		knowledge_list_free(&res);
+	} else if (!k) {
 		cbot_send(event->bot, event->channel,
 		          "Sorry, I don't know anything about %s", key);
 	} else if (user == GET_VALUE) {
@@ -104,6 +281,38 @@ static void knowledge_get(struct cbot_message_event *event, void *user)
 	free(key);
 }
 
+static void knowledge_find(struct cbot_message_event *event, void *user)
+{
+	char *text = sc_regex_get_capture(event->message, event->indices, 0);
+	struct sc_list_head res;
+	struct sc_charbuf cb;
+	struct knowledge *k;
+	bool complete = user == FIND_COMPLETE;
+
+	if (knowledge_search(event->bot, text, complete, &res) <= 0) {
+		cbot_send(event->bot, event->channel,
+		          complete ? "I don't know anything starting with %s"
+		                   : "I don't know anything about %s",
+		          text);
+		free(text);
+		return;
+	}
+	sc_cb_init(&cb, 256);
+	sc_list_for_each_entry(k, &res, list, struct knowledge)
+	{
+		if (complete)
+			sc_cb_printf(&cb, "%s%s", cb.length ? ", " : "",
+			             k->key);
+		else
+			sc_cb_printf(&cb, "%s%s is %s", cb.length ? "\n" : "",
+			             k->key, k->value);
+	}
+	cbot_send(event->bot, event->channel, "%s", cb.buf);
+	sc_cb_destroy(&cb);
+	knowledge_list_free(&res);
+	free(text);
+}
+
 static void knowledge_set(struct cbot_message_event *event, void *user)
 {
 	char *key = sc_regex_get_capture(event->message, event->indices, 0);
@@ -134,13 +343,84 @@ static void knowledge_del(struct cbot_message_event *event, void *user)
 	knowledge_free(k);
 }
 
-static int load(struct cbot_plugin *plugin, config_setting_t *conf)
+/* Check whether this SQLite has FTS5, by creating a table with it */
+static bool have_fts5(struct cbot *bot)
 {
+	char *errmsg = NULL;
 	int rv;
 
-	(void)conf;
+	rv = sqlite3_exec(cbot_db_conn(bot),
+	                  "CREATE VIRTUAL TABLE temp.knowledge_fts_check "
+	                  "USING fts5(x); "
+	                  "DROP TABLE temp.knowledge_fts_check;",
+	                  NULL, NULL, &errmsg);
+	if (rv != SQLITE_OK) {
+		CL_WARN("sqlknow: SQLite %s has no FTS5 (%s), so only exact "
+		        "lookups are available: use one built with "
+		        "SQLITE_ENABLE_FTS5 to search\n",
+		        sqlite3_libversion(), errmsg);
+		sqlite3_free(errmsg);
+		return false;
+	}
+	return true;
+}
+
+static bool have_triggers(struct cbot *bot)
+{
+	sqlite3_stmt *stmt;
+	bool rv;
+
+	if (sqlite3_prepare_v2(cbot_db_conn(bot),
+	                       "SELECT 1 FROM sqlite_master "
+	                       "WHERE type = 'trigger' "
+	                       "AND name = 'knowledge_ai';",
+	                       -1, &stmt, NULL) != SQLITE_OK)
+		return false;
+	rv = sqlite3_step(stmt) == SQLITE_ROW;
+	sqlite3_finalize(stmt);
+	return rv;
+}
+
+/*
+ * Create the full-text index and its triggers, or with @a enable false, drop
+ * the triggers so that writes don't need FTS5. An index which was left without
+ * triggers is stale, so it is rebuilt when they are created again.
+ */
+static int knowledge_fts_setup(struct cbot *bot, bool enable)
+{
+	sqlite3 *db = cbot_db_conn(bot);
+	char *errmsg = NULL;
+	int rv;
+
+	if (enable && have_triggers(bot))
+		return 0;
+	rv = sqlite3_exec(db,
+	                  enable ? "BEGIN; " KNOWLEDGE_FTS "COMMIT;"
+	                         : KNOWLEDGE_FTS_DROP,
+	                  NULL, NULL, &errmsg);
+	if (rv != SQLITE_OK) {
+		CL_CRIT("sqlknow: failed to set up full-text index: %s\n",
+		        errmsg);
+		sqlite3_free(errmsg);
+		if (enable)
+			sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+		return -1;
+	}
+	return 0;
+}
+
+static int load(struct cbot_plugin *plugin, config_setting_t *conf)
+{
+	int rv, enable = 1;
+
+	if (conf)
+		config_setting_lookup_bool(conf, "fts", &enable);
 
 	rv = cbot_db_register(plugin, &tbl_knowledge);
+	if (rv < 0)
+		return rv;
+	fts = enable && have_fts5(plugin->bot);
+	rv = knowledge_fts_setup(plugin->bot, fts);
 	if (rv < 0)
 		return rv;
 
@@ -152,6 +432,12 @@ static int load(struct cbot_plugin *plugin, config_setting_t *conf)
 	              GET_WHO, "who taught you about +(.+)\\??");
 	cbot_register(plugin, CBOT_ADDRESSED, (cbot_handler_t)knowledge_del,
 	              GET_WHO, "forget +(.+)");
+	if (!fts)
+		return 0;
+	cbot_register(plugin, CBOT_ADDRESSED, (cbot_handler_t)knowledge_find,
+	              FIND_SEARCH, "what do you know about +(.+?)\\??");
+	cbot_register(plugin, CBOT_ADDRESSED, (cbot_handler_t)knowledge_find,
+	              FIND_COMPLETE, "complete +(.+)");
 
 	return 0;
 }
@@ -164,6 +450,12 @@ static void help(struct cbot_plugin *plugin, struct sc_charbuf *cb)
 	sc_cb_concat(cb, "- cbot what is SOMETHING: return DEFINITION\n");
 	sc_cb_concat(cb, "- cbot who taugth you about SOMETHING: cbot is a "
 	                 "tattle tale!\n");
+	if (!fts)
+		return;
+	sc_cb_concat(cb, "- cbot what do you know about WORDS: search "
+	                 "knowledge\n");
+	sc_cb_concat(cb, "- cbot complete WORDS: list things whose names "
+	                 "start with WORDS\n");
 }
 
 struct cbot_plugin_ops ops = {
@@ -17,22 +17,11 @@
 
 char *defloc = "San Francisco";
 
-static void sc_cb_rstrip(struct sc_charbuf *buf, char *seq)
+static void rstrip(char *str, const char *seq)
 {
-	int i;
-	bool contained;
-	while (buf->length > 0) {
-		contained = false;
-		for (i = 0; seq[i]; i++) {
-			if (buf->buf[buf->length - 1] == seq[i]) {
-				contained = true;
-				break;
-			}
-		}
-		if (!contained)
-			return;
-		buf->buf[--buf->length] = '\0';
-	}
+	size_t len = strlen(str);
+	while (len > 0 && strchr(seq, str[len - 1]))
+		str[--len] = '\0';
 }
 
 struct weather_req {
@@ -54,31 +43,23 @@ static char *mkurl(CURL *easy, const char *format, char *location)
 
 static void do_weather(void *data)
 {
-	struct sc_charbuf buf;
 	struct weather_req *req = data;
 	struct cbot *bot = req->bot;
-	char *url = NULL;
-	CURLcode rv;
-	sc_cb_init(&buf, 256);
+	char *url, *resp;
 	CURL *easy = curl_easy_init();
 	url = mkurl(easy, req->urlfmt, *req->loc ? req->loc : defloc);
-	curl_easy_setopt(easy, CURLOPT_URL, url);
-	// curl_easy_setopt(easy, CURLOPT_VERBOSE, 1L);
-	cbot_curl_charbuf_response(easy, &buf);
-	rv = cbot_curl_perform(bot, easy);
-	if (rv != CURLE_OK) {
-		fprintf(stderr, "curl: error: %s\n", curl_easy_strerror(rv));
+	curl_easy_cleanup(easy);
+	resp = cbot_curl_get(bot, "%s", url);
+	if (!resp)
 		goto out;
-	}
-	sc_cb_rstrip(&buf, " \t\r\n");
-	cbot_send(bot, req->channel, "%s", buf.buf);
+	rstrip(resp, " \t\r\n");
+	cbot_send(bot, req->channel, "%s", resp);
+	free(resp);
 out:
-	sc_cb_destroy(&buf);
 	free(req->channel);
 	free(req->loc);
 	free(req);
 	free(url);
-	curl_easy_cleanup(easy);
 }
 
 static void weather(struct cbot_message_event *evt, void *user)
@@ -29,37 +29,280 @@ struct cbot_backend_ops *all_ops[] = {
 	&signald_ops,
 };
 
-struct cbot_qmsg {
-	char *msg;
+struct cbot_route {
+	struct sc_list_head bucket;
+	/* Entry in bot->route_lru, unless configured (those are kept) */
+	struct sc_list_head lru;
+	bool configured;
+	uint32_t hash;
 	char *dest;
-	struct sc_list_head list;
+	struct cbot_backend *be;
 };
 
 static void cbot_callback_thread(void *arg);
+static uint32_t scope_hash(const char *channel);
+
+/********
+ * Backends: a bot runs one or more, and sends are routed between them
+ ********/
+
+struct cbot_backend *cbot_backend_add(struct cbot *bot,
+                                      struct cbot_backend_ops *ops,
+                                      const char *name)
+{
+	struct cbot_backend *be = calloc(1, sizeof(*be));
+	be->bot = bot;
+	be->name = strdup(name);
+	be->ops = ops;
+	sc_list_init(&be->init_channels);
+	sc_list_init(&be->msgq);
+	sc_list_insert_end(&bot->backends, &be->list);
+	bot->nbackends++;
+	return be;
+}
+
+struct cbot_backend *cbot_backend_default(const struct cbot *bot)
+{
+	if (!bot->nbackends)
+		return NULL;
+	return sc_list_entry(bot->backends.next, struct cbot_backend, list);
+}
+
+const char *cbot_backend_name(const struct cbot_backend *backend)
+{
+	return backend->name;
+}
+
+static struct cbot_route *route_lookup(const struct cbot *bot,
+                                       const char *dest, uint32_t hash)
+{
+	const struct sc_list_head *bucket;
+	struct cbot_route *route;
+
+	bucket = &bot->routes[hash % CBOT_ROUTE_BUCKETS];
+	sc_list_for_each_entry(route, bucket, bucket, struct cbot_route)
+	{
+		if (route->hash == hash && strcmp(route->dest, dest) == 0)
+			return route;
+	}
+	return NULL;
+}
+
+static void route_free(struct cbot *bot, struct cbot_route *route)
+{
+	sc_list_remove(&route->bucket);
+	if (!route->configured) {
+		sc_list_remove(&route->lru);
+		bot->nroutes--;
+	}
+	free(route->dest);
+	free(route);
+}
+
+static void route_add(struct cbot_backend *be, const char *dest,
+                      bool configured)
+{
+	struct cbot *bot = be->bot;
+	struct cbot_route *route;
+	uint32_t hash;
+
+	if (bot->nbackends < 2 || !dest)
+		return;
+	hash = scope_hash(dest);
+	route = route_lookup(bot, dest, hash);
+	if (route) {
+		route->be = be;
+		if (route->configured)
+			return;
+		sc_list_remove(&route->lru);
+		if (configured) {
+			route->configured = true;
+			bot->nroutes--;
+		} else {
+			sc_list_insert(&bot->route_lru, &route->lru);
+		}
+		return;
+	}
+	route = calloc(1, sizeof(*route));
+	route->hash = hash;
+	route->dest = strdup(dest);
+	route->be = be;
+	route->configured = configured;
+	sc_list_insert_end(&bot->routes[hash % CBOT_ROUTE_BUCKETS],
+	                   &route->bucket);
+	if (configured)
+		return;
+	sc_list_insert(&bot->route_lru, &route->lru);
+	if (++bot->nroutes > CBOT_ROUTE_MAX)
+		route_free(bot, sc_list_entry(bot->route_lru.prev,
+		                              struct cbot_route, lru));
+}
+
+/*
+ * Remember that dest (a channel or user) belongs to this backend. This is only
+ * needed when there's more than one backend. If several backends have the same
+ * destination, the most recent one wins. Only the CBOT_ROUTE_MAX most recently
+ * seen destinations are remembered, besides configured channels.
+ */
+void cbot_backend_learn(struct cbot_backend *be, const char *dest)
+{
+	route_add(be, dest, false);
+}
+
+/*
+ * Route each backend's configured channels to it, until they're seen in an
+ * event. Backends may name a channel differently in events than in their
+ * configuration (e.g. Signal groups), so use the name events will.
+ */
+void cbot_backend_seed_routes(struct cbot *bot)
+{
+	struct cbot_backend *be;
+	struct cbot_channel_conf *chan;
+	char *name;
+
+	sc_list_for_each_entry(be, &bot->backends, list, struct cbot_backend)
+	{
+		sc_list_for_each_entry(chan, &be->init_channels, list,
+		                       struct cbot_channel_conf)
+		{
+			name = NULL;
+			if (be->ops->channel_name)
+				name = be->ops->channel_name(be, chan->name);
+			route_add(be, name ? name : chan->name, true);
+			free(name);
+		}
+	}
+}
+
+/*
+ * Return the backend whose event the current thread is handling, if any. Each
+ * backend handles events in its own thread, so even when handlers for two
+ * backends' events are interleaved, each finds its own.
+ */
+static struct cbot_backend *backend_handling(const struct cbot *bot)
+{
+	struct cbot_backend *be;
+	struct sc_lwt *cur = sc_lwt_current();
+
+	sc_list_for_each_entry(be, &bot->backends, list, struct cbot_backend)
+	{
+		if (be->handling && be->handling_lwt == cur)
+			return be;
+	}
+	return NULL;
+}
+
+static void handling_begin(struct cbot_backend *be)
+{
+	/* With one backend, there is nothing to choose between */
+	if (be->bot->nbackends < 2)
+		return;
+	if (!be->handling++)
+		be->handling_lwt = sc_lwt_current();
+}
+
+static void handling_end(struct cbot_backend *be)
+{
+	if (be->bot->nbackends < 2)
+		return;
+	if (!--be->handling)
+		be->handling_lwt = NULL;
+}
+
+/*
+ * Find the backend to send to dest. In order of preference: the backend which
+ * dest was last seen on, the backend whose event is being handled, or the
+ * first backend.
+ */
+struct cbot_backend *cbot_backend_route(const struct cbot *bot,
+                                        const char *dest)
+{
+	struct cbot_route *route;
+	struct cbot_backend *be;
+
+	if (bot->nbackends < 2)
+		return cbot_backend_default(bot);
+	if (dest && (route = route_lookup(bot, dest, scope_hash(dest))))
+		return route->be;
+	if ((be = backend_handling(bot)))
+		return be;
+	return cbot_backend_default(bot);
+}
+
+static void free_routes(struct cbot *bot)
+{
+	struct cbot_route *route, *next;
+	int i;
+
+	for (i = 0; i < CBOT_ROUTE_BUCKETS; i++) {
+		sc_list_for_each_safe(route, next, &bot->routes[i], bucket,
+		                      struct cbot_route)
+		{
+			route_free(bot, route);
+		}
+	}
+}
 
 /********
  * Functions which plugins can call to perform actions. These are generally
  * delegated to the backends.
  ********/
 
+/*
+ * Format a message for sending. Most messages are short (or are sent with a
+ * plain "%s" format), so this avoids the heap: the result is either the
+ * argument itself, or formatted into the caller's stack buffer. Only longer
+ * messages are allocated, in which case *heap must be freed by the caller.
+ */
+static const char *cbot_vformat(char *buf, size_t size, char **heap,
+                                const char *format, va_list va)
+{
+	va_list copy;
+	const char *str;
+	int len;
+
+	*heap = NULL;
+	if (strcmp(format, "%s") == 0) {
+		/* As glibc's printf would, rather than crashing the backend */
+		str = va_arg(va, const char *);
+		return str ? str : "(null)";
+	}
+
+	va_copy(copy, va);
+	len = vsnprintf(buf, size, format, va);
+	if (len >= (int)size) {
+		*heap = malloc(len + 1);
+		vsnprintf(*heap, len + 1, format, copy);
+		buf = *heap;
+	} else if (len < 0) {
+		buf[0] = '\0';
+	}
+	va_end(copy);
+	return buf;
+}
+
 uint64_t cbot_sendr(const struct cbot *cbot, const char *dest,
                     const struct cbot_reaction_ops *ops, void *arg,
                     const char *format, ...)
 {
+	struct cbot_backend *be;
 	va_list va;
-	struct sc_charbuf cb;
+	char buf[512], *heap;
+	const char *msg;
+	uint64_t ret;
+
 	va_start(va, format);
-	sc_cb_init(&cb, 1024);
-	sc_cb_vprintf(&cb, (char *)format, va);
-	uint64_t ret = cbot->backend_ops->send(cbot, dest, ops, arg, cb.buf);
-	sc_cb_destroy(&cb);
+	msg = cbot_vformat(buf, sizeof(buf), &heap, format, va);
 	va_end(va);
+	be = cbot_backend_route(cbot, dest);
+	ret = be->ops->send(be, dest, ops, arg, msg);
+	free(heap);
 	return ret;
 }
 
 static void cbot_sender_thread(void *arg)
 {
-	struct cbot *bot = arg;
+	struct cbot_backend *be = arg;
 	struct cbot_qmsg *qm, *tmp;
 	struct sc_lwt *tsk = sc_lwt_current();
 	struct timespec to;
@@ -68,7 +311,7 @@ static void cbot_sender_thread(void *arg)
 		to.tv_nsec = 1000 * 1000 * 200; /* 5 per secnd */
 		to.tv_sec = 0;
 		/* only queue us up if we have queued messages */
-		if (bot->msgq.next != &bot->msgq)
+		if (be->msgq.next != &be->msgq)
 			sc_lwt_settimeout(tsk, &to);
 		sc_lwt_set_state(tsk, SC_LWT_BLOCKED);
 		sc_lwt_yield();
@@ -76,7 +319,7 @@ static void cbot_sender_thread(void *arg)
 			break;
 
 		qm = NULL;
-		sc_list_for_each_entry(tmp, &bot->msgq, list, struct cbot_qmsg)
+		sc_list_for_each_entry(tmp, &be->msgq, list, struct cbot_qmsg)
 		{
 			qm = tmp;
 			break;
@@ -85,7 +328,7 @@ static void cbot_sender_thread(void *arg)
 			continue;
 		sc_list_remove(&qm->list);
 		/* clang-tidy can't handle this, thinks i freed qm */
-		cbot_send(bot, qm->dest, "%s", qm->msg); // NOLINT
+		be->ops->send(be, qm->dest, NULL, NULL, qm->msg); // NOLINT
 		CL_DEBUG("Sent queued message\n");
 		free(qm->msg);
 		free(qm->dest);
@@ -97,6 +340,7 @@ void cbot_send_rl(struct cbot *cbot, const char *dest, const char *format, ...)
 {
 	va_list va;
 	struct sc_charbuf cb;
+	struct cbot_backend *be = cbot_backend_route(cbot, dest);
 	struct cbot_qmsg *qm = calloc(1, sizeof(*qm));
 	sc_list_init(&qm->list);
 	va_start(va, format);
@@ -106,36 +350,49 @@ void cbot_send_rl(struct cbot *cbot, const char *dest, const char *format, ...)
 	qm->dest = strdup(dest);
 	qm->msg = cb.buf;
 	// do not destroy cb!
-	sc_list_insert_end(&cbot->msgq, &qm->list);
-	sc_lwt_set_state(cbot->msgq_thread, SC_LWT_RUNNABLE);
+	sc_list_insert_end(&be->msgq, &qm->list);
+	/* The sender thread may not exist in unit tests */
+	if (be->msgq_thread)
+		sc_lwt_set_state(be->msgq_thread, SC_LWT_RUNNABLE);
 }
 
 void cbot_me(const struct cbot *cbot, const char *dest, const char *format, ...)
 {
+	struct cbot_backend *be = cbot_backend_route(cbot, dest);
 	va_list va;
-	struct sc_charbuf cb;
+	char buf[512], *heap;
+	const char *msg;
+
 	va_start(va, format);
-	sc_cb_init(&cb, 1024);
-	sc_cb_vprintf(&cb, (char *)format, va);
-	cbot->backend_ops->me(cbot, dest, cb.buf);
-	sc_cb_destroy(&cb);
+	msg = cbot_vformat(buf, sizeof(buf), &heap, format, va);
 	va_end(va);
+	be->ops->me(be, dest, msg);
+	free(heap);
 }
 
 void cbot_op(const struct cbot *cbot, const char *channel, const char *person)
 {
-	cbot->backend_ops->op(cbot, channel, person);
+	struct cbot_backend *be = cbot_backend_route(cbot, channel);
+	be->ops->op(be, channel, person);
 }
 
 void cbot_join(const struct cbot *cbot, const char *channel,
                const char *password)
 {
-	cbot->backend_ops->join(cbot, channel, password);
+	struct cbot_backend *be = cbot_backend_route(cbot, channel);
+	be->ops->join(be, channel, password);
+	cbot_backend_learn(be, channel);
 }
 
 void cbot_nick(const struct cbot *cbot, const char *newnick)
 {
-	cbot->backend_ops->nick(cbot, newnick);
+	struct cbot_backend *be;
+
+	/* The bot has one name, so every backend takes it */
+	sc_list_for_each_entry(be, &cbot->backends, list, struct cbot_backend)
+	{
+		be->ops->nick(be, newnick);
+	}
 }
 
 static int addressed_advance(const char *message, int i)
@@ -168,15 +425,23 @@ void cbot_add_alias(struct cbot *bot, const char *alias)
 
 int cbot_is_authorized(struct cbot *bot, const char *user, const char *msg)
 {
-	if (bot->backend_ops->is_authorized)
-		return bot->backend_ops->is_authorized(bot, user, msg);
+	struct cbot_backend *be = cbot_backend_route(bot, user);
+	if (be->ops->is_authorized)
+		return be->ops->is_authorized(be, user, msg);
 	return 0;
 }
 
 void cbot_unregister_reaction(struct cbot *bot, uint64_t handle)
 {
-	if (bot->backend_ops->unregister_reaction)
-		bot->backend_ops->unregister_reaction(bot, handle);
+	struct cbot_backend *be;
+
+	/* Handles aren't tagged with their backend, but each backend only
+	 * knows its own */
+	sc_list_for_each_entry(be, &bot->backends, list, struct cbot_backend)
+	{
+		if (be->ops->unregister_reaction)
+			be->ops->unregister_reaction(be, handle);
+	}
 }
 
 /********
@@ -198,11 +463,17 @@ struct cbot *cbot_create(void)
 	for (int i = 0; i < _CBOT_NUM_EVENT_TYPES_; i++) {
 		sc_list_init(&cbot->handlers[i]);
 	}
-	sc_list_init(&cbot->init_channels);
+	for (int i = 0; i < CBOT_SCOPE_BUCKETS; i++)
+		sc_list_init(&cbot->scopes[i]);
+	for (int i = 0; i < _CBOT_NUM_EVENT_TYPES_; i++)
+		sc_list_init(&cbot->dm_scope.handlers[i]);
 	sc_list_init(&cbot->plugins);
-	sc_list_init(&cbot->msgq);
+	sc_list_init(&cbot->backends);
 	sc_list_init(&cbot->callback_list);
 	sc_arr_init(&cbot->aliases, 8, sizeof(char *));
+	for (int i = 0; i < CBOT_ROUTE_BUCKETS; i++)
+		sc_list_init(&cbot->routes[i]);
+	sc_list_init(&cbot->route_lru);
 	return cbot;
 }
 
@@ -233,14 +504,14 @@ static char *conf_str_default(config_setting_t *setting, const char *name,
 }
 
 static struct cbot_channel_conf *
-add_init_channel(struct cbot *bot, config_setting_t *elem, int idx)
+add_init_channel(struct sc_list_head *channels, config_setting_t *elem, int idx)
 {
 	const char *cc;
 	struct cbot_channel_conf *chan = calloc(1, sizeof(*chan));
 	int rv = config_setting_lookup_string(elem, "name", &cc);
 	if (rv == CONFIG_FALSE) {
 		fprintf(stderr,
-		        "cbot config: cbot.channels[%d] missing \"name\" "
+		        "cbot config: channels[%d] missing \"name\" "
 		        "field\n",
 		        idx);
 		goto err_name;
@@ -250,7 +521,7 @@ add_init_channel(struct cbot *bot, config_setting_t *elem, int idx)
 	if (rv == CONFIG_TRUE) {
 		chan->pass = strdup(cc);
 	}
-	sc_list_insert_end(&bot->init_channels, &chan->list);
+	sc_list_insert_end(channels, &chan->list);
 	return chan;
 err_name:
 	free(chan);
@@ -265,56 +536,155 @@ static void free_init_channel(struct cbot_channel_conf *c)
 	free(c);
 }
 
-static void free_init_channels(struct cbot *bot)
+void cbot_free_channels(struct sc_list_head *channels)
 {
 	struct cbot_channel_conf *c, *n;
-	sc_list_for_each_safe(c, n, &bot->init_channels, list,
-	                      struct cbot_channel_conf)
+	sc_list_for_each_safe(c, n, channels, list, struct cbot_channel_conf)
 	{
 		sc_list_remove(&c->list);
 		free_init_channel(c);
 	}
 }
 
-static int add_channels(struct cbot *bot, config_setting_t *botsec)
+int cbot_add_channels(struct sc_list_head *channels, config_setting_t *sec)
 {
 	int rv, i;
 	config_setting_t *chanlist, *elem;
-	chanlist = config_setting_lookup(botsec, "channels");
+	const char *name = config_setting_name(sec);
+	chanlist = config_setting_lookup(sec, "channels");
 	if (!chanlist || !config_setting_is_list(chanlist)) {
 		fprintf(stderr,
-		        "cbot: \"cbot.channels\" section missing or wrong "
-		        "type\n");
+		        "cbot: \"%s.channels\" section missing or wrong "
+		        "type\n",
+		        name);
 		rv = -1;
 		return rv;
-		;
 	}
-	sc_list_init(&bot->init_channels);
 	for (i = 0; i < config_setting_length(chanlist); i++) {
 		elem = config_setting_get_elem(chanlist, i);
 		if (!config_setting_is_group(elem)) {
 			fprintf(stderr,
-			        "cbot: \"cbot.channels[%d]\" is not a group\n",
-			        i);
+			        "cbot: \"%s.channels[%d]\" is not a group\n",
+			        name, i);
 			goto cleanup_channels;
 		}
-		add_init_channel(bot, elem, i);
+		add_init_channel(channels, elem, i);
 	}
 	return 0;
 cleanup_channels:
-	free_init_channels(bot);
+	cbot_free_channels(channels);
 	return -1;
 }
 
-int cbot_load_plugins(struct cbot *bot, config_setting_t *group);
+/*
+ * Configure one backend from its section. The section's "type" names the
+ * backend implementation, and defaults to the section name, so a lone "irc"
+ * section needs nothing extra. A section may list its own "channels", or else
+ * it uses those in the "cbot" section, if any.
+ */
+static int cbot_configure_backend(struct cbot *bot, config_t *conf,
+                                  config_setting_t *botsec, const char *name)
+{
+	struct cbot_backend_ops *ops = NULL;
+	struct cbot_backend *be;
+	config_setting_t *group;
+	const char *type = name;
+	int i;
+
+	group = config_lookup(conf, name);
+	if (!group || !config_setting_is_group(group)) {
+		CL_CRIT("cbot: \"%s\" section missing or wrong type\n", name);
+		return -1;
+	}
+	config_setting_lookup_string(group, "type", &type);
+	for (i = 0; i < nelem(all_ops); i++) {
+		if (strcmp(type, all_ops[i]->name) == 0) {
+			ops = all_ops[i];
+			break;
+		}
+	}
+	if (!ops) {
+		CL_CRIT("cbot: backend \"%s\" not found\n", type);
+		return -1;
+	}
+
+	be = cbot_backend_add(bot, ops, name);
+	if (config_setting_lookup(group, "channels"))
+		i = cbot_add_channels(&be->init_channels, group);
+	else if (config_setting_lookup(botsec, "channels"))
+		i = cbot_add_channels(&be->init_channels, botsec);
+	else
+		i = 0; /* e.g. IRC networks may list their own */
+	if (i < 0)
+		return -1;
+	return ops->configure(be, group);
+}
+
+static int cbot_configure_backends(struct cbot *bot, config_t *conf,
+                                   config_setting_t *botsec)
+{
+	config_setting_t *list;
+	const char *name;
+	int i, count;
+
+	list = config_setting_lookup(botsec, "backend");
+	if (!list)
+		return cbot_configure_backend(bot, conf, botsec, "irc");
+	if (config_setting_type(list) == CONFIG_TYPE_STRING)
+		return cbot_configure_backend(bot, conf, botsec,
+		                              config_setting_get_string(list));
+	if (!config_setting_is_array(list) && !config_setting_is_list(list)) {
+		CL_CRIT("cbot: \"cbot.backend\" should be a string or list\n");
+		return -1;
+	}
+
+	count = config_setting_length(list);
+	if (count == 0) {
+		CL_CRIT("cbot: \"cbot.backend\" is empty\n");
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		name = config_setting_get_string_elem(list, i);
+		if (!name) {
+			CL_CRIT("cbot: \"cbot.backend[%d]\" is not a string\n",
+			        i);
+			return -1;
+		}
+		if (cbot_configure_backend(bot, conf, botsec, name) < 0)
+			return -1;
+	}
+
+	cbot_backend_seed_routes(bot);
+	return 0;
+}
+
+static void cbot_backend_thread(void *arg)
+{
+	struct cbot_backend *be = arg;
+
+	be->ops->run(be);
+	CL_DEBUG("cbot: backend %s exited\n", be->name);
+	/* Once any backend is done, the whole bot shuts down */
+	be->bot->backend_exited = true;
+	sc_lwt_set_state(be->bot->lwt, SC_LWT_RUNNABLE);
+}
 
 static void cbot_run_in_lwt(struct cbot *bot)
 {
+	struct sc_lwt_ctx *ctx = cbot_get_lwt_ctx(bot);
+	struct cbot_backend *be;
 	struct timespec t;
 
-	bot->msgq_thread = sc_lwt_create_task(cbot_get_lwt_ctx(bot),
-	                                      cbot_sender_thread, bot);
-	bot->backend_ops->run(bot);
+	sc_list_for_each_entry(be, &bot->backends, list, struct cbot_backend)
+	{
+		be->msgq_thread =
+		        sc_lwt_create_task(ctx, cbot_sender_thread, be);
+		be->lwt = sc_lwt_create_task(ctx, cbot_backend_thread, be);
+	}
+	while (!bot->backend_exited && !sc_lwt_shutting_down()) {
+		sc_lwt_set_state(bot->lwt, SC_LWT_BLOCKED);
+		sc_lwt_yield();
+	}
 	CL_DEBUG("Sending shutdown signal and waiting...\n");
 	sc_lwt_send_shutdown_signal();
 	t.tv_sec = 5;
@@ -354,6 +724,7 @@ static void cbot_init_logging(struct cbot *bot, config_setting_t *group)
 	cbot_set_log_level(cbot_lookup_level(level));
 
 	printf("cbot: logging to %s at level %d\n", file, levelno);
+	cbot_log_start_writer();
 
 	if (free_file)
 		free(file);
@@ -391,9 +762,11 @@ static char *get_plugin_dir(config_setting_t *setting)
 
 int cbot_load_config(struct cbot *bot, const char *conf_file)
 {
-	int rv, i;
+	int rv;
 	config_t conf;
-	config_setting_t *setting, *backgroup, *pluggroup, *httpgroup;
+	config_setting_t *setting, *pluggroup, *httpgroup;
+	config_setting_t *curlgroup;
+	const char *trace_file = NULL;
 	config_init(&conf);
 	rv = config_read_file(&conf, conf_file);
 	if (rv == CONFIG_FALSE) {
@@ -411,39 +784,21 @@ int cbot_load_config(struct cbot *bot, const char *conf_file)
 	}
 
 	bot->name = conf_str_default(setting, "name", "cbot");
-	bot->backend_name = conf_str_default(setting, "backend", "irc");
 	bot->plugin_dir = get_plugin_dir(setting);
 	bot->db_file = conf_str_default(setting, "db", "db.sqlite3");
 	cbot_init_logging(bot, setting);
 
-	rv = add_channels(bot, setting);
-	if (rv < 0) {
+	config_setting_lookup_string(setting, "trace_file", &trace_file);
+	if (trace_file && cbot_trace_open(bot, trace_file) < 0) {
 		rv = -1;
 		goto out;
 	}
 
-	for (i = 0; i < nelem(all_ops); i++) {
-		if (strcmp(bot->backend_name, all_ops[i]->name) == 0) {
-			bot->backend_ops = all_ops[i];
-			break;
-		}
-	}
-	if (!bot->backend_ops) {
-		CL_CRIT("cbot: backend \"%s\" not found\n", bot->backend_name);
-		rv = -1;
-		goto out;
-	}
-
-	backgroup = config_lookup(&conf, bot->backend_name);
-	if (!backgroup || !config_setting_is_group(backgroup)) {
-		CL_CRIT("cbot: \"%s\" section missing or wrong type\n",
-		        bot->backend_name);
+	rv = cbot_configure_backends(bot, &conf, setting);
+	if (rv < 0) {
 		rv = -1;
 		goto out;
 	}
-	rv = bot->backend_ops->configure(bot, backgroup);
-	if (rv < 0)
-		goto out;
 
 	bot->lwt_ctx = sc_lwt_init();
 	bot->lwt = sc_lwt_create_task(bot->lwt_ctx,
@@ -452,7 +807,13 @@ int cbot_load_config(struct cbot *bot, const char *conf_file)
 	bot->callback_lwt =
 	        sc_lwt_create_task(bot->lwt_ctx, cbot_callback_thread, bot);
 
-	rv = cbot_curl_init(bot);
+	curlgroup = config_lookup(&conf, "curl");
+	if (curlgroup && !config_setting_is_group(curlgroup)) {
+		CL_CRIT("cbot: \"curl\" section should be a group\n");
+		rv = -1;
+		goto out;
+	}
+	rv = cbot_curl_init(bot, curlgroup);
 	if (rv < 0)
 		goto out;
 
@@ -496,8 +857,9 @@ void cbot_run(struct cbot *bot)
 	CL_DEBUG("exiting run() loop, goodbye!");
 }
 
-void cbot_set_nick(struct cbot *bot, const char *newname)
+void cbot_set_nick(const struct cbot_backend *be, const char *newname)
 {
+	struct cbot *bot = be->bot;
 	struct cbot_nick_event event, copy;
 	struct cbot_handler *hdlr, *next;
 
@@ -506,6 +868,7 @@ void cbot_set_nick(struct cbot *bot, const char *newname)
 	bot->name = strdup(newname);
 	event.new_username = bot->name;
 	event.type = CBOT_BOT_NAME;
+	event.backend = (struct cbot_backend *)be;
 
 	if (strcmp(event.old_username, event.new_username) != 0) {
 		sc_list_for_each_safe(hdlr, next, &bot->handlers[event.type],
@@ -530,10 +893,25 @@ static void cbot_unload_all_plugins(struct cbot *bot);
    @brief Free up all resources held by a cbot instance.
    @param cbot The bot to delete.
  */
+static void free_scopes(struct cbot *bot);
+
 void cbot_delete(struct cbot *cbot)
 {
+	struct cbot_backend *be, *next;
+
 	cbot_unload_all_plugins(cbot);
-	free_init_channels(cbot);
+	free_scopes(cbot);
+	sc_list_for_each_safe(be, next, &cbot->backends, list,
+	                      struct cbot_backend)
+	{
+		sc_list_remove(&be->list);
+		if (be->ops->shutdown)
+			be->ops->shutdown(be);
+		cbot_free_channels(&be->init_channels);
+		free(be->name);
+		free(be);
+	}
+	free_routes(cbot);
 	if (cbot->privDb) {
 		int rv = sqlite3_close(cbot->privDb);
 		if (rv != SQLITE_OK) {
@@ -541,7 +919,6 @@ void cbot_delete(struct cbot *cbot)
 		}
 	}
 	free(cbot->name);
-	free(cbot->backend_name);
 	free(cbot->plugin_dir);
 	free(cbot->db_file);
 	sc_lwt_free(cbot->lwt_ctx);
@@ -550,15 +927,19 @@ void cbot_delete(struct cbot *cbot)
 	}
 	sc_arr_destroy(&cbot->aliases);
 	cbot_http_destroy(cbot);
+	cbot_curl_destroy(cbot);
+	cbot_fmt_cache_clear();
+	cbot_trace_close(cbot);
 	free(cbot);
 	EVP_cleanup();
+	cbot_log_stop_writer();
 }
 
 /*********
  * Functions related to handlers: registration and handling of events
  *********/
 
-struct cbot_handler *cbot_register_priv(struct cbot *bot,
+static struct cbot_handler *handler_new(struct cbot *bot,
                                         struct cbot_plugpriv *priv,
                                         enum cbot_event_type type,
                                         cbot_handler_t handler, void *user,
@@ -567,9 +948,11 @@ struct cbot_handler *cbot_register_priv(struct cbot *bot,
 	struct cbot_handler *hdlr = calloc(1, sizeof(*hdlr));
 	hdlr->handler = handler;
 	hdlr->user = user;
+	hdlr->type = type;
+	hdlr->seq = bot->handler_seq++;
 	if (regex)
 		hdlr->regex = sc_regex_compile2(regex, re_flags);
-	sc_list_insert_end(&bot->handlers[type], &hdlr->handler_list);
+	sc_list_init(&hdlr->handler_list);
 	if (priv)
 		sc_list_insert_end(&priv->handlers, &hdlr->plugin_list);
 	else
@@ -578,6 +961,124 @@ struct cbot_handler *cbot_register_priv(struct cbot *bot,
 	return hdlr;
 }
 
+struct cbot_handler *cbot_register_priv(struct cbot *bot,
+                                        struct cbot_plugpriv *priv,
+                                        enum cbot_event_type type,
+                                        cbot_handler_t handler, void *user,
+                                        char *regex, int re_flags)
+{
+	struct cbot_handler *hdlr;
+
+	hdlr = handler_new(bot, priv, type, handler, user, regex, re_flags);
+	sc_list_insert_end(&bot->handlers[type], &hdlr->handler_list);
+	return hdlr;
+}
+
+static uint32_t scope_hash(const char *channel)
+{
+	uint32_t hash = 2166136261u;
+	while (*channel) {
+		hash ^= (unsigned char)*channel++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* Return the scope for a channel, creating it if asked to */
+static struct cbot_scope *scope_lookup(struct cbot *bot, const char *channel,
+                                       bool create)
+{
+	uint32_t hash = scope_hash(channel);
+	struct sc_list_head *bucket = &bot->scopes[hash % CBOT_SCOPE_BUCKETS];
+	struct cbot_scope *scope;
+	int i;
+
+	sc_list_for_each_entry(scope, bucket, bucket, struct cbot_scope)
+	{
+		if (scope->hash == hash && strcmp(scope->channel, channel) == 0)
+			return scope;
+	}
+	if (!create)
+		return NULL;
+	scope = calloc(1, sizeof(*scope));
+	scope->hash = hash;
+	scope->channel = strdup(channel);
+	for (i = 0; i < _CBOT_NUM_EVENT_TYPES_; i++)
+		sc_list_init(&scope->handlers[i]);
+	sc_list_insert_end(bucket, &scope->bucket);
+	return scope;
+}
+
+static void free_scopes(struct cbot *bot)
+{
+	struct cbot_scope *scope, *next;
+	int i;
+
+	for (i = 0; i < CBOT_SCOPE_BUCKETS; i++) {
+		sc_list_for_each_safe(scope, next, &bot->scopes[i], bucket,
+		                      struct cbot_scope)
+		{
+			sc_list_remove(&scope->bucket);
+			free(scope->channel);
+			free(scope);
+		}
+	}
+}
+
+static void scope_add(struct cbot_scope *scope, struct cbot_handler *hdlr)
+{
+	struct sc_list_head *list = &scope->handlers[hdlr->type];
+	struct cbot_scope_node *node;
+
+	/* The handler would be last, so a repeated channel is easy to spot */
+	if (list->prev != list &&
+	    sc_list_entry(list->prev, struct cbot_scope_node, list)->hdlr ==
+	            hdlr)
+		return;
+	node = &hdlr->scopes[hdlr->nscopes++];
+	node->hdlr = hdlr;
+	sc_list_insert_end(list, &node->list);
+}
+
+struct cbot_handler *
+cbot_register_scoped_priv(struct cbot *bot, struct cbot_plugpriv *priv,
+                          enum cbot_event_type type, cbot_handler_t handler,
+                          void *user, char *regex, int re_flags,
+                          const char *const *channels, int flags)
+{
+	struct cbot_handler *hdlr;
+	int i, n = 0;
+
+	if (type != CBOT_MESSAGE && type != CBOT_ADDRESSED &&
+	    type != CBOT_JOIN && type != CBOT_PART) {
+		CL_CRIT("cbot: handlers for event type %d can't be scoped\n",
+		        type);
+		return NULL;
+	}
+	while (channels && channels[n])
+		n++;
+
+	hdlr = handler_new(bot, priv, type, handler, user, regex, re_flags);
+	hdlr->scopes = calloc(n + 1, sizeof(*hdlr->scopes));
+	for (i = 0; i < n; i++)
+		scope_add(scope_lookup(bot, channels[i], true), hdlr);
+	if (flags & CBOT_SCOPE_DM)
+		scope_add(&bot->dm_scope, hdlr);
+	return hdlr;
+}
+
+struct cbot_handler *cbot_register_scoped(struct cbot_plugin *plugin,
+                                          enum cbot_event_type type,
+                                          cbot_handler_t handler, void *user,
+                                          char *regex, int re_flags,
+                                          const char *const *channels,
+                                          int flags)
+{
+	struct cbot_plugpriv *priv = plugpriv(plugin);
+	return cbot_register_scoped_priv(priv->bot, priv, type, handler, user,
+	                                 regex, re_flags, channels, flags);
+}
+
 struct cbot_handler *cbot_register2(struct cbot_plugin *plugin,
                                     enum cbot_event_type type,
                                     cbot_handler_t handler, void *user,
@@ -598,30 +1099,106 @@ struct cbot_handler *cbot_register(struct cbot_plugin *plugin,
 
 void cbot_deregister(struct cbot *bot, struct cbot_handler *hdlr)
 {
+	int i;
+
 	sc_list_remove(&hdlr->handler_list);
 	sc_list_remove(&hdlr->plugin_list);
+	for (i = 0; i < hdlr->nscopes; i++)
+		sc_list_remove(&hdlr->scopes[i].list);
+	free(hdlr->scopes);
 	if (hdlr->regex) {
 		sc_regex_free(hdlr->regex);
 	}
 	free(hdlr);
 }
 
-static void cbot_dispatch_msg(struct cbot *bot, struct cbot_message_event event,
+static void cbot_call_handler(struct cbot *bot, struct cbot_handler *hdlr,
+                              struct cbot_event *event)
+{
+	struct timespec start, end;
+
+	if (!bot->handler_timed) {
+		hdlr->handler(event, hdlr->user);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	hdlr->handler(event, hdlr->user);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	bot->handler_timed(bot, hdlr,
+	                   (end.tv_sec - start.tv_sec) * 1000000000ULL +
+	                           end.tv_nsec - start.tv_nsec);
+}
+
+/*
+ * Walks the handlers for an event: the unscoped handlers, and those scoped to
+ * the event's channel (if any), merged in the order they were registered. The
+ * next handler is found before the current one is called, so that it may
+ * deregister itself.
+ */
+struct handler_iter {
+	struct sc_list_head *head, *pos;
+	struct sc_list_head *scope_head, *scope_pos;
+};
+
+static void handler_iter_init(struct handler_iter *it, struct cbot *bot,
+                              struct cbot_scope *scope,
                               enum cbot_event_type type)
+{
+	it->head = &bot->handlers[type];
+	it->pos = it->head->next;
+	it->scope_head = scope ? &scope->handlers[type] : NULL;
+	it->scope_pos = scope ? it->scope_head->next : NULL;
+}
+
+static struct cbot_handler *handler_iter_next(struct handler_iter *it)
+{
+	struct cbot_handler *hdlr = NULL, *scoped = NULL;
+
+	if (it->pos != it->head)
+		hdlr = sc_list_entry(it->pos, struct cbot_handler,
+		                     handler_list);
+	if (it->scope_pos != it->scope_head)
+		scoped = sc_list_entry(it->scope_pos, struct cbot_scope_node,
+		                       list)
+		                 ->hdlr;
+	if (hdlr && (!scoped || hdlr->seq < scoped->seq)) {
+		it->pos = it->pos->next;
+		return hdlr;
+	} else if (scoped) {
+		it->scope_pos = it->scope_pos->next;
+		return scoped;
+	}
+	return NULL;
+}
+
+/* Return the scope of handlers for an event, if there is one */
+static struct cbot_scope *event_scope(struct cbot *bot, const char *channel,
+                                      bool is_dm)
+{
+	if (is_dm)
+		return &bot->dm_scope;
+	return scope_lookup(bot, channel, false);
+}
+
+static void cbot_dispatch_msg(struct cbot *bot, struct cbot_message_event event,
+                              enum cbot_event_type type,
+                              struct cbot_scope *scope)
 {
 	struct cbot_handler *hdlr;
 	struct cbot_message_event copy;
+	struct handler_iter it;
 	size_t *indices;
 	int result;
-	sc_list_for_each_entry(hdlr, &bot->handlers[type], handler_list,
-	                       struct cbot_handler)
-	{
+
+	handler_iter_init(&it, bot, scope, type);
+	while ((hdlr = handler_iter_next(&it)) != NULL) {
 		if (!hdlr->regex) {
 			event.indices = NULL;
 			event.num_captures = 0;
 			copy = event; /* safe in case of modification */
 			copy.plugin = &hdlr->plugin->p;
-			hdlr->handler((struct cbot_event *)&copy, hdlr->user);
+			cbot_call_handler(bot, hdlr,
+			                  (struct cbot_event *)&copy);
 		} else {
 			result = sc_regex_exec(hdlr->regex, event.message,
 			                       &indices);
@@ -631,8 +1208,8 @@ static void cbot_dispatch_msg(struct cbot *bot, struct cbot_message_event event,
 				        sc_regex_num_captures(hdlr->regex);
 				copy = event;
 				copy.plugin = &hdlr->plugin->p;
-				hdlr->handler((struct cbot_event *)&copy,
-				              hdlr->user);
+				cbot_call_handler(bot, hdlr,
+				                  (struct cbot_event *)&copy);
 				free(indices);
 			}
 		}
@@ -650,18 +1227,27 @@ static void cbot_dispatch_msg(struct cbot *bot, struct cbot_message_event event,
  * IRC also has tho concept of "action" messages, e.g. /me says hello. This
  * function serves these messages too, using the "action" flag.
  *
- * @param bot The bot we're operating on
+ * @param be The backend which received the message
  * @param channel The channel this message came in
  * @param user The user who said it
  * @param message The message itself
  * @param action True if the message was a CTCP action, false otherwise.
  */
-void cbot_handle_message(struct cbot *bot, const char *channel,
+void cbot_handle_message(struct cbot_backend *be, const char *channel,
                          const char *user, const char *message, bool action,
                          bool is_dm)
 {
+	struct cbot *bot = be->bot;
 	struct cbot_message_event event;
-	int address_increment = cbot_addressed(bot, message);
+	struct cbot_scope *scope;
+	int address_increment;
+
+	cbot_backend_learn(be, channel);
+	handling_begin(be);
+	if (bot->trace)
+		cbot_trace_message(bot, channel, user, message, action, is_dm);
+	address_increment = cbot_addressed(bot, message);
+	scope = event_scope(bot, channel, is_dm);
 
 	/* shared fields */
 	event.bot = bot;
@@ -669,55 +1255,72 @@ void cbot_handle_message(struct cbot *bot, const char *channel,
 	event.username = user;
 	event.is_action = action;
 	event.indices = NULL;
+	event.backend = be;
 
 	/* When cbot is directly addressed */
 	if (address_increment || is_dm) {
 		event.message = message + address_increment;
 		event.type = CBOT_ADDRESSED;
-		cbot_dispatch_msg(bot, event, CBOT_ADDRESSED);
+		cbot_dispatch_msg(bot, event, CBOT_ADDRESSED, scope);
 	}
 
 	event.type = CBOT_MESSAGE;
 	event.message = message;
-	cbot_dispatch_msg(bot, event, CBOT_MESSAGE);
+	cbot_dispatch_msg(bot, event, CBOT_MESSAGE, scope);
+	handling_end(be);
 }
 
-void cbot_handle_user_event(struct cbot *bot, const char *channel,
+void cbot_handle_user_event(struct cbot_backend *be, const char *channel,
                             const char *user, enum cbot_event_type type)
 {
+	struct cbot *bot = be->bot;
 	struct cbot_user_event event, copy;
 	struct cbot_handler *hdlr;
+	struct handler_iter it;
+
+	cbot_backend_learn(be, channel);
+	handling_begin(be);
+	if (bot->trace)
+		cbot_trace_user(bot, channel, user, type);
 	event.bot = bot;
 	event.type = type;
 	event.channel = channel;
 	event.username = user;
+	event.backend = be;
 
-	sc_list_for_each_entry(hdlr, &bot->handlers[type], handler_list,
-	                       struct cbot_handler)
-	{
+	handler_iter_init(&it, bot, event_scope(bot, channel, false), type);
+	while ((hdlr = handler_iter_next(&it)) != NULL) {
 		copy = event; /* safe in case of modification */
 		copy.plugin = &hdlr->plugin->p;
-		hdlr->handler((struct cbot_event *)&copy, hdlr->user);
+		cbot_call_handler(bot, hdlr, (struct cbot_event *)&copy);
 	}
+	handling_end(be);
 }
 
-void cbot_handle_nick_event(struct cbot *bot, const char *old_username,
+void cbot_handle_nick_event(struct cbot_backend *be, const char *old_username,
                             const char *new_username)
 {
+	struct cbot *bot = be->bot;
 	struct cbot_nick_event event, copy;
 	struct cbot_handler *hdlr;
+
+	handling_begin(be);
+	if (bot->trace)
+		cbot_trace_nick(bot, old_username, new_username);
 	event.bot = bot;
 	event.type = CBOT_NICK;
 	event.old_username = old_username;
 	event.new_username = new_username;
+	event.backend = be;
 
 	sc_list_for_each_entry(hdlr, &bot->handlers[CBOT_NICK], handler_list,
 	                       struct cbot_handler)
 	{
 		copy = event; /* safe in case of modification */
 		copy.plugin = &hdlr->plugin->p;
-		hdlr->handler((struct cbot_event *)&copy, hdlr->user);
+		cbot_call_handler(bot, hdlr, (struct cbot_event *)&copy);
 	}
+	handling_end(be);
 }
 
 /**********
@@ -915,7 +1518,9 @@ struct cbot_callback *cbot_schedule_callback(struct cbot_plugin *plugin,
 	sc_list_init(&cb->list);
 	sc_list_insert_end(&bot->callback_list, &cb->list);
 	bot->callback_touched = true;
-	sc_lwt_set_state(bot->callback_lwt, SC_LWT_RUNNABLE);
+	/* The callback thread may not exist in unit tests */
+	if (bot->callback_lwt)
+		sc_lwt_set_state(bot->callback_lwt, SC_LWT_RUNNABLE);
 	CL_DEBUG("scheduling callback\n");
 	return cb;
 }
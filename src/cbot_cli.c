@@ -40,12 +40,11 @@ uint64_t rmsgid = 1;
  * CBot Backend Callbacks
  ***************/
 
-static uint64_t cbot_cli_send(const struct cbot *bot, const char *dest,
+static uint64_t cbot_cli_send(const struct cbot_backend *be, const char *dest,
                               const struct cbot_reaction_ops *ops, void *arg,
                               const char *msg)
 {
-	(void)bot; // unused
-	printf("[%s]%s: %s\n", dest, bot->name, msg);
+	printf("[%s]%s: %s\n", dest, be->bot->name, msg);
 	if (ops) {
 		struct react_message *rmsg = calloc(1, sizeof(*rmsg));
 		rmsg->id = rmsgid++;
@@ -60,35 +59,31 @@ static uint64_t cbot_cli_send(const struct cbot *bot, const char *dest,
 	return 0;
 }
 
-static void cbot_cli_me(const struct cbot *bot, const char *dest,
+static void cbot_cli_me(const struct cbot_backend *be, const char *dest,
                         const char *msg)
 {
-	(void)bot; // unused
-	printf("[%s]%s %s\n", dest, bot->name, msg);
+	printf("[%s]%s %s\n", dest, be->bot->name, msg);
 }
 
-static void cbot_cli_op(const struct cbot *bot, const char *channel,
+static void cbot_cli_op(const struct cbot_backend *be, const char *channel,
                         const char *person)
 {
-	(void)bot; // unused
-	printf("[%s~CMD]%s: /op %s\n", channel, bot->name, person);
+	printf("[%s~CMD]%s: /op %s\n", channel, be->bot->name, person);
 }
 
-static void cbot_cli_join(const struct cbot *bot, const char *channel,
+static void cbot_cli_join(const struct cbot_backend *be, const char *channel,
                           const char *password)
 {
-	(void)bot; // unused
-	printf("[%s~CMD]%s: /join %s\n", channel, bot->name, channel);
+	printf("[%s~CMD]%s: /join %s\n", channel, be->bot->name, channel);
 }
 
-static void cbot_cli_nick(const struct cbot *bot, const char *newnick)
+static void cbot_cli_nick(const struct cbot_backend *be, const char *newnick)
 {
-	(void)bot; // unused
-	printf("%s becomes %s\n", bot->name, newnick);
-	cbot_set_nick((struct cbot *)bot, newnick);
+	printf("%s becomes %s\n", be->bot->name, newnick);
+	cbot_set_nick(be, newnick);
 }
 
-static void cbot_cli_unregister_reaction(const struct cbot *bot,
+static void cbot_cli_unregister_reaction(const struct cbot_backend *be,
                                          uint64_t handle)
 {
 	struct react_message *msg;
@@ -110,27 +105,29 @@ struct cli_backend {
 	char *name;
 };
 
-static void cbot_cli_cmd_nick(struct cbot *bot, int argc, char **argv)
+static void cbot_cli_cmd_nick(struct cbot_backend *be, int argc, char **argv)
 {
 	if (argc != 2) {
 		fprintf(stderr, "usage: /nick NEWNAME\n");
 		return;
 	}
-	struct cli_backend *b = bot->backend;
+	struct cli_backend *b = be->priv;
 	free(b->name);
 	b->name = strdup(argv[1]);
 }
 
-static void cbot_cli_cmd_add_membership(struct cbot *bot, int argc, char **argv)
+static void cbot_cli_cmd_add_membership(struct cbot_backend *be, int argc,
+                                        char **argv)
 {
 	if (argc != 3) {
 		fprintf(stderr, "usage: /memberadd user #channel\n");
 		return;
 	}
-	cbot_add_membership(bot, argv[1], argv[2]);
+	cbot_add_membership(be->bot, argv[1], argv[2]);
 }
 
-static void cbot_cli_cmd_get_members(struct cbot *bot, int argc, char **argv)
+static void cbot_cli_cmd_get_members(struct cbot_backend *be, int argc,
+                                     char **argv)
 {
 	struct cbot_user_info *info = NULL;
 	struct sc_list_head head;
@@ -141,7 +138,7 @@ static void cbot_cli_cmd_get_members(struct cbot *bot, int argc, char **argv)
 		return;
 	}
 
-	cbot_get_members(bot, argv[1], &head);
+	cbot_get_members(be->bot, argv[1], &head);
 	sc_list_for_each_entry(info, &head, list, struct cbot_user_info)
 	{
 		printf("%s\n", info->username);
@@ -149,7 +146,7 @@ static void cbot_cli_cmd_get_members(struct cbot *bot, int argc, char **argv)
 	cbot_user_info_free_all(&head);
 }
 
-static void cbot_cli_cmd_react(struct cbot *bot, int argc, char **argv)
+static void cbot_cli_cmd_react(struct cbot_backend *be, int argc, char **argv)
 {
 	struct react_message *msg;
 	uint64_t id = 0;
@@ -159,7 +156,7 @@ static void cbot_cli_cmd_react(struct cbot *bot, int argc, char **argv)
 		return;
 	}
 	id = strtoull(argv[1], NULL, 10);
-	event.bot = bot;
+	event.bot = be->bot;
 	event.emoji = argv[3];
 	event.source = argv[2];
 	event.handle = id;
@@ -181,12 +178,12 @@ static void cbot_cli_cmd_react(struct cbot *bot, int argc, char **argv)
 	fprintf(stderr, "Failed to react to message with id %luu\n", id);
 }
 
-static void cbot_cli_cmd_help(struct cbot *bot, int argc, char **argv);
+static void cbot_cli_cmd_help(struct cbot_backend *be, int argc, char **argv);
 
 struct cbot_cli_cmd {
 	char *cmd;
 	int cmdlen;
-	void (*func)(struct cbot *, int, char **);
+	void (*func)(struct cbot_backend *, int, char **);
 	char *help;
 };
 
@@ -201,7 +198,7 @@ const struct cbot_cli_cmd cmds[] = {
 	CMD("/help", cbot_cli_cmd_help, "list all commands"),
 };
 
-static void cbot_cli_cmd_help(struct cbot *bot, int argc, char **argv)
+static void cbot_cli_cmd_help(struct cbot_backend *be, int argc, char **argv)
 {
 	int maxsize = 0;
 	for (int i = 0; i < nelem(cmds); i++)
@@ -254,14 +251,14 @@ char **cbot_cli_split_line(char *line, int *count)
 	return tokens;
 }
 
-bool cbot_cli_execute_cmd(struct cbot *bot, char *line)
+bool cbot_cli_execute_cmd(struct cbot_backend *be, char *line)
 {
 	int i, argc;
 	char **argv;
 	for (i = 0; i < nelem(cmds); i++) {
 		if (strncmp(cmds[i].cmd, line, cmds[i].cmdlen) == 0) {
 			argv = cbot_cli_split_line(line, &argc);
-			cmds[i].func(bot, argc, argv);
+			cmds[i].func(be, argc, argv);
 			free(argv);
 			return true;
 		}
@@ -322,6 +319,11 @@ static char *sc_lwt_readline(const char *prompt)
 		sc_lwt_wait_fd(cur, STDIN_FILENO, SC_LWT_W_IN, NULL);
 		sc_lwt_set_state(cur, SC_LWT_BLOCKED);
 		sc_lwt_yield();
+		if (sc_lwt_shutting_down()) {
+			rl_callback_handler_remove();
+			sc_lwt_remove_fd(cur, STDIN_FILENO);
+			return NULL;
+		}
 
 		int bits = sc_lwt_fd_status(cur, STDIN_FILENO, NULL);
 		if (bits & SC_LWT_W_IN) {
@@ -362,6 +364,8 @@ static char *sc_lwt_readline(const char *prompt)
 	sc_lwt_set_state(cur, SC_LWT_BLOCKED);
 	sc_lwt_yield();
 	sc_lwt_remove_fd(cur, STDIN_FILENO);
+	if (sc_lwt_shutting_down())
+		return NULL;
 
 	rv = getline(&line, &n, stdin);
 	if (rv < 0) {
@@ -380,7 +384,7 @@ static void cli_history_deinit(void)
 }
 #endif
 
-static void cbot_cli_run(struct cbot *bot)
+static void cbot_cli_run(struct cbot_backend *be)
 {
 	char *line = NULL;
 	int newline;
@@ -388,7 +392,7 @@ static void cbot_cli_run(struct cbot *bot)
 
 	struct cli_backend b = { 0 };
 	b.name = strdup("shell");
-	bot->backend = &b;
+	be->priv = &b;
 
 	cli_history_init();
 	while (true) {
@@ -398,24 +402,25 @@ static void cbot_cli_run(struct cbot *bot)
 		newline = strlen(line);
 		if (newline > 0 && line[newline - 1] == '\n')
 			line[newline - 1] = '\0';
-		if (line[0] == '/' && cbot_cli_execute_cmd(bot, line)) {
+		if (line[0] == '/' && cbot_cli_execute_cmd(be, line)) {
 			free(line);
 			continue;
 		}
-		cbot_handle_message(bot, "stdin", b.name, line, false, false);
+		cbot_handle_message(be, "stdin", b.name, line, false, false);
 		free(line);
 	}
 	cli_history_deinit();
+	be->priv = NULL;
 	free(b.name);
 }
 
-static int cbot_cli_is_authorized(const struct cbot *bot, const char *user,
-                                  const char *msg)
+static int cbot_cli_is_authorized(const struct cbot_backend *be,
+                                  const char *user, const char *msg)
 {
 	return strcmp(user, "shell") == 0;
 }
 
-static int cbot_cli_configure(struct cbot *bot, config_setting_t *group)
+static int cbot_cli_configure(struct cbot_backend *be, config_setting_t *group)
 {
 	return 0;
 }
@@ -5,50 +5,52 @@
 #include <libconfig.h>
 #include <sc-collections.h>
 #include <sc-lwt.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
+#include <time.h>
 
 #include "cbot/cbot.h"
 #include "cbot_irc.h"
 #include "cbot_private.h"
 #include "libircclient.h"
 
-static inline struct cbot *session_bot(irc_session_t *session)
+static inline struct cbot_irc_network *session_net(irc_session_t *session)
 {
 	return irc_get_ctx(session);
 }
 
-static inline struct cbot_irc_backend *session_irc(irc_session_t *session)
+static inline struct cbot_backend *session_be(irc_session_t *session)
 {
-	return session_bot(session)->backend;
+	return session_net(session)->irc->be;
 }
 
-static inline struct cbot_irc_backend *bot_irc(const struct cbot *bot)
+static inline struct cbot *session_bot(irc_session_t *session)
 {
-	return bot->backend;
+	return session_net(session)->irc->bot;
 }
 
-static inline irc_session_t *bot_session(const struct cbot *bot)
+static inline struct cbot_irc_backend *be_irc(const struct cbot_backend *be)
 {
-	return bot_irc(bot)->session;
+	return be->priv;
 }
 
-static struct names_rq *names_rq_new(struct cbot_irc_backend *irc,
+static struct names_rq *names_rq_new(struct cbot_irc_network *net,
                                      const char *chan)
 {
 	struct names_rq *rq;
 	rq = calloc(1, sizeof(*rq));
 	rq->channel = strdup(chan);
-	sc_list_insert_end(&irc->names_rqs, &rq->list);
+	sc_list_insert_end(&net->names_rqs, &rq->list);
 	sc_cb_init(&rq->names, 4096);
 	return rq;
 }
 
-static void names_rq_delete(struct cbot_irc_backend *irc, struct names_rq *rq)
+static void names_rq_delete(struct names_rq *rq)
 {
 	sc_list_remove(&rq->list);
 	free(rq->channel);
@@ -71,22 +73,75 @@ void *lookup_by_str(struct sc_list_head *list, const char *str)
 	return NULL;
 }
 
-void log_event(irc_session_t *session, const char *event, const char *origin,
-               const char **params, unsigned int count)
+/* How often to log event counts at DEBUG level */
+#define STATS_INTERVAL_MS (60 * 1000)
+
+static inline void count_event(irc_session_t *session,
+                               enum irc_event_kind kind)
 {
-	size_t i;
-	printf("Event \"%s\", origin: \"%s\", params: %d [", event, origin,
-	       count);
-	for (i = 0; i < count; i++) {
-		if (i != 0) {
-			fputc('|', stdout);
-		}
-		printf("%s", params[i]);
-	}
-	printf("]\n");
+	session_net(session)->events[kind]++;
+}
+
+/*
+ * Log an event and its parameters at VERB level. Channel floods and NAMES
+ * bursts make this the busiest log message we have, so nothing is formatted
+ * unless it will be written.
+ */
+static void log_event(irc_session_t *session, const char *event,
+                      const char *origin, const char **params,
+                      unsigned int count)
+{
+	struct cbot_irc_network *net;
+	unsigned int i;
+
+	if (!CL_ENABLED(VERB))
+		return;
+	net = session_net(session);
+	sc_cb_clear(&net->scratch);
+	for (i = 0; i < count; i++)
+		sc_cb_printf(&net->scratch, "%s%s", i ? "|" : "", params[i]);
+	CL_VERB("irc %s: event \"%s\", origin: \"%s\", params: %u [%s]\n",
+	        net->name, event, origin ? origin : "", count,
+	        net->scratch.buf);
+}
+
+/* Log the event counts as "name=count" pairs, at the given level */
+static void log_stats(struct cbot_irc_network *net, int level)
+{
+	struct sc_charbuf cb;
+
+	if (!CL_ENABLED(level))
+		return;
+	sc_cb_init(&cb, 256);
+	irc_net_events(net, &cb);
+	CL_LOG(level, "%5s: irc %s: events:%s\n", cbot_level_name(level),
+	       net->name, cb.buf);
+	sc_cb_destroy(&cb);
 }
 
-static void add_all_names(struct cbot *bot, struct names_rq *rq)
+/* Events which we only count and log */
+#define LOG_ONLY(fn, kind)                                                     \
+	static void fn(irc_session_t *session, const char *event,              \
+	               const char *origin, const char **params,                \
+	               unsigned int count)                                     \
+	{                                                                      \
+		count_event(session, kind);                                    \
+		log_event(session, event, origin, params, count);              \
+	}
+
+LOG_ONLY(event_quit, IRC_EV_QUIT)
+LOG_ONLY(event_mode, IRC_EV_MODE)
+LOG_ONLY(event_umode, IRC_EV_UMODE)
+LOG_ONLY(event_topic, IRC_EV_TOPIC)
+LOG_ONLY(event_kick, IRC_EV_KICK)
+LOG_ONLY(event_notice, IRC_EV_NOTICE)
+LOG_ONLY(event_invite, IRC_EV_INVITE)
+LOG_ONLY(event_ctcp_rep, IRC_EV_CTCP_REP)
+LOG_ONLY(event_ctcp_action, IRC_EV_ACTION)
+LOG_ONLY(event_unknown, IRC_EV_UNKNOWN)
+
+static void add_all_names(struct cbot *bot, struct names_rq *rq,
+                          const char *channel)
 {
 	char *nick = strtok(rq->names.buf, " ");
 	do {
@@ -95,17 +150,17 @@ static void add_all_names(struct cbot *bot, struct names_rq *rq)
 			nick++;
 		}
 		/* TODO bulk db insertion API? */
-		cbot_add_membership(bot, nick, rq->channel);
+		cbot_add_membership(bot, nick, (char *)channel);
 	} while ((nick = strtok(NULL, " ")) != NULL);
 }
 
 static void event_rpl_namreply(irc_session_t *session, const char *origin,
                                const char **params, unsigned int count)
 {
-	struct cbot_irc_backend *irc = session_irc(session);
-	struct names_rq *rq = lookup_by_str(&irc->names_rqs, params[2]);
+	struct cbot_irc_network *net = session_net(session);
+	struct names_rq *rq = lookup_by_str(&net->names_rqs, params[2]);
 	if (!rq) {
-		fprintf(stderr, "ERR: unsolicited RPL_NAMREPLY for %s\n",
+		CL_WARN("irc %s: unsolicited RPL_NAMREPLY for %s\n", net->name,
 		        params[2]);
 		return;
 	}
@@ -115,31 +170,34 @@ static void event_rpl_namreply(irc_session_t *session, const char *origin,
 void event_rpl_endofnames(irc_session_t *session, const char *origin,
                           const char **params, unsigned int count)
 {
-	struct cbot_irc_backend *irc = session_irc(session);
+	struct cbot_irc_network *net = session_net(session);
 	struct cbot *bot = session_bot(session);
-	struct names_rq *rq = lookup_by_str(&irc->names_rqs, params[1]);
+	struct names_rq *rq = lookup_by_str(&net->names_rqs, params[1]);
+	const char *channel;
 	if (!rq) {
-		fprintf(stderr, "ERR: unsolicited RPL_ENDOFNAMES for %s\n",
-		        params[1]);
+		CL_WARN("irc %s: unsolicited RPL_ENDOFNAMES for %s\n",
+		        net->name, params[1]);
 		return;
 	}
-	cbot_clear_channel_memberships(bot, rq->channel);
-	add_all_names(bot, rq);
-	names_rq_delete(irc, rq);
+	channel = irc_net_name(net, rq->channel);
+	cbot_clear_channel_memberships(bot, (char *)channel);
+	add_all_names(bot, rq, channel);
+	names_rq_delete(rq);
 }
 
 void event_rpl_topic(irc_session_t *session, const char *origin,
                      const char **params, unsigned int count)
 {
 	struct cbot *bot = session_bot(session);
-	cbot_set_channel_topic(bot, (char *)params[1], (char *)params[2]);
+	const char *channel = irc_net_name(session_net(session), params[1]);
+	cbot_set_channel_topic(bot, (char *)channel, (char *)params[2]);
 }
 
 void event_numeric(irc_session_t *session, unsigned int event,
                    const char *origin, const char **params, unsigned int count)
 {
 	char buf[24];
-	sprintf(buf, "%d", event);
+
 	switch (event) {
 	case 332:
 		event_rpl_topic(session, origin, params, count);
@@ -151,259 +209,600 @@ void event_numeric(irc_session_t *session, unsigned int event,
 		event_rpl_endofnames(session, origin, params, count);
 		break;
 	}
-	log_event(session, buf, origin, params, count);
+	count_event(session, irc_numeric_kind(event));
+	if (CL_ENABLED(VERB)) {
+		sprintf(buf, "%u", event);
+		log_event(session, buf, origin, params, count);
+	}
+}
+
+static inline void maybe_schedule(const struct cbot_backend *be)
+{
+	if (sc_lwt_current() != be->lwt)
+		sc_lwt_set_state(be->lwt, SC_LWT_RUNNABLE);
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 /*
-  Run once we are connected to the server.
+ * Send as much of the output queue as flood control allows. Return how many
+ * milliseconds until the next line may be sent, or 0 if the queue is empty.
  */
-void event_connect(irc_session_t *session, const char *event,
-                   const char *origin, const char **params, unsigned int count)
+static uint64_t net_flush(struct cbot_irc_network *net)
 {
-	struct cbot *bot = session_bot(session);
-	struct cbot_channel_conf *c;
-	sc_list_for_each_entry(c, &bot->init_channels, list,
-	                       struct cbot_channel_conf)
+	struct irc_line *line, *next;
+	uint64_t now, delay;
+	size_t bytes;
+
+	if (!net->registered)
+		return 0;
+	now = now_ms();
+	sc_list_for_each_safe(line, next, &net->outq, list, struct irc_line)
 	{
-		cbot_join(bot, c->name, c->pass);
-		irc_cmd_join(session, c->name, c->pass);
+		bytes = strlen(line->text) + 2;
+		delay = irc_flood_delay(&net->flood, now, bytes);
+		if (delay)
+			return delay;
+		irc_flood_charge(&net->flood, now, bytes);
+		irc_send_raw(net->session, "%s", line->text);
+		sc_list_remove(&line->list);
+		free(line->text);
+		free(line);
 	}
-	log_event(session, event, origin, params, count);
+	return 0;
+}
+
+static void net_clear_outq(struct cbot_irc_network *net)
+{
+	struct irc_line *line, *next;
+
+	sc_list_for_each_safe(line, next, &net->outq, list, struct irc_line)
+	{
+		sc_list_remove(&line->list);
+		free(line->text);
+		free(line);
+	}
+}
+
+static void net_queue(struct cbot_irc_network *net, const char *format, ...)
+{
+	struct irc_line *line = calloc(1, sizeof(*line));
+	struct sc_charbuf cb;
+	va_list va;
+
+	va_start(va, format);
+	sc_cb_init(&cb, 128);
+	sc_cb_vprintf(&cb, (char *)format, va);
+	va_end(va);
+	line->text = cb.buf;
+	sc_list_insert_end(&net->outq, &line->list);
 }
 
-static inline void maybe_schedule(const struct cbot *bot)
+/* Queue a message, split into as many lines as it takes */
+static void net_privmsg(struct cbot_irc_network *net, const char *target,
+                        const char *msg, bool action)
 {
-	if (sc_lwt_current() != bot->lwt)
-		sc_lwt_set_state(bot->lwt, SC_LWT_RUNNABLE);
+	size_t len, max = irc_text_max(net->irc->bot->name, target, action);
+	const char *line;
+
+	while ((line = irc_split(&msg, max, &len)) != NULL) {
+		if (action)
+			net_queue(net, "PRIVMSG %s :\x01" "ACTION %.*s\x01",
+			          target, (int)len, line);
+		else
+			net_queue(net, "PRIVMSG %s :%.*s", target, (int)len,
+			          line);
+	}
 }
 
-static uint64_t cbot_irc_send(const struct cbot *cbot, const char *to,
+static uint64_t cbot_irc_send(const struct cbot_backend *be, const char *to,
                               const struct cbot_reaction_ops *ops, void *arg,
                               const char *msg)
 {
-	irc_session_t *session = bot_session(cbot);
-	irc_cmd_msg(session, to, msg);
-	maybe_schedule(cbot);
+	struct cbot_irc_network *net = irc_net_route(be_irc(be), to, &to);
+	net_privmsg(net, to, msg, false);
+	net_flush(net);
+	maybe_schedule(be);
 	return 0;
 }
 
-static void cbot_irc_me(const struct cbot *cbot, const char *to,
+static void cbot_irc_me(const struct cbot_backend *be, const char *to,
                         const char *msg)
 {
-	irc_session_t *session = bot_session(cbot);
-	irc_cmd_me(session, to, msg);
-	maybe_schedule(cbot);
+	struct cbot_irc_network *net = irc_net_route(be_irc(be), to, &to);
+	net_privmsg(net, to, msg, true);
+	net_flush(net);
+	maybe_schedule(be);
 }
 
-static void cbot_irc_op(const struct cbot *cbot, const char *channel,
+static void cbot_irc_op(const struct cbot_backend *be, const char *channel,
                         const char *username)
 {
-	irc_session_t *session = bot_session(cbot);
-	struct sc_charbuf cb;
-	sc_cb_init(&cb, 256);
-	sc_cb_printf(&cb, "+o %s", username);
-	irc_cmd_channel_mode(session, channel, cb.buf);
-	sc_cb_destroy(&cb);
+	struct cbot_irc_network *net;
+
+	net = irc_net_route(be_irc(be), channel, &channel);
+	net_queue(net, "MODE %s +o %s", channel, username);
+	net_flush(net);
+	maybe_schedule(be);
 }
 
-static void cbot_irc_nick(const struct cbot *cbot, const char *newnick)
+static void cbot_irc_nick(const struct cbot_backend *be, const char *newnick)
 {
-	irc_session_t *session = bot_session(cbot);
-	irc_cmd_nick(session, newnick);
-	maybe_schedule(cbot);
+	struct cbot_irc_network *net;
+
+	sc_list_for_each_entry(net, &be_irc(be)->networks, list,
+	                       struct cbot_irc_network)
+	{
+		net_queue(net, "NICK %s", newnick);
+		net_flush(net);
+	}
+	maybe_schedule(be);
 }
 
-static void cbot_irc_join(const struct cbot *cbot, const char *channel,
-                          const char *password)
+static void net_join(struct cbot_irc_network *net, const char *channel,
+                     const char *password)
 {
-	irc_session_t *session = bot_session(cbot);
-	struct cbot_irc_backend *irc = bot_irc(cbot);
-
 	/* Joining triggers a request for names, which we need to be prepared
 	 * to handle */
-	names_rq_new(irc, channel);
+	names_rq_new(net, channel);
 	/* topic replies we gracefully handle, same with join replies */
 
-	irc_cmd_join(session, channel, password);
-	maybe_schedule(cbot);
+	if (password)
+		net_queue(net, "JOIN %s %s", channel, password);
+	else
+		net_queue(net, "JOIN %s", channel);
+}
+
+static void cbot_irc_join(const struct cbot_backend *be, const char *channel,
+                          const char *password)
+{
+	struct cbot_irc_network *net;
+
+	net = irc_net_route(be_irc(be), channel, &channel);
+	net_join(net, channel, password);
+	net_flush(net);
+	maybe_schedule(be);
+}
+
+/*
+  Run once we are connected to the server.
+ */
+void event_connect(irc_session_t *session, const char *event,
+                   const char *origin, const char **params, unsigned int count)
+{
+	struct cbot_irc_network *net = session_net(session);
+	struct cbot_channel_conf *c;
+	const char *channel;
+
+	net->registered = true;
+	/* The network's own channels, then the backend's: those prefixed with
+	 * this network, or unprefixed ones if this is the first network */
+	sc_list_for_each_entry(c, &net->channels, list,
+	                       struct cbot_channel_conf)
+	{
+		net_join(net, c->name, c->pass);
+		cbot_backend_learn(net->irc->be, irc_net_name(net, c->name));
+	}
+	sc_list_for_each_entry(c, &net->irc->be->init_channels, list,
+	                       struct cbot_channel_conf)
+	{
+		if (irc_net_owns(net, c->name, &channel)) {
+			net_join(net, channel, c->pass);
+			cbot_backend_learn(net->irc->be,
+			                   irc_net_name(net, channel));
+		}
+	}
+	net_flush(net);
+	count_event(session, IRC_EV_CONNECT);
+	log_event(session, event, origin, params, count);
 }
 
 void event_privmsg(irc_session_t *session, const char *event,
                    const char *origin, const char **params, unsigned int count)
 {
+	count_event(session, IRC_EV_PRIVMSG);
 	log_event(session, event, origin, params, count);
 	if (count >= 2 && params[1] != NULL) {
-		cbot_handle_message(session_bot(session), origin, origin,
-		                    params[1], false, true);
-		printf("Event handled by CBot.\n");
+		/* In a DM, the "channel" is the sender */
+		cbot_handle_message(session_be(session),
+		                    irc_net_name(session_net(session), origin),
+		                    origin, params[1], false, true);
 	}
 }
 
 void event_channel(irc_session_t *session, const char *event,
                    const char *origin, const char **params, unsigned int count)
 {
+	count_event(session, IRC_EV_CHANNEL);
 	log_event(session, event, origin, params, count);
 	if (count >= 2 && params[1] != NULL) {
-		cbot_handle_message(session_bot(session), params[0], origin,
-		                    params[1], false, false);
-		printf("Event handled by CBot.\n");
+		cbot_handle_message(
+		        session_be(session),
+		        irc_net_name(session_net(session), params[0]), origin,
+		        params[1], false, false);
 	}
 }
 
 void event_action(irc_session_t *session, const char *event, const char *origin,
                   const char **params, unsigned int count)
 {
+	count_event(session, IRC_EV_ACTION);
 	log_event(session, event, origin, params, count);
-	struct cbot *bot = session_bot(session);
-	cbot_handle_message(bot, params[0], origin, params[1], true, false);
-	printf("Event handled by CBot.\n");
+	struct cbot_backend *be = session_be(session);
+	const char *channel = irc_net_name(session_net(session), params[0]);
+	cbot_handle_message(be, channel, origin, params[1], true, false);
 }
 
 void event_join(irc_session_t *session, const char *event, const char *origin,
                 const char **params, unsigned int count)
 {
+	count_event(session, IRC_EV_JOIN);
 	log_event(session, event, origin, params, count);
-	struct cbot_irc_backend *irc = session_irc(session);
-	struct cbot *bot = irc->bot;
-	if (strcmp(origin, bot->name) != 0) {
-		cbot_handle_user_event(bot, params[0], origin, CBOT_JOIN);
+	struct cbot_backend *be = session_be(session);
+	const char *channel = irc_net_name(session_net(session), params[0]);
+	if (strcmp(origin, be->bot->name) != 0) {
+		cbot_handle_user_event(be, channel, origin, CBOT_JOIN);
 	}
-	printf("Event handled by CBot.\n");
 }
 
 void event_part(irc_session_t *session, const char *event, const char *origin,
                 const char **params, unsigned int count)
 {
+	count_event(session, IRC_EV_PART);
 	log_event(session, event, origin, params, count);
-	struct cbot *bot = session_bot(session);
-	cbot_handle_user_event(bot, params[0], origin, CBOT_PART);
-	printf("Event handled by CBot.\n");
+	struct cbot_backend *be = session_be(session);
+	const char *channel = irc_net_name(session_net(session), params[0]);
+	cbot_handle_user_event(be, channel, origin, CBOT_PART);
 }
 
 void event_nick(irc_session_t *session, const char *event, const char *origin,
                 const char **params, unsigned int count)
 {
+	count_event(session, IRC_EV_NICK);
 	log_event(session, event, origin, params, count);
-	struct cbot *bot = session_bot(session);
-	if (strcmp(origin, bot->name) == 0)
-		cbot_set_nick(bot, params[0]);
+	struct cbot_backend *be = session_be(session);
+	if (strcmp(origin, be->bot->name) == 0)
+		cbot_set_nick(be, params[0]);
 	else
-		cbot_handle_nick_event(bot, origin, params[0]);
-	printf("Event handled by CBot.\n");
+		cbot_handle_nick_event(be, origin, params[0]);
 }
 
-static void cbot_irc_run(struct cbot *bot)
+static void net_error(struct cbot_irc_network *net)
 {
-	irc_session_t *session = bot_session(bot);
-	struct cbot_irc_backend *irc = bot_irc(bot);
-	fd_set in_fd, out_fd, err_fd;
-	int maxfd, rv;
+	CL_CRIT("irc %s: irc error (%s): %s\n", net->name, net->host,
+	        irc_strerror(irc_errno(net->session)));
+	log_stats(net, INFO);
+	if (net->wait_flags)
+		sc_lwt_remove_fd(net->irc->be->lwt, net->fd);
+	net->wait_flags = 0;
+	net->connected = false;
+	net->registered = false;
+	net_clear_outq(net);
+}
+
+/*
+ * Keep the scheduler waiting on the session's socket for what libircclient
+ * wants (it only wants to write while it has output buffered). The socket is
+ * registered once, and only updated when that changes, rather than rebuilding
+ * fd_sets on every wakeup.
+ */
+static int net_wait(struct cbot_irc_network *net, struct sc_lwt *cur)
+{
+	fd_set in_fd, out_fd;
+	int fd = 0, flags = 0;
+
+	FD_ZERO(&in_fd);
+	FD_ZERO(&out_fd);
+	if (irc_add_select_descriptors(net->session, &in_fd, &out_fd, &fd))
+		return -1;
+	/* A session has one socket, so the "maximum" fd is that socket */
+	if (FD_ISSET(fd, &in_fd))
+		flags |= SC_LWT_W_IN;
+	if (FD_ISSET(fd, &out_fd))
+		flags |= SC_LWT_W_OUT;
+	if (fd == net->fd && flags == net->wait_flags)
+		return 0;
+	if (net->wait_flags)
+		sc_lwt_remove_fd(cur, net->fd);
+	net->fd = fd;
+	net->wait_flags = flags;
+	if (flags)
+		sc_lwt_wait_fd(cur, fd, flags, net);
+	return 0;
+}
+
+/* Let libircclient handle whatever is ready on the session's socket */
+static int net_process(struct cbot_irc_network *net, struct sc_lwt *cur)
+{
+	fd_set in_fd, out_fd;
+	int bits, rv;
+
+	if (!net->wait_flags)
+		return 0;
+	bits = sc_lwt_fd_status(cur, net->fd, NULL);
+	if (!bits)
+		return 0;
+	FD_ZERO(&in_fd);
+	FD_ZERO(&out_fd);
+	/* Errors are reported when libircclient next reads */
+	if (bits & (SC_LWT_W_IN | SC_LWT_W_ERR))
+		FD_SET(net->fd, &in_fd);
+	if (bits & SC_LWT_W_OUT)
+		FD_SET(net->fd, &out_fd);
+	net->irc->current = net;
+	rv = irc_process_select_descriptors(net->session, &in_fd, &out_fd);
+	net->irc->current = NULL;
+	return rv;
+}
+
+static void cbot_irc_run(struct cbot_backend *be)
+{
+	struct cbot *bot = be->bot;
+	struct cbot_irc_backend *irc = be_irc(be);
+	struct cbot_irc_network *net;
+	int nconnected;
+	uint64_t delay, wait;
+	struct timespec ts;
 	struct sc_lwt *cur = sc_lwt_current();
 
-	// Start the connection process!
-	if (irc_connect(session, irc->host, irc->port, irc->password, bot->name,
-	                bot->name, NULL)) {
-		fprintf(stderr, "cbot: error connecting to IRC - %s\n",
-		        irc_strerror(irc_errno(session)));
-		exit(EXIT_FAILURE);
+	// Start the connection process! One network failing doesn't stop the
+	// others, but if none connect, the backend (and so the bot) exits.
+	nconnected = 0;
+	sc_list_for_each_entry(net, &irc->networks, list,
+	                       struct cbot_irc_network)
+	{
+		if (irc_connect(net->session, net->host, net->port,
+		                net->password, bot->name, bot->name, NULL)) {
+			CL_CRIT("irc %s: error connecting (%s): %s\n",
+			        net->name, net->host,
+			        irc_strerror(irc_errno(net->session)));
+			continue;
+		}
+		net->connected = true;
+		nconnected++;
+	}
+	if (!nconnected) {
+		CL_CRIT("irc: no network could be connected\n");
+		return;
 	}
 
-	while (1) {
-		sc_lwt_fdgen_advance(cur);
-		sc_lwt_clear_fds(&in_fd, &out_fd, &err_fd);
-		maxfd = 0;
-		rv = irc_add_select_descriptors(session, &in_fd, &out_fd,
-		                                &maxfd);
-		if (rv != 0) {
-			fprintf(stderr, "cbot_irc: irc error: %s\n",
-			        irc_strerror(irc_errno(session)));
-			break;
+	irc->stats_ms = now_ms();
+	/* All sessions are handled by this one thread */
+	while (!sc_lwt_shutting_down()) {
+		nconnected = 0;
+		wait = 0;
+		sc_list_for_each_entry(net, &irc->networks, list,
+		                       struct cbot_irc_network)
+		{
+			if (!net->connected)
+				continue;
+			/* Lines queued while handling the last events */
+			delay = net_flush(net);
+			if (delay && (!wait || delay < wait))
+				wait = delay;
+			if (net_wait(net, cur) != 0)
+				net_error(net);
+			else
+				nconnected++;
 		}
-		sc_lwt_add_select_fds(cur, &in_fd, &out_fd, &err_fd, maxfd,
-		                      NULL);
-		sc_lwt_fdgen_purge(cur);
+		if (!nconnected)
+			break;
 
+		/* Wake up when flood control allows the next line out */
+		if (wait) {
+			ts.tv_sec = wait / 1000;
+			ts.tv_nsec = (wait % 1000) * 1000000;
+			sc_lwt_settimeout(cur, &ts);
+		}
 		sc_lwt_set_state(cur, SC_LWT_BLOCKED);
 		sc_lwt_yield();
-		sc_lwt_clear_fds(&in_fd, &out_fd, &err_fd);
-		sc_lwt_populate_ready_fds(cur, &in_fd, &out_fd, &err_fd, maxfd);
-		rv = irc_process_select_descriptors(session, &in_fd, &out_fd);
-		if (rv != 0) {
-			fprintf(stderr, "cbot_irc: irc error: %s\n",
-			        irc_strerror(irc_errno(session)));
+		sc_lwt_cleartimeout(cur);
+		if (sc_lwt_shutting_down())
 			break;
+		sc_list_for_each_entry(net, &irc->networks, list,
+		                       struct cbot_irc_network)
+		{
+			if (net->connected && net_process(net, cur) != 0)
+				net_error(net);
+		}
+		if (CL_ENABLED(DEBUG) &&
+		    now_ms() - irc->stats_ms >= STATS_INTERVAL_MS) {
+			irc->stats_ms = now_ms();
+			sc_list_for_each_entry(net, &irc->networks, list,
+			                       struct cbot_irc_network)
+			{
+				log_stats(net, DEBUG);
+			}
 		}
 	}
+	sc_list_for_each_entry(net, &irc->networks, list,
+	                       struct cbot_irc_network)
+	{
+		if (net->connected)
+			log_stats(net, INFO);
+	}
+	sc_lwt_remove_all(cur);
+}
+
+/* Apply any flood control settings from group, leaving the rest unchanged */
+static int flood_configure(struct irc_flood *f, config_setting_t *group)
+{
+	int rv, val;
+
+	rv = config_setting_lookup_bool(group, "flood_control", &val);
+	if (rv == CONFIG_TRUE)
+		f->enabled = val;
+	rv = config_setting_lookup_int(group, "flood_line_ms", &val);
+	if (rv == CONFIG_TRUE) {
+		if (val < 0)
+			goto invalid;
+		f->line_ms = val;
+	}
+	rv = config_setting_lookup_int(group, "flood_bytes_per_sec", &val);
+	if (rv == CONFIG_TRUE) {
+		if (val <= 0)
+			goto invalid;
+		f->bytes_per_sec = val;
+	}
+	rv = config_setting_lookup_int(group, "flood_window_ms", &val);
+	if (rv == CONFIG_TRUE) {
+		if (val < 0)
+			goto invalid;
+		f->window_ms = val;
+	}
+	return 0;
+invalid:
+	fprintf(stderr, "cbot irc: invalid flood control setting\n");
+	return -1;
 }
 
-static int cbot_irc_configure(struct cbot *bot, config_setting_t *group)
+static struct cbot_irc_network *net_add(struct cbot_irc_backend *irc,
+                                                config_setting_t *group,
+                                                const char *name)
 {
-	int rv;
+	struct cbot_irc_network *net;
 	const char *host, *password;
-	int port;
-	struct cbot_irc_backend *backend;
+	int rv, port;
 
 	rv = config_setting_lookup_string(group, "host", &host);
 	if (rv == CONFIG_FALSE) {
 		fprintf(stderr,
 		        "cbot irc: key \"host\" wrong type or not exists\n");
-		return -1;
+		return NULL;
 	}
 	rv = config_setting_lookup_int(group, "port", &port);
 	if (rv == CONFIG_FALSE) {
 		fprintf(stderr,
 		        "cbot irc: key \"port\" wrong type or not exists\n");
-		return -1;
+		return NULL;
 	}
 	rv = config_setting_lookup_string(group, "password", &password);
 	if (rv == CONFIG_FALSE)
 		password = NULL;
+	if (strchr(name, ':')) {
+		fprintf(stderr, "cbot irc: network name \"%s\" contains ':'\n",
+		        name);
+		return NULL;
+	}
 
-	backend = calloc(1, sizeof(*backend));
-	bot->backend = backend;
-	backend->bot = bot;
-	backend->host = strdup(host);
-	backend->port = port;
+	net = calloc(1, sizeof(*net));
+	net->irc = irc;
+	net->name = strdup(name);
+	net->host = strdup(host);
+	net->port = port;
 	if (password)
-		backend->password = strdup(password);
+		net->password = strdup(password);
+	sc_list_init(&net->names_rqs);
+	sc_list_init(&net->channels);
+	sc_list_init(&net->outq);
+	irc_flood_init(&net->flood);
+	sc_cb_init(&net->scratch, 128);
+	sc_list_insert_end(&irc->networks, &net->list);
+	irc->nnetworks++;
+
+	net->session = irc_create_session(&irc->callbacks);
+	if (!net->session) {
+		fprintf(stderr, "cbot: error creating IRC session - %s\n",
+		        irc_strerror(irc_errno(net->session)));
+		return NULL;
+	}
+	// Set libircclient to parse nicknames for us.
+	irc_option_set(net->session, LIBIRC_OPTION_STRIPNICKS);
+	// Set libircclient to ignore invalid certificates (irc.case.edu...)
+	irc_option_set(net->session, LIBIRC_OPTION_SSL_NO_VERIFY);
+	// Save the network in the irc context
+	irc_set_ctx(net->session, net);
+	return net;
+}
 
-	sc_list_init(&backend->join_rqs);
-	sc_list_init(&backend->topic_rqs);
-	sc_list_init(&backend->names_rqs);
+static int cbot_irc_configure(struct cbot_backend *be, config_setting_t *group)
+{
+	struct cbot_irc_backend *backend;
+	struct cbot_irc_network *net;
+	config_setting_t *networks, *elem;
+	const char *name;
+	int i;
+
+	backend = calloc(1, sizeof(*backend));
+	be->priv = backend;
+	backend->bot = be->bot;
+	backend->be = be;
+	sc_list_init(&backend->networks);
 
 	backend->callbacks.event_connect = event_connect;
 	backend->callbacks.event_join = event_join;
 	backend->callbacks.event_nick = event_nick;
-	backend->callbacks.event_quit = log_event;
+	backend->callbacks.event_quit = event_quit;
 	backend->callbacks.event_part = event_part;
-	backend->callbacks.event_mode = log_event;
-	backend->callbacks.event_topic = log_event;
-	backend->callbacks.event_kick = log_event;
+	backend->callbacks.event_mode = event_mode;
+	backend->callbacks.event_topic = event_topic;
+	backend->callbacks.event_kick = event_kick;
 	backend->callbacks.event_channel = event_channel;
 	backend->callbacks.event_privmsg = event_privmsg;
-	backend->callbacks.event_notice = log_event;
-	backend->callbacks.event_invite = log_event;
-	backend->callbacks.event_umode = log_event;
-	backend->callbacks.event_ctcp_rep = log_event;
-	backend->callbacks.event_ctcp_action = log_event;
-	backend->callbacks.event_unknown = log_event;
+	backend->callbacks.event_notice = event_notice;
+	backend->callbacks.event_invite = event_invite;
+	backend->callbacks.event_umode = event_umode;
+	backend->callbacks.event_ctcp_rep = event_ctcp_rep;
+	backend->callbacks.event_ctcp_action = event_ctcp_action;
+	backend->callbacks.event_unknown = event_unknown;
 	backend->callbacks.event_numeric = event_numeric;
 
-	backend->session = irc_create_session(&backend->callbacks);
-	if (!backend->session) {
-		fprintf(stderr, "cbot: error creating IRC session - %s\n",
-		        irc_strerror(irc_errno(backend->session)));
+	/* Without a "networks" list, the section itself describes a network */
+	networks = config_setting_lookup(group, "networks");
+	if (!networks) {
+		net = net_add(backend, group, be->name);
+		if (!net)
+			return -1;
+		return flood_configure(&net->flood, group);
+	}
+	if (!config_setting_is_list(networks) ||
+	    config_setting_length(networks) == 0) {
+		fprintf(stderr, "cbot irc: \"networks\" should be a non-empty "
+		                "list\n");
 		return -1;
 	}
-	// Set libircclient to parse nicknames for us.
-	irc_option_set(backend->session, LIBIRC_OPTION_STRIPNICKS);
-	// Set libircclient to ignore invalid certificates (irc.case.edu...)
-	irc_option_set(backend->session, LIBIRC_OPTION_SSL_NO_VERIFY);
-	// Save the cbot struct in the irc context
-	irc_set_ctx(backend->session, bot);
+	for (i = 0; i < config_setting_length(networks); i++) {
+		elem = config_setting_get_elem(networks, i);
+		if (!config_setting_is_group(elem) ||
+		    config_setting_lookup_string(elem, "name", &name) ==
+		            CONFIG_FALSE) {
+			fprintf(stderr,
+			        "cbot irc: networks[%d] should be a group with "
+			        "a \"name\"\n",
+			        i);
+			return -1;
+		}
+		net = net_add(backend, elem, name);
+		if (!net)
+			return -1;
+		/* Settings for all networks, then this one's */
+		if (flood_configure(&net->flood, group) < 0 ||
+		    flood_configure(&net->flood, elem) < 0)
+			return -1;
+		if (config_setting_lookup(elem, "channels") &&
+		    cbot_add_channels(&net->channels, elem) < 0)
+			return -1;
+	}
 	return 0;
 }
 
+/* Unprefixed channels in the backend's list belong to the first network */
+static char *cbot_irc_channel_name(const struct cbot_backend *be,
+                                   const char *name)
+{
+	struct cbot_irc_backend *irc = be_irc(be);
+	const char *target;
+
+	if (irc->nnetworks < 2 || irc_net_lookup(irc, name, &target))
+		return NULL;
+	return strdup(irc_net_name(irc_net_first(irc), name));
+}
+
 struct cbot_backend_ops irc_ops = {
 	.name = "irc",
 	.configure = cbot_irc_configure,
@@ -414,4 +813,5 @@ struct cbot_backend_ops irc_ops = {
 	.join = cbot_irc_join,
 	.nick = cbot_irc_nick,
 	.is_authorized = NULL,
+	.channel_name = cbot_irc_channel_name,
 };
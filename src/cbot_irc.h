@@ -7,6 +7,8 @@
 
 #include <sc-collections.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "cbot/cbot.h"
 #include "libircclient.h"
@@ -17,17 +19,144 @@ struct names_rq {
 	struct sc_charbuf names;
 };
 
-struct cbot_irc_backend {
+/*
+ * Flood control (irc_flood.c). The defaults follow ircu: each line costs two
+ * seconds plus one for every 120 bytes, and the server allows us ten seconds
+ * ahead of the clock. We stop a second short of that.
+ */
+#define IRC_FLOOD_LINE_MS       2000
+#define IRC_FLOOD_BYTES_PER_SEC 120
+#define IRC_FLOOD_WINDOW_MS     9000
+
+struct irc_flood {
+	bool enabled;
+	unsigned int line_ms;
+	unsigned int bytes_per_sec;
+	unsigned int window_ms;
+	/* The server's penalty clock, as we estimate it */
+	uint64_t clock_ms;
+};
+
+void irc_flood_init(struct irc_flood *f);
+/* Return how long to wait before a line of this many bytes may be sent */
+uint64_t irc_flood_delay(const struct irc_flood *f, uint64_t now_ms,
+                         size_t bytes);
+/* Account for a line of this many bytes, sent now */
+void irc_flood_charge(struct irc_flood *f, uint64_t now_ms, size_t bytes);
+
+#define IRC_LINE_MAX 512
+#define IRC_TEXT_MIN 64
+
+/* Return the most text which fits in one PRIVMSG (or ACTION) to target */
+size_t irc_text_max(const char *nick, const char *target, bool action);
+/*
+ * Return the next line of at most max bytes from *msg, setting *len to its
+ * length and advancing *msg past it, or NULL when there are none left. Lines
+ * are split at line breaks, then at spaces or UTF-8 character boundaries.
+ */
+const char *irc_split(const char **msg, size_t max, size_t *len);
+
+/* A raw line waiting in a network's output queue */
+struct irc_line {
+	struct sc_list_head list;
+	char *text;
+};
+
+/* Kinds of event we count, per network */
+enum irc_event_kind {
+	IRC_EV_CONNECT,
+	IRC_EV_NICK,
+	IRC_EV_QUIT,
+	IRC_EV_JOIN,
+	IRC_EV_PART,
+	IRC_EV_MODE,
+	IRC_EV_UMODE,
+	IRC_EV_TOPIC,
+	IRC_EV_KICK,
+	IRC_EV_CHANNEL,
+	IRC_EV_PRIVMSG,
+	IRC_EV_NOTICE,
+	IRC_EV_INVITE,
+	IRC_EV_CTCP_REP,
+	IRC_EV_ACTION,
+	IRC_EV_UNKNOWN,
+	IRC_EV_NAMREPLY,
+	IRC_EV_NUMERIC,
+	_IRC_EV_COUNT_,
+};
+
+/*
+ * One IRC network. A backend may connect to several, in which case CBot
+ * names their channels "network:#channel".
+ */
+struct cbot_irc_network {
+	struct sc_list_head list;
+	struct cbot_irc_backend *irc;
 	irc_session_t *session;
-	irc_callbacks_t callbacks;
-	struct cbot *bot;
 	bool connected;
-	struct sc_list_head join_rqs;
-	struct sc_list_head topic_rqs;
-	struct sc_list_head names_rqs;
+	/* The session's socket, and what we're waiting on it for (if any) */
+	int fd;
+	int wait_flags;
+	/* Set once the server has accepted our registration */
+	bool registered;
+	char *name;
 	char *host;
 	int port;
 	char *password;
+	/* Channels to join from this network's own configuration */
+	struct sc_list_head channels; /* struct cbot_channel_conf */
+	struct sc_list_head names_rqs;
+	/* Lines held back by flood control */
+	struct sc_list_head outq; /* struct irc_line */
+	struct irc_flood flood;
+	unsigned long events[_IRC_EV_COUNT_];
+	/* For building "network:target" names */
+	struct sc_charbuf scratch;
 };
 
+struct cbot_irc_backend {
+	irc_callbacks_t callbacks;
+	struct cbot *bot;
+	struct cbot_backend *be;
+	struct sc_list_head networks; /* struct cbot_irc_network */
+	int nnetworks;
+	/* Network whose events are being processed, if any */
+	struct cbot_irc_network *current;
+	/* When event counts were last logged */
+	uint64_t stats_ms;
+};
+
+/*
+ * Naming across networks (irc_net.c). With more than one network, CBot names
+ * channels and DMs "network:target".
+ */
+/* Return the name CBot uses for target on net (valid until the next call) */
+const char *irc_net_name(struct cbot_irc_network *net, const char *target);
+struct cbot_irc_network *irc_net_first(const struct cbot_irc_backend *irc);
+/*
+ * Return the network named by the prefix of dest, and set *target to the rest.
+ * If dest has no network prefix, return NULL and set *target to dest.
+ */
+struct cbot_irc_network *irc_net_lookup(const struct cbot_irc_backend *irc,
+                                        const char *dest, const char **target);
+/*
+ * Find the network for a CBot destination, and set *target to its name on that
+ * network. Names without a network prefix go to the network whose event is
+ * being handled, or the first one.
+ */
+struct cbot_irc_network *irc_net_route(const struct cbot_irc_backend *irc,
+                                       const char *dest, const char **target);
+/*
+ * Return whether net should join a channel from the backend's own list: those
+ * prefixed with its name, or unprefixed ones if it is the first network.
+ */
+bool irc_net_owns(struct cbot_irc_network *net, const char *name,
+                  const char **target);
+
+/* Event counting (irc_net.c) */
+/* Return which count a numeric reply goes in */
+enum irc_event_kind irc_numeric_kind(unsigned int event);
+/* Append net's event counts to cb, as " name=count" pairs */
+void irc_net_events(const struct cbot_irc_network *net, struct sc_charbuf *cb);
+
 #endif // CBOT_IRC_H
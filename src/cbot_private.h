@@ -15,11 +15,13 @@
 #include <sqlite3.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <time.h>
 
 #include "cbot/cbot.h"
 
 struct cbot_plugpriv;
+struct cbot_scope_node;
 
 struct cbot_handler {
 	/* Function called by CBot */
@@ -30,12 +32,42 @@ struct cbot_handler {
 	struct cbot_plugpriv *plugin;
 	/* Optionally, a regex which must match in order to be called. */
 	struct sc_regex *regex;
-	/* List containing all handlers for this event. */
+	enum cbot_event_type type;
+	/* Registration order, to call scoped and unscoped handlers in order */
+	unsigned long seq;
+	/* List containing all unscoped handlers for this event. */
 	struct sc_list_head handler_list;
 	/* List containing all handlers for this plugin. */
 	struct sc_list_head plugin_list;
+	/* For scoped handlers, the handler's entry in each scope */
+	struct cbot_scope_node *scopes;
+	int nscopes;
 };
 
+/* A handler's entry in a scope's list of handlers */
+struct cbot_scope_node {
+	struct sc_list_head list;
+	struct cbot_handler *hdlr;
+};
+
+/*
+ * The handlers registered with cbot_register_scoped() for one channel, or for
+ * DMs. Channels are found in a chained hash table in struct cbot, so that
+ * dispatching an event only visits handlers which could want it.
+ */
+struct cbot_scope {
+	struct sc_list_head bucket;
+	uint32_t hash;
+	char *channel;
+	struct sc_list_head handlers[_CBOT_NUM_EVENT_TYPES_];
+};
+
+#define CBOT_SCOPE_BUCKETS 64
+
+#define CBOT_ROUTE_BUCKETS 64
+/* Beyond this many, routes learned from events are forgotten, oldest first */
+#define CBOT_ROUTE_MAX 1024
+
 struct cbot_plugpriv {
 	struct cbot_plugin p;
 	/* Name of the plugin */
@@ -50,22 +82,30 @@ struct cbot_plugpriv {
 	void *handle;
 };
 
+struct cbot_backend;
+
 struct cbot_backend_ops {
 	const char *name;
-	int (*configure)(struct cbot *cbot, config_setting_t *group);
-	void (*run)(struct cbot *cbot);
-	uint64_t (*send)(const struct cbot *cbot, const char *to,
+	int (*configure)(struct cbot_backend *be, config_setting_t *group);
+	void (*run)(struct cbot_backend *be);
+	uint64_t (*send)(const struct cbot_backend *be, const char *to,
 	                 const struct cbot_reaction_ops *ops, void *arg,
 	                 const char *msg);
-	void (*me)(const struct cbot *cbot, const char *to, const char *msg);
-	void (*op)(const struct cbot *cbot, const char *channel,
+	void (*me)(const struct cbot_backend *be, const char *to,
+	           const char *msg);
+	void (*op)(const struct cbot_backend *be, const char *channel,
 	           const char *username);
-	void (*join)(const struct cbot *cbot, const char *channel,
+	void (*join)(const struct cbot_backend *be, const char *channel,
 	             const char *password);
-	void (*nick)(const struct cbot *cbot, const char *newnick);
-	int (*is_authorized)(const struct cbot *bot, const char *sender,
+	void (*nick)(const struct cbot_backend *be, const char *newnick);
+	int (*is_authorized)(const struct cbot_backend *be, const char *sender,
 	                     const char *message);
-	void (*unregister_reaction)(const struct cbot *bot, uint64_t id);
+	void (*unregister_reaction)(const struct cbot_backend *be, uint64_t id);
+	/* Return the name which events use for a configured channel, if that
+	 * differs, for the caller to free (optional) */
+	char *(*channel_name)(const struct cbot_backend *be, const char *name);
+	/* Free be->priv, once every thread has exited (optional) */
+	void (*shutdown)(struct cbot_backend *be);
 };
 
 extern struct cbot_backend_ops irc_ops;
@@ -78,7 +118,45 @@ struct cbot_channel_conf {
 	struct sc_list_head list;
 };
 
+int cbot_add_channels(struct sc_list_head *channels, config_setting_t *group);
+void cbot_free_channels(struct sc_list_head *channels);
+
+/* A message queued by cbot_send_rl() */
+struct cbot_qmsg {
+	char *msg;
+	char *dest;
+	struct sc_list_head list;
+};
+
+/*
+ * A running backend. A bot may run several at once, each configured by its own
+ * section, and each with its own channels, thread and send queue.
+ */
+struct cbot_backend {
+	struct cbot *bot;
+	/* Name of the configuration section */
+	char *name;
+	struct cbot_backend_ops *ops;
+	/* Set by ops->configure() for the backend's own use */
+	void *priv;
+	struct sc_list_head init_channels;
+
+	/* Thread which runs ops->run() */
+	struct sc_lwt *lwt;
+	/* While handling an event: the thread doing so, and how many deep */
+	struct sc_lwt *handling_lwt;
+	int handling;
+
+	/* Messages queued by cbot_send_rl(), and the thread sending them */
+	struct sc_lwt *msgq_thread;
+	struct sc_list_head msgq;
+
+	/* Entry in bot->backends */
+	struct sc_list_head list;
+};
+
 struct cbot_http;
+struct cbot_curl_cache;
 
 struct cbot_callback {
 	struct sc_list_head list;
@@ -92,25 +170,33 @@ struct cbot {
 	/* Loaded from configuration */
 	char *name;
 	struct sc_array aliases;
-	char *backend_name;
 	char *plugin_dir;
 	char *db_file;
-	struct sc_list_head init_channels;
 
 	struct sc_list_head handlers[_CBOT_NUM_EVENT_TYPES_];
+	unsigned long handler_seq;
+	/* Scoped handlers: struct cbot_scope, by channel */
+	struct sc_list_head scopes[CBOT_SCOPE_BUCKETS];
+	struct cbot_scope dm_scope;
 	struct sc_list_head plugins;
 	uint8_t hash[20];
-	struct cbot_backend_ops *backend_ops;
-	void *backend;
 	sqlite3 *privDb;
 	struct sc_lwt_ctx *lwt_ctx;
 	struct sc_lwt *lwt;
 
-	struct sc_lwt *msgq_thread;
-	struct sc_list_head msgq;
+	/* struct cbot_backend: the first is the default for sending */
+	struct sc_list_head backends;
+	int nbackends;
+	/* With several backends, the backend each destination belongs to:
+	 * struct cbot_route by dest, and those learned from events by age */
+	struct sc_list_head routes[CBOT_ROUTE_BUCKETS];
+	struct sc_list_head route_lru;
+	int nroutes;
+	bool backend_exited;
 
 	CURLM *curlm;
 	struct sc_lwt *curl_lwt;
+	struct cbot_curl_cache *curl_cache;
 
 	struct MHD_Daemon *http;
 	struct sc_lwt *http_lwt;
@@ -119,32 +205,101 @@ struct cbot {
 	struct sc_list_head callback_list;
 	struct sc_lwt *callback_lwt;
 	bool callback_touched;
+
+	/* Event recording (see trace.c) */
+	FILE *trace;
+	uint64_t trace_last;
+
+	/* If set, called with the time taken by each handler call */
+	void (*handler_timed)(struct cbot *bot, struct cbot_handler *hdlr,
+	                      uint64_t ns);
 };
 
 struct cbot *cbot_create(void);
 int cbot_load_config(struct cbot *bot, const char *conf_file);
+int cbot_load_plugins(struct cbot *bot, config_setting_t *group);
 void cbot_run(struct cbot *bot);
 void cbot_delete(struct cbot *obj);
 
-void cbot_set_nick(struct cbot *bot, const char *newname);
+void cbot_set_nick(const struct cbot_backend *be, const char *newname);
+
+/* Backends (see cbot.c) */
+struct cbot_backend *cbot_backend_add(struct cbot *bot,
+                                      struct cbot_backend_ops *ops,
+                                      const char *name);
+struct cbot_backend *cbot_backend_default(const struct cbot *bot);
+struct cbot_backend *cbot_backend_route(const struct cbot *bot,
+                                        const char *dest);
+void cbot_backend_learn(struct cbot_backend *be, const char *dest);
+void cbot_backend_seed_routes(struct cbot *bot);
 
 struct cbot_handler *cbot_register_priv(struct cbot *bot,
                                         struct cbot_plugpriv *priv,
                                         enum cbot_event_type type,
                                         cbot_handler_t handler, void *user,
                                         char *regex, int re_flags);
+struct cbot_handler *
+cbot_register_scoped_priv(struct cbot *bot, struct cbot_plugpriv *priv,
+                          enum cbot_event_type type, cbot_handler_t handler,
+                          void *user, char *regex, int re_flags,
+                          const char *const *channels, int flags);
 
 /* Functions which backends can call, to trigger various types of events */
-void cbot_handle_message(struct cbot *bot, const char *channel,
+void cbot_handle_message(struct cbot_backend *be, const char *channel,
                          const char *user, const char *message, bool action,
                          bool is_dm);
-void cbot_handle_user_event(struct cbot *bot, const char *channel,
+void cbot_handle_user_event(struct cbot_backend *be, const char *channel,
                             const char *user, enum cbot_event_type type);
-void cbot_handle_nick_event(struct cbot *bot, const char *old_username,
+void cbot_handle_nick_event(struct cbot_backend *be, const char *old_username,
                             const char *new_username);
 
 void *base64_decode(const char *str, int explen);
 
+/*******
+ * Event traces (trace.c)
+ *******/
+enum cbot_trace_kind {
+	CBOT_TRACE_MESSAGE = 1,
+	CBOT_TRACE_USER = 2,
+	CBOT_TRACE_NICK = 3,
+};
+
+/* An event read from a trace. Strings are valid until the next read. */
+struct cbot_trace_event {
+	enum cbot_trace_kind kind;
+	/* Nanoseconds since the trace started */
+	uint64_t ns;
+	/* Not set for CBOT_TRACE_NICK */
+	const char *channel;
+	/* For CBOT_TRACE_NICK, the old name */
+	const char *user;
+	/* For CBOT_TRACE_NICK, the new name. Not set for CBOT_TRACE_USER */
+	const char *message;
+	bool action;
+	bool is_dm;
+	/* For CBOT_TRACE_USER, CBOT_JOIN or CBOT_PART */
+	enum cbot_event_type type;
+};
+
+struct cbot_trace_reader;
+
+int cbot_trace_open(struct cbot *bot, const char *path);
+void cbot_trace_close(struct cbot *bot);
+void cbot_trace_message(struct cbot *bot, const char *channel,
+                        const char *user, const char *message, bool action,
+                        bool is_dm);
+void cbot_trace_user(struct cbot *bot, const char *channel, const char *user,
+                     enum cbot_event_type type);
+void cbot_trace_nick(struct cbot *bot, const char *old_username,
+                     const char *new_username);
+
+struct cbot_trace_reader *cbot_trace_reader_open(const char *path);
+void cbot_trace_reader_close(struct cbot_trace_reader *r);
+/* Returns 1 when an event is read, 0 at the end, and -1 on error */
+int cbot_trace_read(struct cbot_trace_reader *r, struct cbot_trace_event *ev);
+/* Deliver a traced event to the bot's handlers */
+void cbot_trace_replay(struct cbot *bot, const struct cbot_trace_event *ev);
+
 /*******
  * Database functions!
  *******/
@@ -158,7 +313,8 @@ int cbot_db_register_internal(struct cbot *bot,
 /******
  * Curl functions !
  ******/
-int cbot_curl_init(struct cbot *bot);
+int cbot_curl_init(struct cbot *bot, config_setting_t *group);
+void cbot_curl_destroy(struct cbot *bot);
 
 #define nelem(arr) (sizeof(arr) / sizeof(arr[0]))
 
@@ -167,6 +323,11 @@ void run_cbot_cli(int argc, char **argv);
 
 #define plugpriv(plug) ((struct cbot_plugpriv *)plug)
 
+int cbot_log_start_writer(void);
+void cbot_log_stop_writer(void);
+
+void cbot_fmt_cache_clear(void);
+
 int cbot_http_init(struct cbot *bot, config_setting_t *group);
 void cbot_http_destroy(struct cbot *bot);
 
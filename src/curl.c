@@ -1,10 +1,14 @@
 /*
  * Thin wrapping over the libcurl multi API.
  */
+#include <ctype.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <sys/select.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <time.h>
 
 #include <curl/curl.h>
@@ -31,6 +35,96 @@ void cbot_curl_charbuf_response(CURL *easy, struct sc_charbuf *buf)
 	curl_easy_setopt(easy, CURLOPT_WRITEDATA, buf);
 }
 
+static size_t stream_write_cb(char *data, size_t size, size_t nmemb,
+                              void *user)
+{
+	struct cbot_curl_stream *stream = user;
+	size_t len = size * nmemb;
+
+	if (stream->chunk(data, len, stream->arg) != 0) {
+		/* Returning a short count makes curl abort the transfer */
+		stream->aborted = true;
+		return 0;
+	}
+	return len;
+}
+
+static int stream_emit_line(struct cbot_curl_stream *stream)
+{
+	struct sc_charbuf *line = &stream->partial;
+	int rv;
+
+	if (line->length && line->buf[line->length - 1] == '\r')
+		line->buf[--line->length] = '\0';
+	rv = stream->line(line->buf, line->length, stream->arg);
+	sc_cb_clear(line);
+	return rv;
+}
+
+static size_t line_write_cb(char *data, size_t size, size_t nmemb, void *user)
+{
+	struct cbot_curl_stream *stream = user;
+	size_t len = size * nmemb;
+	size_t n, room;
+	char *nl;
+
+	while (len) {
+		nl = memchr(data, '\n', len);
+		n = nl ? (size_t)(nl - data) : len;
+		room = CBOT_CURL_MAX_LINE - stream->partial.length;
+		sc_cb_memcpy(&stream->partial, data, n < room ? n : room);
+		if (!nl)
+			break;
+		data += n + 1;
+		len -= n + 1;
+		if (stream_emit_line(stream) != 0) {
+			stream->aborted = true;
+			return 0;
+		}
+	}
+	return size * nmemb;
+}
+
+void cbot_curl_stream_response(CURL *easy, struct cbot_curl_stream *stream,
+                               cbot_curl_chunk_cb cb, void *arg)
+{
+	stream->chunk = cb;
+	stream->line = NULL;
+	stream->arg = arg;
+	stream->aborted = false;
+	sc_cb_init(&stream->partial, 256);
+	curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, stream_write_cb);
+	curl_easy_setopt(easy, CURLOPT_WRITEDATA, stream);
+}
+
+void cbot_curl_line_response(CURL *easy, struct cbot_curl_stream *stream,
+                             cbot_curl_line_cb cb, void *arg)
+{
+	stream->chunk = NULL;
+	stream->line = cb;
+	stream->arg = arg;
+	stream->aborted = false;
+	sc_cb_init(&stream->partial, 256);
+	curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, line_write_cb);
+	curl_easy_setopt(easy, CURLOPT_WRITEDATA, stream);
+}
+
+int cbot_curl_stream_finish(struct cbot_curl_stream *stream, CURLcode rv)
+{
+	int ret = 0;
+
+	if (stream->aborted) {
+		CL_DEBUG("curl: stream aborted by consumer\n");
+	} else if (rv != CURLE_OK) {
+		CL_WARN("curl: error: %s\n", curl_easy_strerror(rv));
+		ret = -1;
+	} else if (stream->line && stream->partial.length) {
+		stream_emit_line(stream);
+	}
+	sc_cb_destroy(&stream->partial);
+	return ret;
+}
+
 struct sc_list_head waitlist;
 
 struct curl_waiting {
@@ -39,20 +133,41 @@ struct curl_waiting {
 	struct sc_lwt *thread;
 	CURLcode result;
 	bool done;
+	struct timespec finished;
+	/* Completion counter shared by a cbot_curl_perform_many() batch */
+	size_t *ndone;
 };
 
+static void curl_enqueue(struct cbot *bot, struct curl_waiting *wait,
+                         CURL *handle, size_t *ndone)
+{
+	wait->handle = handle;
+	wait->done = false;
+	wait->thread = sc_lwt_current();
+	wait->ndone = ndone;
+	sc_list_init(&wait->list);
+	curl_easy_setopt(handle, CURLOPT_PRIVATE, (char *)wait);
+	curl_multi_add_handle(bot->curlm, handle);
+	sc_lwt_set_state(bot->curl_lwt, SC_LWT_RUNNABLE);
+	sc_list_insert_end(&waitlist, &wait->list);
+}
+
+static void curl_finish(struct curl_waiting *wait, CURLcode result)
+{
+	clock_gettime(CLOCK_MONOTONIC, &wait->finished);
+	wait->result = result;
+	wait->done = true;
+	if (wait->ndone)
+		(*wait->ndone)++;
+	sc_list_remove(&wait->list);
+	sc_lwt_set_state(wait->thread, SC_LWT_RUNNABLE);
+}
+
 CURLcode cbot_curl_perform(struct cbot *bot, CURL *handle)
 {
 	struct curl_waiting wait;
 	bool first = true;
-	wait.handle = handle;
-	wait.done = false;
-	wait.thread = sc_lwt_current();
-	sc_list_init(&wait.list);
-	curl_easy_setopt(handle, CURLOPT_PRIVATE, (char *)&wait);
-	curl_multi_add_handle(bot->curlm, handle);
-	sc_lwt_set_state(bot->curl_lwt, SC_LWT_RUNNABLE);
-	sc_list_insert_end(&waitlist, &wait.list);
+	curl_enqueue(bot, &wait, handle, NULL);
 	while (!wait.done) {
 		CL_VERB("curl: %s request, yielding\n",
 		        first ? "enqueued" : "continue");
@@ -70,6 +185,628 @@ CURLcode cbot_curl_perform(struct cbot *bot, CURL *handle)
 	return wait.result;
 }
 
+static long elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000 +
+	       (end->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Run a batch of requests, counting completions in *ndone until there are
+ * total of them. The count may include other things which the caller is
+ * waiting for (see cache_get_many()), so long as they wake the current LWT.
+ */
+static void perform_batch(struct cbot *bot, struct cbot_curl_req *reqs,
+                          size_t n, enum cbot_curl_wait mode, long timeout_ms,
+                          size_t *ndone, size_t total)
+{
+	struct sc_lwt *cur = sc_lwt_current();
+	struct curl_waiting *waits = calloc(n ? n : 1, sizeof(*waits));
+	struct timespec start, now, ts;
+	size_t i;
+	long remaining;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++)
+		curl_enqueue(bot, &waits[i], reqs[i].handle, ndone);
+
+	/*
+	 * As in cbot_curl_perform(), a shutdown wakes us early but the curl
+	 * thread will complete every request, so keep waiting until our
+	 * condition is satisfied or the deadline passes.
+	 */
+	while (*ndone < total && !(mode == CBOT_CURL_WAIT_ANY && *ndone > 0)) {
+		if (timeout_ms >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			remaining = timeout_ms - elapsed_ms(&start, &now);
+			if (remaining <= 0) {
+				CL_DEBUG("curl: deadline passed with %zu/%zu "
+				         "requests done\n",
+				         *ndone, total);
+				break;
+			}
+			ts.tv_sec = remaining / 1000;
+			ts.tv_nsec = (remaining % 1000) * 1000000;
+			sc_lwt_settimeout(cur, &ts);
+		}
+		sc_lwt_set_state(cur, SC_LWT_BLOCKED);
+		sc_lwt_yield();
+	}
+	sc_lwt_cleartimeout(cur);
+
+	for (i = 0; i < n; i++) {
+		reqs[i].done = waits[i].done;
+		if (waits[i].done) {
+			reqs[i].result = waits[i].result;
+			reqs[i].elapsed_ms =
+			        elapsed_ms(&start, &waits[i].finished);
+			continue;
+		}
+		/* Cancel whatever is left, so the caller may free it. */
+		curl_multi_remove_handle(bot->curlm, waits[i].handle);
+		sc_list_remove(&waits[i].list);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		reqs[i].result = CURLE_OPERATION_TIMEDOUT;
+		reqs[i].elapsed_ms = elapsed_ms(&start, &now);
+	}
+	free(waits);
+}
+
+size_t cbot_curl_perform_many(struct cbot *bot, struct cbot_curl_req *reqs,
+                              size_t n, enum cbot_curl_wait mode,
+                              long timeout_ms)
+{
+	size_t ndone = 0;
+
+	perform_batch(bot, reqs, n, mode, timeout_ms, &ndone, n);
+	return ndone;
+}
+
+/*
+ * Response cache for cbot_curl_get(). Entries are keyed by URL and live in a
+ * small chained hash table, plus an LRU list used for eviction once the total
+ * size of cached bodies exceeds max_bytes. Freshness comes from Cache-Control
+ * max-age (or the configured default TTL), and stale entries which carry an
+ * ETag or Last-Modified validator are revalidated with a conditional request.
+ *
+ * While a request for a URL is in flight, its entry is marked and any other
+ * LWT asking for the same URL simply waits on the entry, rather than issuing
+ * a duplicate request.
+ *
+ * A request is split into cache_start() and cache_finish(), so that
+ * cbot_curl_get_many() can have several in flight at once.
+ */
+#define CACHE_BUCKETS 64
+#define CACHE_DEFAULT_BYTES (4 * 1024 * 1024)
+#define CACHE_DEFAULT_TTL 60
+
+struct cbot_curl_cache {
+	struct sc_list_head buckets[CACHE_BUCKETS];
+	/* Most recently used first */
+	struct sc_list_head lru;
+	size_t bytes;
+	size_t max_bytes;
+	long default_ttl;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long revalidated;
+	unsigned long coalesced;
+};
+
+struct curl_cache_entry {
+	struct sc_list_head bucket;
+	struct sc_list_head lru;
+	/* LWTs waiting on the in-flight request (struct curl_cache_waiter) */
+	struct sc_list_head waiters;
+	uint32_t hash;
+	char *url;
+	char *body;
+	size_t length;
+	time_t expires;
+	char *etag;
+	char *last_modified;
+	bool inflight;
+};
+
+struct curl_cache_waiter {
+	struct sc_list_head list;
+	struct sc_lwt *thread;
+	char *result;
+	bool done;
+	/* Completion counter shared by a cache_get_many() batch */
+	size_t *ndone;
+};
+
+/* Caching-related response headers, as parsed by header_cb() */
+struct curl_cache_headers {
+	char *etag;
+	char *last_modified;
+	long max_age;
+	bool no_store;
+	bool no_cache;
+};
+
+/* One request through the cache, between cache_start() and cache_finish() */
+struct cache_req {
+	struct curl_cache_entry *ent;
+	struct curl_cache_headers hdrs;
+	struct curl_slist *cond;
+	struct sc_charbuf resp;
+	CURL *easy;
+};
+
+static time_t cache_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static uint32_t cache_hash(const char *url)
+{
+	uint32_t hash = 2166136261u;
+	for (; *url; url++) {
+		hash ^= (unsigned char)*url;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static char *copy_body(const char *body, size_t length)
+{
+	char *copy = malloc(length + 1);
+	memcpy(copy, body, length);
+	copy[length] = '\0';
+	return copy;
+}
+
+static void cache_headers_reset(struct curl_cache_headers *hdrs)
+{
+	free(hdrs->etag);
+	free(hdrs->last_modified);
+	hdrs->etag = NULL;
+	hdrs->last_modified = NULL;
+	hdrs->max_age = -1;
+	hdrs->no_store = false;
+	hdrs->no_cache = false;
+}
+
+/*
+ * Return a copy of the value of header "name" if this header line contains it,
+ * otherwise NULL. Header lines from curl are not NUL terminated.
+ */
+static char *header_value(const char *data, size_t len, const char *name)
+{
+	size_t nlen = strlen(name);
+	if (len <= nlen || data[nlen] != ':' ||
+	    strncasecmp(data, name, nlen) != 0)
+		return NULL;
+	data += nlen + 1;
+	len -= nlen + 1;
+	while (len && (*data == ' ' || *data == '\t')) {
+		data++;
+		len--;
+	}
+	while (len && isspace((unsigned char)data[len - 1]))
+		len--;
+	return strndup(data, len);
+}
+
+static void parse_cache_control(struct curl_cache_headers *hdrs,
+                                const char *value)
+{
+	size_t n;
+	while (*value) {
+		value += strspn(value, " \t,");
+		n = strcspn(value, ",");
+		if (n >= 8 && strncasecmp(value, "no-store", 8) == 0)
+			hdrs->no_store = true;
+		else if (n >= 8 && strncasecmp(value, "no-cache", 8) == 0)
+			hdrs->no_cache = true;
+		else if (n > 8 && strncasecmp(value, "max-age=", 8) == 0)
+			hdrs->max_age = strtol(value + 8, NULL, 10);
+		value += n;
+	}
+}
+
+static size_t header_cb(char *data, size_t size, size_t nmemb, void *user)
+{
+	struct curl_cache_headers *hdrs = user;
+	size_t len = size * nmemb;
+	char *value;
+
+	/* A new status line means a new response (e.g. after a redirect) */
+	if (len >= 5 && strncmp(data, "HTTP/", 5) == 0) {
+		cache_headers_reset(hdrs);
+	} else if ((value = header_value(data, len, "ETag"))) {
+		free(hdrs->etag);
+		hdrs->etag = value;
+	} else if ((value = header_value(data, len, "Last-Modified"))) {
+		free(hdrs->last_modified);
+		hdrs->last_modified = value;
+	} else if ((value = header_value(data, len, "Cache-Control"))) {
+		parse_cache_control(hdrs, value);
+		free(value);
+	}
+	return len;
+}
+
+/* Request headers which make a request conditional on validators */
+static struct curl_slist *cond_headers(const char *etag,
+                                       const char *last_modified)
+{
+	struct curl_slist *list = NULL;
+	struct sc_charbuf hdr;
+
+	sc_cb_init(&hdr, 128);
+	if (etag) {
+		sc_cb_printf(&hdr, "If-None-Match: %s", etag);
+		list = curl_slist_append(list, hdr.buf);
+	}
+	if (last_modified) {
+		sc_cb_clear(&hdr);
+		sc_cb_printf(&hdr, "If-Modified-Since: %s", last_modified);
+		list = curl_slist_append(list, hdr.buf);
+	}
+	sc_cb_destroy(&hdr);
+	return list;
+}
+
+static struct curl_cache_entry *
+cache_lookup(struct cbot_curl_cache *cache, const char *url, uint32_t hash)
+{
+	struct curl_cache_entry *ent;
+	struct sc_list_head *bucket = &cache->buckets[hash % CACHE_BUCKETS];
+	sc_list_for_each_entry(ent, bucket, bucket, struct curl_cache_entry)
+	{
+		if (ent->hash == hash && strcmp(ent->url, url) == 0)
+			return ent;
+	}
+	return NULL;
+}
+
+static struct curl_cache_entry *
+cache_insert(struct cbot_curl_cache *cache, const char *url, uint32_t hash)
+{
+	struct curl_cache_entry *ent = calloc(1, sizeof(*ent));
+	ent->hash = hash;
+	ent->url = strdup(url);
+	sc_list_init(&ent->waiters);
+	sc_list_insert(&cache->buckets[hash % CACHE_BUCKETS], &ent->bucket);
+	sc_list_insert(&cache->lru, &ent->lru);
+	return ent;
+}
+
+static void cache_clear_body(struct cbot_curl_cache *cache,
+                             struct curl_cache_entry *ent)
+{
+	cache->bytes -= ent->length;
+	free(ent->body);
+	free(ent->etag);
+	free(ent->last_modified);
+	ent->body = NULL;
+	ent->length = 0;
+	ent->etag = NULL;
+	ent->last_modified = NULL;
+}
+
+static void cache_remove(struct cbot_curl_cache *cache,
+                         struct curl_cache_entry *ent)
+{
+	cache_clear_body(cache, ent);
+	sc_list_remove(&ent->bucket);
+	sc_list_remove(&ent->lru);
+	free(ent->url);
+	free(ent);
+}
+
+static void cache_evict(struct cbot_curl_cache *cache)
+{
+	struct curl_cache_entry *ent;
+	struct sc_list_head *node = cache->lru.prev;
+
+	/* Walk from the least recently used end, skipping in-flight entries */
+	while (cache->bytes > cache->max_bytes && node != &cache->lru) {
+		ent = sc_list_entry(node, struct curl_cache_entry, lru);
+		node = node->prev;
+		if (ent->inflight)
+			continue;
+		CL_DEBUG("curl: cache: evict %s (%zu bytes)\n", ent->url,
+		         ent->length);
+		cache_remove(cache, ent);
+	}
+}
+
+/*
+ * Update the validators and expiry time of an entry from response headers.
+ * Returns false if the entry is not worth keeping.
+ */
+static bool cache_update(struct cbot_curl_cache *cache,
+                         struct curl_cache_entry *ent,
+                         struct curl_cache_headers *hdrs)
+{
+	long ttl = hdrs->max_age >= 0 ? hdrs->max_age : cache->default_ttl;
+	if (hdrs->no_cache)
+		ttl = 0;
+	if (hdrs->etag) {
+		free(ent->etag);
+		ent->etag = hdrs->etag;
+		hdrs->etag = NULL;
+	}
+	if (hdrs->last_modified) {
+		free(ent->last_modified);
+		ent->last_modified = hdrs->last_modified;
+		hdrs->last_modified = NULL;
+	}
+	ent->expires = cache_now() + ttl;
+	return ttl > 0 || ent->etag || ent->last_modified;
+}
+
+static void cache_wake_waiters(struct curl_cache_entry *ent,
+                               const char *result, size_t length)
+{
+	struct curl_cache_waiter *wait, *next;
+	sc_list_for_each_safe(wait, next, &ent->waiters, list,
+	                      struct curl_cache_waiter)
+	{
+		sc_list_remove(&wait->list);
+		wait->result = result ? copy_body(result, length) : NULL;
+		wait->done = true;
+		if (wait->ndone)
+			(*wait->ndone)++;
+		sc_lwt_set_state(wait->thread, SC_LWT_RUNNABLE);
+	}
+}
+
+static void cache_wait_start(struct cbot_curl_cache *cache,
+                             struct curl_cache_entry *ent,
+                             struct curl_cache_waiter *wait, size_t *ndone)
+{
+	wait->thread = sc_lwt_current();
+	wait->result = NULL;
+	wait->done = false;
+	wait->ndone = ndone;
+	sc_list_insert_end(&ent->waiters, &wait->list);
+	cache->coalesced++;
+	CL_DEBUG("curl: cache: waiting on in-flight %s\n", ent->url);
+}
+
+static char *cache_wait(struct cbot_curl_cache *cache,
+                        struct curl_cache_entry *ent)
+{
+	struct curl_cache_waiter wait;
+
+	cache_wait_start(cache, ent, &wait, NULL);
+	/* As in cbot_curl_perform(), a shutdown may wake us early. */
+	while (!wait.done) {
+		sc_lwt_set_state(wait.thread, SC_LWT_BLOCKED);
+		sc_lwt_yield();
+	}
+	return wait.result;
+}
+
+/* Return a copy of the entry's body if it is fresh, otherwise NULL */
+static char *cache_fresh(struct cbot_curl_cache *cache,
+                         struct curl_cache_entry *ent)
+{
+	if (!ent || ent->inflight || !ent->body || cache_now() >= ent->expires)
+		return NULL;
+	cache->hits++;
+	CL_DEBUG("curl: cache: hit %s\n", ent->url);
+	sc_list_remove(&ent->lru);
+	sc_list_insert(&cache->lru, &ent->lru);
+	return copy_body(ent->body, ent->length);
+}
+
+/*
+ * Mark the entry for url as in flight, and return a handle which requests it,
+ * conditionally if we have a stale body with validators. The caller performs
+ * the request and passes its result to cache_finish().
+ */
+static CURL *cache_start(struct cbot_curl_cache *cache, struct cache_req *req,
+                         struct curl_cache_entry *ent, const char *url,
+                         uint32_t hash)
+{
+	struct curl_cache_entry *e = ent ? ent : cache_insert(cache, url, hash);
+
+	cache->misses++;
+	e->inflight = true;
+	memset(req, 0, sizeof(*req));
+	req->ent = e;
+
+	if (e->body)
+		req->cond = cond_headers(e->etag, e->last_modified);
+
+	req->hdrs.max_age = -1;
+	sc_cb_init(&req->resp, 4096);
+	req->easy = curl_easy_init();
+	curl_easy_setopt(req->easy, CURLOPT_URL, url);
+	curl_easy_setopt(req->easy, CURLOPT_HEADERFUNCTION, header_cb);
+	curl_easy_setopt(req->easy, CURLOPT_HEADERDATA, &req->hdrs);
+	curl_easy_setopt(req->easy, CURLOPT_HTTPHEADER, req->cond);
+	cbot_curl_charbuf_response(req->easy, &req->resp);
+	return req->easy;
+}
+
+/*
+ * Complete a request from cache_start(), given its result: update or drop the
+ * entry, and hand the body to any waiters. Returns the caller's copy of the
+ * body, or NULL on error.
+ */
+static char *cache_finish(struct cbot_curl_cache *cache, struct cache_req *req,
+                          CURLcode rv)
+{
+	struct curl_cache_entry *ent = req->ent;
+	struct curl_cache_headers *hdrs = &req->hdrs;
+	struct sc_charbuf *resp = &req->resp;
+	char *result = NULL;
+	size_t length = 0;
+	bool keep = false;
+	long status = 0;
+
+	curl_easy_getinfo(req->easy, CURLINFO_RESPONSE_CODE, &status);
+	curl_easy_cleanup(req->easy);
+	curl_slist_free_all(req->cond);
+
+	if (rv != CURLE_OK) {
+		CL_WARN("curl: error: %s: %s\n", ent->url,
+		        curl_easy_strerror(rv));
+		/* Keep a stale body around so we can revalidate it later. */
+		keep = ent->body != NULL;
+		sc_cb_destroy(resp);
+	} else if (status == 304 && ent->body) {
+		CL_DEBUG("curl: cache: revalidated %s\n", ent->url);
+		cache->revalidated++;
+		keep = cache_update(cache, ent, hdrs);
+		result = copy_body(ent->body, ent->length);
+		length = ent->length;
+		sc_cb_destroy(resp);
+	} else if (status == 200 && !hdrs->no_store &&
+	           (size_t)resp->length <= cache->max_bytes) {
+		cache_clear_body(cache, ent);
+		ent->body = resp->buf;
+		ent->length = resp->length;
+		cache->bytes += ent->length;
+		keep = cache_update(cache, ent, hdrs);
+		result = copy_body(ent->body, ent->length);
+		length = ent->length;
+	} else {
+		/*
+		 * Uncacheable, or an error status: hand back the body as
+		 * always, but leave any previously cached entry alone unless
+		 * the server told us not to store it.
+		 */
+		keep = ent->body != NULL && !hdrs->no_store;
+		result = resp->buf;
+		length = resp->length;
+	}
+	cache_headers_reset(hdrs);
+
+	ent->inflight = false;
+	cache_wake_waiters(ent, result, length);
+	if (keep) {
+		sc_list_remove(&ent->lru);
+		sc_list_insert(&cache->lru, &ent->lru);
+	} else {
+		cache_remove(cache, ent);
+	}
+	cache_evict(cache);
+	return result;
+}
+
+static char *cache_get(struct cbot *bot, struct cbot_curl_cache *cache,
+                       const char *url)
+{
+	struct curl_cache_entry *ent;
+	struct cache_req req;
+	uint32_t hash = cache_hash(url);
+	char *result;
+	CURLcode rv;
+
+	ent = cache_lookup(cache, url, hash);
+	if (ent && ent->inflight)
+		return cache_wait(cache, ent);
+	if ((result = cache_fresh(cache, ent)))
+		return result;
+	rv = cbot_curl_perform(bot, cache_start(cache, &req, ent, url, hash));
+	return cache_finish(cache, &req, rv);
+}
+
+/* How cache_get_many() satisfies each URL of the batch */
+struct cache_slot {
+	enum { SLOT_HIT, SLOT_REQ, SLOT_WAIT, SLOT_DUP } kind;
+	/* SLOT_REQ: our request. SLOT_DUP: the earlier URL with that request */
+	size_t req;
+	struct curl_cache_waiter wait;
+};
+
+/*
+ * cbot_curl_get_many() through the cache. Fresh entries are answered at once.
+ * URLs which another LWT is already fetching are waited on, counting toward
+ * the batch's mode and deadline just like our own requests.
+ */
+static int cache_get_many(struct cbot *bot, struct cbot_curl_cache *cache,
+                          size_t n, const char *const *urls, char **bodies,
+                          enum cbot_curl_wait mode, long timeout_ms)
+{
+	struct cache_slot *slots = calloc(n, sizeof(*slots));
+	struct cache_req *creqs = calloc(n, sizeof(*creqs));
+	struct cbot_curl_req *reqs = calloc(n, sizeof(*reqs));
+	size_t *owner = calloc(n, sizeof(*owner));
+	struct curl_cache_entry *ent;
+	size_t i, j, nreq = 0, ndone = 0, total = 0;
+	uint32_t hash;
+	int nok = 0;
+
+	for (i = 0; i < n; i++) {
+		CL_DEBUG("cURL (batch): %s\n", urls[i]);
+		ent = cache_lookup(cache, urls[i], cache_hash(urls[i]));
+		if ((bodies[i] = cache_fresh(cache, ent)))
+			nok++;
+	}
+	if (nok && mode == CBOT_CURL_WAIT_ANY)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		if (bodies[i])
+			continue;
+		hash = cache_hash(urls[i]);
+		ent = cache_lookup(cache, urls[i], hash);
+		if (ent && ent->inflight) {
+			for (j = 0; j < nreq && creqs[j].ent != ent; j++)
+				;
+			if (j < nreq) {
+				/* The same URL twice in this batch */
+				slots[i].kind = SLOT_DUP;
+				slots[i].req = owner[j];
+			} else {
+				slots[i].kind = SLOT_WAIT;
+				cache_wait_start(cache, ent, &slots[i].wait,
+				                 &ndone);
+				total++;
+			}
+			continue;
+		}
+		slots[i].kind = SLOT_REQ;
+		slots[i].req = nreq;
+		owner[nreq] = i;
+		reqs[nreq].handle =
+		        cache_start(cache, &creqs[nreq], ent, urls[i], hash);
+		nreq++;
+		total++;
+	}
+
+	perform_batch(bot, reqs, nreq, mode, timeout_ms, &ndone, total);
+	for (j = 0; j < nreq; j++)
+		bodies[owner[j]] =
+		        cache_finish(cache, &creqs[j], reqs[j].result);
+
+	for (i = 0; i < n; i++) {
+		switch (slots[i].kind) {
+		case SLOT_DUP:
+			if (bodies[slots[i].req])
+				bodies[i] = strdup(bodies[slots[i].req]);
+			break;
+		case SLOT_WAIT:
+			if (slots[i].wait.done)
+				bodies[i] = slots[i].wait.result;
+			else
+				sc_list_remove(&slots[i].wait.list);
+			break;
+		default:
+			break;
+		}
+		if (bodies[i] && slots[i].kind != SLOT_HIT)
+			nok++;
+	}
+out:
+	free(owner);
+	free(reqs);
+	free(creqs);
+	free(slots);
+	return nok;
+}
+
 char *cbot_curl_get(struct cbot *bot, const char *url, ...)
 {
 	va_list vl;
@@ -81,6 +818,12 @@ char *cbot_curl_get(struct cbot *bot, const char *url, ...)
 	va_end(vl);
 	CL_DEBUG("cURL: %s\n", url_fmt.buf);
 
+	if (bot->curl_cache && bot->curl_cache->max_bytes) {
+		char *result = cache_get(bot, bot->curl_cache, url_fmt.buf);
+		sc_cb_destroy(&url_fmt);
+		return result;
+	}
+
 	CURL *easy = curl_easy_init();
 	curl_easy_setopt(easy, CURLOPT_URL, url_fmt.buf);
 	sc_cb_init(&resp, 4096);
@@ -97,116 +840,395 @@ char *cbot_curl_get(struct cbot *bot, const char *url, ...)
 	return result;
 }
 
+int cbot_curl_get_lines(struct cbot *bot, cbot_curl_line_cb cb, void *arg,
+                        const char *url, ...)
+{
+	va_list vl;
+	struct sc_charbuf url_fmt;
+	struct cbot_curl_stream stream;
+	CURLcode rv;
+	CURL *easy;
+
+	va_start(vl, url);
+	sc_cb_init(&url_fmt, 256);
+	sc_cb_vprintf(&url_fmt, url, vl);
+	va_end(vl);
+	CL_DEBUG("cURL (streaming): %s\n", url_fmt.buf);
+
+	easy = curl_easy_init();
+	curl_easy_setopt(easy, CURLOPT_URL, url_fmt.buf);
+	cbot_curl_line_response(easy, &stream, cb, arg);
+	rv = cbot_curl_perform(bot, easy);
+	curl_easy_cleanup(easy);
+	sc_cb_destroy(&url_fmt);
+	return cbot_curl_stream_finish(&stream, rv);
+}
+
+static size_t validators_header_cb(char *data, size_t size, size_t nmemb,
+                                   void *user)
+{
+	struct cbot_curl_validators *val = user;
+	size_t len = size * nmemb;
+	char *value;
+
+	/* A new status line means a new response (e.g. after a redirect) */
+	if (len >= 5 && strncmp(data, "HTTP/", 5) == 0) {
+		free(val->new_etag);
+		free(val->new_last_modified);
+		val->new_etag = val->new_last_modified = NULL;
+	} else if ((value = header_value(data, len, "ETag"))) {
+		free(val->new_etag);
+		val->new_etag = value;
+	} else if ((value = header_value(data, len, "Last-Modified"))) {
+		free(val->new_last_modified);
+		val->new_last_modified = value;
+	}
+	return len;
+}
+
+void cbot_curl_conditional(CURL *easy, struct cbot_curl_validators *val)
+{
+	val->headers = cond_headers(val->etag, val->last_modified);
+	curl_easy_setopt(easy, CURLOPT_HTTPHEADER, val->headers);
+	curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, validators_header_cb);
+	curl_easy_setopt(easy, CURLOPT_HEADERDATA, val);
+}
+
+enum cbot_curl_cond
+cbot_curl_conditional_finish(CURL *easy, struct cbot_curl_validators *val,
+                             CURLcode rv)
+{
+	enum cbot_curl_cond result = CBOT_CURL_FAILED;
+	long status = 0;
+
+	curl_slist_free_all(val->headers);
+	val->headers = NULL;
+	if (rv == CURLE_OK)
+		curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+
+	if (status == 200 || (status == 304 && val->new_etag)) {
+		free(val->etag);
+		val->etag = val->new_etag;
+		val->new_etag = NULL;
+	}
+	if (status == 200 || (status == 304 && val->new_last_modified)) {
+		free(val->last_modified);
+		val->last_modified = val->new_last_modified;
+		val->new_last_modified = NULL;
+	}
+	if (status == 200)
+		result = CBOT_CURL_MODIFIED;
+	else if (status == 304)
+		result = CBOT_CURL_NOT_MODIFIED;
+	free(val->new_etag);
+	free(val->new_last_modified);
+	val->new_etag = val->new_last_modified = NULL;
+	return result;
+}
+
+void cbot_curl_validators_free(struct cbot_curl_validators *val)
+{
+	curl_slist_free_all(val->headers);
+	free(val->etag);
+	free(val->last_modified);
+	free(val->new_etag);
+	free(val->new_last_modified);
+	memset(val, 0, sizeof(*val));
+}
+
+int cbot_curl_get_many(struct cbot *bot, size_t n, const char *const *urls,
+                       char **bodies, enum cbot_curl_wait mode,
+                       long timeout_ms)
+{
+	struct cbot_curl_req *reqs;
+	struct sc_charbuf *resps;
+	size_t i;
+	int nok = 0;
+
+	if (bot->curl_cache && bot->curl_cache->max_bytes)
+		return cache_get_many(bot, bot->curl_cache, n, urls, bodies,
+		                      mode, timeout_ms);
+
+	reqs = calloc(n, sizeof(*reqs));
+	resps = calloc(n, sizeof(*resps));
+	for (i = 0; i < n; i++) {
+		CL_DEBUG("cURL (batch): %s\n", urls[i]);
+		reqs[i].handle = curl_easy_init();
+		curl_easy_setopt(reqs[i].handle, CURLOPT_URL, urls[i]);
+		sc_cb_init(&resps[i], 4096);
+		cbot_curl_charbuf_response(reqs[i].handle, &resps[i]);
+	}
+	cbot_curl_perform_many(bot, reqs, n, mode, timeout_ms);
+	for (i = 0; i < n; i++) {
+		curl_easy_cleanup(reqs[i].handle);
+		if (reqs[i].done && reqs[i].result == CURLE_OK) {
+			bodies[i] = resps[i].buf;
+			nok++;
+			continue;
+		}
+		if (reqs[i].done)
+			CL_WARN("curl: error: %s: %s\n", urls[i],
+			        curl_easy_strerror(reqs[i].result));
+		bodies[i] = NULL;
+		sc_cb_destroy(&resps[i]);
+	}
+	free(reqs);
+	free(resps);
+	return nok;
+}
+
+/*
+ * The curl thread is driven by curl_multi_socket_action(). Curl tells us which
+ * sockets it cares about via sock_cb(), and we register exactly those with the
+ * LWT scheduler. Curl tells us when it next needs a timeout via timer_cb(),
+ * and we store that as an absolute deadline.
+ */
+struct curl_sock {
+	struct sc_list_head list;
+	curl_socket_t fd;
+	int flags;
+};
+
+struct curl_ready {
+	curl_socket_t fd;
+	int events;
+};
+
+static struct sc_list_head socklist;
+static struct timespec timer_deadline;
+static bool timer_armed;
+
+static int sock_cb(CURL *easy, curl_socket_t fd, int what, void *user,
+                   void *sockp)
+{
+	struct cbot *bot = user;
+	struct curl_sock *sock = sockp;
+	int flags = 0;
+
+	if (what == CURL_POLL_REMOVE) {
+		if (sock) {
+			CL_VERB("curl: remove socket %d\n", fd);
+			sc_lwt_remove_fd(bot->curl_lwt, fd);
+			sc_list_remove(&sock->list);
+			free(sock);
+		}
+		return 0;
+	}
+
+	if (what & CURL_POLL_IN)
+		flags |= SC_LWT_W_IN;
+	if (what & CURL_POLL_OUT)
+		flags |= SC_LWT_W_OUT;
+
+	if (!sock) {
+		sock = calloc(1, sizeof(*sock));
+		sock->fd = fd;
+		sc_list_insert_end(&socklist, &sock->list);
+		curl_multi_assign(bot->curlm, fd, sock);
+	} else if (sock->flags == flags) {
+		return 0;
+	} else {
+		sc_lwt_remove_fd(bot->curl_lwt, fd);
+	}
+	CL_VERB("curl: wait on socket %d for%s%s\n", fd,
+	        (flags & SC_LWT_W_IN) ? " in" : "",
+	        (flags & SC_LWT_W_OUT) ? " out" : "");
+	sock->flags = flags;
+	sc_lwt_wait_fd(bot->curl_lwt, fd, flags, NULL);
+	return 0;
+}
+
+static int timer_cb(CURLM *multi, long timeout_ms, void *user)
+{
+	struct cbot *bot = user;
+
+	if (timeout_ms < 0) {
+		timer_armed = false;
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &timer_deadline);
+	timer_deadline.tv_sec += timeout_ms / 1000;
+	timer_deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (timer_deadline.tv_nsec >= 1000000000) {
+		timer_deadline.tv_sec += 1;
+		timer_deadline.tv_nsec -= 1000000000;
+	}
+	timer_armed = true;
+	/* The curl thread needs to recompute how long it may sleep. */
+	if (bot->curl_lwt != sc_lwt_current())
+		sc_lwt_set_state(bot->curl_lwt, SC_LWT_RUNNABLE);
+	return 0;
+}
+
+/*
+ * Return the time remaining until the curl timer deadline, or false if the
+ * deadline has already passed.
+ */
+static bool timer_remaining(struct timespec *ts)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ts->tv_sec = timer_deadline.tv_sec - now.tv_sec;
+	ts->tv_nsec = timer_deadline.tv_nsec - now.tv_nsec;
+	if (ts->tv_nsec < 0) {
+		ts->tv_sec -= 1;
+		ts->tv_nsec += 1000000000;
+	}
+	return ts->tv_sec > 0 || (ts->tv_sec == 0 && ts->tv_nsec > 0);
+}
+
+static void curl_complete(struct cbot *bot)
+{
+	struct curl_waiting *waiting;
+	CURLMsg *msg;
+	int nmsg;
+
+	while ((msg = curl_multi_info_read(bot->curlm, &nmsg))) {
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &waiting);
+		curl_multi_remove_handle(bot->curlm, waiting->handle);
+		curl_finish(waiting, msg->data.result);
+	}
+}
+
 void cbot_curl_run(void *data)
 {
 	struct cbot *bot = data;
 	struct sc_lwt *cur = sc_lwt_current();
 	struct curl_waiting *waiting, *next;
+	struct curl_sock *sock, *nsock;
+	struct curl_ready ready;
+	struct sc_array readylist;
 	struct timespec ts;
-	int nhdl, maxfd;
-	long millis;
-	bool block;
-	fd_set in_fd, out_fd, err_fd;
-	CURLMcode rv;
-	CURLMsg *msg;
+	int running, bits;
+	size_t i;
+	CURLMcode rv = CURLM_OK;
 
 	bot->curl_lwt = cur;
 	sc_list_init(&waitlist);
+	sc_arr_init(&readylist, struct curl_ready, 16);
 
-	while (true) {
-		/*
-		 * First, we should mark each file descriptor that curl would
-		 * like us to wait on, in case we end up blocking.
-		 */
-		sc_lwt_fdgen_advance(cur);
-		sc_lwt_clear_fds(&in_fd, &out_fd, &err_fd);
-		maxfd = 0;
-		curl_multi_fdset(bot->curlm, &in_fd, &out_fd, &err_fd, &maxfd);
-		sc_lwt_add_select_fds(cur, &in_fd, &out_fd, &err_fd, maxfd,
-		                      NULL);
-		sc_lwt_fdgen_purge(cur);
-
-		/*
-		 * Sometimes, curl doesn't actually want to block, or wants us
-		 * to block but do a timeout. We need to ask it how long it
-		 * wants to wait.
-		 */
-		block = true;
-		millis = 0;
-		curl_multi_timeout(bot->curlm, &millis);
-		/* Clear any previously held timeout for our thread */
+	while (rv == CURLM_OK) {
 		sc_lwt_cleartimeout(cur);
-		if (millis > 0) {
-			ts.tv_sec = millis / 1000;
-			ts.tv_nsec = millis * 1000000;
+		if (timer_armed && !timer_remaining(&ts)) {
+			CL_VERB("curlthread: timer expired\n");
+			timer_armed = false;
+			rv = curl_multi_socket_action(bot->curlm,
+			                              CURL_SOCKET_TIMEOUT, 0,
+			                              &running);
+			curl_complete(bot);
+			continue;
+		} else if (timer_armed) {
 			sc_lwt_settimeout(cur, &ts);
-			CL_VERB("curlthread: set timeout %d millis\n", millis);
-		} else if (millis == 0) {
-			block = false;
-		}
-
-		/* Only block if curl gave a non-zero timeout */
-		if (block) {
-			CL_VERB("curlthread: yielding\n");
-			sc_lwt_set_state(cur, SC_LWT_BLOCKED);
-			sc_lwt_yield();
-			CL_VERB("curlthread: wake up\n");
-			if (sc_lwt_shutting_down()) {
-				CL_DEBUG("curlthread: shutting down\n");
-				break;
-			}
 		}
 
-		/* Now actually drive curl connections forward. */
-		rv = curl_multi_perform(bot->curlm, &nhdl);
-		if (rv != CURLM_OK) {
-			CL_CRIT("curlm error %d: %s\n", rv,
-			        curl_multi_strerror(rv));
+		CL_VERB("curlthread: yielding\n");
+		sc_lwt_set_state(cur, SC_LWT_BLOCKED);
+		sc_lwt_yield();
+		CL_VERB("curlthread: wake up\n");
+		if (sc_lwt_shutting_down()) {
+			CL_DEBUG("curlthread: shutting down\n");
 			break;
 		}
 
 		/*
-		 * Finally, we must read messages from CURL about which
-		 * connections were completed, etc.
-		 */
-		do {
-			msg = curl_multi_info_read(bot->curlm, &nhdl);
-			if (msg && msg->msg == CURLMSG_DONE) {
-				curl_easy_getinfo(msg->easy_handle,
-				                  CURLINFO_PRIVATE, &waiting);
-				curl_multi_remove_handle(bot->curlm,
-				                         waiting->handle);
-				waiting->result = msg->data.result;
-				waiting->done = true;
-				sc_list_remove(&waiting->list);
-				sc_lwt_set_state(waiting->thread,
-				                 SC_LWT_RUNNABLE);
-			}
-		} while (msg);
-
-		/*
-		 * Clear file descriptors for this thread until next time.
+		 * Collect the ready sockets before acting on any of them:
+		 * curl_multi_socket_action() may add or remove sockets from
+		 * the list via sock_cb().
 		 */
-		sc_lwt_remove_all(cur);
+		readylist.len = 0;
+		sc_list_for_each_entry(sock, &socklist, list, struct curl_sock)
+		{
+			bits = sc_lwt_fd_status(cur, sock->fd, NULL);
+			if (!bits)
+				continue;
+			ready.fd = sock->fd;
+			ready.events = 0;
+			if (bits & SC_LWT_W_IN)
+				ready.events |= CURL_CSELECT_IN;
+			if (bits & SC_LWT_W_OUT)
+				ready.events |= CURL_CSELECT_OUT;
+			if (bits & SC_LWT_W_ERR)
+				ready.events |= CURL_CSELECT_ERR;
+			sc_arr_append(&readylist, struct curl_ready, ready);
+		}
+		for (i = 0; i < readylist.len && rv == CURLM_OK; i++) {
+			ready = sc_arr(&readylist, struct curl_ready)[i];
+			rv = curl_multi_socket_action(bot->curlm, ready.fd,
+			                              ready.events, &running);
+		}
+		curl_complete(bot);
 	}
+	if (rv != CURLM_OK)
+		CL_CRIT("curlm error %d: %s\n", rv, curl_multi_strerror(rv));
 
 	sc_list_for_each_safe(waiting, next, &waitlist, list,
 	                      struct curl_waiting)
 	{
 		CL_DEBUG("curlthread: cancel and remove CURL handle+thread\n");
-		sc_list_remove(&waiting->list);
 		curl_multi_remove_handle(bot->curlm, waiting->handle);
-		waiting->result = CURLE_READ_ERROR;
-		waiting->done = true;
-		sc_lwt_set_state(waiting->thread, SC_LWT_RUNNABLE);
+		curl_finish(waiting, CURLE_READ_ERROR);
 	}
 	curl_multi_cleanup(bot->curlm);
 	bot->curlm = NULL;
+	sc_list_for_each_safe(sock, nsock, &socklist, list, struct curl_sock)
+	{
+		sc_list_remove(&sock->list);
+		free(sock);
+	}
+	sc_lwt_remove_all(cur);
+	sc_arr_destroy(&readylist);
 }
 
-int cbot_curl_init(struct cbot *bot)
+int cbot_curl_init(struct cbot *bot, config_setting_t *group)
 {
+	struct cbot_curl_cache *cache = calloc(1, sizeof(*cache));
+	int cache_size = CACHE_DEFAULT_BYTES;
+	int cache_ttl = CACHE_DEFAULT_TTL;
+
+	if (group) {
+		config_setting_lookup_int(group, "cache_size", &cache_size);
+		config_setting_lookup_int(group, "cache_ttl", &cache_ttl);
+	}
+	if (cache_size < 0 || cache_ttl < 0) {
+		CL_CRIT("curl: cache_size and cache_ttl may not be negative\n");
+		free(cache);
+		return -1;
+	}
+	for (int i = 0; i < CACHE_BUCKETS; i++)
+		sc_list_init(&cache->buckets[i]);
+	sc_list_init(&cache->lru);
+	cache->max_bytes = cache_size;
+	cache->default_ttl = cache_ttl;
+	bot->curl_cache = cache;
+
+	sc_list_init(&socklist);
 	bot->curlm = curl_multi_init();
+	curl_multi_setopt(bot->curlm, CURLMOPT_SOCKETFUNCTION, sock_cb);
+	curl_multi_setopt(bot->curlm, CURLMOPT_SOCKETDATA, bot);
+	curl_multi_setopt(bot->curlm, CURLMOPT_TIMERFUNCTION, timer_cb);
+	curl_multi_setopt(bot->curlm, CURLMOPT_TIMERDATA, bot);
 	bot->curl_lwt = sc_lwt_create_task(bot->lwt_ctx, cbot_curl_run, bot);
 	return 0;
 }
+
+void cbot_curl_destroy(struct cbot *bot)
+{
+	struct cbot_curl_cache *cache = bot->curl_cache;
+	struct curl_cache_entry *ent, *next;
+
+	if (!cache)
+		return;
+	CL_DEBUG("curl: cache: %lu hits, %lu misses, %lu revalidated, "
+	         "%lu coalesced\n",
+	         cache->hits, cache->misses, cache->revalidated,
+	         cache->coalesced);
+	sc_list_for_each_safe(ent, next, &cache->lru, lru,
+	                      struct curl_cache_entry)
+	{
+		cache_remove(cache, ent);
+	}
+	free(cache);
+	bot->curl_cache = NULL;
+}
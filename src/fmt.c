@@ -1,124 +1,279 @@
 #include <sc-collections.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "cbot/cbot.h"
+#include "cbot_private.h"
 
-int cbot_format(struct sc_charbuf *buf, const char *fmt,
-                cbot_formatter_t formatter, void *user)
+/*
+ * Templates are compiled into a list of ops: literal spans of the source, and
+ * keys. Keys are copied out NUL terminated, so formatters can be handed them
+ * directly. When compiled against a formatter ops table, each key's formatter
+ * and suffix are resolved up front, so rendering is a loop over the ops with
+ * no scanning, string comparison or allocation.
+ */
+enum fmt_kind {
+	FMT_LITERAL,
+	FMT_KEY,
+};
+
+struct fmt_op {
+	enum fmt_kind kind;
+	const char *text; /* literal span, or NUL terminated key */
+	size_t len;
+	cbot_formatter2_t formatter; /* resolved, for FMT_KEY */
+	const char *suffix;
+};
+
+struct cbot_template {
+	const cbot_formatter_ops_t *ops;
+	uint32_t hash;
+	char *source;
+	int busy; /* renders in progress, for cached templates */
+	int nops;
+	struct fmt_op op[];
+	/* followed by the source, then keys */
+};
+
+/*
+ * Compiled templates used by cbot_format() and cbot_format2(), which take
+ * their template as a string. This is a direct-mapped cache: a slot is simply
+ * replaced on a collision. Like the rest of the bot, it is only used from the
+ * main thread.
+ */
+#define FMT_CACHE_SLOTS 256
+static struct cbot_template *fmt_cache[FMT_CACHE_SLOTS];
+
+static uint32_t fmt_hash(const char *fmt, const cbot_formatter_ops_t *ops)
 {
-	const char *c, *d;
-	struct sc_charbuf cb;
-	int rv, count = 0;
-	sc_cb_init(&cb, 64);
-	while (*fmt) {
-		c = strchr(fmt, '{');
-		if (!c) {
-			sc_cb_concat(buf, fmt);
-			rv = count;
-			goto out;
-		}
-		if (c[1] == '{') {
-			sc_cb_append(buf, '{');
-			fmt = &c[2];
+	uint32_t hash = 2166136261u ^ (uint32_t)(uintptr_t)ops;
+	for (; *fmt; fmt++) {
+		hash ^= (unsigned char)*fmt;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static cbot_formatter2_t fmt_resolve(const cbot_formatter_ops_t *op,
+                                     const char *key, const char **suffix)
+{
+	size_t prefix_len;
+	while (op && op->prefix) {
+		if (op->formatter == CBOT_FMT_CHAIN_SIGNAL) {
+			op = (const cbot_formatter_ops_t *)op->prefix;
 			continue;
 		}
-		sc_cb_memcpy(buf, fmt, c - fmt);
-		d = strchr(c, '}');
-		if (!d) {
-			rv = -1;
-			goto out;
+		prefix_len = strlen(op->prefix);
+		if (strncmp(key, op->prefix, prefix_len) == 0) {
+			*suffix = key + prefix_len;
+			return op->formatter;
 		}
-		sc_cb_clear(&cb);
-		sc_cb_memcpy(&cb, c + 1, d - c - 1);
-		rv = formatter(buf, cb.buf, user);
-		count += 1;
-		if (rv < 0)
-			goto out;
-		fmt = d + 1;
+		op++;
 	}
-	rv = count;
-out:
-	sc_cb_destroy(&cb);
-	return rv;
+	return NULL;
 }
 
-int cbot_format2(struct sc_charbuf *cb, const char *fmt,
-                 const cbot_formatter_ops_t *ops, ...)
+static struct cbot_template *fmt_compile(const char *fmt,
+                                         const cbot_formatter_ops_t *ops,
+                                         uint32_t hash)
 {
+	struct cbot_template *t;
+	struct fmt_op *op;
 	const char *c, *d;
-	struct sc_charbuf token_buf;
-	int rv, count = 0;
-	va_list args;
+	char *keys;
+	size_t len = strlen(fmt), maxops = 1;
 
-	va_start(args, ops);
-	sc_cb_init(&token_buf, 64);
+	for (c = fmt; (c = strchr(c, '{')); c++)
+		maxops += 2;
+	t = malloc(sizeof(*t) + maxops * sizeof(t->op[0]) + 2 * (len + 1));
+	t->ops = ops;
+	t->hash = hash;
+	t->busy = 0;
+	t->nops = 0;
+	t->source = (char *)&t->op[maxops];
+	memcpy(t->source, fmt, len + 1);
+	keys = t->source + len + 1;
 
+	fmt = t->source;
 	while (*fmt) {
 		c = strchr(fmt, '{');
-		if (!c) {
-			sc_cb_concat(cb, fmt);
-			rv = count;
-			goto out;
+		if (!c)
+			c = fmt + strlen(fmt);
+		if (c > fmt) {
+			op = &t->op[t->nops++];
+			op->kind = FMT_LITERAL;
+			op->text = fmt;
+			op->len = c - fmt;
 		}
-		sc_cb_memcpy(cb, fmt, c - fmt);
+		if (!*c)
+			break;
 		if (c[1] == '{') {
-			sc_cb_append(cb, '{');
+			op = &t->op[t->nops++];
+			op->kind = FMT_LITERAL;
+			op->text = c;
+			op->len = 1;
 			fmt = &c[2];
 			continue;
 		}
 		d = strchr(c, '}');
-		if (!d) {
-			rv = -1;
-			goto out;
+		if (!d)
+			goto err;
+		op = &t->op[t->nops++];
+		op->kind = FMT_KEY;
+		op->text = keys;
+		op->len = d - c - 1;
+		memcpy(keys, c + 1, op->len);
+		keys[op->len] = '\0';
+		keys += op->len + 1;
+		op->formatter = NULL;
+		op->suffix = NULL;
+		if (ops) {
+			op->formatter = fmt_resolve(ops, op->text, &op->suffix);
+			if (!op->formatter)
+				goto err;
 		}
+		fmt = d + 1;
+	}
+	return t;
+err:
+	free(t);
+	return NULL;
+}
 
-		sc_cb_clear(&token_buf);
-		sc_cb_memcpy(&token_buf, c + 1, d - c - 1);
-
-		const cbot_formatter_ops_t *op = ops;
-		int handled = 0;
-		while (op && op->prefix) {
-			if (op->formatter == CBOT_FMT_CHAIN_SIGNAL) {
-				op = (const cbot_formatter_ops_t *)op->prefix;
-				continue;
-			}
-			size_t prefix_len = strlen(op->prefix);
-			if (strncmp(token_buf.buf, op->prefix, prefix_len) ==
-			    0) {
-				const char *suffix = token_buf.buf + prefix_len;
-				va_list args_copy;
-				va_copy(args_copy, args);
-				int args_consumed =
-				        op->formatter(cb, suffix, &args_copy);
-				va_end(args_copy);
-				if (args_consumed < 0) {
-					rv = args_consumed;
-					goto out;
-				}
-				for (int i = 0; i < args_consumed; i++) {
-					(void)va_arg(args, void *);
-				}
-				handled = 1;
-				count++;
-				break;
-			}
-			op++;
+struct cbot_template *cbot_template_compile(const char *fmt,
+                                            const cbot_formatter_ops_t *ops)
+{
+	return fmt_compile(fmt, ops, fmt_hash(fmt, ops));
+}
+
+void cbot_template_free(struct cbot_template *t)
+{
+	free(t);
+}
+
+/*
+ * Return a compiled template from the cache, compiling it if necessary. A
+ * formatter may itself format something, so a template which is being rendered
+ * is never evicted: instead, the new template is returned uncached, and
+ * fmt_release() frees it.
+ */
+static struct cbot_template *fmt_acquire(const char *fmt,
+                                         const cbot_formatter_ops_t *ops)
+{
+	uint32_t hash = fmt_hash(fmt, ops);
+	struct cbot_template **slot = &fmt_cache[hash % FMT_CACHE_SLOTS];
+	struct cbot_template *t = *slot;
+
+	if (!t || t->hash != hash || t->ops != ops ||
+	    strcmp(t->source, fmt) != 0) {
+		t = fmt_compile(fmt, ops, hash);
+		if (!t)
+			return NULL;
+		if (*slot && (*slot)->busy) {
+			t->busy = -1; /* uncached */
+			return t;
 		}
+		free(*slot);
+		*slot = t;
+	}
+	t->busy++;
+	return t;
+}
+
+static void fmt_release(struct cbot_template *t)
+{
+	if (t->busy < 0)
+		free(t);
+	else
+		t->busy--;
+}
+
+void cbot_fmt_cache_clear(void)
+{
+	for (int i = 0; i < FMT_CACHE_SLOTS; i++) {
+		free(fmt_cache[i]);
+		fmt_cache[i] = NULL;
+	}
+}
 
-		if (!handled) {
-			rv = -1;
-			goto out;
+int cbot_format(struct sc_charbuf *buf, const char *fmt,
+                cbot_formatter_t formatter, void *user)
+{
+	struct cbot_template *t = fmt_acquire(fmt, NULL);
+	int i, rv = 0, count = 0;
+
+	if (!t)
+		return -1;
+	for (i = 0; i < t->nops; i++) {
+		if (t->op[i].kind == FMT_LITERAL) {
+			sc_cb_memcpy(buf, t->op[i].text, t->op[i].len);
+			continue;
 		}
+		rv = formatter(buf, (char *)t->op[i].text, user);
+		count++;
+		if (rv < 0)
+			break;
+	}
+	fmt_release(t);
+	return rv < 0 ? rv : count;
+}
 
-		fmt = d + 1;
+int cbot_template_vrender(struct sc_charbuf *cb, const struct cbot_template *t,
+                          va_list args)
+{
+	const struct fmt_op *op;
+	va_list args_copy;
+	int i, j, consumed, count = 0;
+
+	for (i = 0; i < t->nops; i++) {
+		op = &t->op[i];
+		if (op->kind == FMT_LITERAL) {
+			sc_cb_memcpy(cb, op->text, op->len);
+			continue;
+		}
+		if (!op->formatter)
+			return -1;
+		va_copy(args_copy, args);
+		consumed = op->formatter(cb, op->suffix, &args_copy);
+		va_end(args_copy);
+		if (consumed < 0)
+			return consumed;
+		for (j = 0; j < consumed; j++)
+			(void)va_arg(args, void *);
+		count++;
 	}
-	rv = count;
-out:
+	return count;
+}
+
+int cbot_template_render(struct sc_charbuf *cb, const struct cbot_template *t,
+                         ...)
+{
+	va_list args;
+	int rv;
+
+	va_start(args, t);
+	rv = cbot_template_vrender(cb, t, args);
+	va_end(args);
+	return rv;
+}
+
+int cbot_format2(struct sc_charbuf *cb, const char *fmt,
+                 const cbot_formatter_ops_t *ops, ...)
+{
+	struct cbot_template *t = fmt_acquire(fmt, ops);
+	va_list args;
+	int rv;
+
+	if (!t)
+		return -1;
+	va_start(args, ops);
+	rv = cbot_template_vrender(cb, t, args);
 	va_end(args);
-	sc_cb_destroy(&token_buf);
+	fmt_release(t);
 	return rv;
 }
 
@@ -8,7 +8,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
 #include <time.h>
 
 #include "cbot/cbot.h"
@@ -116,32 +115,34 @@ static void cbot_http_run(void *data)
 	struct sc_lwt *cur = sc_lwt_current();
 	struct cbot *bot = data;
 	struct MHD_Daemon *daemon = bot->http;
-	fd_set in_fd, out_fd, err_fd;
+	const union MHD_DaemonInfo *info;
 	struct timespec ts;
-	int maxfd, rv;
+	int rv;
 	unsigned long long req_to;
 
-	while (true) {
-		sc_lwt_fdgen_advance(cur);
-		maxfd = 0;
-		sc_lwt_clear_fds(&in_fd, &out_fd, &err_fd);
-		rv = MHD_get_fdset(daemon, &in_fd, &out_fd, &err_fd, &maxfd);
-		if (rv == MHD_NO) {
-			fprintf(stderr, "MHD_get_fdset says no\n");
-		}
-		sc_lwt_add_select_fds(cur, &in_fd, &out_fd, &err_fd, maxfd,
-		                      NULL);
-		sc_lwt_fdgen_purge(cur);
+	/*
+	 * The daemon keeps its listening socket and connections in its own
+	 * epoll set, which is readable whenever any of them are ready. Wait on
+	 * that once, instead of asking for an fd_set on every wakeup.
+	 */
+	info = MHD_get_daemon_info(daemon, MHD_DAEMON_INFO_EPOLL_FD);
+	if (!info) {
+		CL_CRIT("http: could not get the daemon's epoll fd\n");
+		goto out;
+	}
+	sc_lwt_wait_fd(cur, info->epoll_fd, SC_LWT_W_IN, NULL);
 
+	while (true) {
 		rv = MHD_get_timeout(daemon, &req_to);
 		if (rv == MHD_YES) {
 			ts.tv_sec = req_to / 1000;
-			ts.tv_nsec = req_to * 1000000;
+			ts.tv_nsec = (req_to % 1000) * 1000000;
 			sc_lwt_settimeout(cur, &ts);
 		}
 
 		sc_lwt_set_state(cur, SC_LWT_BLOCKED);
 		sc_lwt_yield();
+		sc_lwt_cleartimeout(cur);
 		if (sc_lwt_shutting_down())
 			break;
 
@@ -150,6 +151,8 @@ static void cbot_http_run(void *data)
 			fprintf(stderr, "MHD_run says no\n");
 		}
 	}
+	sc_lwt_remove_fd(cur, info->epoll_fd);
+out:
 	MHD_stop_daemon(daemon);
 }
 
@@ -0,0 +1,115 @@
+/*
+ * irc_flood.c: pacing and splitting of outgoing IRC lines
+ *
+ * Servers disconnect clients for "excess flood" using a penalty clock, as in
+ * ircu and most of its descendants. Each line we send advances the clock by a
+ * fixed cost plus a cost for its length. The clock never lags behind the
+ * current time, and once it runs too far ahead, we're flooding. We keep our
+ * own copy of the clock, and hold lines back until sending them would keep it
+ * within the window.
+ *
+ * Lines are also limited to 512 bytes, including the prefix the server adds
+ * when relaying our messages to others, so long messages are split into
+ * several lines, without breaking UTF-8 sequences.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cbot_irc.h"
+#include "utf8.h"
+
+void irc_flood_init(struct irc_flood *f)
+{
+	f->enabled = true;
+	f->line_ms = IRC_FLOOD_LINE_MS;
+	f->bytes_per_sec = IRC_FLOOD_BYTES_PER_SEC;
+	f->window_ms = IRC_FLOOD_WINDOW_MS;
+	f->clock_ms = 0;
+}
+
+static uint64_t flood_cost(const struct irc_flood *f, size_t bytes)
+{
+	return f->line_ms + (uint64_t)bytes * 1000 / f->bytes_per_sec;
+}
+
+uint64_t irc_flood_delay(const struct irc_flood *f, uint64_t now_ms,
+                         size_t bytes)
+{
+	uint64_t start, end;
+
+	if (!f->enabled)
+		return 0;
+	start = f->clock_ms > now_ms ? f->clock_ms : now_ms;
+	end = start + flood_cost(f, bytes);
+	if (end <= now_ms + f->window_ms)
+		return 0;
+	return end - (now_ms + f->window_ms);
+}
+
+void irc_flood_charge(struct irc_flood *f, uint64_t now_ms, size_t bytes)
+{
+	if (f->clock_ms < now_ms)
+		f->clock_ms = now_ms;
+	f->clock_ms += flood_cost(f, bytes);
+}
+
+size_t irc_text_max(const char *nick, const char *target, bool action)
+{
+	/*
+	 * ":nick!user@host PRIVMSG target :text\r\n", where the user name is
+	 * at most 10 bytes (including any "~") and the host name 63.
+	 */
+	size_t overhead = 1 + strlen(nick) + 1 + 10 + 1 + 63 + 1 +
+	                  strlen("PRIVMSG ") + strlen(target) + 2 + 2;
+
+	if (action)
+		overhead += strlen("\x01" "ACTION \x01");
+	if (overhead + IRC_TEXT_MIN > IRC_LINE_MAX)
+		return IRC_TEXT_MIN;
+	return IRC_LINE_MAX - overhead;
+}
+
+static inline bool is_break(char c)
+{
+	return c == '\n' || c == '\r';
+}
+
+const char *irc_split(const char **msg, size_t max, size_t *len)
+{
+	const char *line = *msg;
+	size_t n, end = 0;
+
+	/* Line breaks can't be sent, and empty lines are not allowed */
+	while (is_break(*line))
+		line++;
+	if (!*line)
+		return NULL;
+
+	while (line[end] && !is_break(line[end]) && end <= max)
+		end++;
+	if (end <= max) {
+		*len = end;
+		*msg = line + end;
+		return line;
+	}
+
+	/* Too long: break at the last space in the second half if we can */
+	for (n = max; n > 0 && n >= max / 2; n--) {
+		if (line[n] == ' ') {
+			*len = n;
+			*msg = line + n + 1;
+			return line;
+		}
+	}
+
+	/* Otherwise, at the start of a character */
+	n = max;
+	while (n > 0 && (line[n] & UTF8_CMASK) == UTF8_CVAL)
+		n--;
+	if (n == 0)
+		n = max;
+	*len = n;
+	*msg = line + n;
+	return line;
+}
@@ -0,0 +1,107 @@
+/*
+ * irc_net.c: naming channels and DMs across several IRC networks, and counting
+ * each network's events
+ *
+ * With more than one network, channels and DMs are named "network:target" to
+ * keep them apart. Neither channel names nor nicks may contain a colon, so
+ * this is unambiguous. With one network, names are left alone.
+ */
+#include <stdbool.h>
+#include <string.h>
+
+#include <sc-collections.h>
+
+#include "cbot_irc.h"
+
+const char *irc_net_name(struct cbot_irc_network *net, const char *target)
+{
+	if (net->irc->nnetworks < 2)
+		return target;
+	sc_cb_clear(&net->scratch);
+	sc_cb_printf(&net->scratch, "%s:%s", net->name, target);
+	return net->scratch.buf;
+}
+
+struct cbot_irc_network *irc_net_first(const struct cbot_irc_backend *irc)
+{
+	return sc_list_entry(irc->networks.next, struct cbot_irc_network,
+	                     list);
+}
+
+struct cbot_irc_network *irc_net_lookup(const struct cbot_irc_backend *irc,
+                                        const char *dest, const char **target)
+{
+	struct cbot_irc_network *net;
+	const char *colon;
+
+	*target = dest;
+	if (irc->nnetworks < 2 || !(colon = strchr(dest, ':')))
+		return NULL;
+	sc_list_for_each_entry(net, &irc->networks, list,
+	                       struct cbot_irc_network)
+	{
+		if (strncmp(net->name, dest, colon - dest) == 0 &&
+		    net->name[colon - dest] == '\0') {
+			*target = colon + 1;
+			return net;
+		}
+	}
+	return NULL;
+}
+
+struct cbot_irc_network *irc_net_route(const struct cbot_irc_backend *irc,
+                                       const char *dest, const char **target)
+{
+	struct cbot_irc_network *net = irc_net_lookup(irc, dest, target);
+
+	if (net)
+		return net;
+	if (irc->current)
+		return irc->current;
+	return irc_net_first(irc);
+}
+
+bool irc_net_owns(struct cbot_irc_network *net, const char *name,
+                  const char **target)
+{
+	struct cbot_irc_network *owner = irc_net_lookup(net->irc, name, target);
+
+	return owner == net || (!owner && net == irc_net_first(net->irc));
+}
+
+static const char *event_names[] = {
+	[IRC_EV_CONNECT] = "connect",
+	[IRC_EV_NICK] = "nick",
+	[IRC_EV_QUIT] = "quit",
+	[IRC_EV_JOIN] = "join",
+	[IRC_EV_PART] = "part",
+	[IRC_EV_MODE] = "mode",
+	[IRC_EV_UMODE] = "umode",
+	[IRC_EV_TOPIC] = "topic",
+	[IRC_EV_KICK] = "kick",
+	[IRC_EV_CHANNEL] = "channel",
+	[IRC_EV_PRIVMSG] = "privmsg",
+	[IRC_EV_NOTICE] = "notice",
+	[IRC_EV_INVITE] = "invite",
+	[IRC_EV_CTCP_REP] = "ctcp_rep",
+	[IRC_EV_ACTION] = "action",
+	[IRC_EV_UNKNOWN] = "unknown",
+	[IRC_EV_NAMREPLY] = "namreply",
+	[IRC_EV_NUMERIC] = "numeric",
+};
+
+enum irc_event_kind irc_numeric_kind(unsigned int event)
+{
+	/* NAMES replies come in bursts, so they get their own count */
+	if (event == 353)
+		return IRC_EV_NAMREPLY;
+	return IRC_EV_NUMERIC;
+}
+
+void irc_net_events(const struct cbot_irc_network *net, struct sc_charbuf *cb)
+{
+	int i;
+
+	for (i = 0; i < _IRC_EV_COUNT_; i++)
+		sc_cb_printf(cb, " %s=%lu", event_names[i], net->events[i]);
+}
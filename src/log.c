@@ -1,19 +1,280 @@
+/*
+ * log.c: CBot's logging
+ *
+ * Formatting happens on the calling thread, but the result is pushed onto a
+ * lock-free ring buffer, which a background writer thread drains to the log
+ * file. This keeps file I/O out of the LWT event loop. Each slot holds a short
+ * message inline; longer messages spill to the heap. If the ring is full, the
+ * message is dropped (and counted) rather than blocking the bot.
+ *
+ * Until the writer is started (and after it is stopped), messages are written
+ * synchronously, which is what unit tests and early startup see.
+ */
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "cbot/cbot.h"
 #include "cbot_private.h"
 
-static int current_log_level;
+#ifdef CLOCK_REALTIME_COARSE
+#define LOG_CLOCK CLOCK_REALTIME_COARSE
+#else
+#define LOG_CLOCK CLOCK_REALTIME
+#endif
+
+/* Must be a power of two */
+#define LOG_RING_SLOTS 1024
+#define LOG_SLOT_SIZE  240
+/* How often the writer wakes up to flush even when idle (ms) */
+#define LOG_FLUSH_MS   1000
+
+int cbot_current_log_level;
 static FILE *current_log_file;
 
+struct log_slot {
+	unsigned long seq;
+	struct timespec ts;
+	char *spill;
+	size_t len;
+	char msg[LOG_SLOT_SIZE];
+};
+
+static struct log_slot ring[LOG_RING_SLOTS];
+static unsigned long ring_tail; /* next slot to claim (producers) */
+static unsigned long ring_head; /* next slot to drain (writer only) */
+static unsigned long ring_dropped;
+
+static pthread_t writer;
+static bool writer_running;
+static int writer_stop;
+static int writer_sleeping;
+static int wake_pipe[2] = { -1, -1 };
+
+/*
+ * An output buffer, with a cached timestamp prefix. The writer thread and
+ * log_sync() each have their own, since a synchronous message may be logged
+ * while the writer is still flushing (e.g. during cbot_log_stop_writer()).
+ */
+struct log_out {
+	char *buf;
+	size_t size;
+	size_t len;
+	time_t stamp_sec;
+	char stamp[32];
+};
+
+static char writer_buf[64 * 1024];
+static struct log_out writer_out = {
+	.buf = writer_buf,
+	.size = sizeof(writer_buf),
+	.stamp_sec = -1,
+};
+static char sync_buf[1024];
+static struct log_out sync_out = {
+	.buf = sync_buf,
+	.size = sizeof(sync_buf),
+	.stamp_sec = -1,
+};
+
+static void out_flush(struct log_out *out)
+{
+	if (out->len && current_log_file) {
+		fwrite(out->buf, 1, out->len, current_log_file);
+		fflush(current_log_file);
+	}
+	out->len = 0;
+}
+
+static void out_append(struct log_out *out, const char *data, size_t len)
+{
+	if (out->len + len > out->size)
+		out_flush(out);
+	if (len > out->size) {
+		if (current_log_file)
+			fwrite(data, 1, len, current_log_file);
+		return;
+	}
+	memcpy(out->buf + out->len, data, len);
+	out->len += len;
+}
+
+/*
+ * Write the timestamp for a message. The date and time are only re-formatted
+ * when the second changes, which is rare relative to the message rate.
+ */
+static void out_stamp(struct log_out *out, const struct timespec *ts)
+{
+	struct tm tm;
+	char millis[8];
+
+	if (ts->tv_sec != out->stamp_sec) {
+		localtime_r(&ts->tv_sec, &tm);
+		strftime(out->stamp, sizeof(out->stamp), "%Y-%m-%d %H:%M:%S",
+		         &tm);
+		out->stamp_sec = ts->tv_sec;
+	}
+	out_append(out, out->stamp, strlen(out->stamp));
+	snprintf(millis, sizeof(millis), ".%03ld ", ts->tv_nsec / 1000000);
+	out_append(out, millis, strlen(millis));
+}
+
+static void log_sync(const char *format, va_list args)
+{
+	struct timespec ts;
+	char *msg = NULL;
+	va_list copy;
+	int len;
+
+	clock_gettime(LOG_CLOCK, &ts);
+	va_copy(copy, args);
+	len = vsnprintf(NULL, 0, format, copy);
+	va_end(copy);
+	if (len < 0)
+		return;
+	msg = malloc(len + 1);
+	vsnprintf(msg, len + 1, format, args);
+	out_stamp(&sync_out, &ts);
+	out_append(&sync_out, msg, len);
+	out_flush(&sync_out);
+	free(msg);
+}
+
+static void wake_writer(void)
+{
+	char c = 0;
+	if (__atomic_exchange_n(&writer_sleeping, 0, __ATOMIC_ACQ_REL))
+		(void)!write(wake_pipe[1], &c, 1);
+}
+
+static void log_async(const char *format, va_list args)
+{
+	struct log_slot *slot;
+	unsigned long pos, seq;
+	va_list copy;
+	int len;
+
+	/*
+	 * Claim a slot. This is a bounded multi-producer queue: each slot's
+	 * sequence number says whether it is free for the producer at this
+	 * position, or still waiting to be drained.
+	 */
+	pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &ring[pos % LOG_RING_SLOTS];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&ring_tail, &pos,
+			                                pos + 1, true,
+			                                __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED))
+				break;
+		} else if ((long)(seq - pos) < 0) {
+			__atomic_fetch_add(&ring_dropped, 1, __ATOMIC_RELAXED);
+			wake_writer();
+			return;
+		} else {
+			pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	clock_gettime(LOG_CLOCK, &slot->ts);
+	va_copy(copy, args);
+	len = vsnprintf(slot->msg, sizeof(slot->msg), format, args);
+	slot->spill = NULL;
+	if (len < 0) {
+		len = 0;
+	} else if (len >= (int)sizeof(slot->msg)) {
+		slot->spill = malloc(len + 1);
+		vsnprintf(slot->spill, len + 1, format, copy);
+	}
+	va_end(copy);
+	slot->len = len;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	wake_writer();
+}
+
+/* Writer thread: drain everything available. Returns true if we did work. */
+static bool drain(void)
+{
+	struct log_slot *slot;
+	struct timespec ts;
+	unsigned long dropped;
+	char note[64];
+	bool any = false;
+
+	for (;;) {
+		slot = &ring[ring_head % LOG_RING_SLOTS];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) !=
+		    ring_head + 1)
+			break;
+		out_stamp(&writer_out, &slot->ts);
+		if (slot->spill) {
+			out_append(&writer_out, slot->spill, slot->len);
+			free(slot->spill);
+			slot->spill = NULL;
+		} else {
+			out_append(&writer_out, slot->msg, slot->len);
+		}
+		__atomic_store_n(&slot->seq, ring_head + LOG_RING_SLOTS,
+		                 __ATOMIC_RELEASE);
+		ring_head++;
+		any = true;
+	}
+	dropped = __atomic_exchange_n(&ring_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped) {
+		clock_gettime(LOG_CLOCK, &ts);
+		out_stamp(&writer_out, &ts);
+		snprintf(note, sizeof(note), "log: dropped %lu messages\n",
+		         dropped);
+		out_append(&writer_out, note, strlen(note));
+	}
+	if (any || dropped)
+		out_flush(&writer_out);
+	return any;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct pollfd pfd = { .fd = wake_pipe[0], .events = POLLIN };
+	char buf[64];
+
+	while (!__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE)) {
+		if (drain())
+			continue;
+		/*
+		 * Announce that we're going to sleep, then check once more, so
+		 * that a producer which just missed the flag is not lost.
+		 */
+		__atomic_store_n(&writer_sleeping, 1, __ATOMIC_SEQ_CST);
+		if (drain())
+			continue;
+		if (poll(&pfd, 1, LOG_FLUSH_MS) > 0)
+			while (read(wake_pipe[0], buf, sizeof(buf)) ==
+			       sizeof(buf))
+				;
+	}
+	drain();
+	return NULL;
+}
+
 void cbot_vlog(int level, const char *format, va_list args)
 {
 	/* clang-tidy decided args is uninitialized? */
-	if (current_log_file && level >= current_log_level)
-		vfprintf(current_log_file, format, args); // NOLINT
+	if (!current_log_file || level < cbot_current_log_level)
+		return;
+	if (__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE))
+		log_async(format, args); // NOLINT
+	else
+		log_sync(format, args); // NOLINT
 }
 
 void cbot_log(int level, const char *format, ...)
@@ -26,12 +287,12 @@ void cbot_log(int level, const char *format, ...)
 
 void cbot_set_log_level(int level)
 {
-	current_log_level = level;
+	cbot_current_log_level = level;
 }
 
 int cbot_get_log_level(void)
 {
-	return current_log_level;
+	return cbot_current_log_level;
 }
 
 void cbot_set_log_file(FILE *f)
@@ -39,6 +300,46 @@ void cbot_set_log_file(FILE *f)
 	current_log_file = f;
 }
 
+int cbot_log_start_writer(void)
+{
+	int i;
+
+	if (writer_running)
+		return 0;
+	for (i = 0; i < LOG_RING_SLOTS; i++)
+		ring[i].seq = i;
+	ring_head = ring_tail = 0;
+	if (pipe(wake_pipe) < 0) {
+		perror("cbot: log pipe");
+		return -1;
+	}
+	fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+	writer_stop = 0;
+	if (pthread_create(&writer, NULL, writer_thread, NULL) != 0) {
+		fprintf(stderr, "cbot: failed to start log writer thread\n");
+		close(wake_pipe[0]);
+		close(wake_pipe[1]);
+		return -1;
+	}
+	__atomic_store_n(&writer_running, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void cbot_log_stop_writer(void)
+{
+	char c = 0;
+
+	if (!writer_running)
+		return;
+	__atomic_store_n(&writer_running, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&writer_stop, 1, __ATOMIC_RELEASE);
+	(void)!write(wake_pipe[1], &c, 1);
+	pthread_join(writer, NULL);
+	close(wake_pipe[0]);
+	close(wake_pipe[1]);
+	wake_pipe[0] = wake_pipe[1] = -1;
+}
+
 struct levels {
 	char *name;
 	int level;
@@ -50,7 +351,7 @@ struct levels levels[] = {
 	{ "DEBUG", DEBUG },
 	{ "INFO", INFO },
 	{ "WARN", WARN },
-	{ "CRiT", CRIT },
+	{ "CRIT", CRIT },
 };
 /* clang-format on */
 
@@ -61,3 +362,11 @@ int cbot_lookup_level(const char *str)
 			return levels[i].level;
 	return atoi(str);
 }
+
+const char *cbot_level_name(int level)
+{
+	for (int i = 0; i < nelem(levels); i++)
+		if (levels[i].level == level)
+			return levels[i].name;
+	return "";
+}
@@ -63,30 +63,23 @@ int cbot_signal_socket(struct cbot_signal_backend *sig, const char *path)
 		perror("create socket");
 		return -1;
 	}
-	sig->ws = fdopen(sig->fd, "w");
-	if (!sig->ws) {
-		perror("fdopen socket");
-		close(sig->fd);
-		return -1;
-	}
-	setvbuf(sig->ws, NULL, _IONBF, 0);
-
 	addr.sun_family = AF_UNIX;
 	strncpy(addr.sun_path, path, sizeof(addr.sun_path));
 	int rv = connect(sig->fd, (struct sockaddr *)&addr, sizeof(addr));
 	if (rv) {
 		perror("connect");
-		fclose(sig->ws);
 		close(sig->fd);
 		return -1;
 	}
 	return 0;
 }
 
-static int cbot_signal_configure(struct cbot *bot, config_setting_t *group)
+static int cbot_signal_configure(struct cbot_backend *be,
+                                 config_setting_t *group)
 {
+	struct cbot *bot = be->bot;
 	struct cbot_signal_backend *backend;
-	int rv;
+	int rv, fd;
 	const char *phone;
 	const char *uuid;
 	const char *auth = NULL;
@@ -128,11 +121,14 @@ static int cbot_signal_configure(struct cbot *bot, config_setting_t *group)
 	sc_list_init(&backend->messages);
 	sc_list_init(&backend->msgq);
 	sc_arr_init(&backend->pending, struct signal_reaction_cb, 16);
+	sc_cb_init(&backend->out, 1024);
+	sc_arr_init(&backend->mentions, struct signal_mention, 4);
 	if (auth)
 		backend->auth_uuid = strdup(auth);
 
 	backend->bot = bot;
-	bot->backend = backend;
+	backend->be = be;
+	be->priv = backend;
 
 	if (strcmp(bridge, "signald") == 0) {
 		backend->bridge = &signald_bridge;
@@ -153,25 +149,30 @@ static int cbot_signal_configure(struct cbot *bot, config_setting_t *group)
 	cbot_add_alias(bot, &alias[1]);
 	free(alias);
 
-	rv = backend->bridge->configure(bot, group);
-	if (rv == 0)
+	rv = backend->bridge->configure(backend, group);
+	if (rv == 0) {
+		fd = backend->write_fd ? backend->write_fd : backend->fd;
+		signal_outq_init(&backend->outq, fd);
 		return 0;
+	}
 out:
 	free(backend->sender);
 	free(backend->uuid);
 	free(backend->auth_uuid);
 	/* TODO: free all callbacks */
 	sc_arr_destroy(&backend->pending);
+	sc_cb_destroy(&backend->out);
+	sc_arr_destroy(&backend->mentions);
 	free(backend);
+	be->priv = NULL;
 	return -1;
 }
 
 bool signal_is_group_listening(struct cbot_signal_backend *sig, const char *grp)
 {
-	struct cbot *bot = sig->bot;
 	struct cbot_channel_conf *chan;
 
-	sc_list_for_each_entry(chan, &bot->init_channels, list,
+	sc_list_for_each_entry(chan, &sig->be->init_channels, list,
 	                       struct cbot_channel_conf)
 	{
 		if (strcmp(chan->name, grp) == 0)
@@ -225,10 +226,10 @@ bool signal_get_reaction_cb(struct cbot_signal_backend *sig, uint64_t ts,
 	}
 }
 
-static void unregister_reaction(const struct cbot *bot, uint64_t ts)
+static void unregister_reaction(const struct cbot_backend *be, uint64_t ts)
 {
 	struct signal_reaction_cb cb = { ts, { 0 }, 0 };
-	struct cbot_signal_backend *sig = bot->backend;
+	struct cbot_signal_backend *sig = be->priv;
 	struct sc_array *a = &sig->pending;
 	struct signal_reaction_cb *arr = sc_arr(a, struct signal_reaction_cb);
 	struct signal_reaction_cb *res =
@@ -239,38 +240,32 @@ static void unregister_reaction(const struct cbot *bot, uint64_t ts)
 	}
 }
 
-static uint64_t cbot_signal_send(const struct cbot *bot, const char *to,
+int signal_send_request(struct cbot_signal_backend *sig, const char *to,
+                        const char *msg)
+{
+	const char *dest;
+	int kind, len;
+
+	dest = mention_find(to, &kind, &len, NULL);
+	if (!dest) {
+		CL_CRIT("error: invalid signal destination \"%s\"\n", to);
+		return -1;
+	}
+	sc_cb_clear(&sig->out);
+	sig->bridge->write_send(sig, kind, dest, len, msg);
+	return signal_write(sig);
+}
+
+static uint64_t cbot_signal_send(const struct cbot_backend *be, const char *to,
                                  const struct cbot_reaction_ops *ops, void *arg,
                                  const char *msg)
 {
-	struct cbot_signal_backend *sig = bot->backend;
-	char *dest_payload;
-	int kind;
+	struct cbot_signal_backend *sig = be->priv;
 	uint64_t timestamp;
-	struct signal_mention *mentions;
-	size_t num_mentions;
-
-	dest_payload = mention_parse(to, &kind, NULL);
-	char *quoted = json_quote_and_mention(msg, &mentions, &num_mentions);
-
-	switch (kind) {
-	case MENTION_USER:
-		timestamp = sig->bridge->send_single(sig, dest_payload, quoted,
-		                                     mentions, num_mentions);
-		break;
-	case MENTION_GROUP:
-		timestamp = sig->bridge->send_group(sig, dest_payload, quoted,
-		                                    mentions, num_mentions);
-		break;
-	default:
-		CL_CRIT("error: invalid signal destination \"%s\"\n", to);
-		timestamp = 0;
-	}
-	free(dest_payload);
-	free(quoted);
-	for (size_t i = 0; i < num_mentions; i++)
-		free(mentions[i].uuid);
-	free(mentions);
+
+	if (signal_send_request(sig, to, msg) < 0)
+		return 0;
+	timestamp = sig->bridge->send_result(sig);
 	if (ops && timestamp) {
 		add_reaction_cb(sig, timestamp, ops, arg);
 		return timestamp;
@@ -279,17 +274,17 @@ static uint64_t cbot_signal_send(const struct cbot *bot, const char *to,
 	}
 }
 
-static void cbot_signal_nick(const struct cbot *bot, const char *newnick)
+static void cbot_signal_nick(const struct cbot_backend *be, const char *newnick)
 {
-	struct cbot_signal_backend *sig = bot->backend;
-	sig->bridge->nick(bot, newnick);
-	cbot_set_nick((struct cbot *)bot, newnick);
+	struct cbot_signal_backend *sig = be->priv;
+	sig->bridge->nick(sig, newnick);
+	cbot_set_nick(be, newnick);
 }
 
-static int cbot_signal_is_authorized(const struct cbot *bot, const char *sender,
-                                     const char *message)
+static int cbot_signal_is_authorized(const struct cbot_backend *be,
+                                     const char *sender, const char *message)
 {
-	struct cbot_signal_backend *sig = bot->backend;
+	struct cbot_signal_backend *sig = be->priv;
 	int kind, rv = 0;
 	char *uuid;
 
@@ -308,10 +303,44 @@ static int cbot_signal_is_authorized(const struct cbot *bot, const char *sender,
 	return rv;
 }
 
-static void cbot_signal_run(struct cbot *bot)
+static void cbot_signal_run(struct cbot_backend *be)
+{
+	struct cbot_signal_backend *sig = be->priv;
+	signal_outq_start(&sig->outq, cbot_get_lwt_ctx(be->bot));
+	sig->bridge->run(sig);
+}
+
+static void cbot_signal_shutdown(struct cbot_backend *be)
+{
+	struct cbot_signal_backend *sig = be->priv;
+	struct jmsg *jm, *next;
+
+	if (!sig)
+		return;
+	sc_list_for_each_safe(jm, next, &sig->messages, list, struct jmsg)
+	{
+		sc_list_remove(&jm->list);
+		jmsg_free(jm);
+	}
+	signal_outq_destroy(&sig->outq);
+	if (sig->write_fd)
+		close(sig->write_fd);
+	close(sig->fd);
+	free(sig->sender);
+	free(sig->uuid);
+	free(sig->auth_uuid);
+	sc_arr_destroy(&sig->pending);
+	sc_cb_destroy(&sig->out);
+	sc_arr_destroy(&sig->mentions);
+	free(sig);
+	be->priv = NULL;
+}
+
+/* Channels are configured by group ID, but events name them as mentions */
+static char *cbot_signal_channel_name(const struct cbot_backend *be,
+                                      const char *name)
 {
-	struct cbot_signal_backend *sig = bot->backend;
-	sig->bridge->run(bot);
+	return mention_format_p(name, "group");
 }
 
 struct cbot_backend_ops signald_ops = {
@@ -322,4 +351,6 @@ struct cbot_backend_ops signald_ops = {
 	.nick = cbot_signal_nick,
 	.is_authorized = cbot_signal_is_authorized,
 	.unregister_reaction = unregister_reaction,
+	.channel_name = cbot_signal_channel_name,
+	.shutdown = cbot_signal_shutdown,
 };
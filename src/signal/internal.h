@@ -33,26 +33,30 @@ struct signal_mention {
 	uint64_t start;
 	/** UTF-16 length of the text to replace */
 	uint64_t length;
-	/** UUID of the user mentioned */
-	char *uuid;
+	/** UUID of the user mentioned (not NUL terminated) */
+	const char *uuid;
+	/** Length of the UUID */
+	int uuid_len;
 };
 
 /** Operations that are specific to a Signal API bridge. */
 struct signal_bridge_ops {
-	/** Send an already-quoted direct message */
-	uint64_t (*send_single)(struct cbot_signal_backend *, const char *to,
-	                        const char *quoted_msg,
-	                        const struct signal_mention *, size_t);
-	/** Send an already-quoted message to a group */
-	uint64_t (*send_group)(struct cbot_signal_backend *, const char *to,
-	                       const char *quoted_msg,
-	                       const struct signal_mention *, size_t);
+	/**
+	 * Serialize a request to send @a msg into the output buffer. @a kind is
+	 * MENTION_USER or MENTION_GROUP, and @a to (which is not NUL
+	 * terminated) is the user or group ID. The message is quoted as it is
+	 * copied in, and its @mentions are collected into sig->mentions.
+	 */
+	void (*write_send)(struct cbot_signal_backend *, int kind,
+	                   const char *to, int tolen, const char *msg);
+	/** Wait for the result of the last send, returning its timestamp */
+	uint64_t (*send_result)(struct cbot_signal_backend *);
 	/** Update profile name */
-	void (*nick)(const struct cbot *bot, const char *newnick);
+	void (*nick)(struct cbot_signal_backend *, const char *newnick);
 	/** Run the bot backend thread */
-	void (*run)(struct cbot *bot);
+	void (*run)(struct cbot_signal_backend *);
 	/** Bridge-specific configuration routine */
-	int (*configure)(struct cbot *bot, config_setting_t *group);
+	int (*configure)(struct cbot_signal_backend *, config_setting_t *group);
 };
 
 /*
@@ -63,6 +67,34 @@ struct signal_bridge_ops {
 extern struct signal_bridge_ops signald_bridge;
 extern struct signal_bridge_ops signalcli_bridge;
 
+/*
+ * Senders block once more than SIGNAL_OUTQ_HIGH bytes are waiting to be
+ * written, until the queue drains to SIGNAL_OUTQ_LOW.
+ */
+#define SIGNAL_OUTQ_HIGH (256 * 1024)
+#define SIGNAL_OUTQ_LOW  (64 * 1024)
+
+/** Queue of serialized requests waiting to be written to the bridge */
+struct signal_outq {
+	/** Descriptor to write to (non-blocking) */
+	int fd;
+	/** struct sc_charbuf: requests, starting at index "first" */
+	struct sc_array reqs;
+	/** struct sc_charbuf: written buffers, ready for reuse */
+	struct sc_array spare;
+	size_t first;
+	/** Bytes of the first request which are already written */
+	size_t offset;
+	/** Total bytes waiting to be written */
+	size_t bytes;
+	/** Thread which writes when the descriptor becomes writable */
+	struct sc_lwt *writer;
+	/** Threads blocked until the queue drains */
+	struct sc_list_head waiters;
+	/** Set on a write error: no more requests will be accepted */
+	bool failed;
+};
+
 struct cbot_signal_backend {
 	/* Signal bridge operations */
 	struct signal_bridge_ops *bridge;
@@ -82,10 +114,13 @@ struct cbot_signal_backend {
 	int ignore_dm;
 
 	/*
-	 * A stdio write stream associated with the above socket. It is in
-	 * unbuffered mode, used to write formatted JSON commands.
+	 * Outgoing requests are serialized into "out", and then handed to the
+	 * output queue by signal_write(). Together with the mentions array,
+	 * buffers are reused, so that sending a message needn't allocate.
 	 */
-	FILE *ws;
+	struct sc_charbuf out;
+	struct sc_array mentions; /* struct signal_mention */
+	struct signal_outq outq;
 
 	/* Phone number & uuid of the bot sender */
 	char *sender;
@@ -94,8 +129,9 @@ struct cbot_signal_backend {
 	/* uuid of authorized user */
 	char *auth_uuid;
 
-	/* Reference to the bot */
+	/* Reference to the bot, and the backend (whose thread reads) */
 	struct cbot *bot;
+	struct cbot_backend *be;
 
 	/* Array of message timestamps and information on callbacks */
 	struct sc_array pending;
@@ -116,6 +152,15 @@ struct jmsg {
 	struct sc_list_head list;
 };
 
+/**
+ * Parse each complete line in @a cb into a jmsg, adding them to @a list. The
+ * trailing incomplete line (if any) is moved to the start of the buffer.
+ * @param cb Buffer of data read from the bridge
+ * @param list List to add messages to
+ * @return The number of messages added, or -1 on error
+ */
+int jmsg_split(struct sc_charbuf *cb, struct sc_list_head *list);
+
 /**
  * Read the next jmsg from the queue of incoming messages. If there are no
  * messages in the queue, this will block.
@@ -170,6 +215,18 @@ char *mention_format_p(const char *string, const char *prefix);
  */
 char *mention_format(char *string, const char *prefix);
 
+/**
+ * Find the value of a mention placeholder text, without copying it.
+ * @param string Input text starting at the mention
+ * @param[out] kind The kind of message: MENTION_ERR for error.
+ * @param[out] len Will be filled with the length of the value
+ * @param[out] offset If provided, will be filled with the number of characters
+ * of this mention.
+ * @return Pointer to the value within @a string, or NULL on error
+ */
+const char *mention_find(const char *string, int *kind, int *len,
+                         int *offset);
+
 /**
  * Parse a mention placeholder text.
  * @param string Input text starting at the mention
@@ -201,26 +258,33 @@ char *mention_parse(const char *string, int *kind, int *offset);
 char *mention_from_json(const char *str, struct json_easy *je, uint32_t list);
 
 /**
- * Return a newly allocated string with necessary escaping for JSON. Return an
- * array which contains all mention JSON elements.
+ * Append a message to @a cb with necessary escaping for JSON, and fill @a ms
+ * with all of its mentions.
  *
  * This is called with a message text just before sending it.
  *
  * Beyond obvious JSON escaping, this function detects any mention placeholder
  * mention text:
  *   @(uuid:UUUID)
- * That text is removed and a JSON array element is created in "mentions" to
- * represent it.
+ * That text is replaced by a single character, and a mention is added to @a ms
+ * to represent it. The mention refers to the UUID within @a instr, so it is
+ * only valid as long as @a instr is.
  *
  * Duplicated "@@" are resolved back to "@" - this is to reverse the escaping
  * done by mention_from_json() above.
  *
+ * @param cb Buffer to append the quoted message to
  * @param instr Input string
- * @param[out] ms Will be set to an array of mention objects parsed
- * @param[out] n Will be set to the length of @a ms
+ * @param ms Array of struct signal_mention, which is cleared and filled
+ */
+void json_quote_mention_cb(struct sc_charbuf *cb, const char *instr,
+                           struct sc_array *ms);
+
+/**
+ * Append a string to @a cb with necessary JSON escaping.
+ * No handling of mentions is done.
  */
-char *json_quote_and_mention(const char *instr, struct signal_mention **ms,
-                             size_t *n);
+void json_quote_cb(struct sc_charbuf *cb, const char *instr);
 
 /**
  * Return a newly allocated string with necessary JSON escaping.
@@ -229,8 +293,46 @@ char *json_quote_and_mention(const char *instr, struct signal_mention **ms,
  */
 char *json_quote_nomention(const char *instr);
 
+/***** outq.c *****/
+
+/**
+ * Initialize an output queue
+ * @param q Queue to initialize
+ * @param fd Non-blocking descriptor which requests are written to
+ */
+void signal_outq_init(struct signal_outq *q, int fd);
+
+/** Free the buffers of an output queue */
+void signal_outq_destroy(struct signal_outq *q);
+
+/**
+ * Start the writer thread for an output queue. Until this is called, requests
+ * which can't be written right away stay queued.
+ */
+void signal_outq_start(struct signal_outq *q, struct sc_lwt_ctx *ctx);
+
+/**
+ * Queue the request in sig->out to be written to the bridge, and leave an
+ * empty buffer in its place. It is written right away if possible. If the
+ * queue is over its high watermark, this blocks until it drains.
+ * @param sig Signal backend
+ * @returns 0 on success, -1 if writing to the bridge has failed
+ */
+int signal_write(struct cbot_signal_backend *sig);
+
 /***** backend.c *****/
 
+/**
+ * Serialize and write a request to send a message, without waiting for the
+ * result.
+ * @param sig Signal backend
+ * @param to Destination, as a mention placeholder
+ * @param msg Message text
+ * @returns 0 on success, -1 if the destination is invalid or the write fails
+ */
+int signal_send_request(struct cbot_signal_backend *sig, const char *to,
+                        const char *msg);
+
 /**
  * Fetch the reaction callback for a given message timestamp
  * @param sig Signal backend
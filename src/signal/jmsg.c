@@ -29,6 +29,8 @@ static int async_read(int fd, char *data, size_t nbytes)
 			/* would block, we should yield */
 			sc_lwt_set_state(cur, SC_LWT_BLOCKED);
 			sc_lwt_yield();
+			if (sc_lwt_shutting_down())
+				return -1;
 		} else if (rv < 0) {
 			perror("cbot_signal pipe read");
 			return -1;
@@ -52,6 +54,74 @@ static int jmsg_parse(struct jmsg *jm)
 	return 0;
 }
 
+int jmsg_split(struct sc_charbuf *cb, struct sc_list_head *list)
+{
+	int nextmsgidx = 0, start;
+	char *found;
+	int count = 0;
+
+	while ((found = memchr(cb->buf + nextmsgidx, '\n',
+	                       cb->length - nextmsgidx))) {
+		char *buf = NULL;
+		struct jmsg *jm = NULL;
+		int len;
+
+		/*
+		 * Find start of next message and replace newline with nul
+		 * terminator
+		 */
+		start = nextmsgidx;
+		nextmsgidx = found - cb->buf + 1;
+		len = nextmsgidx - start;
+		*found = '\0';
+
+		/*
+		 * Copy data into new jmsg and add to output.
+		 */
+		buf = malloc(len);
+		if (!buf) {
+			CL_CRIT("Allocation error\n");
+			return -1;
+		}
+		memcpy(buf, cb->buf + start, len);
+		jm = calloc(1, sizeof(*jm));
+		if (!jm) {
+			CL_CRIT("Allocation error\n");
+			free(buf);
+			return -1;
+		}
+		json_easy_init(&jm->easy, buf);
+		/* Weirdly, clang-tidy believes that here, buf could be
+		 * leaked. I guess it doesn't pick up on the fact that
+		 * now, jm->easy takes ownership of buf. Suppress the
+		 * false positive.*/
+		sc_list_init(&jm->list); // NOLINT
+		CL_VERB("JM: \"%s\"\n", jm->easy.input);
+		if (jmsg_parse(jm) < 0) {
+			jmsg_free(jm);
+			return -1;
+		}
+		sc_list_insert_end(list, &jm->list);
+		count += 1;
+
+		/*
+		 * Skip past any possible additional newlines.
+		 */
+		while (nextmsgidx < cb->length && cb->buf[nextmsgidx] == '\n')
+			nextmsgidx++;
+	}
+
+	/*
+	 * Shift the incomplete line (if any) down to the start, once for all
+	 * the messages, rather than once per message.
+	 */
+	if (nextmsgidx) {
+		memmove(cb->buf, cb->buf + nextmsgidx, cb->length - nextmsgidx);
+		cb->length -= nextmsgidx;
+	}
+	return count;
+}
+
 /*
  * Read at least one jmsg, adding it to the list. All jmsg are parsed.
  *
@@ -60,9 +130,8 @@ static int jmsg_parse(struct jmsg *jm)
  */
 static int jmsg_read(int fd, struct sc_list_head *list)
 {
-	int rv, nextmsgidx;
+	int rv;
 	struct sc_charbuf cb;
-	char *found;
 	int count = 0;
 
 	sc_cb_init(&cb, 4096);
@@ -77,70 +146,18 @@ static int jmsg_read(int fd, struct sc_list_head *list)
 			cb.length += rv;
 		}
 
-		found = memchr(cb.buf, '\n', cb.length);
-		while (found) {
-			char *buf = NULL;
-			struct jmsg *jm = NULL;
-
-			/*
-			 * Find start of next message and replace newline
-			 * with nul terminator
-			 */
-			nextmsgidx = found - cb.buf + 1;
-			*found = '\0';
-
-			/*
-			 * Copy data into new jmsg and add to output.
-			 */
-			buf = malloc(nextmsgidx);
-			if (!buf) {
-				CL_CRIT("Allocation error\n");
-				goto err;
-			}
-			memcpy(buf, cb.buf, nextmsgidx);
-			jm = calloc(1, sizeof(*jm));
-			if (!jm) {
-				CL_CRIT("Allocation error\n");
-				free(buf);
-				goto err;
-			}
-			json_easy_init(&jm->easy, buf);
-			/* Weirdly, clang-tidy believes that here, buf could be
-			 * leaked. I guess it doesn't pick up on the fact that
-			 * now, jm->easy takes ownership of buf. Suppress the
-			 * false positive.*/
-			sc_list_init(&jm->list); // NOLINT
-			CL_VERB("JM: \"%s\"\n", jm->easy.input);
-			if (jmsg_parse(jm) < 0) {
-				jmsg_free(jm);
-				goto err;
-			}
-			sc_list_insert_end(list, &jm->list);
-			count += 1;
-
-			/*
-			 * Skip past any possible additional newlines.
-			 */
-			while (nextmsgidx < cb.length &&
-			       cb.buf[nextmsgidx] == '\n')
-				nextmsgidx++;
-
-			/*
-			 * If there is no more data in the buffer, we're good.
-			 * Return.
-			 */
-			if (nextmsgidx == cb.length) {
-				sc_cb_destroy(&cb);
-				return count;
-			}
-
-			/*
-			 * Otherwise, shift data down to
-			 */
-			memmove(cb.buf, &cb.buf[nextmsgidx],
-			        cb.length - nextmsgidx);
-			cb.length -= nextmsgidx;
-			found = memchr(cb.buf, '\n', cb.length);
+		rv = jmsg_split(&cb, list);
+		if (rv < 0)
+			goto err;
+		count += rv;
+
+		/*
+		 * If we have messages and there is no more data in the buffer,
+		 * we're good. Return.
+		 */
+		if (count && cb.length == 0) {
+			sc_cb_destroy(&cb);
+			return count;
 		}
 
 		/* Ensure there is space to read more data */
@@ -223,7 +240,7 @@ struct jmsg *jmsg_wait_field(struct cbot_signal_backend *sig, const char *field,
 		return jm;
 
 	cur = sc_lwt_current();
-	if (cur != sig->bot->lwt) {
+	if (cur != sig->be->lwt) {
 		struct signal_queued_item item = { 0 };
 		item.field = field;
 		item.value = value;
@@ -232,7 +249,7 @@ struct jmsg *jmsg_wait_field(struct cbot_signal_backend *sig, const char *field,
 		sc_list_insert_end(&sig->msgq, &item.list);
 		while (!item.result && !sc_lwt_shutting_down()) {
 			sc_lwt_set_state(cur, SC_LWT_BLOCKED);
-			sc_lwt_set_state(sig->bot->lwt, SC_LWT_RUNNABLE);
+			sc_lwt_set_state(sig->be->lwt, SC_LWT_RUNNABLE);
 			sc_lwt_yield();
 		}
 		return item.result;
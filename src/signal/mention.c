@@ -41,10 +41,10 @@ static const char *startswith(const char *str, const char *pfx)
 	return NULL;
 }
 
-char *mention_parse(const char *string, int *kind, int *offset)
+const char *mention_find(const char *string, int *kind, int *len,
+                         int *offset)
 {
 	const char *start, *end;
-	char *out;
 
 	if ((start = startswith(string, "@(uuid:"))) {
 		*kind = MENTION_USER;
@@ -54,21 +54,28 @@ char *mention_parse(const char *string, int *kind, int *offset)
 		*kind = MENTION_ERR;
 		if (offset)
 			*offset = 1;
-		return strdup("@???");
+		return NULL;
 	}
 	end = strchr(start, ')');
 	if (!end) {
 		*kind = MENTION_ERR;
 		if (offset)
 			*offset = 1;
-		return strdup("@???");
+		return NULL;
 	}
-	out = malloc(end - start + 1);
-	memcpy(out, start, end - start);
-	out[end - start] = '\0';
+	*len = end - start;
 	if (offset)
 		*offset = end - string + 1;
-	return out;
+	return start;
+}
+
+char *mention_parse(const char *string, int *kind, int *offset)
+{
+	int len;
+	const char *value = mention_find(string, kind, &len, offset);
+	if (!value)
+		return strdup("@???");
+	return strndup(value, len);
 }
 
 /*
@@ -189,68 +196,74 @@ err:
 	return NULL;
 }
 
-char *json_quote_and_mention(const char *instr, struct signal_mention **ms,
-                             size_t *n)
+void json_quote_mention_cb(struct sc_charbuf *cb, const char *instr,
+                           struct sc_array *ms)
 {
-	size_t i = 0, u16extra = 0;
-	struct sc_charbuf cb;
-	struct sc_array mb;
 	struct signal_mention ment;
+	const char *uuid;
+	uint64_t u16units = 0;
+	int kind, len, offset, nbytes;
+	size_t i;
 
-	sc_cb_init(&cb, strlen(instr));
-	sc_arr_init(&mb, struct signal_mention, 1);
-
+	ms->len = 0;
 	for (i = 0; instr[i]; i++) {
 		if (instr[i] == '"' || instr[i] == '\\') {
-			sc_cb_append(&cb, '\\');
-			sc_cb_append(&cb, instr[i]);
+			sc_cb_append(cb, '\\');
+			sc_cb_append(cb, instr[i]);
 		} else if (instr[i] == '\n') {
-			sc_cb_append(&cb, '\\');
-			sc_cb_append(&cb, 'n');
+			sc_cb_append(cb, '\\');
+			sc_cb_append(cb, 'n');
 		} else if (instr[i] == '@' && instr[i + 1] == '@') {
-			sc_cb_append(&cb, '@');
+			sc_cb_append(cb, '@');
 			i++;
-		} else if (instr[i] == '@' && instr[i + 1] != '@') {
-			int kind, offset;
-			char *uuid = mention_parse(instr + i, &kind, &offset);
+		} else if (instr[i] == '@') {
+			uuid = mention_find(instr + i, &kind, &len, &offset);
 			if (kind != MENTION_USER) {
-				sc_cb_append(&cb, '@');
-				free(uuid);
+				sc_cb_append(cb, '@');
 			} else {
-				ment.start = cb.length + u16extra;
+				ment.start = u16units;
 				ment.length = 1;
 				ment.uuid = uuid;
-				sc_cb_append(&cb, 'X');
-				sc_arr_append(&mb, struct signal_mention, ment);
+				ment.uuid_len = len;
+				sc_cb_append(cb, 'X');
+				sc_arr_append(ms, struct signal_mention, ment);
 				i += offset - 1;
 			}
-		} else if (utf8_nbytes(instr[i]) == 4) {
-			u16extra++;
-			sc_cb_append(&cb, instr[i]);
 		} else {
-			sc_cb_append(&cb, instr[i]);
+			sc_cb_append(cb, instr[i]);
+			/* Count UTF-16 units (see index_of_utf16()) */
+			nbytes = utf8_nbytes(instr[i]);
+			if (nbytes)
+				u16units += (nbytes == 4) ? 2 : 1;
+			continue;
 		}
+		u16units++;
 	}
-	*ms = (struct signal_mention *)mb.arr;
-	*n = mb.len;
-	return cb.buf;
 }
 
-char *json_quote_nomention(const char *instr)
+void json_quote_cb(struct sc_charbuf *cb, const char *instr)
 {
-	struct sc_charbuf buf;
-	sc_cb_init(&buf, strlen(instr) + 1);
 	for (size_t i = 0; instr[i]; i++) {
 		switch (instr[i]) {
 		case '"':
 		case '\\':
-			sc_cb_append(&buf, '\\');
-			sc_cb_append(&buf, instr[i]);
+			sc_cb_append(cb, '\\');
+			sc_cb_append(cb, instr[i]);
 			break;
 		case '\n':
-			sc_cb_append(&buf, '\\');
-			sc_cb_append(&buf, 'n');
+			sc_cb_append(cb, '\\');
+			sc_cb_append(cb, 'n');
+			break;
+		default:
+			sc_cb_append(cb, instr[i]);
 		}
 	}
+}
+
+char *json_quote_nomention(const char *instr)
+{
+	struct sc_charbuf buf;
+	sc_cb_init(&buf, strlen(instr) + 1);
+	json_quote_cb(&buf, instr);
 	return buf.buf;
 }
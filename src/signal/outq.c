@@ -0,0 +1,229 @@
+/*
+ * signal/outq.c: buffered, non-blocking writes to the Signal bridge
+ *
+ * Each request is serialized into sig->out, and then moved onto the output
+ * queue (without copying). The queue is written with writev(), so that
+ * requests which pile up while the bridge is busy are coalesced into one
+ * system call. When the bridge can't accept more, a writer thread waits for the
+ * descriptor to become writable. Written buffers are kept to serialize later
+ * requests into, so in the steady state the queue doesn't allocate.
+ *
+ * If too much data is queued, senders are blocked until the writer catches up,
+ * rather than letting the queue grow without bound.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <sc-collections.h>
+#include <sc-lwt.h>
+
+#include "../cbot_private.h"
+#include "cbot/cbot.h"
+#include "internal.h"
+
+/* Maximum number of requests to write in one writev() */
+#define OUTQ_IOV 64
+
+struct outq_waiter {
+	struct sc_list_head list;
+	struct sc_lwt *thread;
+};
+
+void signal_outq_init(struct signal_outq *q, int fd)
+{
+	q->fd = fd;
+	sc_arr_init(&q->reqs, struct sc_charbuf, 8);
+	sc_arr_init(&q->spare, struct sc_charbuf, 8);
+	q->first = 0;
+	q->offset = 0;
+	q->bytes = 0;
+	q->writer = NULL;
+	q->failed = false;
+	sc_list_init(&q->waiters);
+}
+
+void signal_outq_destroy(struct signal_outq *q)
+{
+	struct sc_charbuf *cbs;
+	size_t i;
+
+	cbs = sc_arr(&q->reqs, struct sc_charbuf);
+	for (i = 0; i < q->reqs.len; i++)
+		sc_cb_destroy(&cbs[i]);
+	cbs = sc_arr(&q->spare, struct sc_charbuf);
+	for (i = 0; i < q->spare.len; i++)
+		sc_cb_destroy(&cbs[i]);
+	sc_arr_destroy(&q->reqs);
+	sc_arr_destroy(&q->spare);
+}
+
+/* Return an empty buffer for the next request, reusing one if we can */
+static struct sc_charbuf outq_spare(struct signal_outq *q)
+{
+	struct sc_charbuf cb;
+
+	if (q->spare.len) {
+		cb = sc_arr(&q->spare, struct sc_charbuf)[--q->spare.len];
+		sc_cb_clear(&cb);
+	} else {
+		sc_cb_init(&cb, 1024);
+	}
+	return cb;
+}
+
+/* Account for @n bytes written, recycling requests which are complete */
+static void outq_consume(struct signal_outq *q, size_t n)
+{
+	struct sc_charbuf *reqs = sc_arr(&q->reqs, struct sc_charbuf);
+
+	q->bytes -= n;
+	n += q->offset;
+	while (q->first < q->reqs.len && n >= (size_t)reqs[q->first].length) {
+		n -= reqs[q->first].length;
+		sc_arr_append(&q->spare, struct sc_charbuf, reqs[q->first]);
+		q->first++;
+	}
+	q->offset = n;
+	if (q->first == q->reqs.len)
+		q->first = q->reqs.len = 0;
+}
+
+/*
+ * Write as much of the queue as the descriptor accepts. Returns 0 when the
+ * queue is empty or the write would block, and -1 on error.
+ */
+static int outq_flush(struct signal_outq *q)
+{
+	struct sc_charbuf *reqs = sc_arr(&q->reqs, struct sc_charbuf);
+	struct iovec iov[OUTQ_IOV];
+	ssize_t rv;
+	int n;
+
+	while (q->bytes) {
+		for (n = 0; n < OUTQ_IOV && q->first + n < q->reqs.len; n++) {
+			iov[n].iov_base = reqs[q->first + n].buf;
+			iov[n].iov_len = reqs[q->first + n].length;
+		}
+		iov[0].iov_base = (char *)iov[0].iov_base + q->offset;
+		iov[0].iov_len -= q->offset;
+
+		rv = writev(q->fd, iov, n);
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		} else if (rv < 0 && (errno == EAGAIN ||
+		                      errno == EWOULDBLOCK)) {
+			return 0;
+		} else if (rv < 0) {
+			CL_CRIT("cbot signal: write: %s\n", strerror(errno));
+			q->failed = true;
+			return -1;
+		}
+		outq_consume(q, rv);
+	}
+	return 0;
+}
+
+static void outq_wake_waiters(struct signal_outq *q)
+{
+	struct outq_waiter *w;
+
+	sc_list_for_each_entry(w, &q->waiters, list, struct outq_waiter)
+	{
+		sc_lwt_set_state(w->thread, SC_LWT_RUNNABLE);
+	}
+}
+
+static void signal_writer(void *arg)
+{
+	struct signal_outq *q = arg;
+	struct sc_lwt *cur = sc_lwt_current();
+	bool waiting;
+
+	while (!sc_lwt_shutting_down()) {
+		if (outq_flush(q) < 0)
+			break;
+		if (q->bytes <= SIGNAL_OUTQ_LOW)
+			outq_wake_waiters(q);
+
+		/* Wait for writability, or for more requests to be queued */
+		waiting = q->bytes != 0;
+		if (waiting)
+			sc_lwt_wait_fd(cur, q->fd, SC_LWT_W_OUT, NULL);
+		sc_lwt_set_state(cur, SC_LWT_BLOCKED);
+		sc_lwt_yield();
+		if (waiting)
+			sc_lwt_remove_fd(cur, q->fd);
+	}
+	q->writer = NULL;
+	outq_wake_waiters(q);
+}
+
+void signal_outq_start(struct signal_outq *q, struct sc_lwt_ctx *ctx)
+{
+	if (!q->writer)
+		q->writer = sc_lwt_create_task(ctx, signal_writer, q);
+}
+
+/* Block the current thread until the queue drains below the low watermark */
+static void outq_wait(struct signal_outq *q)
+{
+	struct outq_waiter w;
+
+	w.thread = sc_lwt_current();
+	sc_list_init(&w.list);
+	sc_list_insert_end(&q->waiters, &w.list);
+	CL_DEBUG("cbot signal: %zu bytes queued, waiting for writer\n",
+	         q->bytes);
+	while (q->bytes > SIGNAL_OUTQ_LOW && q->writer && !q->failed &&
+	       !sc_lwt_shutting_down()) {
+		sc_lwt_set_state(w.thread, SC_LWT_BLOCKED);
+		sc_lwt_yield();
+	}
+	sc_list_remove(&w.list);
+}
+
+int signal_write(struct cbot_signal_backend *sig)
+{
+	struct signal_outq *q = &sig->outq;
+	size_t len = sig->out.length;
+
+	if (q->failed)
+		return -1;
+	if (!len)
+		return 0;
+
+	/* Drop requests which have been written from the front */
+	if (q->first && q->first * 2 >= q->reqs.len) {
+		memmove(q->reqs.arr,
+		        sc_arr(&q->reqs, struct sc_charbuf) + q->first,
+		        (q->reqs.len - q->first) * sizeof(struct sc_charbuf));
+		q->reqs.len -= q->first;
+		q->first = 0;
+	}
+	sc_arr_append(&q->reqs, struct sc_charbuf, sig->out);
+	sig->out = outq_spare(q);
+	q->bytes += len;
+
+	/*
+	 * If nothing else was queued, try to write it right away. Otherwise,
+	 * the writer is already waiting for the descriptor to be writable (if
+	 * it has been started).
+	 */
+	if ((q->bytes == len || !q->writer) && outq_flush(q) < 0)
+		return -1;
+	if (!q->bytes || !q->writer)
+		return 0;
+	sc_lwt_set_state(q->writer, SC_LWT_RUNNABLE);
+
+	/*
+	 * Apply backpressure, but never to the thread which reads from the
+	 * bridge: if it stops reading, the bridge may stop reading too.
+	 */
+	if (q->bytes > SIGNAL_OUTQ_HIGH && sc_lwt_current() != sig->be->lwt)
+		outq_wait(q);
+	return q->failed ? -1 : 0;
+}
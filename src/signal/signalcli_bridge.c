@@ -43,35 +43,34 @@ static uint64_t get_timestamp(struct jmsg *jm)
 	return timestamp;
 }
 
-static char *format_mentions(const struct signal_mention *ms, size_t n)
+static void signalcli_write_send(struct cbot_signal_backend *sig, int kind,
+                                 const char *to, int tolen, const char *msg)
 {
-	struct sc_charbuf cb;
-	sc_cb_init(&cb, 128);
-
-	for (size_t i = 0; i < n; i++) {
+	struct signal_mention *ms;
+	size_t i;
+
+	sc_cb_printf(&sig->out,
+	             "{\"jsonrpc\":\"2.0\",\"method\":\"send\",\"id\":\"%lu\","
+	             "\"params\":{\"message\":\"",
+	             sig->id++);
+	json_quote_mention_cb(&sig->out, msg, &sig->mentions);
+	sc_cb_printf(&sig->out, "\",\"%s\":\"%.*s\",\"mentions\":[",
+	             kind == MENTION_GROUP ? "groupId" : "recipient", tolen,
+	             to);
+	ms = sc_arr(&sig->mentions, struct signal_mention);
+	for (i = 0; i < sig->mentions.len; i++) {
 		if (i)
-			sc_cb_append(&cb, ',');
-		sc_cb_printf(&cb, "\"%" PRIu64 ":%" PRIu64 ":%s\"", ms[i].start,
-		             ms[i].length, ms[i].uuid);
+			sc_cb_append(&sig->out, ',');
+		sc_cb_printf(&sig->out, "\"%" PRIu64 ":%" PRIu64 ":%.*s\"",
+		             ms[i].start, ms[i].length, ms[i].uuid_len,
+		             ms[i].uuid);
 	}
-	return cb.buf;
+	sc_cb_concat(&sig->out, "]}}\n");
 }
 
-const static char fmt_send[] =
-        ("{\"jsonrpc\":\"2.0\",\"method\":\"send\",\"id\":\"%lu\","
-         "\"params\":{\"message\":\"%s\",\"%s\":\"%s\",\"mentions\":[%s]}"
-         "}\n");
-
-static uint64_t signalcli_send(struct cbot_signal_backend *sig, const char *to,
-                               const char *quoted,
-                               const struct signal_mention *ms, size_t n,
-                               const char *key)
+static uint64_t signalcli_send_result(struct cbot_signal_backend *sig)
 {
-
 	uint64_t timestamp = 0;
-	char *mentions = format_mentions(ms, n);
-	fprintf(sig->ws, fmt_send, sig->id++, quoted, key, to, mentions);
-	free(mentions);
 	struct jmsg *jm = get_result(sig);
 	/* jm could be NULL when shutting down */
 	if (jm) {
@@ -81,32 +80,19 @@ static uint64_t signalcli_send(struct cbot_signal_backend *sig, const char *to,
 	return timestamp;
 }
 
-static uint64_t signalcli_send_single(struct cbot_signal_backend *sig,
-                                      const char *to, const char *quoted,
-                                      const struct signal_mention *ms, size_t n)
-{
-	return signalcli_send(sig, to, quoted, ms, n, "recipient");
-}
-
-static uint64_t signalcli_send_group(struct cbot_signal_backend *sig,
-                                     const char *to, const char *quoted,
-                                     const struct signal_mention *ms, size_t n)
-{
-	return signalcli_send(sig, to, quoted, ms, n, "groupId");
-}
-
-static const char fmt_nick[] =
+static const char fmt_nick_start[] =
         ("{\"jsonrpc\":\"2.0\",\"method\":\"updateProfile\","
-         "\"id\":\"%lu\",\"params\":{\"name\":\"%s\","
-         "\"aboutEmoji\":\"🤖\",\"about\",\"I'm a bot! "
+         "\"id\":\"%lu\",\"params\":{\"name\":\"");
+static const char fmt_nick_end[] =
+        ("\",\"aboutEmoji\":\"🤖\",\"about\":\"I'm a bot! "
          "https://github.com/brenns10/cbot\"}}\n");
 
-static void signalcli_nick(const struct cbot *bot, const char *newnick)
+static void signalcli_nick(struct cbot_signal_backend *sig, const char *newnick)
 {
-	struct cbot_signal_backend *sig = bot->backend;
-	char *quoted = json_quote_nomention(newnick);
-	fprintf(sig->ws, fmt_nick, sig->id++, quoted);
-	free(quoted);
+	sc_cb_printf(&sig->out, fmt_nick_start, sig->id++);
+	json_quote_cb(&sig->out, newnick);
+	sc_cb_concat(&sig->out, fmt_nick_end);
+	signal_write(sig);
 }
 
 static int handle_reaction(struct cbot_signal_backend *sig, struct jmsg *jm,
@@ -210,9 +196,9 @@ static int handle_incoming(struct cbot_signal_backend *sig, struct jmsg *jm)
 	}
 
 	if (group)
-		cbot_handle_message(sig->bot, group, srcb, msgb, false, false);
+		cbot_handle_message(sig->be, group, srcb, msgb, false, false);
 	else
-		cbot_handle_message(sig->bot, srcb, srcb, msgb, false, true);
+		cbot_handle_message(sig->be, srcb, srcb, msgb, false, true);
 out:
 	free(group);
 	free(srcb);
@@ -220,16 +206,15 @@ out:
 	return 0;
 }
 
-static void signalcli_run(struct cbot *bot)
+static void signalcli_run(struct cbot_signal_backend *sig)
 {
 	struct sc_lwt *cur = sc_lwt_current();
-	struct cbot_signal_backend *sig = bot->backend;
 	struct jmsg *jm;
 
 	sc_lwt_wait_fd(cur, sig->fd, SC_LWT_W_IN, NULL);
 
 	CL_INFO("signalcli: running\n");
-	signalcli_nick(bot, bot->name);
+	signalcli_nick(sig, sig->bot->name);
 
 	while (1) {
 		jm = jmsg_next(sig);
@@ -286,9 +271,11 @@ static int pipecmd(struct cbot_signal_backend *sig, char *cmd, int *input_fd,
 		/* and the write end of stdout */
 		close(stdout[WRITE]);
 
-		/* ensure stdout (which we read from) is non-blocking */
+		/* ensure both ends we use are non-blocking */
 		fcntl(stdout[READ], F_SETFL,
 		      fcntl(stdout[READ], F_GETFL) | O_NONBLOCK);
+		fcntl(stdin[WRITE], F_SETFL,
+		      fcntl(stdin[WRITE], F_GETFL) | O_NONBLOCK);
 
 		*input_fd = stdin[WRITE];
 		*output_fd = stdout[READ];
@@ -298,9 +285,9 @@ static int pipecmd(struct cbot_signal_backend *sig, char *cmd, int *input_fd,
 #undef WRITE
 }
 
-static int signalcli_configure(struct cbot *bot, config_setting_t *group)
+static int signalcli_configure(struct cbot_signal_backend *sig,
+                               config_setting_t *group)
 {
-	struct cbot_signal_backend *sig = bot->backend;
 	const char *signalcli_cmd = NULL, *signalcli_socket = NULL;
 
 	config_setting_lookup_string(group, "signalcli_cmd", &signalcli_cmd);
@@ -319,22 +306,12 @@ static int signalcli_configure(struct cbot *bot, config_setting_t *group)
 	if (rv < 0)
 		return rv;
 
-	sig->ws = fdopen(sig->write_fd, "w");
-	if (!sig->ws) {
-		perror("fdopen pipe");
-		close(sig->fd);
-		close(sig->write_fd);
-		kill(sig->child, SIGTERM);
-		waitpid(sig->child, NULL, 0);
-		return -1;
-	}
-	setvbuf(sig->ws, NULL, _IONBF, 0);
 	return 0;
 }
 
 struct signal_bridge_ops signalcli_bridge = {
-	.send_single = signalcli_send_single,
-	.send_group = signalcli_send_group,
+	.write_send = signalcli_write_send,
+	.send_result = signalcli_send_result,
 	.nick = signalcli_nick,
 	.run = signalcli_run,
 	.configure = signalcli_configure,
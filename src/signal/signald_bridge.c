@@ -79,57 +79,59 @@ static int signald_subscribe(struct cbot_signal_backend *sig)
 {
 	char fmt[] = "\n{\"id\":\"%lu\",\"version\":\"v1\","
 	             "\"type\":\"subscribe\",\"account\":\"%s\"}\n";
-	fprintf(sig->ws, fmt, sig->id++, sig->sender);
+	sc_cb_printf(&sig->out, fmt, sig->id++, sig->sender);
+	if (signal_write(sig) < 0)
+		return -1;
 	return signald_result(sig, "subscribe");
 }
 
-static void signald_nick(const struct cbot *bot, const char *newnick)
+static void signald_nick(struct cbot_signal_backend *sig, const char *newnick)
 {
-	struct cbot_signal_backend *sig = bot->backend;
-	fprintf(sig->ws,
-	        "\n{\"id\":\"%lu\",\"account\":\"%s\",\"name\":\"%s\",\"type\":"
-	        "\"set_profile\",\"version\":\"v1\"}\n",
-	        sig->id++, sig->sender, newnick);
-	signald_result(sig, "set_profile");
+	sc_cb_printf(&sig->out,
+	             "\n{\"id\":\"%lu\",\"account\":\"%s\",\"name\":\"",
+	             sig->id++, sig->sender);
+	json_quote_cb(&sig->out, newnick);
+	sc_cb_concat(&sig->out,
+	             "\",\"type\":\"set_profile\",\"version\":\"v1\"}\n");
+	if (signal_write(sig) == 0)
+		signald_result(sig, "set_profile");
 }
 
-static char *format_mentions(const struct signal_mention *ms, size_t n)
+static void signald_write_send(struct cbot_signal_backend *sig, int kind,
+                               const char *to, int tolen, const char *msg)
 {
-	struct sc_charbuf cb;
-	sc_cb_init(&cb, 128);
-
-	for (size_t i = 0; i < n; i++) {
+	struct signal_mention *ms;
+	size_t i;
+
+	sc_cb_printf(&sig->out, "\n{\"id\": \"%lu\",\"username\":\"%s\",",
+	             sig->id++, sig->sender);
+	if (kind == MENTION_GROUP)
+		sc_cb_printf(&sig->out, "\"recipientGroupId\":\"%.*s\",", tolen,
+		             to);
+	else
+		sc_cb_printf(&sig->out,
+		             "\"recipientAddress\":{\"uuid\":\"%.*s\"},", tolen,
+		             to);
+	sc_cb_concat(&sig->out, "\"messageBody\":\"");
+	json_quote_mention_cb(&sig->out, msg, &sig->mentions);
+	sc_cb_concat(&sig->out, "\",\"mentions\":[");
+	ms = sc_arr(&sig->mentions, struct signal_mention);
+	for (i = 0; i < sig->mentions.len; i++) {
 		if (i)
-			sc_cb_append(&cb, ',');
-		sc_cb_printf(&cb,
+			sc_cb_append(&sig->out, ',');
+		sc_cb_printf(&sig->out,
 		             "{\"length\": %" PRIu64 ", \"start\": %" PRIu64
-		             ", \"uuid\": \"%s\"}",
-		             ms[i].length, ms[i].start, ms[i].uuid);
+		             ", \"uuid\": \"%.*s\"}",
+		             ms[i].length, ms[i].start, ms[i].uuid_len,
+		             ms[i].uuid);
 	}
-	return cb.buf;
+	sc_cb_concat(&sig->out, "],\"type\":\"send\",\"version\":\"v1\"}\n");
 }
 
-const static char fmt_send_group[] = ("\n{"
-                                      "\"id\": \"%lu\","
-                                      "\"username\":\"%s\","
-                                      "\"recipientGroupId\":\"%s\","
-                                      "\"messageBody\":\"%s\","
-                                      "\"mentions\":[%s],"
-                                      "\"type\":\"send\","
-                                      "\"version\":\"v1\""
-                                      "}\n");
-
-static uint64_t signald_send_group(struct cbot_signal_backend *sig,
-                                   const char *to, const char *quoted,
-                                   const struct signal_mention *ms, size_t n)
+static uint64_t signald_send_result(struct cbot_signal_backend *sig)
 {
-	struct jmsg *jm;
 	uint64_t timestamp = 0;
-	char *mentions = format_mentions(ms, n);
-	fprintf(sig->ws, fmt_send_group, sig->id++, sig->sender, to, quoted,
-	        mentions);
-	free(mentions);
-	jm = signald_get_result(sig, "send");
+	struct jmsg *jm = signald_get_result(sig, "send");
 	/* jm could be NULL when shutting down */
 	if (jm) {
 		timestamp = get_timestamp(jm);
@@ -138,34 +140,6 @@ static uint64_t signald_send_group(struct cbot_signal_backend *sig,
 	return timestamp;
 }
 
-const static char fmt_send_single[] = ("\n{"
-                                       "\"id\": \"%lu\","
-                                       "\"username\":\"%s\","
-                                       "\"recipientAddress\":{"
-                                       "\"uuid\":\"%s\""
-                                       "},"
-                                       "\"messageBody\":\"%s\","
-                                       "\"mentions\":[%s],"
-                                       "\"type\":\"send\","
-                                       "\"version\":\"v1\""
-                                       "}\n");
-
-static uint64_t signald_send_single(struct cbot_signal_backend *sig,
-                                    const char *to, const char *quoted,
-                                    const struct signal_mention *ms, size_t n)
-{
-	struct jmsg *jm;
-	uint64_t timestamp;
-	char *mentions = format_mentions(ms, n);
-	fprintf(sig->ws, fmt_send_single, sig->id++, sig->sender, to, quoted,
-	        mentions);
-	free(mentions);
-	jm = signald_get_result(sig, "send");
-	timestamp = get_timestamp(jm);
-	jmsg_free(jm);
-	return timestamp;
-}
-
 static int handle_reaction(struct cbot_signal_backend *sig, struct jmsg *jm,
                            uint32_t reaction_index)
 {
@@ -262,9 +236,9 @@ static int handle_incoming(struct cbot_signal_backend *sig, struct jmsg *jm)
 	}
 
 	if (group)
-		cbot_handle_message(sig->bot, group, srcb, msgb, false, false);
+		cbot_handle_message(sig->be, group, srcb, msgb, false, false);
 	else
-		cbot_handle_message(sig->bot, srcb, srcb, msgb, false, true);
+		cbot_handle_message(sig->be, srcb, srcb, msgb, false, true);
 out:
 	free(group);
 	free(srcb);
@@ -272,10 +246,9 @@ out:
 	return 0;
 }
 
-static void signald_run(struct cbot *bot)
+static void signald_run(struct cbot_signal_backend *sig)
 {
 	struct sc_lwt *cur = sc_lwt_current();
-	struct cbot_signal_backend *sig = bot->backend;
 	struct jmsg *jm;
 
 	sc_lwt_wait_fd(cur, sig->fd, SC_LWT_W_IN, NULL);
@@ -285,7 +258,7 @@ static void signald_run(struct cbot *bot)
 	if (signald_subscribe(sig) < 0)
 		return;
 	signald_expect(sig, "ListenerState");
-	signald_nick(bot, bot->name);
+	signald_nick(sig, sig->bot->name);
 
 	while (1) {
 		jm = jmsg_next(sig);
@@ -302,9 +275,9 @@ static void signald_run(struct cbot *bot)
 	CL_CRIT("cbot signal: jmsg_read() returned NULL, exiting\n");
 }
 
-static int signald_configure(struct cbot *bot, config_setting_t *group)
+static int signald_configure(struct cbot_signal_backend *sig,
+                             config_setting_t *group)
 {
-	struct cbot_signal_backend *sig = bot->backend;
 	const char *signald_socket;
 
 	int rv = config_setting_lookup_string(group, "signald_socket",
@@ -318,8 +291,8 @@ static int signald_configure(struct cbot *bot, config_setting_t *group)
 }
 
 struct signal_bridge_ops signald_bridge = {
-	.send_single = signald_send_single,
-	.send_group = signald_send_group,
+	.write_send = signald_write_send,
+	.send_result = signald_send_result,
 	.nick = signald_nick,
 	.run = signald_run,
 	.configure = signald_configure,
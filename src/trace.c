@@ -0,0 +1,279 @@
+/**
+ * trace.c: recording and replaying the events which backends deliver
+ *
+ * When "trace_file" is configured, every event passed to cbot_handle_message(),
+ * cbot_handle_user_event() and cbot_handle_nick_event() is appended to a
+ * compact binary trace. A trace can be replayed through a set of plugins later
+ * (see tests/replay.c), to measure how they perform under real traffic.
+ *
+ * The format is an 8 byte magic ("CBOTTRC1") followed by the start time, as
+ * 8 little-endian bytes of nanoseconds since the epoch. Then each record is:
+ *
+ *   - one byte: the kind of event, OR'd with flags
+ *   - varint: nanoseconds since the previous record (or the start)
+ *   - one to three strings, each a varint length followed by the bytes
+ *
+ * Varints are unsigned LEB128, so short strings cost a single length byte.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sc-collections.h>
+
+#include "cbot/cbot.h"
+#include "cbot_private.h"
+
+#define TRACE_MAGIC "CBOTTRC1"
+
+#define TRACE_KIND_MASK 0x0F
+#define TRACE_ACTION    0x10
+#define TRACE_DM        0x20
+#define TRACE_PART      0x40
+
+/* No backend delivers strings this long: a longer length means corruption */
+#define TRACE_STRING_MAX (1024 * 1024)
+
+struct cbot_trace_reader {
+	FILE *f;
+	uint64_t ns;
+	struct sc_charbuf strings;
+};
+
+static uint64_t trace_now(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void put_varint(FILE *f, uint64_t val)
+{
+	while (val >= 0x80) {
+		putc((val & 0x7F) | 0x80, f);
+		val >>= 7;
+	}
+	putc(val, f);
+}
+
+static void put_string(FILE *f, const char *str)
+{
+	size_t len = strlen(str);
+	put_varint(f, len);
+	fwrite(str, 1, len, f);
+}
+
+static void put_header(struct cbot *bot, int kind)
+{
+	uint64_t now = trace_now(CLOCK_MONOTONIC);
+	putc(kind, bot->trace);
+	put_varint(bot->trace, now - bot->trace_last);
+	bot->trace_last = now;
+}
+
+int cbot_trace_open(struct cbot *bot, const char *path)
+{
+	uint64_t start = trace_now(CLOCK_REALTIME);
+	int i;
+
+	bot->trace = fopen(path, "wb");
+	if (!bot->trace) {
+		CL_CRIT("cbot: could not open trace file %s\n", path);
+		return -1;
+	}
+	setvbuf(bot->trace, NULL, _IOFBF, 64 * 1024);
+	fwrite(TRACE_MAGIC, 1, 8, bot->trace);
+	for (i = 0; i < 8; i++)
+		putc((start >> (8 * i)) & 0xFF, bot->trace);
+	bot->trace_last = trace_now(CLOCK_MONOTONIC);
+	CL_INFO("cbot: recording events to %s\n", path);
+	return 0;
+}
+
+void cbot_trace_close(struct cbot *bot)
+{
+	if (bot->trace) {
+		fclose(bot->trace);
+		bot->trace = NULL;
+	}
+}
+
+void cbot_trace_message(struct cbot *bot, const char *channel,
+                        const char *user, const char *message, bool action,
+                        bool is_dm)
+{
+	int kind = CBOT_TRACE_MESSAGE;
+
+	if (action)
+		kind |= TRACE_ACTION;
+	if (is_dm)
+		kind |= TRACE_DM;
+	put_header(bot, kind);
+	put_string(bot->trace, channel);
+	put_string(bot->trace, user);
+	put_string(bot->trace, message);
+}
+
+void cbot_trace_user(struct cbot *bot, const char *channel, const char *user,
+                     enum cbot_event_type type)
+{
+	put_header(bot, CBOT_TRACE_USER | (type == CBOT_PART ? TRACE_PART : 0));
+	put_string(bot->trace, channel);
+	put_string(bot->trace, user);
+}
+
+void cbot_trace_nick(struct cbot *bot, const char *old_username,
+                     const char *new_username)
+{
+	put_header(bot, CBOT_TRACE_NICK);
+	put_string(bot->trace, old_username);
+	put_string(bot->trace, new_username);
+}
+
+struct cbot_trace_reader *cbot_trace_reader_open(const char *path)
+{
+	struct cbot_trace_reader *r;
+	unsigned char header[16];
+
+	r = calloc(1, sizeof(*r));
+	r->f = fopen(path, "rb");
+	if (!r->f) {
+		perror(path);
+		free(r);
+		return NULL;
+	}
+	if (fread(header, 1, 16, r->f) != 16 ||
+	    memcmp(header, TRACE_MAGIC, 8) != 0) {
+		fprintf(stderr, "%s: not a cbot trace\n", path);
+		fclose(r->f);
+		free(r);
+		return NULL;
+	}
+	sc_cb_init(&r->strings, 1024);
+	return r;
+}
+
+void cbot_trace_reader_close(struct cbot_trace_reader *r)
+{
+	if (r) {
+		fclose(r->f);
+		sc_cb_destroy(&r->strings);
+		free(r);
+	}
+}
+
+static int get_varint(FILE *f, uint64_t *val)
+{
+	int c, shift = 0;
+
+	*val = 0;
+	do {
+		if ((c = getc(f)) == EOF || shift > 63)
+			return -1;
+		*val |= (uint64_t)(c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return 0;
+}
+
+/* Read a string into r->strings, returning its offset (or -1) */
+static long get_string(struct cbot_trace_reader *r)
+{
+	uint64_t len;
+	long offset = r->strings.length;
+	size_t capacity = r->strings.capacity;
+	char *buf;
+
+	if (get_varint(r->f, &len) < 0 || len > TRACE_STRING_MAX)
+		return -1;
+	/* At most three strings per record, so this can't overflow */
+	while (capacity < r->strings.length + len + 1)
+		capacity *= 2;
+	if (capacity != (size_t)r->strings.capacity) {
+		buf = realloc(r->strings.buf, capacity);
+		if (!buf)
+			return -1;
+		r->strings.buf = buf;
+		r->strings.capacity = capacity;
+	}
+	if (fread(r->strings.buf + offset, 1, len, r->f) != len)
+		return -1;
+	r->strings.length += len + 1;
+	r->strings.buf[offset + len] = '\0';
+	return offset;
+}
+
+int cbot_trace_read(struct cbot_trace_reader *r, struct cbot_trace_event *ev)
+{
+	long off[3] = { 0, 0, 0 };
+	uint64_t delta;
+	int c, i, nstr;
+
+	if ((c = getc(r->f)) == EOF)
+		return 0;
+	if (get_varint(r->f, &delta) < 0)
+		goto err;
+	r->ns += delta;
+
+	memset(ev, 0, sizeof(*ev));
+	ev->kind = c & TRACE_KIND_MASK;
+	ev->ns = r->ns;
+	ev->action = c & TRACE_ACTION;
+	ev->is_dm = c & TRACE_DM;
+	switch (ev->kind) {
+	case CBOT_TRACE_MESSAGE:
+		nstr = 3;
+		break;
+	case CBOT_TRACE_USER:
+		ev->type = (c & TRACE_PART) ? CBOT_PART : CBOT_JOIN;
+		nstr = 2;
+		break;
+	case CBOT_TRACE_NICK:
+		nstr = 2;
+		break;
+	default:
+		goto err;
+	}
+
+	sc_cb_clear(&r->strings);
+	for (i = 0; i < nstr; i++)
+		if ((off[i] = get_string(r)) < 0)
+			goto err;
+
+	/* Only take pointers once the buffer is done growing */
+	if (ev->kind == CBOT_TRACE_NICK) {
+		ev->user = r->strings.buf + off[0];
+		ev->message = r->strings.buf + off[1];
+	} else {
+		ev->channel = r->strings.buf + off[0];
+		ev->user = r->strings.buf + off[1];
+		if (nstr == 3)
+			ev->message = r->strings.buf + off[2];
+	}
+	return 1;
+err:
+	fprintf(stderr, "cbot trace: truncated or corrupt record\n");
+	return -1;
+}
+
+void cbot_trace_replay(struct cbot *bot, const struct cbot_trace_event *ev)
+{
+	/* Traces don't record the backend, so deliver to the default one */
+	struct cbot_backend *be = cbot_backend_default(bot);
+
+	switch (ev->kind) {
+	case CBOT_TRACE_MESSAGE:
+		cbot_handle_message(be, ev->channel, ev->user, ev->message,
+		                    ev->action, ev->is_dm);
+		break;
+	case CBOT_TRACE_USER:
+		cbot_handle_user_event(be, ev->channel, ev->user, ev->type);
+		break;
+	case CBOT_TRACE_NICK:
+		cbot_handle_nick_event(be, ev->user, ev->message);
+		break;
+	}
+}
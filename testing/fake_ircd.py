@@ -0,0 +1,384 @@
+#!/usr/bin/env python3
+"""
+A minimal IRC server and load generator, for testing the IRC backend.
+
+The bot connects to it with the usual "host" and "port" settings. Once the bot
+has joined every simulated channel (each with thousands of nicks in its NAMES
+reply), the server floods it with traffic: PRIVMSGs at a configurable rate,
+mixed with JOIN/PART/NICK storms.
+
+Some messages are "prompts" addressed to the bot (by default, a command for the
+emote plugin). Each message the bot sends to a channel is matched to the oldest
+unanswered prompt there, to measure how long the bot takes to respond under
+load. When the run is over, a line of JSON with the results (including how
+much the bot sent per second) is printed to stderr, or to the --report file.
+
+To get a config file for the bot which joins the simulated channels:
+
+    testing/fake_ircd.py --print-config > load.cfg
+    build/cbot load.cfg
+"""
+import argparse
+import asyncio
+import collections
+import json
+import random
+import sys
+import time
+
+SERVER = "fake.ircd"
+CORPUS = [
+    "hello everyone",
+    "does anybody know how to exit vim",
+    "c++ is a fine language",
+    "lunch++",
+    "the quick brown fox jumps over the lazy dog",
+    "https://example.com/some/long/link?with=a&query=string",
+    "I'd like a cookie right about now",
+]
+
+
+def channel_name(i):
+    return "#load%d" % i
+
+
+def percentile(values, pct):
+    return values[min(len(values) - 1, len(values) * pct // 100)]
+
+
+class Stats:
+    def __init__(self):
+        self.start = time.monotonic()
+        self.end = None
+        self.generated = collections.Counter()
+        self.prompts = 0
+        self.commands = collections.Counter()
+        self.bytes_in = 0
+        self.replies = []
+        self.last_reply = 0
+        self.unmatched = 0
+
+    def report(self, out):
+        end = self.end or time.monotonic()
+        elapsed = max(end - self.start, 1e-9)
+        sent = sum(self.generated.values())
+        result = {
+            "name": "irc_load",
+            "duration_s": round(elapsed, 3),
+            "generated": dict(self.generated),
+            "generated_per_sec": round(sent / elapsed, 1),
+            "bot_commands": dict(self.commands),
+            "bot_privmsg_per_sec": round(self.commands["PRIVMSG"] / elapsed,
+                                         1),
+            "bot_bytes_per_sec": round(self.bytes_in / elapsed, 1),
+            "prompts": self.prompts,
+            "replies": len(self.replies),
+            "unmatched_privmsgs": self.unmatched,
+        }
+        if self.replies:
+            lat = sorted(self.replies)
+            result.update({
+                "p50_ms": round(percentile(lat, 50), 3),
+                "p90_ms": round(percentile(lat, 90), 3),
+                "p99_ms": round(percentile(lat, 99), 3),
+                "max_ms": round(lat[-1], 3),
+            })
+        print(json.dumps(result), file=out, flush=True)
+
+
+def parse(line):
+    """Split an IRC line into (command, params)"""
+    if line.startswith(":"):
+        line = line.split(" ", 1)[1] if " " in line else ""
+    trailing = None
+    if " :" in line:
+        line, trailing = line.split(" :", 1)
+    params = line.split()
+    if trailing is not None:
+        params.append(trailing)
+    if not params:
+        return "", []
+    return params[0].upper(), params[1:]
+
+
+class FakeIrcd:
+    def __init__(self, args, writer):
+        self.args = args
+        self.writer = writer
+        self.rng = random.Random(args.seed)
+        self.stats = Stats()
+        self.nick = None
+        self.registered = False
+        self.ready = asyncio.Event()
+        self.channels = [channel_name(i) for i in range(args.channels)]
+        self.joined = set()
+        # The simulated users: current nick of each, and channel membership
+        self.nicks = ["user%05d" % i for i in range(args.users)]
+        self.renames = 0
+        self.members = {}
+        for chan in self.channels:
+            self.members[chan] = set(
+                self.rng.sample(range(args.users), min(args.names,
+                                                       args.users)))
+        # Per-channel queue of prompt times awaiting a reply
+        self.pending = collections.defaultdict(collections.deque)
+
+    def send(self, line):
+        self.writer.write(line.encode() + b"\r\n")
+
+    def numeric(self, num, *params):
+        *middle, last = params
+        self.send(":%s %03d %s %s:%s" %
+                  (SERVER, num, self.nick,
+                   "".join(p + " " for p in middle), last))
+
+    def user_line(self, idx, rest):
+        nick = self.nicks[idx]
+        self.send(":%s!%s@load.test %s" % (nick, nick, rest))
+
+    def send_names(self, chan):
+        names = []
+        for idx in sorted(self.members[chan]):
+            prefix = "@" if idx % 50 == 0 else "+" if idx % 10 == 0 else ""
+            names.append(prefix + self.nicks[idx])
+        names.append(self.nick)
+        line, lines = [], []
+        for name in names:
+            # Keep each line comfortably under the 512 byte limit
+            if sum(len(n) + 1 for n in line) + len(name) > 400:
+                lines.append(line)
+                line = []
+            line.append(name)
+        lines.append(line)
+        for line in lines:
+            self.numeric(353, "=", chan, " ".join(line))
+        self.numeric(366, chan, "End of /NAMES list.")
+
+    def join(self, chan):
+        if chan in self.joined:
+            return
+        self.joined.add(chan)
+        self.send(":%s!%s@load.test JOIN %s" % (self.nick, self.nick, chan))
+        self.numeric(332, chan, "Load testing channel %s" % chan)
+        if chan in self.members:
+            self.send_names(chan)
+        else:
+            self.numeric(366, chan, "End of /NAMES list.")
+        if self.channels and self.joined.issuperset(self.channels):
+            self.ready.set()
+
+    def handle_command(self, command, params):
+        if command == "NICK" and params:
+            if self.registered:
+                self.send(":%s!%s@load.test NICK :%s" %
+                          (self.nick, self.nick, params[0]))
+            self.nick = params[0]
+        elif command == "USER" and not self.registered:
+            self.registered = True
+            self.numeric(1, "Welcome to the load test, %s" % self.nick)
+            self.numeric(376, "End of /MOTD command.")
+            if not self.channels:
+                self.ready.set()
+        elif command == "PING":
+            self.send(":%s PONG %s :%s" %
+                      (SERVER, SERVER, params[0] if params else ""))
+        elif command == "JOIN" and params:
+            for chan in params[0].split(","):
+                self.join(chan)
+        elif command == "PART" and params:
+            for chan in params[0].split(","):
+                self.joined.discard(chan)
+        elif command == "PRIVMSG" and len(params) >= 2:
+            queue = self.pending.get(params[0])
+            if queue:
+                start = queue.popleft()
+                self.stats.last_reply = time.monotonic()
+                self.stats.replies.append((self.stats.last_reply - start) *
+                                          1000)
+            else:
+                self.stats.unmatched += 1
+
+    async def read_commands(self, reader):
+        while True:
+            line = await reader.readline()
+            if not line:
+                return
+            self.stats.bytes_in += len(line)
+            command, params = parse(line.decode(errors="replace").rstrip())
+            self.stats.commands[command] += 1
+            self.handle_command(command, params)
+
+    def churn(self, chan):
+        rng = self.rng
+        idx = rng.randrange(len(self.nicks))
+        roll = rng.random()
+        if roll < 0.1:
+            self.renames += 1
+            new = "user%05d_%d" % (idx, self.renames)
+            self.user_line(idx, "NICK :%s" % new)
+            self.nicks[idx] = new
+            self.stats.generated["NICK"] += 1
+        elif idx in self.members[chan]:
+            self.user_line(idx, "PART %s :bye" % chan)
+            self.members[chan].discard(idx)
+            self.stats.generated["PART"] += 1
+        else:
+            self.user_line(idx, "JOIN %s" % chan)
+            self.members[chan].add(idx)
+            self.stats.generated["JOIN"] += 1
+
+    def generate(self):
+        args, rng = self.args, self.rng
+        chan = rng.choice(self.channels)
+        roll = rng.random()
+        if roll < args.churn_ratio:
+            self.churn(chan)
+            return
+        members = self.members[chan]
+        idx = rng.choice(tuple(members)) if members else 0
+        if roll < args.churn_ratio + args.prompt_ratio:
+            text = args.prompt.format(name=self.nick)
+            self.pending[chan].append(time.monotonic())
+            self.stats.prompts += 1
+        else:
+            text = rng.choice(CORPUS)
+        self.user_line(idx, "PRIVMSG %s :%s" % (chan, text))
+        self.stats.generated["PRIVMSG"] += 1
+
+    async def generate_all(self):
+        args = self.args
+        await self.ready.wait()
+        self.stats = Stats()
+        interval = 1 / args.rate if args.rate else 0
+        start = time.monotonic()
+        if self.channels:
+            for i in range(args.count):
+                self.generate()
+                if interval:
+                    delay = start + (i + 1) * interval - time.monotonic()
+                    if delay > 0:
+                        await asyncio.sleep(delay)
+                if i % 64 == 63 or interval:
+                    await self.writer.drain()
+        await self.writer.drain()
+        end = time.monotonic()
+
+        # Give the bot a chance to answer the last prompts, but don't count
+        # time spent waiting for replies which never come
+        deadline = end + args.drain
+        while (time.monotonic() < deadline and
+               any(self.pending.values())):
+            await asyncio.sleep(0.01)
+        self.stats.end = max(end, self.stats.last_reply)
+
+    async def run(self, reader):
+        gen = asyncio.ensure_future(self.generate_all())
+        read = asyncio.ensure_future(self.read_commands(reader))
+        await asyncio.wait([gen, read], return_when=asyncio.FIRST_COMPLETED)
+        if not gen.done():
+            print("fake_ircd: bot disconnected", file=sys.stderr)
+            gen.cancel()
+        else:
+            self.send("ERROR :Closing link (load test complete)")
+        read.cancel()
+        self.report()
+
+    def report(self):
+        if self.args.report:
+            with open(self.args.report, "a") as f:
+                self.stats.report(f)
+        else:
+            self.stats.report(sys.stderr)
+
+
+async def serve(args):
+    done = asyncio.Event()
+
+    async def client(reader, writer):
+        await FakeIrcd(args, writer).run(reader)
+        try:
+            await writer.drain()
+        except ConnectionError:
+            pass
+        writer.close()
+        if not args.serve_forever:
+            done.set()
+
+    server = await asyncio.start_server(client, args.bind, args.port)
+    async with server:
+        await done.wait()
+
+
+def print_config(args):
+    channels = ",\n".join('    { name = "%s" }' % channel_name(i)
+                          for i in range(args.channels))
+    print("""cbot: {
+  name = "%s";
+  channels = (
+%s
+  );
+  backend = "irc";
+  plugin_dir = "build";
+  db = ":memory:";
+  log_level = "WARN";
+};
+
+irc: {
+  host = "%s";
+  port = %d;
+  // The fake server doesn't enforce a flood limit, and replies are timed
+  flood_control = false;
+};
+
+plugins: {
+  emote: {};
+  greet: {};
+  sqlkarma: {};
+};""" % (args.name, channels, args.bind, args.port))
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="IRC server stand-in for load testing cbot")
+    parser.add_argument("--bind", default="127.0.0.1",
+                        help="address to listen on")
+    parser.add_argument("-p", "--port", type=int, default=6667,
+                        help="port to listen on")
+    parser.add_argument("--serve-forever", action="store_true",
+                        help="keep accepting new clients")
+    parser.add_argument("-n", "--count", type=int, default=10000,
+                        help="number of events to generate")
+    parser.add_argument("-r", "--rate", type=float, default=1000,
+                        help="events per second (0: as fast as possible)")
+    parser.add_argument("--channels", type=int, default=20,
+                        help="number of channels")
+    parser.add_argument("--users", type=int, default=5000,
+                        help="number of simulated users")
+    parser.add_argument("--names", type=int, default=2000,
+                        help="initial number of users in each channel")
+    parser.add_argument("--churn-ratio", type=float, default=0.2,
+                        help="fraction of events which are JOIN/PART/NICK")
+    parser.add_argument("--prompt-ratio", type=float, default=0.05,
+                        help="fraction of events which expect a reply")
+    parser.add_argument("--prompt", default="{name}: emote waves",
+                        help="text of prompts ({name} is the bot's nick)")
+    parser.add_argument("--name", default="cbot",
+                        help="the bot's name, for --print-config")
+    parser.add_argument("--drain", type=float, default=5,
+                        help="seconds to wait for replies after generating")
+    parser.add_argument("--seed", type=int, default=1,
+                        help="random seed, for repeatable runs")
+    parser.add_argument("--report", metavar="FILE",
+                        help="append results to FILE rather than stderr")
+    parser.add_argument("--print-config", action="store_true",
+                        help="print a cbot config for this server and exit")
+    args = parser.parse_args()
+
+    if args.print_config:
+        print_config(args)
+    else:
+        asyncio.run(serve(args))
+
+
+if __name__ == "__main__":
+    main()
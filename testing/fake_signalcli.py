@@ -0,0 +1,394 @@
+#!/usr/bin/env python3
+"""
+A stand-in for signal-cli's jsonRpc mode, for load testing the Signal backend.
+
+It speaks the same line-based JSON-RPC protocol as "signal-cli jsonRpc", either
+on stdin/stdout (use it as signalcli_cmd) or on a UNIX socket (use it with
+signalcli_socket). Once the bot sends its first request, a stream of receive
+envelopes is generated: group messages, DMs, mentions and reactions. Requests
+are answered after a configurable latency, "send" with a fresh timestamp.
+
+Some generated messages are "prompts" which the bot should reply to (by
+default, a greeting for the greet plugin). Each reply is matched to the oldest
+unanswered prompt in its conversation, to measure the bot's end-to-end response
+latency. When the run is over, a line of JSON with the results is printed to
+stderr, or to the --report file.
+
+To get a config file for the bot which listens to the generated groups:
+
+    testing/fake_signalcli.py --print-config > load.cfg
+    build/cbot load.cfg
+"""
+import argparse
+import asyncio
+import base64
+import collections
+import hashlib
+import json
+import os
+import random
+import shlex
+import sys
+import time
+
+BOT_UUID = "00000000-0000-4000-8000-000000000b07"
+CORPUS = [
+    "hello everyone",
+    "does anybody know how to exit vim",
+    "c++ is a fine language",
+    "lunch++",
+    "the quick brown fox jumps over the lazy dog",
+    "https://example.com/some/long/link?with=a&query=string",
+    "I'd like a cookie right about now",
+]
+MENTION = "￼"
+
+
+def group_id(i):
+    return base64.b64encode(hashlib.sha256(b"group%d" % i).digest()).decode()
+
+
+def user_uuid(i):
+    return "00000000-0000-4000-8000-%012d" % i
+
+
+def now_ms():
+    return int(time.time() * 1000)
+
+
+def percentile(values, pct):
+    return values[min(len(values) - 1, len(values) * pct // 100)]
+
+
+class Stats:
+    def __init__(self):
+        self.start = time.monotonic()
+        self.end = None
+        self.generated = 0
+        self.prompts = 0
+        self.requests = collections.Counter()
+        self.replies = []
+        self.last_reply = 0
+        self.unmatched = 0
+
+    def report(self, out):
+        end = self.end or time.monotonic()
+        elapsed = max(end - self.start, 1e-9)
+        sends = self.requests["send"]
+        result = {
+            "name": "signalcli_load",
+            "duration_s": round(elapsed, 3),
+            "generated": self.generated,
+            "generated_per_sec": round(self.generated / elapsed, 1),
+            "requests": dict(self.requests),
+            "sends_per_sec": round(sends / elapsed, 1),
+            "prompts": self.prompts,
+            "replies": len(self.replies),
+            "unmatched_sends": self.unmatched,
+        }
+        if self.replies:
+            lat = sorted(self.replies)
+            result.update({
+                "p50_ms": round(percentile(lat, 50), 3),
+                "p90_ms": round(percentile(lat, 90), 3),
+                "p99_ms": round(percentile(lat, 99), 3),
+                "max_ms": round(lat[-1], 3),
+            })
+        print(json.dumps(result), file=out, flush=True)
+
+
+class FakeSignalCli:
+    def __init__(self, args, writer):
+        self.args = args
+        self.writer = writer
+        self.rng = random.Random(args.seed)
+        self.stats = Stats()
+        self.ready = asyncio.Event()
+        self.last_ts = 0
+        # Timestamps of the bot's messages, for reactions to target
+        self.sent_ts = collections.deque(maxlen=100)
+        # Per-conversation queue of (time, prompt) awaiting a reply
+        self.pending = collections.defaultdict(collections.deque)
+        self.groups = [group_id(i) for i in range(args.groups)]
+        self.users = [user_uuid(i + 1) for i in range(args.users)]
+
+    def timestamp(self):
+        self.last_ts = max(now_ms(), self.last_ts + 1)
+        return self.last_ts
+
+    def write(self, obj):
+        self.writer.write(json.dumps(obj).encode() + b"\n")
+
+    def respond(self, req):
+        result = {}
+        if req.get("method") == "send":
+            ts = self.timestamp()
+            self.sent_ts.append(ts)
+            result = {"timestamp": ts, "results": []}
+        self.write({"jsonrpc": "2.0", "result": result, "id": req["id"]})
+
+    def handle_request(self, line):
+        try:
+            req = json.loads(line)
+        except ValueError:
+            print("fake_signalcli: bad request: %r" % line, file=sys.stderr)
+            return
+        method = req.get("method", "")
+        self.stats.requests[method] += 1
+        self.ready.set()
+        if method == "send":
+            params = req.get("params", {})
+            conv = params.get("groupId") or params.get("recipient")
+            if isinstance(conv, list):
+                conv = conv[0]
+            queue = self.pending.get(conv)
+            if queue:
+                start, _ = queue.popleft()
+                self.stats.last_reply = time.monotonic()
+                self.stats.replies.append((self.stats.last_reply - start) *
+                                          1000)
+            else:
+                self.stats.unmatched += 1
+        if "id" not in req:
+            return
+        delay = self.args.latency / 1000
+        if self.args.jitter:
+            delay += self.rng.uniform(0, self.args.jitter / 1000)
+        if delay > 0:
+            asyncio.get_running_loop().call_later(delay, self.respond, req)
+        else:
+            self.respond(req)
+
+    async def read_requests(self, reader):
+        while True:
+            line = await reader.readline()
+            if not line:
+                return
+            self.handle_request(line)
+
+    def envelope(self, source, group, data):
+        ts = data["timestamp"]
+        if group:
+            data["groupInfo"] = {"groupId": group, "type": "DELIVER"}
+        return {
+            "jsonrpc": "2.0",
+            "method": "receive",
+            "params": {
+                "envelope": {
+                    "source": source,
+                    "sourceNumber": None,
+                    "sourceUuid": source,
+                    "sourceName": "Load Tester",
+                    "sourceDevice": 1,
+                    "timestamp": ts,
+                    "dataMessage": data,
+                },
+                "account": self.args.account,
+            },
+        }
+
+    def generate(self):
+        args, rng = self.args, self.rng
+        source = rng.choice(self.users)
+        group = None
+        if not self.groups or rng.random() < args.dm_ratio:
+            conv = source
+        else:
+            group = conv = rng.choice(self.groups)
+        data = {
+            "timestamp": self.timestamp(),
+            "message": None,
+            "expiresInSeconds": 0,
+            "viewOnce": False,
+        }
+        roll = rng.random()
+        if roll < args.reaction_ratio and self.sent_ts:
+            data["reaction"] = {
+                "emoji": rng.choice(["❤️", "\U0001f44d"]),
+                "targetAuthor": BOT_UUID,
+                "targetAuthorNumber": None,
+                "targetAuthorUuid": BOT_UUID,
+                "targetSentTimestamp": rng.choice(self.sent_ts),
+                "isRemove": rng.random() < 0.2,
+            }
+        elif roll < args.reaction_ratio + args.prompt_ratio:
+            data["message"] = args.prompt.format(name=args.name)
+            self.pending[conv].append((time.monotonic(), data["message"]))
+            self.stats.prompts += 1
+        elif roll < (args.reaction_ratio + args.prompt_ratio +
+                     args.mention_ratio):
+            target = rng.choice(self.users + [BOT_UUID])
+            text = rng.choice(CORPUS)
+            data["message"] = "%s %s" % (MENTION, text)
+            data["mentions"] = [{
+                "name": target,
+                "number": None,
+                "uuid": target,
+                "start": 0,
+                "length": 1,
+            }]
+        else:
+            data["message"] = rng.choice(CORPUS)
+        self.write(self.envelope(source, group, data))
+        self.stats.generated += 1
+
+    async def generate_all(self):
+        args = self.args
+        await self.ready.wait()
+        self.stats = Stats()
+        interval = 1 / args.rate if args.rate else 0
+        start = time.monotonic()
+        for i in range(args.count):
+            self.generate()
+            if interval:
+                delay = start + (i + 1) * interval - time.monotonic()
+                if delay > 0:
+                    await asyncio.sleep(delay)
+            if i % 64 == 63 or interval:
+                await self.writer.drain()
+        await self.writer.drain()
+        end = time.monotonic()
+
+        # Give the bot a chance to answer the last prompts, but don't count
+        # time spent waiting for replies which never come
+        deadline = end + args.drain
+        while (time.monotonic() < deadline and
+               any(self.pending.values())):
+            await asyncio.sleep(0.01)
+        self.stats.end = max(end, self.stats.last_reply)
+
+    async def run(self, reader):
+        gen = asyncio.ensure_future(self.generate_all())
+        read = asyncio.ensure_future(self.read_requests(reader))
+        await asyncio.wait([gen, read], return_when=asyncio.FIRST_COMPLETED)
+        if not gen.done():
+            print("fake_signalcli: bot disconnected", file=sys.stderr)
+            gen.cancel()
+        read.cancel()
+        self.report()
+
+    def report(self):
+        if self.args.report:
+            with open(self.args.report, "a") as f:
+                self.stats.report(f)
+        else:
+            self.stats.report(sys.stderr)
+
+
+async def run_stdio(args):
+    loop = asyncio.get_running_loop()
+    reader = asyncio.StreamReader(limit=1 << 20)
+    await loop.connect_read_pipe(
+        lambda: asyncio.StreamReaderProtocol(reader), sys.stdin)
+    transport, protocol = await loop.connect_write_pipe(
+        asyncio.streams.FlowControlMixin, sys.stdout)
+    writer = asyncio.StreamWriter(transport, protocol, reader, loop)
+    await FakeSignalCli(args, writer).run(reader)
+    transport.close()
+
+
+async def run_socket(args):
+    done = asyncio.Event()
+
+    async def client(reader, writer):
+        await FakeSignalCli(args, writer).run(reader)
+        writer.close()
+        if not args.serve_forever:
+            done.set()
+
+    if os.path.exists(args.socket):
+        os.unlink(args.socket)
+    server = await asyncio.start_unix_server(client, args.socket,
+                                             limit=1 << 20)
+    async with server:
+        await done.wait()
+    os.unlink(args.socket)
+
+
+def print_config(args):
+    cfg_dir = os.path.dirname(os.path.abspath(__file__))
+    if args.socket:
+        bridge = 'signalcli_socket = "%s";' % args.socket
+    else:
+        # Run the stand-in with the same options we were given
+        cmd = [os.path.join(cfg_dir, "fake_signalcli.py")]
+        cmd += [a for a in sys.argv[1:] if a != "--print-config"]
+        bridge = 'signalcli_cmd = "%s";' % " ".join(map(shlex.quote, cmd))
+    channels = ",\n".join('    { name = "%s" }' % g
+                          for g in (group_id(i) for i in range(args.groups)))
+    print("""cbot: {
+  name = "%s";
+  channels = (
+%s
+  );
+  backend = "signal";
+  plugin_dir = "build";
+  db = ":memory:";
+  log_level = "WARN";
+};
+
+signal: {
+  phone = "%s";
+  uuid = "%s";
+  bridge = "signal-cli";
+  %s
+};
+
+plugins: {
+  greet: {};
+  sqlkarma: {};
+};""" % (args.name, channels, args.account, BOT_UUID, bridge))
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="signal-cli jsonRpc stand-in for load testing cbot")
+    parser.add_argument("--socket", metavar="PATH",
+                        help="listen on a UNIX socket, not stdin/stdout")
+    parser.add_argument("--serve-forever", action="store_true",
+                        help="with --socket, keep accepting new clients")
+    parser.add_argument("-n", "--count", type=int, default=10000,
+                        help="number of envelopes to generate")
+    parser.add_argument("-r", "--rate", type=float, default=1000,
+                        help="envelopes per second (0: as fast as possible)")
+    parser.add_argument("--groups", type=int, default=4,
+                        help="number of groups")
+    parser.add_argument("--users", type=int, default=50,
+                        help="number of users sending messages")
+    parser.add_argument("--dm-ratio", type=float, default=0.1,
+                        help="fraction of messages which are DMs")
+    parser.add_argument("--mention-ratio", type=float, default=0.1,
+                        help="fraction of messages with a mention")
+    parser.add_argument("--reaction-ratio", type=float, default=0.05,
+                        help="fraction of envelopes which are reactions")
+    parser.add_argument("--prompt-ratio", type=float, default=0.1,
+                        help="fraction of messages which expect a reply")
+    parser.add_argument("--prompt", default="hello {name}",
+                        help="text of prompts ({name} is the bot's name)")
+    parser.add_argument("--name", default="cbot", help="the bot's name")
+    parser.add_argument("--account", default="+12223334444",
+                        help="the bot's phone number")
+    parser.add_argument("--latency", type=float, default=0,
+                        help="milliseconds to wait before each response")
+    parser.add_argument("--jitter", type=float, default=0,
+                        help="up to this many more milliseconds of latency")
+    parser.add_argument("--drain", type=float, default=5,
+                        help="seconds to wait for replies after generating")
+    parser.add_argument("--seed", type=int, default=1,
+                        help="random seed, for repeatable runs")
+    parser.add_argument("--report", metavar="FILE",
+                        help="append results to FILE rather than stderr")
+    parser.add_argument("--print-config", action="store_true",
+                        help="print a cbot config for this stand-in and exit")
+    args = parser.parse_args()
+
+    if args.print_config:
+        print_config(args)
+    elif args.socket:
+        asyncio.run(run_socket(args))
+    else:
+        asyncio.run(run_stdio(args))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <sc-lwt.h>
+#include <unity.h>
+
+#include "../src/cbot_private.h"
+
+struct sent {
+	char dest[64];
+	char msg[64];
+	int count;
+};
+
+static struct cbot *bot;
+static struct cbot_backend *irc_be, *sig_be;
+static struct sent irc_sent, sig_sent;
+static struct cbot_plugpriv priv;
+
+static uint64_t record_send(const struct cbot_backend *be, const char *to,
+                            const struct cbot_reaction_ops *ops, void *arg,
+                            const char *msg)
+{
+	struct sent *sent = be->priv;
+	strncpy(sent->dest, to, sizeof(sent->dest) - 1);
+	strncpy(sent->msg, msg, sizeof(sent->msg) - 1);
+	sent->count++;
+	return 0;
+}
+
+static void record_nick(const struct cbot_backend *be, const char *newnick)
+{
+	struct sent *sent = be->priv;
+	sent->count++;
+}
+
+/* Like Signal, events name "group" channels differently to configuration */
+static char *record_channel_name(const struct cbot_backend *be,
+                                 const char *name)
+{
+	struct sc_charbuf cb;
+
+	if (strncmp(name, "group:", 6) != 0)
+		return NULL;
+	sc_cb_init(&cb, 64);
+	sc_cb_printf(&cb, "@(%s)", name);
+	return cb.buf;
+}
+
+static struct cbot_backend_ops record_ops = {
+	.name = "record",
+	.send = record_send,
+	.nick = record_nick,
+	.channel_name = record_channel_name,
+};
+
+static void reply_handler(struct cbot_event *event, void *user)
+{
+	struct cbot_message_event *mevent = (struct cbot_message_event *)event;
+	TEST_ASSERT_EQUAL_PTR(user, mevent->backend);
+	/* A user we've never seen: routed to the backend handling the event */
+	cbot_send(event->bot, "stranger", "hello");
+}
+
+void setUp(void)
+{
+	bot = cbot_create();
+	bot->name = strdup("cbot");
+	/* cbot_delete() frees this */
+	bot->lwt_ctx = sc_lwt_init();
+	memset(&irc_sent, 0, sizeof(irc_sent));
+	memset(&sig_sent, 0, sizeof(sig_sent));
+	irc_be = cbot_backend_add(bot, &record_ops, "irc");
+	irc_be->priv = &irc_sent;
+	sig_be = cbot_backend_add(bot, &record_ops, "signal");
+	sig_be->priv = &sig_sent;
+	memset(&priv, 0, sizeof(priv));
+	priv.bot = bot;
+	sc_list_init(&priv.handlers);
+}
+
+void tearDown(void)
+{
+	cbot_delete(bot);
+}
+
+static void test_default(void)
+{
+	TEST_ASSERT_EQUAL_PTR(irc_be, cbot_backend_default(bot));
+	TEST_ASSERT_EQUAL_STRING("signal", cbot_backend_name(sig_be));
+	cbot_send(bot, "#unknown", "hi");
+	TEST_ASSERT_EQUAL(1, irc_sent.count);
+	TEST_ASSERT_EQUAL(0, sig_sent.count);
+}
+
+static void test_format(void)
+{
+	cbot_send(bot, "#a", "%s", "plain");
+	TEST_ASSERT_EQUAL_STRING("plain", irc_sent.msg);
+	cbot_send(bot, "#a", "%s", NULL);
+	TEST_ASSERT_EQUAL_STRING("(null)", irc_sent.msg);
+	cbot_send(bot, "#a", "%d %s", 1, "two");
+	TEST_ASSERT_EQUAL_STRING("1 two", irc_sent.msg);
+}
+
+static void test_learned(void)
+{
+	cbot_backend_learn(irc_be, "#cbot");
+	cbot_backend_learn(sig_be, "group");
+	cbot_backend_learn(sig_be, "#b");
+	cbot_backend_learn(irc_be, "#a");
+
+	cbot_send(bot, "group", "hi");
+	TEST_ASSERT_EQUAL(1, sig_sent.count);
+	TEST_ASSERT_EQUAL_STRING("group", sig_sent.dest);
+	cbot_send(bot, "#a", "hi");
+	cbot_send(bot, "#cbot", "hi");
+	TEST_ASSERT_EQUAL(2, irc_sent.count);
+	TEST_ASSERT_EQUAL_PTR(sig_be, cbot_backend_route(bot, "#b"));
+
+	/* The most recent backend to see a destination wins */
+	cbot_backend_learn(sig_be, "#cbot");
+	TEST_ASSERT_EQUAL_PTR(sig_be, cbot_backend_route(bot, "#cbot"));
+}
+
+static void test_event(void)
+{
+	struct cbot_handler *hdlr;
+
+	hdlr = cbot_register_priv(bot, &priv, CBOT_MESSAGE, reply_handler,
+	                          sig_be, NULL, 0);
+	cbot_handle_message(sig_be, "group", "user", "hi", false, false);
+	cbot_deregister(bot, hdlr);
+	TEST_ASSERT_EQUAL(1, sig_sent.count);
+	TEST_ASSERT_EQUAL_STRING("stranger", sig_sent.dest);
+	TEST_ASSERT_EQUAL(0, sig_be->handling);
+
+	/* The channel is now known to belong to the Signal backend */
+	TEST_ASSERT_EQUAL_PTR(sig_be, cbot_backend_route(bot, "group"));
+	TEST_ASSERT_EQUAL_PTR(irc_be, cbot_backend_route(bot, "stranger"));
+}
+
+static void add_channel(struct cbot_backend *be, const char *name)
+{
+	struct cbot_channel_conf *chan = calloc(1, sizeof(*chan));
+
+	chan->name = strdup(name);
+	sc_list_insert_end(&be->init_channels, &chan->list);
+}
+
+static void test_seed(void)
+{
+	add_channel(irc_be, "#cbot");
+	add_channel(sig_be, "group:abc=");
+	add_channel(sig_be, "#signal");
+	cbot_backend_seed_routes(bot);
+
+	TEST_ASSERT_EQUAL_PTR(irc_be, cbot_backend_route(bot, "#cbot"));
+	TEST_ASSERT_EQUAL_PTR(sig_be, cbot_backend_route(bot, "#signal"));
+	/* Under the name events use, not the configured one */
+	TEST_ASSERT_EQUAL_PTR(sig_be, cbot_backend_route(bot, "@(group:abc=)"));
+	cbot_send(bot, "@(group:abc=)", "hi");
+	TEST_ASSERT_EQUAL(1, sig_sent.count);
+	TEST_ASSERT_EQUAL_STRING("@(group:abc=)", sig_sent.dest);
+	/* Configured channels aren't counted against the limit */
+	TEST_ASSERT_EQUAL(0, bot->nroutes);
+}
+
+static void test_route_limit(void)
+{
+	char dest[32];
+	int i;
+
+	add_channel(sig_be, "#signal");
+	cbot_backend_seed_routes(bot);
+	for (i = 0; i <= CBOT_ROUTE_MAX; i++) {
+		snprintf(dest, sizeof(dest), "user%d", i);
+		cbot_backend_learn(sig_be, dest);
+		/* Seeing user0 again keeps it */
+		if (i == CBOT_ROUTE_MAX / 2)
+			cbot_backend_learn(sig_be, "user0");
+	}
+	TEST_ASSERT_EQUAL(CBOT_ROUTE_MAX, bot->nroutes);
+
+	/* The least recently seen was forgotten, and goes to the default */
+	TEST_ASSERT_EQUAL_PTR(irc_be, cbot_backend_route(bot, "user1"));
+	TEST_ASSERT_EQUAL_PTR(sig_be, cbot_backend_route(bot, "user0"));
+	TEST_ASSERT_EQUAL_PTR(sig_be, cbot_backend_route(bot, "user2"));
+	snprintf(dest, sizeof(dest), "user%d", CBOT_ROUTE_MAX);
+	TEST_ASSERT_EQUAL_PTR(sig_be, cbot_backend_route(bot, dest));
+	TEST_ASSERT_EQUAL_PTR(sig_be, cbot_backend_route(bot, "#signal"));
+}
+
+struct interleaved {
+	struct cbot_backend *be;
+	const char *stranger;
+};
+
+/* Yield partway through, so the other backend's handler runs meanwhile */
+static void yield_handler(struct cbot_event *event, void *user)
+{
+	struct cbot_message_event *mevent = (struct cbot_message_event *)event;
+	struct interleaved *il = user;
+
+	if (mevent->backend != il->be)
+		return;
+	sc_lwt_set_state(sc_lwt_current(), SC_LWT_RUNNABLE);
+	sc_lwt_yield();
+	cbot_send(event->bot, il->stranger, "hello");
+}
+
+static void handle_thread(void *arg)
+{
+	struct interleaved *il = arg;
+
+	cbot_handle_message(il->be, "user", "user", "hi", false, true);
+}
+
+static void test_interleaved(void)
+{
+	struct interleaved irc_il = { irc_be, "irc stranger" };
+	struct interleaved sig_il = { sig_be, "signal stranger" };
+	struct cbot_handler *irc_hdlr, *sig_hdlr;
+
+	irc_hdlr = cbot_register_priv(bot, &priv, CBOT_MESSAGE, yield_handler,
+	                              &irc_il, NULL, 0);
+	sig_hdlr = cbot_register_priv(bot, &priv, CBOT_MESSAGE, yield_handler,
+	                              &sig_il, NULL, 0);
+	sc_lwt_create_task(bot->lwt_ctx, handle_thread, &sig_il);
+	sc_lwt_create_task(bot->lwt_ctx, handle_thread, &irc_il);
+	sc_lwt_run(bot->lwt_ctx);
+	cbot_deregister(bot, irc_hdlr);
+	cbot_deregister(bot, sig_hdlr);
+
+	/* Each reply went to the backend of the event it handled */
+	TEST_ASSERT_EQUAL(1, irc_sent.count);
+	TEST_ASSERT_EQUAL_STRING("irc stranger", irc_sent.dest);
+	TEST_ASSERT_EQUAL(1, sig_sent.count);
+	TEST_ASSERT_EQUAL_STRING("signal stranger", sig_sent.dest);
+}
+
+static void test_nick(void)
+{
+	cbot_nick(bot, "newname");
+	TEST_ASSERT_EQUAL(1, irc_sent.count);
+	TEST_ASSERT_EQUAL(1, sig_sent.count);
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_default);
+	RUN_TEST(test_format);
+	RUN_TEST(test_learned);
+	RUN_TEST(test_event);
+	RUN_TEST(test_seed);
+	RUN_TEST(test_route_limit);
+	RUN_TEST(test_interleaved);
+	RUN_TEST(test_nick);
+	return UNITY_END();
+}
@@ -0,0 +1,81 @@
+/**
+ * bench.c: tools for benchmarking cbot
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+static unsigned long allocs;
+
+#ifdef __GLIBC__
+/*
+ * glibc lets a program replace malloc, and its own calls go through the
+ * replacement, so we can count every allocation by wrapping the real one.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+bool BENCH_counting_allocs(void)
+{
+	return true;
+}
+#else
+bool BENCH_counting_allocs(void)
+{
+	return false;
+}
+#endif
+
+unsigned long BENCH_allocs(void)
+{
+	return __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+}
+
+void BENCH_start(struct BENCH *b, const char *name, unsigned long iters)
+{
+	b->name = name;
+	b->iters = iters;
+	b->allocs = BENCH_allocs();
+	clock_gettime(CLOCK_MONOTONIC, &b->start);
+}
+
+double BENCH_end(struct BENCH *b)
+{
+	struct timespec end;
+	unsigned long nallocs = BENCH_allocs() - b->allocs;
+	double ns, per_op = (double)nallocs / b->iters;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = (end.tv_sec - b->start.tv_sec) * 1e9 +
+	     (end.tv_nsec - b->start.tv_nsec);
+	printf("{\"name\": \"%s\", \"iters\": %lu, \"ns_per_op\": %.1f, "
+	       "\"ops_per_sec\": %.0f, ",
+	       b->name, b->iters, ns / b->iters, b->iters / (ns / 1e9));
+	if (BENCH_counting_allocs())
+		printf("\"allocs_per_op\": %.3f}\n", per_op);
+	else
+		printf("\"allocs_per_op\": null}\n");
+	fflush(stdout);
+	return per_op;
+}
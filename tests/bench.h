@@ -0,0 +1,53 @@
+/**
+ * bench.h: tools for benchmarking cbot
+ *
+ * A benchmark runs some operation a fixed number of times between
+ * BENCH_start() and BENCH_end(), which prints the result as a line of JSON.
+ * Where the C library allows it, heap allocations are counted too, so that
+ * benchmarks can check that a hot path does not allocate. All declarations are
+ * prefixed "BENCH_" to distinguish them from the cbot API.
+ */
+
+#ifndef CBOT_BENCH_H
+#define CBOT_BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * A running benchmark
+ */
+struct BENCH {
+	const char *name;
+	unsigned long iters;
+	struct timespec start;
+	unsigned long allocs;
+};
+
+/**
+ * Return true if allocations are being counted
+ */
+bool BENCH_counting_allocs(void);
+
+/**
+ * Return the number of heap allocations made so far
+ */
+unsigned long BENCH_allocs(void);
+
+/**
+ * Begin timing a benchmark
+ * @param b Benchmark to start
+ * @param name Name to report it as
+ * @param iters Number of operations that will be run
+ */
+void BENCH_start(struct BENCH *b, const char *name, unsigned long iters);
+
+/**
+ * Finish a benchmark and print its results as JSON
+ * @param b Benchmark to end
+ * @returns Allocations per operation (0 if they are not counted)
+ */
+double BENCH_end(struct BENCH *b);
+
+#endif // CBOT_BENCH_H
@@ -0,0 +1,363 @@
+/**
+ * bench_micro.c: microbenchmarks of cbot's hot paths
+ *
+ * Usage: bench_micro [NAME ...]
+ *
+ * Each benchmark runs a fixed number of iterations over fixed inputs, after a
+ * warmup, and prints one line of JSON (see bench.h). With arguments, only the
+ * named benchmarks are run. Compare the output between releases to catch
+ * regressions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nosj.h>
+#include <sc-collections.h>
+#include <sqlite3.h>
+
+#include "../src/cbot_private.h"
+#include "../src/signal/internal.h"
+#include "bench.h"
+#include "cbot/cbot.h"
+#include "cbot/db.h"
+#include "cbot/json.h"
+#include "plugintest.h"
+
+#define WARMUP 1000
+
+static struct cbot *bot;
+
+static void bench_format2(void)
+{
+	struct sc_charbuf cb;
+	struct BENCH b;
+	unsigned long i, iters = 500000;
+
+	sc_cb_init(&cb, 256);
+	for (i = 0; i < WARMUP; i++) {
+		sc_cb_clear(&cb);
+		cbot_dfmt(&cb, "{%s} now has {%d} karma", "cbot", 42);
+	}
+	BENCH_start(&b, "format2", iters);
+	for (i = 0; i < iters; i++) {
+		sc_cb_clear(&cb);
+		cbot_dfmt(&cb, "{%s} now has {%d} karma", "cbot", (int)i);
+	}
+	BENCH_end(&b);
+	sc_cb_destroy(&cb);
+}
+
+static void bench_tokenize(void)
+{
+	const char *msg = "cbot: remind me in 5 minutes \"to check the oven\" "
+	                  "and 'the laundry' please";
+	struct cbot_tok tok;
+	struct BENCH b;
+	unsigned long i, iters = 500000;
+
+	for (i = 0; i < WARMUP; i++) {
+		cbot_tokenize(msg, &tok);
+		cbot_tok_destroy(&tok);
+	}
+	BENCH_start(&b, "tokenize", iters);
+	for (i = 0; i < iters; i++) {
+		cbot_tokenize(msg, &tok);
+		cbot_tok_destroy(&tok);
+	}
+	BENCH_end(&b);
+}
+
+static void bench_addressed(void)
+{
+	/* Not addressed, addressed by name, and addressed by alias */
+	const char *msgs[] = {
+		"the quick brown fox jumps over the lazy dog",
+		"benchbot: what is the weather",
+		"bb, what is the weather",
+	};
+	struct BENCH b;
+	unsigned long i, iters = 3000000;
+	int total = 0;
+
+	BENCH_start(&b, "addressed", iters);
+	for (i = 0; i < iters; i++)
+		total += cbot_addressed(bot, msgs[i % nelem(msgs)]);
+	BENCH_end(&b);
+	if (total == 0)
+		fprintf(stderr, "bench_micro: addressed: no matches\n");
+}
+
+static const char mention_json[] =
+        "{\"message\": \"hey \\ufffc, have you seen \\ufffc?\", "
+        "\"mentions\": ["
+        "{\"start\": 4, \"length\": 1, "
+        "\"uuid\": \"0d6ee7ec-3bd5-4e0e-9ac2-0b2c7c4de3f1\"}, "
+        "{\"start\": 21, \"length\": 1, "
+        "\"uuid\": \"6b2ab1ba-6a10-4fd5-9a4d-7a3b21c5f2e0\"}]}";
+
+static void bench_mention_from_json(void)
+{
+	struct json_easy *je;
+	struct BENCH b;
+	uint32_t mentions;
+	char *message;
+	unsigned long i, iters = 200000;
+
+	je = json_easy_new(mention_json);
+	if (json_easy_parse(je) != JSON_OK ||
+	    je_get_array(je, 0, "mentions", &mentions) != JSON_OK ||
+	    je_get_string(je, 0, "message", &message) != JSON_OK) {
+		fprintf(stderr, "bench_micro: bad mention JSON\n");
+		json_easy_destroy(je);
+		return;
+	}
+	for (i = 0; i < WARMUP; i++)
+		free(mention_from_json(message, je, mentions));
+	BENCH_start(&b, "mention_from_json", iters);
+	for (i = 0; i < iters; i++)
+		free(mention_from_json(message, je, mentions));
+	BENCH_end(&b);
+	free(message);
+	json_easy_destroy(je);
+}
+
+static void bench_json_quote_mention(void)
+{
+	const char *msg = "hey @(uuid:0d6ee7ec-3bd5-4e0e-9ac2-0b2c7c4de3f1), "
+	                  "have you seen "
+	                  "@(uuid:6b2ab1ba-6a10-4fd5-9a4d-7a3b21c5f2e0)? "
+	                  "\"quotes\" and \\backslashes\\ need escaping";
+	struct sc_charbuf cb;
+	struct sc_array ms;
+	struct BENCH b;
+	unsigned long i, iters = 500000;
+
+	sc_cb_init(&cb, 256);
+	sc_arr_init(&ms, struct signal_mention, 4);
+	for (i = 0; i < WARMUP; i++) {
+		sc_cb_clear(&cb);
+		json_quote_mention_cb(&cb, msg, &ms);
+	}
+	BENCH_start(&b, "json_quote_mention", iters);
+	for (i = 0; i < iters; i++) {
+		sc_cb_clear(&cb);
+		json_quote_mention_cb(&cb, msg, &ms);
+	}
+	BENCH_end(&b);
+	sc_arr_destroy(&ms);
+	sc_cb_destroy(&cb);
+}
+
+#define JMSG_LINES 64
+#define JMSG_FORMAT                                                            \
+	"{\"jsonrpc\":\"2.0\",\"method\":\"receive\",\"params\":"              \
+	"{\"envelope\":{\"source\":\"+15550000%03lu\","                        \
+	"\"sourceUuid\":\"0d6ee7ec-3bd5-4e0e-9ac2-0b2c7c4de3f1\","             \
+	"\"timestamp\":%lu,\"dataMessage\":{\"timestamp\":%lu,"                \
+	"\"message\":\"message number %lu\","                                  \
+	"\"groupInfo\":{\"groupId\":\"Z3JvdXA=\"}}}}}\n"
+
+static void jmsg_split_once(struct sc_charbuf *cb, const char *data,
+                            size_t len)
+{
+	struct sc_list_head list;
+	struct jmsg *jm, *next;
+
+	sc_list_init(&list);
+	memcpy(cb->buf, data, len);
+	cb->length = len;
+	if (jmsg_split(cb, &list) != JMSG_LINES)
+		fprintf(stderr, "bench_micro: jmsg_split: wrong count\n");
+	sc_list_for_each_safe(jm, next, &list, list, struct jmsg)
+	{
+		sc_list_remove(&jm->list);
+		jmsg_free(jm);
+	}
+}
+
+static void bench_jmsg_split(void)
+{
+	struct sc_charbuf data, cb;
+	struct BENCH b;
+	unsigned long i, iters = 20000;
+
+	/* A read()'s worth of signal-cli notifications */
+	sc_cb_init(&data, 16384);
+	for (i = 0; i < JMSG_LINES; i++)
+		sc_cb_printf(&data, JMSG_FORMAT, i, 1700000000000 + i,
+		             1700000000000 + i, i);
+	sc_cb_init(&cb, data.length + 1);
+
+	for (i = 0; i < WARMUP / JMSG_LINES; i++)
+		jmsg_split_once(&cb, data.buf, data.length);
+	BENCH_start(&b, "jmsg_split", iters * JMSG_LINES);
+	for (i = 0; i < iters; i++)
+		jmsg_split_once(&cb, data.buf, data.length);
+	BENCH_end(&b);
+	sc_cb_destroy(&cb);
+	sc_cb_destroy(&data);
+}
+
+static void noop_handler(struct cbot_event *event, void *user)
+{
+	(*(unsigned long *)user)++;
+}
+
+#define DISPATCH_HANDLERS 32
+
+static void bench_dispatch(void)
+{
+	const char *msgs[] = {
+		"the quick brown fox jumps over the lazy dog",
+		"trigger7 with some arguments",
+		"benchbot: trigger3 something",
+		"lunch++",
+	};
+	struct cbot_backend *be = cbot_backend_default(bot);
+	struct cbot_handler *hdlrs[DISPATCH_HANDLERS];
+	struct cbot_plugpriv priv = { 0 };
+	struct BENCH b;
+	unsigned long i, iters = 200000, calls = 0;
+	char regex[64];
+
+	/* Most handlers are regexes which rarely match, as in real plugins */
+	priv.name = "bench";
+	priv.bot = bot;
+	sc_list_init(&priv.handlers);
+	for (i = 0; i < DISPATCH_HANDLERS; i++) {
+		snprintf(regex, sizeof(regex), "trigger%lu (.*)", i);
+		hdlrs[i] = cbot_register_priv(bot, &priv,
+		                              i % 2 ? CBOT_MESSAGE
+		                                    : CBOT_ADDRESSED,
+		                              noop_handler, &calls, regex, 0);
+	}
+
+	for (i = 0; i < WARMUP; i++)
+		cbot_handle_message(be, "#bench", "user",
+		                    msgs[i % nelem(msgs)], false, false);
+	BENCH_start(&b, "dispatch_32_regex", iters);
+	for (i = 0; i < iters; i++)
+		cbot_handle_message(be, "#bench", "user",
+		                    msgs[i % nelem(msgs)], false, false);
+	BENCH_end(&b);
+	if (calls == 0)
+		fprintf(stderr, "bench_micro: dispatch: no handlers called\n");
+
+	for (i = 0; i < DISPATCH_HANDLERS; i++)
+		cbot_deregister(bot, hdlrs[i]);
+}
+
+static int bench_db_get(struct cbot *bot, char *key)
+{
+	CBOTDB_QUERY_FUNC_BEGIN(bot, void,
+	                        "SELECT value FROM bench WHERE key=$key;");
+	CBOTDB_BIND_ARG(text, key);
+	CBOTDB_SINGLE_INTEGER_RESULT();
+}
+
+static int bench_db_set(struct cbot *bot, char *key, int value)
+{
+	CBOTDB_QUERY_FUNC_BEGIN(bot, void,
+	                        "INSERT INTO bench(key, value) "
+	                        "VALUES($key, $value) "
+	                        "ON CONFLICT(key) DO UPDATE "
+	                        "SET value=excluded.value;");
+	CBOTDB_BIND_ARG(text, key);
+	CBOTDB_BIND_ARG(int, value);
+	CBOTDB_NO_RESULT();
+}
+
+#define DB_KEYS 100
+
+static void bench_db(void)
+{
+	struct sc_list_head members;
+	struct BENCH b;
+	unsigned long i, iters = 100000;
+	char key[32];
+
+	if (sqlite3_exec(cbot_db_conn(bot),
+	                 "CREATE TABLE bench(key TEXT PRIMARY KEY, value INT);",
+	                 NULL, NULL, NULL) != SQLITE_OK) {
+		fprintf(stderr, "bench_micro: %s\n",
+		        sqlite3_errmsg(cbot_db_conn(bot)));
+		return;
+	}
+	for (i = 0; i < DB_KEYS; i++) {
+		snprintf(key, sizeof(key), "key%lu", i);
+		bench_db_set(bot, key, i);
+		snprintf(key, sizeof(key), "user%lu", i);
+		cbot_add_membership(bot, key, "#bench");
+	}
+
+	BENCH_start(&b, "db_single_integer", iters);
+	for (i = 0; i < iters; i++) {
+		snprintf(key, sizeof(key), "key%lu", i % DB_KEYS);
+		bench_db_get(bot, key);
+	}
+	BENCH_end(&b);
+
+	BENCH_start(&b, "db_upsert", iters);
+	for (i = 0; i < iters; i++) {
+		snprintf(key, sizeof(key), "key%lu", i % DB_KEYS);
+		bench_db_set(bot, key, i);
+	}
+	BENCH_end(&b);
+
+	/* Join query returning a list of DB_KEYS structs */
+	iters = 2000;
+	BENCH_start(&b, "db_list", iters);
+	for (i = 0; i < iters; i++) {
+		sc_list_init(&members);
+		cbot_get_members(bot, "#bench", &members);
+		cbot_user_info_free_all(&members);
+	}
+	BENCH_end(&b);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} benches[] = {
+	{ "format2", bench_format2 },
+	{ "tokenize", bench_tokenize },
+	{ "addressed", bench_addressed },
+	{ "mention_from_json", bench_mention_from_json },
+	{ "json_quote_mention", bench_json_quote_mention },
+	{ "jmsg_split", bench_jmsg_split },
+	{ "dispatch", bench_dispatch },
+	{ "db", bench_db },
+};
+
+static bool selected(const char *name, int argc, char **argv)
+{
+	int i;
+
+	if (argc < 2)
+		return true;
+	for (i = 1; i < argc; i++)
+		if (strcmp(argv[i], name) == 0)
+			return true;
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+
+	cbot_set_log_file(stderr);
+	cbot_set_log_level(WARN);
+	bot = PT_bot_create("benchbot");
+	if (!bot)
+		return 1;
+	cbot_add_alias(bot, "bb");
+
+	for (i = 0; i < nelem(benches); i++)
+		if (selected(benches[i].name, argc, argv))
+			benches[i].run();
+
+	PT_bot_destroy(bot);
+	return 0;
+}
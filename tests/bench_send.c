@@ -0,0 +1,92 @@
+/**
+ * bench_send.c: benchmark the Signal send path
+ *
+ * Sends messages through cbot_send(), the signal-cli bridge's request
+ * serialization and the output queue, into one end of a socket pair. Once the
+ * reusable buffers have grown to fit, a send should not allocate at all.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../src/cbot_private.h"
+#include "../src/signal/internal.h"
+#include "bench.h"
+
+#define WARMUP 1000
+#define ITERS  200000
+
+static int peer;
+
+/* Like cbot_signal_send(), but don't wait for a result which won't come */
+static uint64_t bench_signal_send(const struct cbot_backend *be,
+                                  const char *to,
+                                  const struct cbot_reaction_ops *ops,
+                                  void *arg, const char *msg)
+{
+	char buf[4096];
+
+	signal_send_request(be->priv, to, msg);
+	while (read(peer, buf, sizeof(buf)) == sizeof(buf))
+		;
+	return 0;
+}
+
+static struct cbot_backend_ops bench_ops = {
+	.name = "bench",
+	.send = bench_signal_send,
+};
+
+static void send_many(struct cbot *bot, unsigned long iters)
+{
+	unsigned long i;
+
+	for (i = 0; i < iters; i++)
+		cbot_send(bot, "@(uuid:0d6ee7ec-3bd5-4e0e-9ac2-0b2c7c4de3f1)",
+		          "hello @(uuid:6b2ab1ba-6a10-4fd5-9a4d-7a3b21c5f2e0), "
+		          "you have \"%lu\" karma",
+		          i);
+}
+
+int main(int argc, char **argv)
+{
+	struct cbot_signal_backend sig = { 0 };
+	struct cbot_backend be = { 0 };
+	struct cbot bot = { 0 };
+	struct BENCH b;
+	int sv[2];
+	double allocs;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+	peer = sv[1];
+	sig.fd = sv[0];
+	sig.bridge = &signalcli_bridge;
+	sc_cb_init(&sig.out, 1024);
+	sc_arr_init(&sig.mentions, struct signal_mention, 4);
+	signal_outq_init(&sig.outq, sig.fd);
+	be.bot = &bot;
+	be.ops = &bench_ops;
+	be.priv = &sig;
+	sig.bot = &bot;
+	sig.be = &be;
+	sc_list_init(&bot.backends);
+	sc_list_insert_end(&bot.backends, &be.list);
+	bot.nbackends = 1;
+
+	send_many(&bot, WARMUP);
+	BENCH_start(&b, "signal_send", ITERS);
+	send_many(&bot, ITERS);
+	allocs = BENCH_end(&b);
+
+	sc_cb_destroy(&sig.out);
+	sc_arr_destroy(&sig.mentions);
+	signal_outq_destroy(&sig.outq);
+	close(sv[0]);
+	close(sv[1]);
+	return allocs > 0 ? 1 : 0;
+}
@@ -0,0 +1,186 @@
+/**
+ * bench_wakeup.c: benchmark waking an I/O thread, select-style vs. persistent
+ *
+ * Two LWTs pass a byte back and forth over a pair of pipes, while the "server"
+ * thread also watches a number of idle pipes, as the IRC, curl and HTTP threads
+ * watch sockets which are mostly quiet. Each round is one wakeup of each
+ * thread.
+ *
+ * In "select" mode, the server rebuilds fd_sets and re-adds them to the
+ * scheduler on every wakeup (sc_lwt_add_select_fds() and friends), so a wakeup
+ * costs time proportional to the highest fd. In "persistent" mode, it registers
+ * each fd once with sc_lwt_wait_fd(), and only asks about the fd it expects to
+ * be ready.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#include <sc-lwt.h>
+
+#include "bench.h"
+
+#define ROUNDS 20000
+
+struct wakeup {
+	bool persistent;
+	int nidle;
+	int (*idle)[2]; /* pipes which are never written */
+	int ping[2];
+	int pong[2];
+	int maxfd;
+};
+
+static void client_thread(void *arg)
+{
+	struct wakeup *w = arg;
+	struct sc_lwt *cur = sc_lwt_current();
+	char c = 'x';
+	int i;
+
+	sc_lwt_wait_fd(cur, w->pong[0], SC_LWT_W_IN, NULL);
+	for (i = 0; i < ROUNDS; i++) {
+		if (write(w->ping[1], &c, 1) != 1)
+			break;
+		do {
+			sc_lwt_set_state(cur, SC_LWT_BLOCKED);
+			sc_lwt_yield();
+		} while (!sc_lwt_fd_status(cur, w->pong[0], NULL));
+		if (read(w->pong[0], &c, 1) != 1)
+			break;
+	}
+	sc_lwt_remove_all(cur);
+}
+
+/* Wait for the ping fd, rebuilding the set of fds on every wakeup */
+static void select_wait(struct wakeup *w, struct sc_lwt *cur)
+{
+	fd_set in_fd, out_fd, err_fd;
+	int i;
+
+	do {
+		sc_lwt_fdgen_advance(cur);
+		sc_lwt_clear_fds(&in_fd, &out_fd, &err_fd);
+		for (i = 0; i < w->nidle; i++)
+			FD_SET(w->idle[i][0], &in_fd);
+		FD_SET(w->ping[0], &in_fd);
+		sc_lwt_add_select_fds(cur, &in_fd, &out_fd, &err_fd, w->maxfd,
+		                      NULL);
+		sc_lwt_fdgen_purge(cur);
+
+		sc_lwt_set_state(cur, SC_LWT_BLOCKED);
+		sc_lwt_yield();
+
+		sc_lwt_clear_fds(&in_fd, &out_fd, &err_fd);
+		sc_lwt_populate_ready_fds(cur, &in_fd, &out_fd, &err_fd,
+		                          w->maxfd);
+	} while (!FD_ISSET(w->ping[0], &in_fd));
+}
+
+/* Wait for the ping fd, which is already registered */
+static void persistent_wait(struct wakeup *w, struct sc_lwt *cur)
+{
+	do {
+		sc_lwt_set_state(cur, SC_LWT_BLOCKED);
+		sc_lwt_yield();
+	} while (!sc_lwt_fd_status(cur, w->ping[0], NULL));
+}
+
+static void server_thread(void *arg)
+{
+	struct wakeup *w = arg;
+	struct sc_lwt *cur = sc_lwt_current();
+	char c;
+	int i;
+
+	if (w->persistent) {
+		for (i = 0; i < w->nidle; i++)
+			sc_lwt_wait_fd(cur, w->idle[i][0], SC_LWT_W_IN,
+			               NULL);
+		sc_lwt_wait_fd(cur, w->ping[0], SC_LWT_W_IN, NULL);
+	}
+	for (i = 0; i < ROUNDS; i++) {
+		if (w->persistent)
+			persistent_wait(w, cur);
+		else
+			select_wait(w, cur);
+		if (read(w->ping[0], &c, 1) != 1)
+			break;
+		if (write(w->pong[1], &c, 1) != 1)
+			break;
+	}
+	sc_lwt_remove_all(cur);
+}
+
+static int max(int a, int b)
+{
+	return a > b ? a : b;
+}
+
+static int run(bool persistent, int nidle)
+{
+	struct wakeup w = { .ping = { -1, -1 }, .pong = { -1, -1 } };
+	struct sc_lwt_ctx *ctx;
+	struct BENCH b;
+	char name[64];
+	int i, ret = -1;
+
+	w.persistent = persistent;
+	w.idle = calloc(nidle ? nidle : 1, sizeof(*w.idle));
+	if (pipe(w.ping) < 0 || pipe(w.pong) < 0) {
+		perror("pipe");
+		goto out;
+	}
+	w.maxfd = max(w.ping[0], w.pong[0]);
+	for (w.nidle = 0; w.nidle < nidle; w.nidle++) {
+		if (pipe(w.idle[w.nidle]) < 0) {
+			perror("pipe");
+			goto out;
+		}
+		w.maxfd = max(w.maxfd, w.idle[w.nidle][1]);
+		if (w.maxfd >= FD_SETSIZE) {
+			/* The select path can't handle it */
+			fprintf(stderr, "bench_wakeup: fd %d is too large\n",
+			        w.maxfd);
+			w.nidle++;
+			goto out;
+		}
+	}
+
+	ctx = sc_lwt_init();
+	sc_lwt_create_task(ctx, server_thread, &w);
+	sc_lwt_create_task(ctx, client_thread, &w);
+	snprintf(name, sizeof(name), "wakeup_%s_%d",
+	         persistent ? "persistent" : "select", nidle);
+	BENCH_start(&b, name, ROUNDS);
+	sc_lwt_run(ctx);
+	BENCH_end(&b);
+	sc_lwt_free(ctx);
+	ret = 0;
+out:
+	for (i = 0; i < w.nidle; i++) {
+		close(w.idle[i][0]);
+		close(w.idle[i][1]);
+	}
+	free(w.idle);
+	close(w.ping[0]);
+	close(w.ping[1]);
+	close(w.pong[0]);
+	close(w.pong[1]);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	static const int nidle[] = { 0, 64, 256, 448 };
+	size_t i;
+
+	for (i = 0; i < sizeof(nidle) / sizeof(nidle[0]); i++) {
+		if (run(false, nidle[i]) < 0 || run(true, nidle[i]) < 0)
+			return 1;
+	}
+	return 0;
+}
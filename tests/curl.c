@@ -0,0 +1,777 @@
+/**
+ * curl.c: tests for the curl integration, against a local HTTP server
+ *
+ * Every test runs within one LWT, alongside the bot's curl thread, so that
+ * requests go through the same multi handle and socket driver as in cbot.
+ * The response cache persists from one test to the next, so each test uses
+ * paths of its own.
+ */
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libconfig.h>
+#include <sc-lwt.h>
+#include <unity.h>
+
+#include "../src/cbot_private.h"
+#include "cbot/curl.h"
+#include "httptest.h"
+
+/* Small enough that the eviction test can fill it */
+#define CACHE_SIZE 1024
+
+static struct cbot *bot;
+static struct sc_lwt *runner;
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+	HT_reset();
+}
+
+/* Fetch a URL on an LWT of its own, to exercise coalescing */
+struct fetch {
+	const char *url;
+	char *body;
+	bool done;
+};
+
+static void fetch_thread(void *arg)
+{
+	struct fetch *f = arg;
+
+	f->body = cbot_curl_get(bot, "%s", f->url);
+	f->done = true;
+	sc_lwt_set_state(runner, SC_LWT_RUNNABLE);
+}
+
+static void fetch_start(struct fetch *f, const char *url)
+{
+	f->url = url;
+	f->body = NULL;
+	f->done = false;
+	sc_lwt_create_task(cbot_get_lwt_ctx(bot), fetch_thread, f);
+}
+
+static void fetch_wait(struct fetch *f)
+{
+	while (!f->done) {
+		sc_lwt_set_state(runner, SC_LWT_BLOCKED);
+		sc_lwt_yield();
+	}
+}
+
+static long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Get a URL twice, returning how many requests the server saw */
+static int get_twice(const char *path, const struct HT_response *resp)
+{
+	const char *url = HT_route(path, resp);
+	char *body;
+
+	for (int i = 0; i < 2; i++) {
+		body = cbot_curl_get(bot, "%s", url);
+		TEST_ASSERT_NOT_NULL(body);
+		TEST_ASSERT_EQUAL_STRING(resp->body, body);
+		free(body);
+	}
+	return HT_requests(path);
+}
+
+static void test_max_age(void)
+{
+	struct HT_response resp = {
+		.status = 200,
+		.headers = "Cache-Control: public, max-age=60\r\n",
+		.body = "fresh",
+	};
+	struct HT_response lower = {
+		.status = 200,
+		.headers = "cache-control:max-age=60\r\n",
+		.body = "fresh",
+	};
+
+	TEST_ASSERT_EQUAL(1, get_twice("/max-age", &resp));
+	/* Header names are case insensitive, and whitespace is optional */
+	TEST_ASSERT_EQUAL(1, get_twice("/max-age-lower", &lower));
+}
+
+static void test_default_ttl(void)
+{
+	struct HT_response resp = { .status = 200, .body = "default" };
+
+	TEST_ASSERT_EQUAL(1, get_twice("/default-ttl", &resp));
+}
+
+static void test_no_store(void)
+{
+	struct HT_response resp = {
+		.status = 200,
+		.headers = "Cache-Control: no-store, max-age=60\r\n",
+		.body = "secret",
+	};
+	struct HT_response expired = {
+		.status = 200,
+		.headers = "Cache-Control: max-age=0\r\n",
+		.body = "stale",
+	};
+
+	TEST_ASSERT_EQUAL(2, get_twice("/no-store", &resp));
+	/* Expiring at once, with no validator, isn't worth keeping either */
+	TEST_ASSERT_EQUAL(2, get_twice("/max-age-0", &expired));
+}
+
+static void test_no_cache(void)
+{
+	struct HT_response resp = {
+		.status = 200,
+		.headers = "Cache-Control: no-cache\r\n",
+		.body = "validated",
+		.etag = "\"v1\"",
+	};
+
+	/* Kept for its validator, but revalidated on every use */
+	TEST_ASSERT_EQUAL(2, get_twice("/no-cache", &resp));
+	TEST_ASSERT_EQUAL(1, HT_conditional("/no-cache"));
+}
+
+static void test_revalidate(void)
+{
+	struct HT_response old = {
+		.status = 200,
+		.headers = "Cache-Control: max-age=0\r\n",
+		.body = "old",
+		.etag = "\"v1\"",
+	};
+	struct HT_response same = old, changed = old;
+	const char *url = HT_route("/revalidate", &old);
+	char *body;
+
+	body = cbot_curl_get(bot, "%s", url);
+	TEST_ASSERT_EQUAL_STRING("old", body);
+	free(body);
+
+	/* The server would now say "new", but it agrees that "v1" is current */
+	same.body = "new";
+	HT_route("/revalidate", &same);
+	body = cbot_curl_get(bot, "%s", url);
+	TEST_ASSERT_EQUAL_STRING("old", body);
+	free(body);
+	TEST_ASSERT_EQUAL(1, HT_conditional("/revalidate"));
+
+	changed.body = "new";
+	changed.etag = "\"v2\"";
+	HT_route("/revalidate", &changed);
+	body = cbot_curl_get(bot, "%s", url);
+	TEST_ASSERT_EQUAL_STRING("new", body);
+	free(body);
+	TEST_ASSERT_EQUAL(1, HT_conditional("/revalidate"));
+}
+
+static void test_error_status(void)
+{
+	struct HT_response missing = {
+		.status = 404,
+		.headers = "Cache-Control: max-age=60\r\n",
+		.body = "missing",
+	};
+
+	/* Error pages are returned, but not cached */
+	TEST_ASSERT_EQUAL(2, get_twice("/missing", &missing));
+}
+
+static void test_evict(void)
+{
+	char big[401], huge[CACHE_SIZE + 2];
+	struct HT_response resp = { .status = 200, .body = big };
+	struct HT_response too_big = { .status = 200, .body = huge };
+	const char *a = HT_route("/lru-a", &resp);
+	const char *b = HT_route("/lru-b", &resp);
+	const char *c = HT_route("/lru-c", &resp);
+	char *body;
+
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	memset(huge, 'x', sizeof(huge) - 1);
+	huge[sizeof(huge) - 1] = '\0';
+
+	/* Only two of these fit: "a" was used more recently than "b" */
+	free(cbot_curl_get(bot, "%s", a));
+	free(cbot_curl_get(bot, "%s", b));
+	free(cbot_curl_get(bot, "%s", a));
+	free(cbot_curl_get(bot, "%s", c));
+	TEST_ASSERT_EQUAL(1, HT_requests("/lru-a"));
+
+	body = cbot_curl_get(bot, "%s", a);
+	TEST_ASSERT_EQUAL_STRING(big, body);
+	free(body);
+	TEST_ASSERT_EQUAL(1, HT_requests("/lru-a"));
+	free(cbot_curl_get(bot, "%s", b));
+	TEST_ASSERT_EQUAL(2, HT_requests("/lru-b"));
+
+	/* A body larger than the whole cache is never kept */
+	TEST_ASSERT_EQUAL(2, get_twice("/too-big", &too_big));
+}
+
+static void test_coalesce(void)
+{
+	struct HT_response resp = {
+		.status = 200,
+		.headers = "Cache-Control: max-age=60\r\n",
+		.body = "slow",
+		.delay_ms = 200,
+	};
+	const char *url = HT_route("/coalesce", &resp);
+	struct fetch f[3];
+
+	for (int i = 0; i < 3; i++)
+		fetch_start(&f[i], url);
+	for (int i = 0; i < 3; i++) {
+		fetch_wait(&f[i]);
+		TEST_ASSERT_EQUAL_STRING("slow", f[i].body);
+		free(f[i].body);
+	}
+	TEST_ASSERT_EQUAL(1, HT_requests("/coalesce"));
+}
+
+static void test_coalesce_error(void)
+{
+	struct HT_response resp = {
+		.status = 500,
+		.body = "oops",
+		.delay_ms = 200,
+	};
+	const char *url = HT_route("/coalesce-error", &resp);
+	struct fetch f[2];
+
+	/* Waiters get the same answer as the request they waited on */
+	for (int i = 0; i < 2; i++)
+		fetch_start(&f[i], url);
+	for (int i = 0; i < 2; i++) {
+		fetch_wait(&f[i]);
+		TEST_ASSERT_EQUAL_STRING("oops", f[i].body);
+		free(f[i].body);
+	}
+	TEST_ASSERT_EQUAL(1, HT_requests("/coalesce-error"));
+}
+
+static void test_concurrent(void)
+{
+	struct HT_response resp = {
+		.status = 200,
+		.headers = "Cache-Control: no-store\r\n",
+		.body = "slow",
+		.delay_ms = 300,
+	};
+	char path[32];
+	struct fetch f[8];
+	long start = now_ms();
+
+	/* Different URLs, so each is a request of its own */
+	for (int i = 0; i < 8; i++) {
+		snprintf(path, sizeof(path), "/concurrent-%d", i);
+		fetch_start(&f[i], HT_route(path, &resp));
+	}
+	for (int i = 0; i < 8; i++) {
+		fetch_wait(&f[i]);
+		TEST_ASSERT_EQUAL_STRING("slow", f[i].body);
+		free(f[i].body);
+	}
+	/* The curl thread waits on all of their sockets at once */
+	TEST_ASSERT_LESS_THAN(4 * 300, now_ms() - start);
+}
+
+static void test_sequential(void)
+{
+	struct HT_response resp = {
+		.status = 200,
+		.headers = "Cache-Control: no-store\r\n",
+		.body = "again",
+	};
+	const char *url = HT_route("/sequential", &resp);
+	char *body;
+
+	/* Each request adds and removes its socket from the curl thread */
+	for (int i = 0; i < 20; i++) {
+		body = cbot_curl_get(bot, "%s", url);
+		TEST_ASSERT_EQUAL_STRING("again", body);
+		free(body);
+	}
+	TEST_ASSERT_EQUAL(20, HT_requests("/sequential"));
+}
+
+static void test_timer(void)
+{
+	struct HT_response resp = {
+		.status = 200,
+		.body = "too late",
+		.delay_ms = 1000,
+	};
+	const char *url = HT_route("/timer", &resp);
+	CURL *easy = curl_easy_init();
+	struct sc_charbuf buf;
+	long start = now_ms();
+	CURLcode rv;
+
+	/*
+	 * Nothing happens on the socket before curl's own timeout, so only the
+	 * timer callback can wake the curl thread to notice it.
+	 */
+	sc_cb_init(&buf, 64);
+	curl_easy_setopt(easy, CURLOPT_URL, url);
+	curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, 100L);
+	cbot_curl_charbuf_response(easy, &buf);
+	rv = cbot_curl_perform(bot, easy);
+	TEST_ASSERT_EQUAL(CURLE_OPERATION_TIMEDOUT, rv);
+	TEST_ASSERT_LESS_THAN(1000, now_ms() - start);
+	curl_easy_cleanup(easy);
+	sc_cb_destroy(&buf);
+}
+
+static void test_refused(void)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	socklen_t len = sizeof(addr);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	/* Find a port which nothing listens on */
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	getsockname(fd, (struct sockaddr *)&addr, &len);
+	close(fd);
+	TEST_ASSERT_NULL(cbot_curl_get(bot, "http://127.0.0.1:%d/",
+	                               ntohs(addr.sin_port)));
+}
+
+/* A handle which fetches a URL into a buffer */
+static CURL *easy_get(const char *url, struct sc_charbuf *buf)
+{
+	CURL *easy = curl_easy_init();
+
+	sc_cb_init(buf, 64);
+	curl_easy_setopt(easy, CURLOPT_URL, url);
+	cbot_curl_charbuf_response(easy, buf);
+	return easy;
+}
+
+/* Perform requests for paths with the given delays, then check the results */
+static size_t perform_many(const int *delays, size_t n,
+                           enum cbot_curl_wait mode, long timeout_ms,
+                           struct cbot_curl_req *reqs)
+{
+	struct HT_response resp[4];
+	struct sc_charbuf bufs[4];
+	char path[32];
+	size_t i, ndone;
+
+	memset(reqs, 0, n * sizeof(*reqs));
+	for (i = 0; i < n; i++) {
+		resp[i] = (struct HT_response){
+			.status = 200,
+			.body = "done",
+			.delay_ms = delays[i],
+		};
+		snprintf(path, sizeof(path), "/many-%d", delays[i]);
+		reqs[i].handle = easy_get(HT_route(path, &resp[i]), &bufs[i]);
+	}
+	ndone = cbot_curl_perform_many(bot, reqs, n, mode, timeout_ms);
+	for (i = 0; i < n; i++) {
+		if (reqs[i].done && reqs[i].result == CURLE_OK)
+			TEST_ASSERT_EQUAL_STRING("done", bufs[i].buf);
+		/* Whether or not it completed, the handle is ours again */
+		curl_easy_cleanup(reqs[i].handle);
+		sc_cb_destroy(&bufs[i]);
+	}
+	return ndone;
+}
+
+static void test_perform_all(void)
+{
+	const int delays[] = { 0, 100, 200 };
+	struct cbot_curl_req reqs[3];
+	long start = now_ms();
+
+	TEST_ASSERT_EQUAL(3, perform_many(delays, 3, CBOT_CURL_WAIT_ALL, -1,
+	                                  reqs));
+	for (int i = 0; i < 3; i++) {
+		TEST_ASSERT_TRUE(reqs[i].done);
+		TEST_ASSERT_EQUAL(CURLE_OK, reqs[i].result);
+	}
+	TEST_ASSERT_LESS_THAN(reqs[2].elapsed_ms, reqs[0].elapsed_ms);
+	TEST_ASSERT_GREATER_OR_EQUAL(200, reqs[2].elapsed_ms);
+	/* As long as the slowest, not the sum of them */
+	TEST_ASSERT_LESS_THAN(300, now_ms() - start);
+}
+
+static void test_perform_any(void)
+{
+	const int delays[] = { 1000, 0 };
+	struct cbot_curl_req reqs[2];
+	long start = now_ms();
+
+	TEST_ASSERT_EQUAL(1, perform_many(delays, 2, CBOT_CURL_WAIT_ANY, -1,
+	                                  reqs));
+	TEST_ASSERT_TRUE(reqs[1].done);
+	TEST_ASSERT_EQUAL(CURLE_OK, reqs[1].result);
+	/* The slow one was cancelled */
+	TEST_ASSERT_FALSE(reqs[0].done);
+	TEST_ASSERT_EQUAL(CURLE_OPERATION_TIMEDOUT, reqs[0].result);
+	TEST_ASSERT_LESS_THAN(1000, now_ms() - start);
+}
+
+static void test_perform_deadline(void)
+{
+	const int delays[] = { 0, 1000 };
+	struct cbot_curl_req reqs[2];
+	long start = now_ms();
+
+	TEST_ASSERT_EQUAL(1, perform_many(delays, 2, CBOT_CURL_WAIT_ALL, 200,
+	                                  reqs));
+	TEST_ASSERT_TRUE(reqs[0].done);
+	TEST_ASSERT_FALSE(reqs[1].done);
+	TEST_ASSERT_EQUAL(CURLE_OPERATION_TIMEDOUT, reqs[1].result);
+	TEST_ASSERT_GREATER_OR_EQUAL(200, reqs[1].elapsed_ms);
+	TEST_ASSERT_LESS_THAN(1000, now_ms() - start);
+}
+
+static void test_get_many(void)
+{
+	struct HT_response resp = {
+		.status = 200,
+		.headers = "Cache-Control: max-age=60\r\n",
+		.body = "many",
+	};
+	struct HT_response slow = resp;
+	const char *urls[4];
+	char *bodies[4];
+	struct fetch f;
+
+	slow.delay_ms = 200;
+	urls[0] = HT_route("/get-many-hit", &resp);
+	urls[1] = HT_route("/get-many-req", &resp);
+	urls[2] = urls[1];
+	urls[3] = HT_route("/get-many-wait", &slow);
+
+	/* A fresh entry, and a request which another LWT has in flight */
+	free(cbot_curl_get(bot, "%s", urls[0]));
+	fetch_start(&f, urls[3]);
+	sc_lwt_yield();
+
+	TEST_ASSERT_EQUAL(4, cbot_curl_get_many(bot, 4, urls, bodies,
+	                                        CBOT_CURL_WAIT_ALL, -1));
+	for (int i = 0; i < 4; i++) {
+		TEST_ASSERT_EQUAL_STRING("many", bodies[i]);
+		free(bodies[i]);
+	}
+	fetch_wait(&f);
+	TEST_ASSERT_EQUAL_STRING("many", f.body);
+	free(f.body);
+	TEST_ASSERT_EQUAL(1, HT_requests("/get-many-hit"));
+	/* The same URL twice in a batch is fetched once */
+	TEST_ASSERT_EQUAL(1, HT_requests("/get-many-req"));
+	TEST_ASSERT_EQUAL(1, HT_requests("/get-many-wait"));
+}
+
+static void test_get_many_any(void)
+{
+	struct HT_response resp = {
+		.status = 200,
+		.headers = "Cache-Control: max-age=60\r\n",
+		.body = "any",
+	};
+	const char *urls[2];
+	char *bodies[2];
+
+	urls[0] = HT_route("/get-many-any-miss", &resp);
+	urls[1] = HT_route("/get-many-any-hit", &resp);
+	free(cbot_curl_get(bot, "%s", urls[1]));
+
+	/* A fresh entry satisfies the batch without making any request */
+	TEST_ASSERT_EQUAL(1, cbot_curl_get_many(bot, 2, urls, bodies,
+	                                        CBOT_CURL_WAIT_ANY, -1));
+	TEST_ASSERT_NULL(bodies[0]);
+	TEST_ASSERT_EQUAL_STRING("any", bodies[1]);
+	free(bodies[1]);
+	TEST_ASSERT_EQUAL(0, HT_requests("/get-many-any-miss"));
+}
+
+static void test_get_many_deadline(void)
+{
+	struct HT_response fast = {
+		.status = 200,
+		.headers = "Cache-Control: max-age=60\r\n",
+		.body = "fast",
+	};
+	struct HT_response slow = fast;
+	const char *urls[3];
+	char *bodies[3];
+	struct fetch f;
+
+	slow.body = "slow";
+	slow.delay_ms = 500;
+	urls[0] = HT_route("/deadline-fast", &fast);
+	urls[1] = HT_route("/deadline-slow", &slow);
+	urls[2] = HT_route("/deadline-wait", &slow);
+	fetch_start(&f, urls[2]);
+	sc_lwt_yield();
+
+	TEST_ASSERT_EQUAL(1, cbot_curl_get_many(bot, 3, urls, bodies,
+	                                        CBOT_CURL_WAIT_ALL, 100));
+	TEST_ASSERT_EQUAL_STRING("fast", bodies[0]);
+	free(bodies[0]);
+	TEST_ASSERT_NULL(bodies[1]);
+	TEST_ASSERT_NULL(bodies[2]);
+
+	/* We gave up waiting, but the request we waited on carries on */
+	fetch_wait(&f);
+	TEST_ASSERT_EQUAL_STRING("slow", f.body);
+	free(f.body);
+}
+
+/* Make a conditional request, checking the body if there is one */
+static enum cbot_curl_cond get_conditional(const char *url,
+                                           struct cbot_curl_validators *val,
+                                           const char *expect)
+{
+	struct sc_charbuf buf;
+	CURL *easy = easy_get(url, &buf);
+	enum cbot_curl_cond cond;
+	CURLcode rv;
+
+	cbot_curl_conditional(easy, val);
+	rv = cbot_curl_perform(bot, easy);
+	cond = cbot_curl_conditional_finish(easy, val, rv);
+	TEST_ASSERT_EQUAL_STRING(expect, buf.buf);
+	curl_easy_cleanup(easy);
+	sc_cb_destroy(&buf);
+	return cond;
+}
+
+static void test_conditional(void)
+{
+	struct HT_response v1 = {
+		.status = 200,
+		.headers = "Last-Modified: Wed, 05 Jun 2024 17:00:00 GMT\r\n",
+		.body = "one",
+		.etag = "\"v1\"",
+	};
+	struct HT_response v2 = {
+		.status = 200,
+		.body = "two",
+		.etag = "\"v2\"",
+	};
+	struct HT_response broken = { .status = 500, .body = "oops" };
+	struct cbot_curl_validators val = { 0 };
+	const char *url = HT_route("/conditional", &v1);
+
+	TEST_ASSERT_EQUAL(CBOT_CURL_MODIFIED,
+	                  get_conditional(url, &val, "one"));
+	TEST_ASSERT_EQUAL(0, HT_conditional("/conditional"));
+	TEST_ASSERT_EQUAL_STRING("\"v1\"", val.etag);
+	TEST_ASSERT_EQUAL_STRING("Wed, 05 Jun 2024 17:00:00 GMT",
+	                         val.last_modified);
+
+	/* Not modified: no body, and the validators still hold */
+	TEST_ASSERT_EQUAL(CBOT_CURL_NOT_MODIFIED,
+	                  get_conditional(url, &val, ""));
+	TEST_ASSERT_EQUAL(1, HT_conditional("/conditional"));
+	TEST_ASSERT_EQUAL_STRING("\"v1\"", val.etag);
+
+	/* An error leaves them alone too */
+	HT_route("/conditional", &broken);
+	TEST_ASSERT_EQUAL(CBOT_CURL_FAILED, get_conditional(url, &val, "oops"));
+	TEST_ASSERT_EQUAL_STRING("\"v1\"", val.etag);
+
+	/* A new version replaces both, even the one it lacks */
+	HT_route("/conditional", &v2);
+	TEST_ASSERT_EQUAL(CBOT_CURL_MODIFIED,
+	                  get_conditional(url, &val, "two"));
+	TEST_ASSERT_EQUAL_STRING("\"v2\"", val.etag);
+	TEST_ASSERT_NULL(val.last_modified);
+	cbot_curl_validators_free(&val);
+	TEST_ASSERT_NULL(val.etag);
+}
+
+/* Line consumer which records lines, and stops after a limit */
+struct lines {
+	struct sc_charbuf got;
+	int count;
+	int limit;
+};
+
+static int record_line(char *line, size_t len, void *arg)
+{
+	struct lines *l = arg;
+
+	TEST_ASSERT_EQUAL(strlen(line), len);
+	sc_cb_append(&l->got, '[');
+	sc_cb_memcpy(&l->got, line, len);
+	sc_cb_append(&l->got, ']');
+	return ++l->count == l->limit;
+}
+
+static void test_lines(void)
+{
+	struct HT_response resp = {
+		.status = 200,
+		.body = "one\r\ntwo\n\nthree",
+	};
+	struct lines l = { .limit = -1 };
+
+	sc_cb_init(&l.got, 64);
+	TEST_ASSERT_EQUAL(0, cbot_curl_get_lines(bot, record_line, &l, "%s",
+	                                         HT_route("/lines", &resp)));
+	/* Either line ending, and a last line with none */
+	TEST_ASSERT_EQUAL_STRING("[one][two][][three]", l.got.buf);
+	sc_cb_destroy(&l.got);
+}
+
+static void test_lines_long(void)
+{
+	char line[CBOT_CURL_MAX_LINE + 100];
+	struct HT_response resp = { .status = 200, .body = line };
+	struct lines l = { .limit = -1 };
+
+	memset(line, 'x', sizeof(line) - 2);
+	line[sizeof(line) - 2] = '\n';
+	line[sizeof(line) - 1] = '\0';
+	sc_cb_init(&l.got, 64);
+	TEST_ASSERT_EQUAL(0, cbot_curl_get_lines(bot, record_line, &l, "%s",
+	                                         HT_route("/long", &resp)));
+	TEST_ASSERT_EQUAL(1, l.count);
+	TEST_ASSERT_EQUAL(CBOT_CURL_MAX_LINE + 2, l.got.length);
+	sc_cb_destroy(&l.got);
+}
+
+static void test_lines_abort(void)
+{
+	struct HT_response resp = {
+		.status = 200,
+		.body = "a line of a body which is much too long to read\n",
+		.repeat = 100000,
+	};
+	struct lines l = { .limit = 3 };
+
+	/* Stopping early is not an error, and no more lines arrive */
+	sc_cb_init(&l.got, 64);
+	TEST_ASSERT_EQUAL(0, cbot_curl_get_lines(bot, record_line, &l, "%s",
+	                                         HT_route("/abort", &resp)));
+	TEST_ASSERT_EQUAL(3, l.count);
+	sc_cb_destroy(&l.got);
+}
+
+static void test_lines_error(void)
+{
+	struct lines l = { .limit = -1 };
+
+	sc_cb_init(&l.got, 64);
+	TEST_ASSERT_EQUAL(-1, cbot_curl_get_lines(bot, record_line, &l,
+	                                          "http://127.0.0.1:1/"));
+	TEST_ASSERT_EQUAL(0, l.count);
+	sc_cb_destroy(&l.got);
+}
+
+static int count_chunk(const char *data, size_t len, void *arg)
+{
+	size_t *total = arg;
+
+	*total += len;
+	return 1;
+}
+
+static void test_chunks_abort(void)
+{
+	struct HT_response resp = {
+		.status = 200,
+		.body = "chunk of a body which is much too long to read\n",
+		.repeat = 100000,
+	};
+	struct cbot_curl_stream stream;
+	CURL *easy = curl_easy_init();
+	size_t total = 0;
+	CURLcode rv;
+
+	curl_easy_setopt(easy, CURLOPT_URL, HT_route("/chunks", &resp));
+	cbot_curl_stream_response(easy, &stream, count_chunk, &total);
+	rv = cbot_curl_perform(bot, easy);
+	TEST_ASSERT_EQUAL(CURLE_WRITE_ERROR, rv);
+	TEST_ASSERT_EQUAL(0, cbot_curl_stream_finish(&stream, rv));
+	/* Only the first chunk was consumed */
+	TEST_ASSERT_GREATER_THAN(0, total);
+	TEST_ASSERT_LESS_THAN(strlen(resp.body) * resp.repeat, total);
+	curl_easy_cleanup(easy);
+}
+
+static void run_tests(void *arg)
+{
+	runner = sc_lwt_current();
+	RUN_TEST(test_max_age);
+	RUN_TEST(test_default_ttl);
+	RUN_TEST(test_no_store);
+	RUN_TEST(test_no_cache);
+	RUN_TEST(test_revalidate);
+	RUN_TEST(test_error_status);
+	RUN_TEST(test_evict);
+	RUN_TEST(test_coalesce);
+	RUN_TEST(test_coalesce_error);
+	RUN_TEST(test_concurrent);
+	RUN_TEST(test_sequential);
+	RUN_TEST(test_timer);
+	RUN_TEST(test_refused);
+	RUN_TEST(test_perform_all);
+	RUN_TEST(test_perform_any);
+	RUN_TEST(test_perform_deadline);
+	RUN_TEST(test_get_many);
+	RUN_TEST(test_get_many_any);
+	RUN_TEST(test_get_many_deadline);
+	RUN_TEST(test_conditional);
+	RUN_TEST(test_lines);
+	RUN_TEST(test_lines_long);
+	RUN_TEST(test_lines_abort);
+	RUN_TEST(test_lines_error);
+	RUN_TEST(test_chunks_abort);
+	/* Stop the curl thread */
+	sc_lwt_send_shutdown_signal();
+}
+
+int main(int argc, char **argv)
+{
+	config_t conf;
+	char cfg[128];
+	int rv;
+
+	if (HT_start() < 0) {
+		perror("HT_start");
+		return 1;
+	}
+	snprintf(cfg, sizeof(cfg),
+	         "curl = { cache_size = %d; cache_ttl = 60; };", CACHE_SIZE);
+	config_init(&conf);
+	config_read_string(&conf, cfg);
+
+	bot = cbot_create();
+	bot->lwt_ctx = sc_lwt_init();
+	cbot_curl_init(bot, config_lookup(&conf, "curl"));
+	config_destroy(&conf);
+
+	UNITY_BEGIN();
+	sc_lwt_create_task(bot->lwt_ctx, run_tests, NULL);
+	sc_lwt_run(bot->lwt_ctx);
+	rv = UNITY_END();
+
+	cbot_delete(bot);
+	HT_stop();
+	return rv;
+}
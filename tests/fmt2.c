@@ -205,6 +205,54 @@ static void test_custom_formatters(void)
 	TEST_ASSERT_EQUAL_STRING("Time: 23:31:30", cb.buf);
 }
 
+static void test_template(void)
+{
+	struct cbot_template *t;
+	int rv;
+
+	t = cbot_template_compile("{coord:xy} is {%s}{{", custom_formatters);
+	TEST_ASSERT_NOT_NULL(t);
+	rv = cbot_template_render(&cb, t, 1, 2, "here");
+	TEST_ASSERT_EQUAL_INT(2, rv);
+	TEST_ASSERT_EQUAL_STRING("(1,2) is here{", cb.buf);
+
+	sc_cb_clear(&cb);
+	rv = cbot_template_render(&cb, t, 3, 4, "there");
+	TEST_ASSERT_EQUAL_INT(2, rv);
+	TEST_ASSERT_EQUAL_STRING("(3,4) is there{", cb.buf);
+	cbot_template_free(t);
+
+	TEST_ASSERT_NULL(
+	        cbot_template_compile("{unknown:x}", custom_formatters));
+	TEST_ASSERT_NULL(cbot_template_compile("{%s", custom_formatters));
+}
+
+static int key_formatter(struct sc_charbuf *buf, char *key, void *user)
+{
+	if (strcmp(key, "name") != 0)
+		return -1;
+	sc_cb_concat(buf, user);
+	return 0;
+}
+
+static void test_format_callback(void)
+{
+	int rv;
+
+	rv = cbot_format(&cb, "a{{b {name}!", key_formatter, "cbot");
+	TEST_ASSERT_EQUAL_INT(1, rv);
+	TEST_ASSERT_EQUAL_STRING("a{b cbot!", cb.buf);
+
+	/* The same format string again, now compiled and cached */
+	sc_cb_clear(&cb);
+	rv = cbot_format(&cb, "a{{b {name}!", key_formatter, "bot");
+	TEST_ASSERT_EQUAL_INT(1, rv);
+	TEST_ASSERT_EQUAL_STRING("a{b bot!", cb.buf);
+
+	rv = cbot_format(&cb, "{other}", key_formatter, "cbot");
+	TEST_ASSERT_LESS_THAN(0, rv);
+}
+
 int main(int argc, char **argv)
 {
 	UNITY_BEGIN();
@@ -217,5 +265,7 @@ int main(int argc, char **argv)
 	RUN_TEST(test_unclosed_brace);
 	RUN_TEST(test_tm_formatter);
 	RUN_TEST(test_custom_formatters);
+	RUN_TEST(test_template);
+	RUN_TEST(test_format_callback);
 	return UNITY_END();
 }
@@ -0,0 +1,257 @@
+/**
+ * httptest.c: a tiny HTTP server for testing the curl integration
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sc-collections.h>
+
+#include "httptest.h"
+
+#define HT_MAX_ROUTES 32
+
+struct HT_route {
+	char path[128];
+	char url[160];
+	const struct HT_response *resp;
+	int requests;
+	int conditional;
+};
+
+static struct HT_route routes[HT_MAX_ROUTES];
+static int nroutes;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t acceptor;
+static int listen_fd = -1;
+static unsigned short port;
+
+static struct HT_route *route_find(const char *path)
+{
+	for (int i = 0; i < nroutes; i++)
+		if (strcmp(routes[i].path, path) == 0)
+			return &routes[i];
+	return NULL;
+}
+
+/* Return the value of a header in a request head, or NULL */
+static char *request_header(char *head, const char *name, char *buf,
+                            size_t len)
+{
+	size_t nlen = strlen(name);
+	char *line = strstr(head, "\r\n"), *end;
+
+	while (line && line[2]) {
+		line += 2;
+		end = strstr(line, "\r\n");
+		if (!end)
+			break;
+		if ((size_t)(end - line) > nlen && line[nlen] == ':' &&
+		    strncasecmp(line, name, nlen) == 0) {
+			line += nlen + 1;
+			line += strspn(line, " \t");
+			snprintf(buf, len, "%.*s", (int)(end - line), line);
+			return buf;
+		}
+		line = end;
+	}
+	return NULL;
+}
+
+static void send_all(int fd, const char *data, size_t len)
+{
+	ssize_t rv;
+
+	while (len) {
+		/* The client may hang up on us, which mustn't be a SIGPIPE */
+		rv = send(fd, data, len, MSG_NOSIGNAL);
+		if (rv <= 0)
+			return;
+		data += rv;
+		len -= rv;
+	}
+}
+
+static void answer(int fd, char *head)
+{
+	struct HT_route *route;
+	struct HT_response resp = { .status = 404 };
+	struct sc_charbuf out;
+	char path[128], etag[128], since[128];
+	size_t i, repeat, length = 0;
+	bool not_modified = false, inm, ims;
+
+	if (sscanf(head, "%*s %127s", path) != 1)
+		return;
+	inm = request_header(head, "If-None-Match", etag, sizeof(etag));
+	ims = request_header(head, "If-Modified-Since", since, sizeof(since));
+	pthread_mutex_lock(&lock);
+	route = route_find(path);
+	if (route) {
+		resp = *route->resp;
+		route->requests++;
+		if (inm || ims)
+			route->conditional++;
+		not_modified = inm && resp.etag && strcmp(etag, resp.etag) == 0;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (resp.delay_ms) {
+		struct timespec ts = {
+			.tv_sec = resp.delay_ms / 1000,
+			.tv_nsec = (resp.delay_ms % 1000) * 1000000L,
+		};
+		nanosleep(&ts, NULL);
+	}
+
+	repeat = resp.repeat ? resp.repeat : 1;
+	if (not_modified)
+		resp.status = 304;
+	else if (resp.body)
+		length = strlen(resp.body) * repeat;
+
+	sc_cb_init(&out, 512);
+	sc_cb_printf(&out, "HTTP/1.1 %d Test\r\n", resp.status);
+	if (resp.etag)
+		sc_cb_printf(&out, "ETag: %s\r\n", resp.etag);
+	if (resp.headers)
+		sc_cb_concat(&out, resp.headers);
+	if (!not_modified)
+		sc_cb_printf(&out, "Content-Length: %zu\r\n", length);
+	sc_cb_concat(&out, "Connection: close\r\n\r\n");
+	send_all(fd, out.buf, out.length);
+	sc_cb_destroy(&out);
+	for (i = 0; length && i < repeat; i++)
+		send_all(fd, resp.body, strlen(resp.body));
+}
+
+static void *connection(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char head[4096];
+	size_t len = 0;
+	ssize_t rv;
+
+	while (len < sizeof(head) - 1) {
+		rv = recv(fd, head + len, sizeof(head) - 1 - len, 0);
+		if (rv <= 0)
+			break;
+		len += rv;
+		head[len] = '\0';
+		if (strstr(head, "\r\n\r\n")) {
+			answer(fd, head);
+			break;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *accept_loop(void *arg)
+{
+	pthread_t thread;
+	int fd;
+
+	while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		if (pthread_create(&thread, NULL, connection,
+		                   (void *)(intptr_t)fd) != 0) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+int HT_start(void)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	socklen_t len = sizeof(addr);
+
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_fd < 0)
+		return -1;
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(listen_fd, 64) < 0 ||
+	    getsockname(listen_fd, (struct sockaddr *)&addr, &len) < 0) {
+		close(listen_fd);
+		return -1;
+	}
+	port = ntohs(addr.sin_port);
+	if (pthread_create(&acceptor, NULL, accept_loop, NULL) != 0) {
+		close(listen_fd);
+		return -1;
+	}
+	return 0;
+}
+
+void HT_stop(void)
+{
+	/* Wakes the acceptor from accept(), which then fails */
+	shutdown(listen_fd, SHUT_RDWR);
+	pthread_join(acceptor, NULL);
+	close(listen_fd);
+	listen_fd = -1;
+}
+
+void HT_reset(void)
+{
+	pthread_mutex_lock(&lock);
+	nroutes = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+const char *HT_route(const char *path, const struct HT_response *resp)
+{
+	struct HT_route *route;
+
+	pthread_mutex_lock(&lock);
+	route = route_find(path);
+	if (!route && nroutes < HT_MAX_ROUTES) {
+		route = &routes[nroutes++];
+		snprintf(route->path, sizeof(route->path), "%s", path);
+		snprintf(route->url, sizeof(route->url),
+		         "http://127.0.0.1:%hu%s", port, path);
+	}
+	if (route) {
+		route->resp = resp;
+		route->requests = 0;
+		route->conditional = 0;
+	}
+	pthread_mutex_unlock(&lock);
+	return route ? route->url : NULL;
+}
+
+int HT_requests(const char *path)
+{
+	struct HT_route *route;
+	int n;
+
+	pthread_mutex_lock(&lock);
+	route = route_find(path);
+	n = route ? route->requests : 0;
+	pthread_mutex_unlock(&lock);
+	return n;
+}
+
+int HT_conditional(const char *path)
+{
+	struct HT_route *route;
+	int n;
+
+	pthread_mutex_lock(&lock);
+	route = route_find(path);
+	n = route ? route->conditional : 0;
+	pthread_mutex_unlock(&lock);
+	return n;
+}
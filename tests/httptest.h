@@ -0,0 +1,70 @@
+/**
+ * httptest.h: a tiny HTTP server for testing the curl integration
+ *
+ * The server runs on its own pthread (not an LWT), listening on an ephemeral
+ * port on the loopback interface, and answers each connection on a thread of
+ * its own, so that a slow response doesn't hold up the others. Responses are
+ * canned: a test registers a path along with what to answer for it. All
+ * declarations here are prefixed "HT_" to indicate they're HTTP test helpers.
+ */
+
+#ifndef HTTPTEST_H
+#define HTTPTEST_H
+
+#include <stddef.h>
+
+/**
+ * What to answer for a path
+ */
+struct HT_response {
+	/** HTTP status, e.g. 200 */
+	int status;
+	/** Extra header lines, each terminated by "\r\n", or NULL */
+	const char *headers;
+	/** Response body, or NULL for none */
+	const char *body;
+	/** Number of times the body is repeated (0 means once) */
+	size_t repeat;
+	/** Wait this long before answering */
+	int delay_ms;
+	/**
+	 * If set, a request with a matching If-None-Match header gets a 304
+	 * (along with the extra headers) rather than the body.
+	 */
+	const char *etag;
+};
+
+/**
+ * Start the server. Returns 0 on success, -1 on error.
+ */
+int HT_start(void);
+
+/**
+ * Stop the server. Connections still being answered are left to finish.
+ */
+void HT_stop(void);
+
+/**
+ * Forget every registered path, along with the request counts.
+ */
+void HT_reset(void);
+
+/**
+ * Register the response for a path (e.g. "/feed.ics"). The response must live
+ * until HT_reset(). Returns the full URL of the path, owned by the server and
+ * valid until HT_reset().
+ */
+const char *HT_route(const char *path, const struct HT_response *resp);
+
+/**
+ * Return how many requests have been made for a path.
+ */
+int HT_requests(const char *path);
+
+/**
+ * Return how many requests for a path were conditional, that is, they carried
+ * an If-None-Match or If-Modified-Since header.
+ */
+int HT_conditional(const char *path);
+
+#endif
@@ -0,0 +1,128 @@
+#include <string.h>
+
+#include <unity.h>
+
+#include "../src/cbot_irc.h"
+
+static struct irc_flood flood;
+
+void setUp(void)
+{
+	irc_flood_init(&flood);
+}
+
+void tearDown(void)
+{
+}
+
+static void test_burst(void)
+{
+	uint64_t now = 100000;
+	int sent = 0;
+
+	/* 100 bytes costs 2000 + 833ms: three lines fit in a 9s window */
+	while (!irc_flood_delay(&flood, now, 100)) {
+		irc_flood_charge(&flood, now, 100);
+		sent++;
+	}
+	TEST_ASSERT_EQUAL(3, sent);
+	TEST_ASSERT_EQUAL(3 * 2833 - 9000 + 2833,
+	                  irc_flood_delay(&flood, now, 100));
+
+	/* Once that much time passes, one more line may go */
+	now += irc_flood_delay(&flood, now, 100);
+	TEST_ASSERT_EQUAL(0, irc_flood_delay(&flood, now, 100));
+	irc_flood_charge(&flood, now, 100);
+	TEST_ASSERT_EQUAL(2833, irc_flood_delay(&flood, now, 100));
+}
+
+static void test_idle(void)
+{
+	/* The clock doesn't bank credit for time spent idle */
+	irc_flood_charge(&flood, 1000, 0);
+	TEST_ASSERT_EQUAL(0, irc_flood_delay(&flood, 1000000, 0));
+	irc_flood_charge(&flood, 1000000, 0);
+	TEST_ASSERT_EQUAL(1002000, flood.clock_ms);
+}
+
+static void test_disabled(void)
+{
+	int i;
+
+	flood.enabled = false;
+	for (i = 0; i < 100; i++)
+		irc_flood_charge(&flood, 0, 400);
+	TEST_ASSERT_EQUAL(0, irc_flood_delay(&flood, 0, 400));
+}
+
+static void test_text_max(void)
+{
+	/* ":cbot!" + user + "@" + host + " PRIVMSG #c :" + "\r\n" */
+	size_t overhead = 1 + 4 + 1 + 10 + 1 + 63 + 1 + 8 + 2 + 2 + 2;
+
+	TEST_ASSERT_EQUAL(512 - overhead, irc_text_max("cbot", "#c", false));
+	TEST_ASSERT_EQUAL(512 - overhead - 9, irc_text_max("cbot", "#c", true));
+}
+
+/* Split msg into lines of at most max bytes, joined with "|" */
+static void split(const char *msg, size_t max, char *out)
+{
+	const char *line;
+	size_t len;
+
+	out[0] = '\0';
+	while ((line = irc_split(&msg, max, &len)) != NULL) {
+		TEST_ASSERT_LESS_OR_EQUAL(max, len);
+		if (out[0])
+			strcat(out, "|");
+		strncat(out, line, len);
+	}
+}
+
+static void test_split(void)
+{
+	char out[256];
+
+	split("hello", 10, out);
+	TEST_ASSERT_EQUAL_STRING("hello", out);
+	split("", 10, out);
+	TEST_ASSERT_EQUAL_STRING("", out);
+	split("one\ntwo\r\n\nthree\n", 10, out);
+	TEST_ASSERT_EQUAL_STRING("one|two|three", out);
+	split("0123456789", 10, out);
+	TEST_ASSERT_EQUAL_STRING("0123456789", out);
+	split("hello there world", 10, out);
+	TEST_ASSERT_EQUAL_STRING("hello|there|world", out);
+	/* A space too early in the line isn't worth breaking at */
+	split("a bcdefghijklm", 10, out);
+	TEST_ASSERT_EQUAL_STRING("a bcdefghi|jklm", out);
+}
+
+static void test_split_utf8(void)
+{
+	char out[256];
+
+	/* "é" is two bytes: don't split it */
+	split("abcdefgh\xc3\xa9", 10, out);
+	TEST_ASSERT_EQUAL_STRING("abcdefgh\xc3\xa9", out);
+	split("abcdefghij\xc3\xa9", 10, out);
+	TEST_ASSERT_EQUAL_STRING("abcdefghij|\xc3\xa9", out);
+	split("abcdefghi\xc3\xa9z", 10, out);
+	TEST_ASSERT_EQUAL_STRING("abcdefghi|\xc3\xa9z", out);
+	/* "€" is three */
+	split("\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac", 10, out);
+	TEST_ASSERT_EQUAL_STRING(
+	        "\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac|\xe2\x82\xac", out);
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_burst);
+	RUN_TEST(test_idle);
+	RUN_TEST(test_disabled);
+	RUN_TEST(test_text_max);
+	RUN_TEST(test_split);
+	RUN_TEST(test_split_utf8);
+	return UNITY_END();
+}
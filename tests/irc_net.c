@@ -0,0 +1,161 @@
+#include <string.h>
+
+#include <unity.h>
+
+#include "../src/cbot_irc.h"
+
+static struct cbot_irc_backend irc;
+static struct cbot_irc_network libera, oftc;
+
+static void add_net(struct cbot_irc_network *net, char *name)
+{
+	memset(net, 0, sizeof(*net));
+	net->irc = &irc;
+	net->name = name;
+	sc_cb_init(&net->scratch, 64);
+	sc_list_insert_end(&irc.networks, &net->list);
+	irc.nnetworks++;
+}
+
+void setUp(void)
+{
+	memset(&irc, 0, sizeof(irc));
+	sc_list_init(&irc.networks);
+	add_net(&libera, "libera");
+	add_net(&oftc, "oftc");
+}
+
+void tearDown(void)
+{
+	sc_cb_destroy(&libera.scratch);
+	sc_cb_destroy(&oftc.scratch);
+}
+
+static void test_one_network(void)
+{
+	const char *target;
+
+	sc_list_remove(&oftc.list);
+	irc.nnetworks = 1;
+
+	/* Names are left alone, and never treated as prefixed */
+	TEST_ASSERT_EQUAL_STRING("#cbot", irc_net_name(&libera, "#cbot"));
+	TEST_ASSERT_NULL(irc_net_lookup(&irc, "libera:#cbot", &target));
+	TEST_ASSERT_EQUAL_STRING("libera:#cbot", target);
+	TEST_ASSERT_EQUAL_PTR(&libera,
+	                      irc_net_route(&irc, "libera:#cbot", &target));
+	TEST_ASSERT_EQUAL_STRING("libera:#cbot", target);
+	TEST_ASSERT_TRUE(irc_net_owns(&libera, "#cbot", &target));
+	TEST_ASSERT_EQUAL_STRING("#cbot", target);
+}
+
+static void test_name(void)
+{
+	TEST_ASSERT_EQUAL_STRING("libera:#cbot",
+	                         irc_net_name(&libera, "#cbot"));
+	TEST_ASSERT_EQUAL_STRING("oftc:#cbot", irc_net_name(&oftc, "#cbot"));
+	TEST_ASSERT_EQUAL_STRING("oftc:nick", irc_net_name(&oftc, "nick"));
+}
+
+static void test_lookup(void)
+{
+	const char *name, *target;
+
+	TEST_ASSERT_EQUAL_PTR(&oftc,
+	                      irc_net_lookup(&irc, "oftc:#cbot", &target));
+	TEST_ASSERT_EQUAL_STRING("#cbot", target);
+	TEST_ASSERT_EQUAL_PTR(&libera,
+	                      irc_net_lookup(&irc, "libera:nick", &target));
+	TEST_ASSERT_EQUAL_STRING("nick", target);
+
+	/* No prefix, or one which isn't exactly a network's name */
+	TEST_ASSERT_NULL(irc_net_lookup(&irc, "#cbot", &target));
+	TEST_ASSERT_EQUAL_STRING("#cbot", target);
+	TEST_ASSERT_NULL(irc_net_lookup(&irc, "lib:#cbot", &target));
+	TEST_ASSERT_EQUAL_STRING("lib:#cbot", target);
+	TEST_ASSERT_NULL(irc_net_lookup(&irc, "oftcx:#cbot", &target));
+	TEST_ASSERT_EQUAL_STRING("oftcx:#cbot", target);
+
+	/* What irc_net_name() produces, irc_net_lookup() takes apart */
+	name = irc_net_name(&oftc, "#a");
+	TEST_ASSERT_EQUAL_PTR(&oftc, irc_net_lookup(&irc, name, &target));
+	TEST_ASSERT_EQUAL_STRING("#a", target);
+}
+
+static void test_route(void)
+{
+	const char *target;
+
+	/* Unprefixed names go to the first network... */
+	TEST_ASSERT_EQUAL_PTR(&libera, irc_net_route(&irc, "#cbot", &target));
+	TEST_ASSERT_EQUAL_STRING("#cbot", target);
+
+	/* ...unless a network's event is being handled */
+	irc.current = &oftc;
+	TEST_ASSERT_EQUAL_PTR(&oftc, irc_net_route(&irc, "nick", &target));
+	TEST_ASSERT_EQUAL_STRING("nick", target);
+
+	/* A prefix always wins */
+	TEST_ASSERT_EQUAL_PTR(&libera,
+	                      irc_net_route(&irc, "libera:nick", &target));
+	TEST_ASSERT_EQUAL_STRING("nick", target);
+}
+
+static void test_owns(void)
+{
+	const char *target;
+
+	/* The backend's unprefixed channels are joined on the first network */
+	TEST_ASSERT_TRUE(irc_net_owns(&libera, "#a", &target));
+	TEST_ASSERT_EQUAL_STRING("#a", target);
+	TEST_ASSERT_FALSE(irc_net_owns(&oftc, "#a", &target));
+
+	/* Prefixed ones on their own network, without the prefix */
+	TEST_ASSERT_FALSE(irc_net_owns(&libera, "oftc:#b", &target));
+	TEST_ASSERT_TRUE(irc_net_owns(&oftc, "oftc:#b", &target));
+	TEST_ASSERT_EQUAL_STRING("#b", target);
+	TEST_ASSERT_TRUE(irc_net_owns(&libera, "libera:#c", &target));
+	TEST_ASSERT_EQUAL_STRING("#c", target);
+	TEST_ASSERT_FALSE(irc_net_owns(&oftc, "libera:#c", &target));
+}
+
+static void test_numeric_kind(void)
+{
+	TEST_ASSERT_EQUAL(IRC_EV_NAMREPLY, irc_numeric_kind(353));
+	TEST_ASSERT_EQUAL(IRC_EV_NUMERIC, irc_numeric_kind(332));
+	TEST_ASSERT_EQUAL(IRC_EV_NUMERIC, irc_numeric_kind(366));
+	TEST_ASSERT_EQUAL(IRC_EV_NUMERIC, irc_numeric_kind(1));
+}
+
+static void test_events(void)
+{
+	struct sc_charbuf cb;
+	int i;
+
+	/* Every kind of event has a name, and its own count */
+	for (i = 0; i < _IRC_EV_COUNT_; i++)
+		libera.events[i] = i * 10;
+	libera.events[irc_numeric_kind(353)]++;
+	sc_cb_init(&cb, 256);
+	irc_net_events(&libera, &cb);
+	TEST_ASSERT_EQUAL_STRING(
+	        " connect=0 nick=10 quit=20 join=30 part=40 mode=50 umode=60"
+	        " topic=70 kick=80 channel=90 privmsg=100 notice=110"
+	        " invite=120 ctcp_rep=130 action=140 unknown=150"
+	        " namreply=161 numeric=170",
+	        cb.buf);
+	sc_cb_destroy(&cb);
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_one_network);
+	RUN_TEST(test_name);
+	RUN_TEST(test_lookup);
+	RUN_TEST(test_route);
+	RUN_TEST(test_owns);
+	RUN_TEST(test_numeric_kind);
+	RUN_TEST(test_events);
+	return UNITY_END();
+}
@@ -0,0 +1,225 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sc-collections.h>
+#include <unity.h>
+
+#include "../src/cbot_private.h"
+
+/* Matches LOG_RING_SLOTS in src/log.c */
+#define RING_SLOTS 1024
+
+/* The log file is a pipe, which a reader thread drains into "captured" */
+static FILE *logf;
+static int rfd;
+static pthread_t reader;
+static bool reading;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sc_charbuf captured;
+static int nlines;
+
+static void *reader_thread(void *arg)
+{
+	char buf[4096];
+	ssize_t rv;
+	ssize_t i;
+
+	while ((rv = read(rfd, buf, sizeof(buf))) > 0) {
+		pthread_mutex_lock(&lock);
+		sc_cb_memcpy(&captured, buf, rv);
+		for (i = 0; i < rv; i++)
+			nlines += buf[i] == '\n';
+		pthread_mutex_unlock(&lock);
+	}
+	return NULL;
+}
+
+static void start_reader(void)
+{
+	TEST_ASSERT_EQUAL(0,
+	                  pthread_create(&reader, NULL, reader_thread, NULL));
+	reading = true;
+}
+
+/* Wait until n lines have been written, or give up after a few seconds */
+static void wait_lines(int n)
+{
+	int i, got = 0;
+
+	for (i = 0; i < 5000 && got < n; i++) {
+		pthread_mutex_lock(&lock);
+		got = nlines;
+		pthread_mutex_unlock(&lock);
+		if (got < n)
+			usleep(1000);
+	}
+	TEST_ASSERT_EQUAL(n, got);
+}
+
+void setUp(void)
+{
+	int fds[2];
+
+	TEST_ASSERT_EQUAL(0, pipe(fds));
+	rfd = fds[0];
+	logf = fdopen(fds[1], "w");
+	sc_cb_init(&captured, 4096);
+	nlines = 0;
+	reading = false;
+	cbot_set_log_file(logf);
+	cbot_set_log_level(INFO);
+	TEST_ASSERT_EQUAL(0, cbot_log_start_writer());
+}
+
+/* Stop the writer, then return everything it wrote */
+static char *finish(void)
+{
+	if (!reading)
+		start_reader();
+	cbot_log_stop_writer();
+	cbot_set_log_file(NULL);
+	fclose(logf);
+	logf = NULL;
+	pthread_join(reader, NULL);
+	return captured.buf;
+}
+
+void tearDown(void)
+{
+	if (logf)
+		finish();
+	close(rfd);
+	sc_cb_destroy(&captured);
+}
+
+/* Check for the "YYYY-MM-DD HH:MM:SS.mmm " prefix, and skip it */
+static char *unstamp(char *line)
+{
+	static const char pattern[] = "dddd-dd-dd dd:dd:dd.ddd ";
+	size_t i;
+
+	for (i = 0; pattern[i]; i++) {
+		if (pattern[i] == 'd')
+			TEST_ASSERT_TRUE(line[i] >= '0' && line[i] <= '9');
+		else
+			TEST_ASSERT_EQUAL_INT(pattern[i], line[i]);
+	}
+	return line + i;
+}
+
+static void test_wraparound(void)
+{
+	char *out, *line, *save = NULL;
+	char want[512], pad[300];
+	int i, n = 3 * RING_SLOTS + 10;
+
+	memset(pad, 'x', sizeof(pad) - 1);
+	pad[sizeof(pad) - 1] = '\0';
+
+	/* Never fill the ring, so that nothing is dropped */
+	start_reader();
+	for (i = 0; i < n; i++) {
+		if (i % 100 == 7)
+			cbot_log(INFO, "message %d %s\n", i, pad);
+		else
+			cbot_log(INFO, "message %d\n", i);
+		if (i % (RING_SLOTS / 2) == 0)
+			wait_lines(i + 1);
+	}
+	out = finish();
+
+	for (i = 0; i < n; i++) {
+		line = strtok_r(i ? NULL : out, "\n", &save);
+		TEST_ASSERT_NOT_NULL(line);
+		if (i % 100 == 7)
+			snprintf(want, sizeof(want), "message %d %s", i, pad);
+		else
+			snprintf(want, sizeof(want), "message %d", i);
+		TEST_ASSERT_EQUAL_STRING(want, unstamp(line));
+	}
+	TEST_ASSERT_NULL(strtok_r(NULL, "\n", &save));
+}
+
+static void test_overflow(void)
+{
+	char *out, *line, *save = NULL;
+	unsigned long dropped = 0, n;
+	int i, got = 0, next = 0, total = 4 * RING_SLOTS;
+	char pad[200];
+
+	memset(pad, 'x', sizeof(pad) - 1);
+	pad[sizeof(pad) - 1] = '\0';
+
+	/*
+	 * Nobody reads the pipe yet, so the writer soon blocks writing to it,
+	 * the ring fills, and the rest are dropped.
+	 */
+	for (i = 0; i < total; i++)
+		cbot_log(INFO, "message %d %s\n", i, pad);
+	out = finish();
+
+	for (line = strtok_r(out, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save)) {
+		line = unstamp(line);
+		if (sscanf(line, "log: dropped %lu messages", &n) == 1) {
+			dropped += n;
+			continue;
+		}
+		/* The messages which made it are in order */
+		TEST_ASSERT_EQUAL(1, sscanf(line, "message %d", &i));
+		TEST_ASSERT_GREATER_OR_EQUAL(next, i);
+		next = i + 1;
+		got++;
+	}
+	TEST_ASSERT_GREATER_THAN(0, dropped);
+	TEST_ASSERT_EQUAL(total, got + (int)dropped);
+}
+
+static void test_flush_on_stop(void)
+{
+	char *out, *line, *save = NULL;
+	char want[32];
+	int i;
+
+	start_reader();
+	for (i = 0; i < RING_SLOTS / 2; i++)
+		cbot_log(INFO, "message %d\n", i);
+	cbot_log_stop_writer();
+	/* Once stopped, messages are written synchronously */
+	cbot_log(INFO, "after stop\n");
+	/* Filtered messages are not written at all */
+	cbot_log(DEBUG, "debug\n");
+	out = finish();
+
+	for (i = 0; i < RING_SLOTS / 2; i++) {
+		line = strtok_r(i ? NULL : out, "\n", &save);
+		TEST_ASSERT_NOT_NULL(line);
+		snprintf(want, sizeof(want), "message %d", i);
+		TEST_ASSERT_EQUAL_STRING(want, unstamp(line));
+	}
+	line = strtok_r(NULL, "\n", &save);
+	TEST_ASSERT_NOT_NULL(line);
+	TEST_ASSERT_EQUAL_STRING("after stop", unstamp(line));
+	TEST_ASSERT_NULL(strtok_r(NULL, "\n", &save));
+}
+
+static void test_level_name(void)
+{
+	TEST_ASSERT_EQUAL_STRING("INFO", cbot_level_name(INFO));
+	TEST_ASSERT_EQUAL_STRING("DEBUG", cbot_level_name(DEBUG));
+	TEST_ASSERT_EQUAL_INT(WARN, cbot_lookup_level(cbot_level_name(WARN)));
+	TEST_ASSERT_EQUAL_STRING("", cbot_level_name(INFO + 1));
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_wraparound);
+	RUN_TEST(test_overflow);
+	RUN_TEST(test_flush_on_stop);
+	RUN_TEST(test_level_name);
+	return UNITY_END();
+}
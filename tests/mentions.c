@@ -6,6 +6,7 @@
 #include <unity.h>
 
 #include <nosj.h>
+#include <sc-collections.h>
 
 #include "../src/signal/internal.h"
 #include "cbot/json.h"
@@ -56,9 +57,47 @@ static void test_mention_from_json(void)
 	do_test_mention_from_json("test_replace_text");
 }
 
+static void test_json_quote_mention(void)
+{
+	struct sc_charbuf cb;
+	struct sc_array ms;
+	struct signal_mention *m;
+
+	sc_cb_init(&cb, 16);
+	sc_arr_init(&ms, struct signal_mention, 1);
+
+	/* The emoji is two UTF-16 units, and "@@" is one */
+	json_quote_mention_cb(&cb, "say \"hi\" @@x 😀@(uuid:abcd)!\n", &ms);
+	TEST_ASSERT_EQUAL_STRING("say \\\"hi\\\" @x 😀X!\\n", cb.buf);
+	TEST_ASSERT_EQUAL(1, ms.len);
+	m = sc_arr(&ms, struct signal_mention);
+	TEST_ASSERT_EQUAL(14, m[0].start);
+	TEST_ASSERT_EQUAL(1, m[0].length);
+	TEST_ASSERT_EQUAL(4, m[0].uuid_len);
+	TEST_ASSERT_EQUAL_STRING_LEN("abcd", m[0].uuid, 4);
+
+	/* Reusing the buffers starts a fresh mention list */
+	sc_cb_clear(&cb);
+	json_quote_mention_cb(&cb, "no mentions", &ms);
+	TEST_ASSERT_EQUAL_STRING("no mentions", cb.buf);
+	TEST_ASSERT_EQUAL(0, ms.len);
+
+	sc_cb_destroy(&cb);
+	sc_arr_destroy(&ms);
+}
+
+static void test_json_quote_nomention(void)
+{
+	char *quoted = json_quote_nomention("a \"b\"\n@(uuid:abcd)");
+	TEST_ASSERT_EQUAL_STRING("a \\\"b\\\"\\n@(uuid:abcd)", quoted);
+	free(quoted);
+}
+
 int main(int argc, char **argv)
 {
 	UNITY_BEGIN();
 	RUN_TEST(test_mention_from_json);
+	RUN_TEST(test_json_quote_mention);
+	RUN_TEST(test_json_quote_nomention);
 	return UNITY_END();
 }
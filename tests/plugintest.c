@@ -9,6 +9,7 @@
 #include "sc-lwt.h"
 #include <libconfig.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -17,27 +18,28 @@
  */
 struct PT_backend {
 	struct sc_list_head messages;
+	bool authorized;
 };
 
-static int PTB_configure(struct cbot *cbot, config_setting_t *group)
+static int PTB_configure(struct cbot_backend *be, config_setting_t *group)
 {
 	struct PT_backend *backend = calloc(1, sizeof(*backend));
 	sc_list_init(&backend->messages);
-	cbot->backend = backend;
+	be->priv = backend;
 	return 0;
 }
 
-static void PTB_run(struct cbot *cbot)
+static void PTB_run(struct cbot_backend *be)
 {
 	// Test backend doesn't run an event loop
 	// Tests directly inject events
 }
 
-static uint64_t PTB_send(const struct cbot *cbot, const char *to,
+static uint64_t PTB_send(const struct cbot_backend *be, const char *to,
                          const struct cbot_reaction_ops *ops, void *arg,
                          const char *msg)
 {
-	struct PT_backend *backend = cbot->backend;
+	struct PT_backend *backend = be->priv;
 	struct PT_message *tm = calloc(1, sizeof(*tm));
 
 	tm->dest = strdup(to);
@@ -48,9 +50,10 @@ static uint64_t PTB_send(const struct cbot *cbot, const char *to,
 	return 0; // No reaction support in test backend
 }
 
-static void PTB_me(const struct cbot *cbot, const char *to, const char *msg)
+static void PTB_me(const struct cbot_backend *be, const char *to,
+                   const char *msg)
 {
-	struct PT_backend *backend = cbot->backend;
+	struct PT_backend *backend = be->priv;
 	struct PT_message *tm = calloc(1, sizeof(*tm));
 
 	tm->dest = strdup(to);
@@ -59,31 +62,32 @@ static void PTB_me(const struct cbot *cbot, const char *to, const char *msg)
 	sc_list_insert_end(&backend->messages, &tm->list);
 }
 
-static void PTB_op(const struct cbot *cbot, const char *channel,
+static void PTB_op(const struct cbot_backend *be, const char *channel,
                    const char *username)
 {
 	// No-op for testing
 }
 
-static void PTB_join(const struct cbot *cbot, const char *channel,
+static void PTB_join(const struct cbot_backend *be, const char *channel,
                      const char *password)
 {
 	// No-op for testing
 }
 
-static void PTB_nick(const struct cbot *cbot, const char *newnick)
+static void PTB_nick(const struct cbot_backend *be, const char *newnick)
 {
 	// No-op for testing
 }
 
-static int PTB_is_authorized(const struct cbot *bot, const char *sender,
-                             const char *message)
+static int PTB_is_authorized(const struct cbot_backend *be,
+                             const char *sender, const char *message)
 {
-	// For testing, you could make this configurable
-	return 0;
+	struct PT_backend *backend = be->priv;
+	return backend->authorized;
 }
 
-static void PTB_unregister_reaction(const struct cbot *bot, uint64_t id)
+static void PTB_unregister_reaction(const struct cbot_backend *be,
+                                    uint64_t id)
 {
 	// No-op for testing
 }
@@ -107,11 +111,9 @@ struct cbot *PT_bot_create(const char *name)
 
 	// cbot_create() already initializes all the lists and aliases
 	bot->name = strdup(name);
-	bot->backend_name = strdup("test");
-	bot->backend_ops = &test_ops;
 
 	// Initialize the backend
-	PTB_configure(bot, NULL);
+	PTB_configure(cbot_backend_add(bot, &test_ops, "test"), NULL);
 
 	// Initialize database (in-memory)
 	bot->db_file = strdup(":memory:");
@@ -126,6 +128,25 @@ struct cbot *PT_bot_create(const char *name)
 	return bot;
 }
 
+/*
+ * The sender thread doesn't run in tests, so deliver messages queued by
+ * cbot_send_rl() straight to the test backend.
+ */
+static void PT_messages_flush(struct cbot *bot)
+{
+	struct cbot_backend *be = cbot_backend_default(bot);
+	struct cbot_qmsg *qm, *tmp;
+
+	sc_list_for_each_safe(qm, tmp, &be->msgq, list, struct cbot_qmsg)
+	{
+		sc_list_remove(&qm->list);
+		PTB_send(be, qm->dest, NULL, NULL, qm->msg);
+		free(qm->msg);
+		free(qm->dest);
+		free(qm);
+	}
+}
+
 static void PT_message_free(struct PT_message *msg)
 {
 	if (!msg)
@@ -150,11 +171,13 @@ void PT_bot_destroy(struct cbot *bot)
 	if (!bot)
 		return;
 
-	struct PT_backend *backend = bot->backend;
-	if (backend) {
+	struct cbot_backend *be = cbot_backend_default(bot);
+	if (be && be->priv) {
+		struct PT_backend *backend = be->priv;
+		PT_messages_flush(bot);
 		PT_messages_free_all(&backend->messages);
 		free(backend);
-		bot->backend = NULL;
+		be->priv = NULL;
 	}
 
 	// cbot_delete will free lwt_ctx and other resources
@@ -164,21 +187,30 @@ void PT_bot_destroy(struct cbot *bot)
 void PT_inject_message(struct cbot *bot, const char *channel, const char *user,
                        const char *message, bool is_action, bool is_dm)
 {
-	cbot_handle_message(bot, channel, user, message, is_action, is_dm);
+	cbot_handle_message(cbot_backend_default(bot), channel, user, message,
+	                    is_action, is_dm);
+}
+
+void PT_set_authorized(struct cbot *bot, bool authorized)
+{
+	struct PT_backend *backend = cbot_backend_default(bot)->priv;
+	backend->authorized = authorized;
 }
 
 void PT_messages_clear(struct cbot *bot)
 {
-	struct PT_backend *backend = bot->backend;
+	struct PT_backend *backend = cbot_backend_default(bot)->priv;
+	PT_messages_flush(bot);
 	PT_messages_free_all(&backend->messages);
 	sc_list_init(&backend->messages);
 }
 
 int PT_messages_count(struct cbot *bot)
 {
-	struct PT_backend *backend = bot->backend;
+	struct PT_backend *backend = cbot_backend_default(bot)->priv;
 	int count = 0;
 	struct PT_message *msg;
+	PT_messages_flush(bot);
 	sc_list_for_each_entry(msg, &backend->messages, list, struct PT_message)
 	{
 		count++;
@@ -188,9 +220,10 @@ int PT_messages_count(struct cbot *bot)
 
 struct PT_message *PT_messages_get(struct cbot *bot, int n)
 {
-	struct PT_backend *backend = bot->backend;
+	struct PT_backend *backend = cbot_backend_default(bot)->priv;
 	int i = 0;
 	struct PT_message *msg;
+	PT_messages_flush(bot);
 	sc_list_for_each_entry(msg, &backend->messages, list, struct PT_message)
 	{
 		if (i == n)
@@ -200,12 +233,29 @@ struct PT_message *PT_messages_get(struct cbot *bot, int n)
 	return NULL;
 }
 
-struct cbot_plugin *
-PT_load_plugin(struct cbot *bot, struct cbot_plugin_ops *ops, const char *name)
+struct cbot_plugin *PT_load_plugin_conf(struct cbot *bot,
+                                        struct cbot_plugin_ops *ops,
+                                        const char *name, const char *conf)
 {
-	struct cbot_plugpriv *priv = calloc(1, sizeof(*priv));
+	config_t config;
+	config_setting_t *group = NULL;
+	struct cbot_plugpriv *priv;
+
+	if (conf) {
+		config_init(&config);
+		if (config_read_string(&config, conf) == CONFIG_FALSE) {
+			fprintf(stderr, "PT: config error line %d: %s\n",
+			        config_error_line(&config),
+			        config_error_text(&config));
+			config_destroy(&config);
+			return NULL;
+		}
+		group = config_root_setting(&config);
+	}
+
+	priv = calloc(1, sizeof(*priv));
 	if (!priv)
-		return NULL;
+		goto out;
 
 	priv->name = strdup(name);
 	priv->bot = bot;
@@ -217,14 +267,23 @@ PT_load_plugin(struct cbot *bot, struct cbot_plugin_ops *ops, const char *name)
 	sc_list_insert_end(&bot->plugins, &priv->list);
 
 	// Call the plugin's load function
-	if (ops->load && ops->load(&priv->p, NULL) != 0) {
+	if (ops->load && ops->load(&priv->p, group) != 0) {
 		sc_list_remove(&priv->list);
 		free(priv->name);
 		free(priv);
-		return NULL;
+		priv = NULL;
 	}
 
-	return &priv->p;
+out:
+	if (conf)
+		config_destroy(&config);
+	return priv ? &priv->p : NULL;
+}
+
+struct cbot_plugin *
+PT_load_plugin(struct cbot *bot, struct cbot_plugin_ops *ops, const char *name)
+{
+	return PT_load_plugin_conf(bot, ops, name, NULL);
 }
 
 void PT_unload_plugin(struct cbot_plugin *plugin)
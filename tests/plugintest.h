@@ -52,6 +52,13 @@ void PT_bot_destroy(struct cbot *bot);
 void PT_inject_message(struct cbot *bot, const char *channel, const char *user,
                        const char *message, bool is_action, bool is_dm);
 
+/**
+ * Set whether the test backend considers every sender an admin (by default,
+ * nobody is).
+ */
+void PT_set_authorized(struct cbot *bot, bool authorized);
+
+/* Messages sent by plugins, including those queued by cbot_send_rl() */
 void PT_messages_clear(struct cbot *bot);
 int PT_messages_count(struct cbot *bot);
 struct PT_message *PT_messages_get(struct cbot *bot, int n);
@@ -68,6 +75,23 @@ struct PT_message *PT_messages_get(struct cbot *bot, int n);
 struct cbot_plugin *
 PT_load_plugin(struct cbot *bot, struct cbot_plugin_ops *ops, const char *name);
 
+/**
+ * Load a plugin with a configuration.
+ *
+ * The configuration is parsed with libconfig, and its root group is passed to
+ * the plugin's load function. It is destroyed once load returns, so the plugin
+ * must copy anything it keeps.
+ *
+ * @param bot Bot instance
+ * @param ops Plugin operations
+ * @param name Plugin name
+ * @param conf Plugin configuration in libconfig syntax, or NULL
+ * @returns Plugin instance, or NULL on failure
+ */
+struct cbot_plugin *PT_load_plugin_conf(struct cbot *bot,
+                                        struct cbot_plugin_ops *ops,
+                                        const char *name, const char *conf);
+
 /**
  * Unload a plugin and free its resources
  */
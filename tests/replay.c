@@ -0,0 +1,358 @@
+/**
+ * replay.c: replay a trace of events through a set of plugins
+ *
+ * Usage: replay [-r] [-p PLUGIN_DIR] [-n COUNT] CONFIG [TRACE]
+ *
+ * CONFIG is a cbot configuration file: the name and plugin_dir from its "cbot"
+ * section are used, and the plugins in its "plugins" section are loaded onto a
+ * bot with the plugin test backend. TRACE is a trace recorded by setting
+ * "trace_file" in the cbot section. Without one, a synthetic trace of COUNT
+ * events (default 100000) is generated.
+ *
+ * Events are replayed as fast as possible, or with -r, at the speed they were
+ * recorded. Results are printed as JSON: one line for the whole replay, and one
+ * for each handler, with latency percentiles and (with glibc) the number of
+ * heap allocations made per call.
+ */
+
+#include <libconfig.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sc-collections.h>
+#include <sc-lwt.h>
+
+#include "../src/cbot_private.h"
+#include "bench.h"
+#include "plugintest.h"
+
+struct handler_stats {
+	struct cbot_handler *hdlr;
+	struct sc_array ns; /* uint64_t */
+	unsigned long allocs, max_allocs;
+};
+
+/*
+ * To count allocations per handler, each handler is wrapped in one which
+ * notes the allocation count before and after the call.
+ */
+struct counted_handler {
+	cbot_handler_t handler;
+	void *user;
+	unsigned long allocs; /* made by the last call */
+};
+
+static struct sc_array stats; /* struct handler_stats */
+
+static struct counted_handler *counted;
+
+/*
+ * Allocations are counted by bench.c, which stands in for malloc() and friends
+ * where the C library allows it. Plugins are loaded into this process, so their
+ * allocations (and those of the libraries they call) are counted too.
+ */
+static void counted_call(struct cbot_event *event, void *user)
+{
+	struct counted_handler *ch = user;
+	unsigned long before = BENCH_allocs();
+
+	ch->handler(event, ch->user);
+	ch->allocs = BENCH_allocs() - before;
+}
+
+/* Wrap every handler the plugins registered, to count its allocations */
+static void count_handlers(struct cbot *bot)
+{
+	struct cbot_plugpriv *priv;
+	struct cbot_handler *hdlr;
+	size_t n = 0;
+
+	sc_list_for_each_entry(priv, &bot->plugins, list, struct cbot_plugpriv)
+	{
+		sc_list_for_each_entry(hdlr, &priv->handlers, plugin_list,
+		                       struct cbot_handler)
+		{
+			n++;
+		}
+	}
+	counted = calloc(n ? n : 1, sizeof(*counted));
+	n = 0;
+	sc_list_for_each_entry(priv, &bot->plugins, list, struct cbot_plugpriv)
+	{
+		sc_list_for_each_entry(hdlr, &priv->handlers, plugin_list,
+		                       struct cbot_handler)
+		{
+			counted[n].handler = hdlr->handler;
+			counted[n].user = hdlr->user;
+			hdlr->handler = counted_call;
+			hdlr->user = &counted[n++];
+		}
+	}
+}
+
+static const char *event_names[] = {
+	[CBOT_ADDRESSED] = "addressed",
+	[CBOT_MESSAGE] = "message",
+	[CBOT_JOIN] = "join",
+	[CBOT_PART] = "part",
+	[CBOT_NICK] = "nick",
+	[CBOT_BOT_NAME] = "bot_name",
+};
+
+static void handler_timed(struct cbot *bot, struct cbot_handler *hdlr,
+                          uint64_t ns)
+{
+	struct handler_stats *hs = sc_arr(&stats, struct handler_stats);
+	struct counted_handler *ch;
+	struct handler_stats new;
+	size_t i;
+
+	for (i = 0; i < stats.len; i++)
+		if (hs[i].hdlr == hdlr)
+			break;
+	if (i == stats.len) {
+		new.hdlr = hdlr;
+		sc_arr_init(&new.ns, uint64_t, 1024);
+		new.allocs = new.max_allocs = 0;
+		sc_arr_append(&stats, struct handler_stats, new);
+		hs = sc_arr(&stats, struct handler_stats);
+	}
+	sc_arr_append(&hs[i].ns, uint64_t, ns);
+	if (hdlr->handler == counted_call) {
+		ch = hdlr->user;
+		hs[i].allocs += ch->allocs;
+		if (ch->allocs > hs[i].max_allocs)
+			hs[i].max_allocs = ch->allocs;
+	}
+}
+
+static int cmp_u64(const void *lhs, const void *rhs)
+{
+	uint64_t l = *(const uint64_t *)lhs, r = *(const uint64_t *)rhs;
+	return (l > r) - (l < r);
+}
+
+static void report_handler(struct cbot *bot, struct handler_stats *hs)
+{
+	struct cbot_handler *h;
+	uint64_t *ns = sc_arr(&hs->ns, uint64_t);
+	size_t n = hs->ns.len;
+	const char *event;
+	int type = hs->hdlr->type, index = 0;
+
+	sc_list_for_each_entry(h, &hs->hdlr->plugin->handlers, plugin_list,
+	                       struct cbot_handler)
+	{
+		if (h == hs->hdlr)
+			break;
+		index++;
+	}
+	event = "other";
+	if (type < nelem(event_names) && event_names[type])
+		event = event_names[type];
+	qsort(ns, n, sizeof(*ns), cmp_u64);
+	printf("{\"name\": \"replay_handler\", \"plugin\": \"%s\", "
+	       "\"event\": \"%s\", \"handler\": %d, \"calls\": %zu, "
+	       "\"p50_ns\": %lu, \"p90_ns\": %lu, \"p99_ns\": %lu, "
+	       "\"max_ns\": %lu",
+	       hs->hdlr->plugin->name, event, index, n,
+	       (unsigned long)ns[n / 2], (unsigned long)ns[n * 9 / 10],
+	       (unsigned long)ns[n * 99 / 100], (unsigned long)ns[n - 1]);
+	if (BENCH_counting_allocs())
+		printf(", \"allocs_per_call\": %.2f, \"max_allocs\": %lu",
+		       (double)hs->allocs / n, hs->max_allocs);
+	printf("}\n");
+}
+
+/* Messages for a synthetic trace, in roughly the proportions we see */
+static const char *corpus[] = {
+	"hello everyone",
+	"does anybody know how to exit vim",
+	"cbot: hello",
+	"c++ is a fine language",
+	"lunch++",
+	"mondays--",
+	"cbot: what is the weather",
+	"the quick brown fox jumps over the lazy dog",
+	"cbot: emote shrug",
+	"https://example.com/some/long/link?with=a&query=string",
+	"I'd like a cookie right about now",
+	"cbot: magic8 will it rain today?",
+};
+
+static int synthesize(struct cbot *bot, const char *path, unsigned long count)
+{
+	char user[32], channel[32];
+	unsigned long i;
+
+	if (cbot_trace_open(bot, path) < 0)
+		return -1;
+	for (i = 0; i < count; i++) {
+		snprintf(user, sizeof(user), "user%lu", (i * 7) % 50);
+		snprintf(channel, sizeof(channel), "#chan%lu", i % 4);
+		if (i % 100 == 99)
+			cbot_trace_user(bot, channel, user,
+			                (i / 100) % 2 ? CBOT_PART : CBOT_JOIN);
+		else if (i % 1000 == 500)
+			cbot_trace_nick(bot, user, "newnick");
+		else
+			cbot_trace_message(bot, channel, user,
+			                   corpus[i % nelem(corpus)], false,
+			                   false);
+	}
+	cbot_trace_close(bot);
+	return 0;
+}
+
+static void wait_until(const struct timespec *start, uint64_t ns)
+{
+	struct timespec now, ts;
+	uint64_t elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - start->tv_sec) * 1000000000ULL +
+	          now.tv_nsec - start->tv_nsec;
+	if (elapsed >= ns)
+		return;
+	ts.tv_sec = (ns - elapsed) / 1000000000ULL;
+	ts.tv_nsec = (ns - elapsed) % 1000000000ULL;
+	nanosleep(&ts, NULL);
+}
+
+static void noop_thread(void *arg)
+{
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [-r] [-p PLUGIN_DIR] [-n COUNT] CONFIG [TRACE]\n",
+	        prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct cbot_trace_reader *reader = NULL;
+	struct cbot_trace_event ev;
+	struct timespec start;
+	struct cbot *bot = NULL;
+	struct BENCH b;
+	config_t conf;
+	config_setting_t *setting, *plugins;
+	const char *name = "cbot", *plugin_dir = NULL;
+	char synth[] = "/tmp/cbot-replay-XXXXXX";
+	const char *trace = NULL;
+	unsigned long count = 100000, events = 0;
+	bool realtime = false;
+	int opt, rv, fd, ret = 1;
+	size_t i;
+
+	while ((opt = getopt(argc, argv, "rp:n:")) != -1) {
+		switch (opt) {
+		case 'r':
+			realtime = true;
+			break;
+		case 'p':
+			plugin_dir = optarg;
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc || argc - optind > 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	sc_arr_init(&stats, struct handler_stats, 32);
+	config_init(&conf);
+	if (config_read_file(&conf, argv[optind]) == CONFIG_FALSE) {
+		fprintf(stderr, "%s:%d: %s\n", argv[optind],
+		        config_error_line(&conf), config_error_text(&conf));
+		goto out;
+	}
+	setting = config_lookup(&conf, "cbot");
+	if (setting) {
+		config_setting_lookup_string(setting, "name", &name);
+		if (!plugin_dir)
+			config_setting_lookup_string(setting, "plugin_dir",
+			                             &plugin_dir);
+	}
+	plugins = config_lookup(&conf, "plugins");
+	if (!plugins || !config_setting_is_group(plugins)) {
+		fprintf(stderr, "\"plugins\" section missing or wrong type\n");
+		goto out;
+	}
+
+	cbot_set_log_file(stderr);
+	cbot_set_log_level(WARN);
+	bot = PT_bot_create(name);
+	if (!bot)
+		goto out;
+	free(bot->plugin_dir);
+	bot->plugin_dir = strdup(plugin_dir ? plugin_dir : ".");
+	/* Rate-limited sends are queued for a thread which never runs */
+	cbot_backend_default(bot)->msgq_thread =
+	        sc_lwt_create_task(bot->lwt_ctx, noop_thread, NULL);
+	if (cbot_load_plugins(bot, plugins) < 0)
+		goto out;
+
+	if (optind + 1 < argc) {
+		trace = argv[optind + 1];
+	} else {
+		if ((fd = mkstemp(synth)) < 0) {
+			perror("mkstemp");
+			goto out;
+		}
+		close(fd);
+		rv = synthesize(bot, synth, count);
+		trace = synth;
+		if (rv < 0)
+			goto out;
+	}
+	reader = cbot_trace_reader_open(trace);
+	if (!reader)
+		goto out;
+
+	if (BENCH_counting_allocs())
+		count_handlers(bot);
+	bot->handler_timed = handler_timed;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	/* We don't know the number of events until we've read them all */
+	BENCH_start(&b, "replay", 0);
+	while ((rv = cbot_trace_read(reader, &ev)) > 0) {
+		if (realtime)
+			wait_until(&start, ev.ns);
+		cbot_trace_replay(bot, &ev);
+		if (++events % 256 == 0)
+			PT_messages_clear(bot);
+	}
+	b.iters = events ? events : 1;
+	BENCH_end(&b);
+	bot->handler_timed = NULL;
+	if (rv < 0)
+		goto out;
+
+	for (i = 0; i < stats.len; i++)
+		report_handler(bot, &sc_arr(&stats, struct handler_stats)[i]);
+	ret = 0;
+out:
+	for (i = 0; i < stats.len; i++)
+		sc_arr_destroy(&sc_arr(&stats, struct handler_stats)[i].ns);
+	sc_arr_destroy(&stats);
+	cbot_trace_reader_close(reader);
+	if (trace == synth)
+		unlink(synth);
+	if (bot)
+		PT_bot_destroy(bot);
+	free(counted);
+	config_destroy(&conf);
+	return ret;
+}
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <unity.h>
+
+#include "../src/cbot_private.h"
+
+static struct cbot *bot;
+static struct cbot_backend *be;
+static struct cbot_plugpriv priv;
+/* Handlers append their user pointer (a single character) here */
+static char calls[32];
+
+static uint64_t null_send(const struct cbot_backend *be, const char *to,
+                          const struct cbot_reaction_ops *ops, void *arg,
+                          const char *msg)
+{
+	return 0;
+}
+
+static struct cbot_backend_ops null_ops = {
+	.name = "null",
+	.send = null_send,
+};
+
+static void record(struct cbot_event *event, void *user)
+{
+	strncat(calls, user, 1);
+}
+
+void setUp(void)
+{
+	bot = cbot_create();
+	bot->name = strdup("cbot");
+	be = cbot_backend_add(bot, &null_ops, "null");
+	memset(&priv, 0, sizeof(priv));
+	priv.bot = bot;
+	sc_list_init(&priv.handlers);
+	calls[0] = '\0';
+}
+
+void tearDown(void)
+{
+	struct cbot_handler *hdlr, *next;
+
+	sc_list_for_each_safe(hdlr, next, &priv.handlers, plugin_list,
+	                      struct cbot_handler)
+	{
+		cbot_deregister(bot, hdlr);
+	}
+	cbot_delete(bot);
+}
+
+static struct cbot_handler *scoped(enum cbot_event_type type, char *user,
+                                   char *regex, const char *const *channels,
+                                   int flags)
+{
+	return cbot_register_scoped_priv(bot, &priv, type, record, user, regex,
+	                                 0, channels, flags);
+}
+
+static void message(const char *channel, const char *msg, bool is_dm)
+{
+	cbot_handle_message(be, channel, "user", msg, false, is_dm);
+}
+
+static void test_channels(void)
+{
+	const char *channels[] = { "#a", "#b", NULL };
+
+	scoped(CBOT_MESSAGE, "s", NULL, channels, 0);
+	message("#a", "hi", false);
+	message("#b", "hi", false);
+	message("#c", "hi", false);
+	message("user", "hi", true);
+	TEST_ASSERT_EQUAL_STRING("ss", calls);
+}
+
+static void test_dm(void)
+{
+	const char *channels[] = { "#a", NULL };
+
+	scoped(CBOT_ADDRESSED, "d", "help", NULL, CBOT_SCOPE_DM);
+	scoped(CBOT_ADDRESSED, "a", "help", channels, 0);
+	message("user", "help", true);
+	message("#a", "cbot: help", false);
+	message("#b", "cbot: help", false);
+	TEST_ASSERT_EQUAL_STRING("da", calls);
+}
+
+static void test_order(void)
+{
+	const char *channels[] = { "#a", NULL };
+
+	cbot_register_priv(bot, &priv, CBOT_MESSAGE, record, "1", NULL, 0);
+	scoped(CBOT_MESSAGE, "2", NULL, channels, 0);
+	cbot_register_priv(bot, &priv, CBOT_MESSAGE, record, "3", NULL, 0);
+	scoped(CBOT_MESSAGE, "4", NULL, channels, 0);
+	message("#a", "hi", false);
+	TEST_ASSERT_EQUAL_STRING("1234", calls);
+	calls[0] = '\0';
+	message("#b", "hi", false);
+	TEST_ASSERT_EQUAL_STRING("13", calls);
+}
+
+static void test_deregister(void)
+{
+	const char *channels[] = { "#a", "#a", "#b", NULL };
+	struct cbot_handler *hdlr;
+
+	hdlr = scoped(CBOT_MESSAGE, "x", NULL, channels, CBOT_SCOPE_DM);
+	/* Repeated channels are only counted once */
+	TEST_ASSERT_EQUAL(3, hdlr->nscopes);
+	message("#a", "hi", false);
+	TEST_ASSERT_EQUAL_STRING("x", calls);
+	cbot_deregister(bot, hdlr);
+	message("#a", "hi", false);
+	message("#b", "hi", false);
+	message("user", "hi", true);
+	TEST_ASSERT_EQUAL_STRING("x", calls);
+}
+
+static void test_user_event(void)
+{
+	const char *channels[] = { "#a", NULL };
+
+	scoped(CBOT_JOIN, "j", NULL, channels, 0);
+	cbot_handle_user_event(be, "#a", "user", CBOT_JOIN);
+	cbot_handle_user_event(be, "#b", "user", CBOT_JOIN);
+	cbot_handle_user_event(be, "#a", "user", CBOT_PART);
+	TEST_ASSERT_EQUAL_STRING("j", calls);
+
+	TEST_ASSERT_NULL(scoped(CBOT_NICK, "n", NULL, channels, 0));
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_channels);
+	RUN_TEST(test_dm);
+	RUN_TEST(test_order);
+	RUN_TEST(test_deregister);
+	RUN_TEST(test_user_event);
+	return UNITY_END();
+}
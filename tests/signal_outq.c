@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <sc-lwt.h>
+#include <unity.h>
+
+#include "../src/cbot_private.h"
+#include "../src/signal/internal.h"
+
+static struct cbot_signal_backend sig;
+static struct cbot_backend be;
+static int peer;
+
+void setUp(void)
+{
+	int sv[2];
+	int size = 4096;
+
+	TEST_ASSERT(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) ==
+	            0);
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	memset(&sig, 0, sizeof(sig));
+	memset(&be, 0, sizeof(be));
+	sig.be = &be;
+	sig.fd = sv[0];
+	peer = sv[1];
+	sc_cb_init(&sig.out, 64);
+	signal_outq_init(&sig.outq, sig.fd);
+}
+
+void tearDown(void)
+{
+	signal_outq_destroy(&sig.outq);
+	sc_cb_destroy(&sig.out);
+	close(sig.fd);
+	close(peer);
+}
+
+/* Read everything available from the peer into @cb */
+static void drain(struct sc_charbuf *cb)
+{
+	char buf[4096];
+	ssize_t rv;
+
+	while ((rv = read(peer, buf, sizeof(buf))) > 0)
+		sc_cb_memcpy(cb, buf, rv);
+}
+
+static void test_write_immediately(void)
+{
+	struct sc_charbuf got;
+
+	sc_cb_init(&got, 64);
+	sc_cb_concat(&sig.out, "{\"id\":1}\n");
+	TEST_ASSERT_EQUAL(0, signal_write(&sig));
+	TEST_ASSERT_EQUAL(0, sig.out.length);
+	TEST_ASSERT_EQUAL(0, sig.outq.bytes);
+	drain(&got);
+	TEST_ASSERT_EQUAL_STRING("{\"id\":1}\n", got.buf);
+	sc_cb_destroy(&got);
+}
+
+static void test_queue_when_full(void)
+{
+	struct sc_charbuf got, want;
+	int i;
+
+	sc_cb_init(&got, 1024);
+	sc_cb_init(&want, 1024);
+
+	/* Overfill the socket: the rest must stay queued, in order */
+	for (i = 0; i < 2000; i++) {
+		sc_cb_printf(&sig.out, "{\"id\":%d,\"pad\":\"%0100d\"}\n", i,
+		             0);
+		sc_cb_concat(&want, sig.out.buf);
+		TEST_ASSERT_EQUAL(0, signal_write(&sig));
+	}
+	TEST_ASSERT(sig.outq.bytes > 0);
+
+	/* Each write flushes what it can, as the peer reads */
+	while (sig.outq.bytes) {
+		drain(&got);
+		sc_cb_concat(&sig.out, "\n");
+		sc_cb_concat(&want, "\n");
+		TEST_ASSERT_EQUAL(0, signal_write(&sig));
+	}
+	drain(&got);
+	TEST_ASSERT_EQUAL(want.length, got.length);
+	TEST_ASSERT_EQUAL_STRING(want.buf, got.buf);
+
+	sc_cb_destroy(&got);
+	sc_cb_destroy(&want);
+}
+
+static void test_write_error(void)
+{
+	close(peer);
+	peer = -1;
+	sc_cb_concat(&sig.out, "{\"id\":1}\n");
+	TEST_ASSERT_EQUAL(-1, signal_write(&sig));
+	TEST_ASSERT(sig.outq.failed);
+	sc_cb_concat(&sig.out, "{\"id\":2}\n");
+	TEST_ASSERT_EQUAL(-1, signal_write(&sig));
+}
+
+/* State shared by the threads of test_backpressure() */
+static struct sc_charbuf got, want;
+static size_t peak, woke_at, read_at_wake;
+static int write_rv;
+static bool woke;
+
+/* Queue requests until one blocks, and note how much is queued after it */
+static void sender_thread(void *arg)
+{
+	int i = 0;
+
+	do {
+		sc_cb_printf(&sig.out, "{\"id\":%d,\"pad\":\"%0500d\"}\n", i++,
+		             0);
+		sc_cb_concat(&want, sig.out.buf);
+		if (sig.outq.bytes + sig.out.length > peak)
+			peak = sig.outq.bytes + sig.out.length;
+		write_rv = signal_write(&sig);
+	} while (!write_rv && peak <= SIGNAL_OUTQ_HIGH);
+	woke_at = sig.outq.bytes;
+	read_at_wake = got.length;
+	woke = true;
+}
+
+/* Play the bridge: read whatever the writer manages to send */
+static void reader_thread(void *arg)
+{
+	struct sc_lwt *cur = sc_lwt_current();
+	char buf[4096];
+	ssize_t rv;
+
+	sc_lwt_wait_fd(cur, peer, SC_LWT_W_IN, NULL);
+	while (!woke || sig.outq.bytes || got.length < want.length) {
+		sc_lwt_set_state(cur, SC_LWT_BLOCKED);
+		sc_lwt_yield();
+		if (!sc_lwt_fd_status(cur, peer, NULL))
+			continue;
+		/* One read per wakeup, so that the queue drains slowly */
+		rv = read(peer, buf, sizeof(buf));
+		if (rv > 0)
+			sc_cb_memcpy(&got, buf, rv);
+	}
+	sc_lwt_remove_all(cur);
+	/* Stop the writer thread */
+	sc_lwt_send_shutdown_signal();
+}
+
+static void test_backpressure(void)
+{
+	struct sc_lwt_ctx *ctx = sc_lwt_init();
+
+	sc_cb_init(&got, 4096);
+	sc_cb_init(&want, 4096);
+	peak = woke_at = read_at_wake = 0;
+	write_rv = 0;
+	woke = false;
+
+	signal_outq_start(&sig.outq, ctx);
+	TEST_ASSERT_NOT_NULL(sig.outq.writer);
+	sc_lwt_create_task(ctx, sender_thread, NULL);
+	sc_lwt_create_task(ctx, reader_thread, NULL);
+	sc_lwt_run(ctx);
+	sc_lwt_free(ctx);
+
+	/*
+	 * The sender went over the high watermark, and was woken by the writer
+	 * once the queue drained to the low watermark: not before the bridge
+	 * read anything, and not only once the queue was empty.
+	 */
+	TEST_ASSERT(woke);
+	TEST_ASSERT_EQUAL(0, write_rv);
+	TEST_ASSERT(peak > SIGNAL_OUTQ_HIGH);
+	TEST_ASSERT(read_at_wake > 0);
+	TEST_ASSERT(woke_at <= SIGNAL_OUTQ_LOW);
+	TEST_ASSERT(woke_at > 0);
+
+	/* The writer thread wrote everything, in order, then exited */
+	TEST_ASSERT_NULL(sig.outq.writer);
+	TEST_ASSERT_EQUAL(0, sig.outq.bytes);
+	TEST_ASSERT_EQUAL(want.length, got.length);
+	TEST_ASSERT_EQUAL_STRING(want.buf, got.buf);
+
+	sc_cb_destroy(&got);
+	sc_cb_destroy(&want);
+}
+
+int main(int argc, char **argv)
+{
+	signal(SIGPIPE, SIG_IGN);
+	UNITY_BEGIN();
+	RUN_TEST(test_write_immediately);
+	RUN_TEST(test_queue_when_full);
+	RUN_TEST(test_write_error);
+	RUN_TEST(test_backpressure);
+	return UNITY_END();
+}
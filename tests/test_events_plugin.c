@@ -0,0 +1,476 @@
+/**
+ * test_events_plugin.c: Unit tests for the events plugin's iCal parser, and
+ * its refreshing of feeds
+ *
+ * The parser and search are static, so this includes the plugin source rather
+ * than linking against it. Feeds are refreshed from a local HTTP server, on an
+ * LWT alongside the bot's curl thread.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+
+#include "../plugin/events.c"
+#include "../src/cbot_private.h"
+#include "httptest.h"
+#include "plugintest.h"
+
+static struct ical_feed feed = { .name = "Test" };
+static struct sc_charbuf out;
+static struct cbot *bot;
+static struct sc_lwt *runner;
+
+void setUp(void)
+{
+	/* Times are formatted in local time */
+	setenv("TZ", "UTC", 1);
+	tzset();
+	sc_cb_init(&out, 256);
+}
+
+void tearDown(void)
+{
+	feed_free(&feed);
+	for (int i = 0; i < NFEEDS; i++)
+		feed_free(&feeds[i]);
+	sc_cb_destroy(&out);
+	HT_reset();
+}
+
+/* Parse a feed given as lines, as they would be streamed */
+static void parse(const char *const *lines)
+{
+	struct ical_parse p;
+
+	ical_parse_init(&p);
+	for (; *lines; lines++)
+		ical_line(&p, *lines, strlen(*lines));
+	feed_load(&feed, &p);
+}
+
+static const char *summary(size_t i)
+{
+	TEST_ASSERT_LESS_THAN(feed.events.len, i);
+	return feed.strings.buf +
+	       sc_arr(&feed.events, struct ical_event)[i].summary;
+}
+
+static const char *search(const char *start, const char *end)
+{
+	sc_cb_clear(&out);
+	feed_search(&feed, parse_ical_time(start), parse_ical_time(end), &out);
+	return out.buf;
+}
+
+static void test_time(void)
+{
+	TEST_ASSERT_EQUAL(0, parse_ical_time("19700101T000000Z"));
+	TEST_ASSERT_EQUAL(951782400, parse_ical_time("20000229T000000Z"));
+	TEST_ASSERT_EQUAL(1717606800, parse_ical_time("20240605T170000Z"));
+	/* Only UTC times are understood */
+	TEST_ASSERT_EQUAL(-1, parse_ical_time("20240605T170000"));
+	TEST_ASSERT_EQUAL(-1, parse_ical_time("20240605"));
+	TEST_ASSERT_EQUAL(-1, parse_ical_time("20241305T170000Z"));
+	TEST_ASSERT_EQUAL(-1, parse_ical_time("2024060xT170000Z"));
+}
+
+static void test_unfold(void)
+{
+	const char *const lines[] = {
+		"BEGIN:VCALENDAR",
+		"BEGIN:VEVENT",
+		"SUMMARY:Warriors vs Lak",
+		" ers in a very long",
+		"\t title",
+		"DTSTART:20240605T170000Z",
+		"DTEND:20240605T190000Z",
+		"END:VEVENT",
+		"END:VCALENDAR",
+		NULL,
+	};
+
+	parse(lines);
+	TEST_ASSERT_EQUAL(1, feed.events.len);
+	TEST_ASSERT_EQUAL_STRING("Warriors vs Lakers in a very long title",
+	                         summary(0));
+}
+
+static void test_last_line(void)
+{
+	const char *const lines[] = {
+		"BEGIN:VCALENDAR",
+		"BEGIN:VEVENT",
+		"SUMMARY:Con",
+		" cert",
+		"DTSTART:20240605T170000Z",
+		"END:VEVENT",
+		NULL,
+	};
+
+	/*
+	 * The last line is handled once the feed ends, rather than when the
+	 * next line shows that it isn't folded
+	 */
+	parse(lines);
+	TEST_ASSERT_EQUAL(1, feed.events.len);
+	TEST_ASSERT_EQUAL_STRING("Concert", summary(0));
+}
+
+static void test_not_calendar(void)
+{
+	struct feed_fetch f = { .feed = &feed };
+	char page[] = "<html>", begin[] = "BEGIN:VCALENDAR", event[] = "<p>";
+
+	/* The stream is abandoned at the first line of something else */
+	ical_parse_init(&f.parse);
+	TEST_ASSERT_NOT_EQUAL(0, feed_fetch_line(page, strlen(page), &f));
+	TEST_ASSERT_FALSE(f.calendar);
+	TEST_ASSERT_EQUAL(0, feed_fetch_line(begin, strlen(begin), &f));
+	TEST_ASSERT_EQUAL(0, feed_fetch_line(event, strlen(event), &f));
+	TEST_ASSERT_TRUE(f.calendar);
+	ical_parse_destroy(&f.parse);
+}
+
+static void test_escapes(void)
+{
+	const char *const lines[] = {
+		"BEGIN:VEVENT",
+		"SUMMARY:Giants vs\\, Dodgers\\; game\\none \\\\ two\\",
+		"DTSTART:20240605T170000Z",
+		"END:VEVENT",
+		NULL,
+	};
+
+	parse(lines);
+	TEST_ASSERT_EQUAL(1, feed.events.len);
+	TEST_ASSERT_EQUAL_STRING("Giants vs, Dodgers; game one \\ two\\",
+	                         summary(0));
+}
+
+static void test_params(void)
+{
+	const char *const lines[] = {
+		"BEGIN:VEVENT",
+		"SUMMARY;LANGUAGE=en;X-NOTE=\"a:b\":Concert",
+		"DTSTART;VALUE=DATE-TIME:20240605T170000Z",
+		"DTEND:20240605T190000Z",
+		"END:VEVENT",
+		NULL,
+	};
+
+	parse(lines);
+	TEST_ASSERT_EQUAL(1, feed.events.len);
+	TEST_ASSERT_EQUAL_STRING("Concert", summary(0));
+	TEST_ASSERT_EQUAL(7200, feed.max_duration);
+}
+
+static void test_valarm(void)
+{
+	const char *const lines[] = {
+		"BEGIN:VEVENT",
+		"SUMMARY:Concert",
+		"BEGIN:VALARM",
+		"SUMMARY:Reminder",
+		"DTSTART:20240101T000000Z",
+		"BEGIN:X-NESTED",
+		"SUMMARY:Nested",
+		"END:X-NESTED",
+		"END:VALARM",
+		"DTSTART:20240605T170000Z",
+		"DTEND:20240605T190000Z",
+		"END:VEVENT",
+		/* Properties outside of an event are ignored */
+		"SUMMARY:Stray",
+		"DTSTART:20240605T170000Z",
+		NULL,
+	};
+
+	parse(lines);
+	TEST_ASSERT_EQUAL(1, feed.events.len);
+	TEST_ASSERT_EQUAL_STRING("Concert", summary(0));
+	TEST_ASSERT_EQUAL(1717606800,
+	                  sc_arr(&feed.events, struct ical_event)[0].start);
+}
+
+static void test_skipped(void)
+{
+	const char *const lines[] = {
+		/* Away games */
+		"BEGIN:VEVENT",
+		"SUMMARY:Warriors at Lakers",
+		"DTSTART:20240605T170000Z",
+		"END:VEVENT",
+		"BEGIN:VEVENT",
+		"SUMMARY:Valkyries at Sparks",
+		"DTSTART:20240605T170000Z",
+		"END:VEVENT",
+		/* No summary, no start, or ending before it starts */
+		"BEGIN:VEVENT",
+		"DTSTART:20240605T170000Z",
+		"END:VEVENT",
+		"BEGIN:VEVENT",
+		"SUMMARY:Whenever",
+		"END:VEVENT",
+		"BEGIN:VEVENT",
+		"SUMMARY:Backwards",
+		"DTSTART:20240605T170000Z",
+		"DTEND:20240605T160000Z",
+		"END:VEVENT",
+		/* Local times aren't understood */
+		"BEGIN:VEVENT",
+		"SUMMARY:Local",
+		"DTSTART;TZID=America/Los_Angeles:20240605T170000",
+		"END:VEVENT",
+		"BEGIN:VEVENT",
+		"SUMMARY:Warriors vs Lakers",
+		"DTSTART:20240605T170000Z",
+		"END:VEVENT",
+		NULL,
+	};
+
+	parse(lines);
+	TEST_ASSERT_EQUAL(1, feed.events.len);
+	TEST_ASSERT_EQUAL_STRING("Warriors vs Lakers", summary(0));
+}
+
+static void test_search(void)
+{
+	/* Out of order, as feeds may be */
+	const char *const lines[] = {
+		"BEGIN:VEVENT",
+		"SUMMARY:Late",
+		"DTSTART:20240605T210000Z",
+		"DTEND:20240605T230000Z",
+		"END:VEVENT",
+		"BEGIN:VEVENT",
+		"SUMMARY:Festival",
+		"DTSTART:20240601T000000Z",
+		"DTEND:20240610T000000Z",
+		"END:VEVENT",
+		"BEGIN:VEVENT",
+		"SUMMARY:Early",
+		"DTSTART:20240605T120000Z",
+		"DTEND:20240605T170000Z",
+		"END:VEVENT",
+		"BEGIN:VEVENT",
+		"SUMMARY:Tomorrow",
+		"DTSTART:20240606T180000Z",
+		"DTEND:20240606T200000Z",
+		"END:VEVENT",
+		NULL,
+	};
+	time_t early;
+
+	parse(lines);
+	TEST_ASSERT_EQUAL(4, feed.events.len);
+	TEST_ASSERT_EQUAL_STRING("Festival", summary(0));
+	TEST_ASSERT_EQUAL_STRING("Early", summary(1));
+	TEST_ASSERT_EQUAL_STRING("Late", summary(2));
+	TEST_ASSERT_EQUAL_STRING("Tomorrow", summary(3));
+	TEST_ASSERT_EQUAL(9 * 86400, feed.max_duration);
+
+	early = parse_ical_time("20240605T120000Z");
+	TEST_ASSERT_EQUAL(0, feed_lower_bound(&feed, 0));
+	TEST_ASSERT_EQUAL(1, feed_lower_bound(&feed, early - 1));
+	TEST_ASSERT_EQUAL(1, feed_lower_bound(&feed, early));
+	TEST_ASSERT_EQUAL(2, feed_lower_bound(&feed, early + 1));
+	TEST_ASSERT_EQUAL(4, feed_lower_bound(&feed, early + 2 * 86400));
+
+	/* The festival began long before, but overlaps: so does "Early" */
+	TEST_ASSERT_EQUAL_STRING(
+	        "Festival at 12:00am--12:00am. Also, "
+	        "Early at 12:00pm-- 5:00pm. Also, "
+	        "Late at  9:00pm--11:00pm.",
+	        search("20240605T170000Z", "20240605T220000Z"));
+	TEST_ASSERT_EQUAL_STRING(
+	        "Festival at 12:00am--12:00am. Also, "
+	        "Tomorrow at  6:00pm-- 8:00pm.",
+	        search("20240606T170000Z", "20240606T220000Z"));
+	TEST_ASSERT_EQUAL_STRING("",
+	                         search("20240611T170000Z", "20240611T220000Z"));
+}
+
+#define CALENDAR(events) "BEGIN:VCALENDAR\r\n" events "END:VCALENDAR\r\n"
+#define EVENT(summary)                                                         \
+	"BEGIN:VEVENT\r\n"                                                     \
+	"SUMMARY:" summary "\r\n"                                              \
+	"DTSTART:20240605T170000Z\r\n"                                         \
+	"END:VEVENT\r\n"
+
+static struct HT_response v1 = {
+	.status = 200,
+	.body = CALENDAR(EVENT("Concert")),
+	.etag = "\"v1\"",
+};
+
+static void serve(const struct HT_response *a, const struct HT_response *b)
+{
+	feeds[0].url = HT_route("/a.ics", a);
+	feeds[1].url = HT_route("/b.ics", b);
+}
+
+static void make_stale(void)
+{
+	for (int i = 0; i < NFEEDS; i++)
+		feeds[i].checked = time(NULL) - FEED_MAX_AGE;
+}
+
+static void test_refresh(void)
+{
+	struct HT_response v2 = {
+		.status = 200,
+		.body = CALENDAR(EVENT("Concert") EVENT("Game")),
+		.etag = "\"v2\"",
+	};
+	void *parsed;
+
+	serve(&v1, &v1);
+	TEST_ASSERT_FALSE(feeds_refresh(bot));
+	TEST_ASSERT_TRUE(feeds[0].loaded);
+	TEST_ASSERT_TRUE(feeds[1].loaded);
+	TEST_ASSERT_EQUAL(1, feeds[0].events.len);
+	TEST_ASSERT_EQUAL(0, HT_conditional("/a.ics"));
+
+	/* Fresh feeds aren't requested at all */
+	TEST_ASSERT_FALSE(feeds_refresh(bot));
+	TEST_ASSERT_EQUAL(1, HT_requests("/a.ics"));
+
+	/* Stale feeds are revalidated, but not parsed again */
+	parsed = feeds[0].events.arr;
+	make_stale();
+	TEST_ASSERT_FALSE(feeds_refresh(bot));
+	TEST_ASSERT_EQUAL(1, HT_conditional("/a.ics"));
+	TEST_ASSERT_EQUAL(1, HT_conditional("/b.ics"));
+	TEST_ASSERT_EQUAL_PTR(parsed, feeds[0].events.arr);
+	TEST_ASSERT_GREATER_THAN(time(NULL) - FEED_MAX_AGE, feeds[0].checked);
+
+	/* Only the feed which changed is parsed again */
+	serve(&v1, &v2);
+	make_stale();
+	TEST_ASSERT_FALSE(feeds_refresh(bot));
+	TEST_ASSERT_EQUAL_PTR(parsed, feeds[0].events.arr);
+	TEST_ASSERT_EQUAL(2, feeds[1].events.len);
+	TEST_ASSERT_EQUAL_STRING("\"v2\"", feeds[1].val.etag);
+}
+
+static void test_refresh_error(void)
+{
+	/* Large, but abandoned after its first line */
+	struct HT_response page = {
+		.status = 200,
+		.body = "<html>Down for maintenance</html>\r\n",
+		.repeat = 100000,
+		.etag = "\"page\"",
+	};
+	struct HT_response empty = {
+		.status = 200,
+		.body = "",
+		.etag = "\"empty\"",
+	};
+	struct HT_response missing = { .status = 404, .body = "missing" };
+
+	serve(&v1, &v1);
+	TEST_ASSERT_FALSE(feeds_refresh(bot));
+
+	/* An error keeps the events and validators we had */
+	serve(&missing, &v1);
+	make_stale();
+	TEST_ASSERT_TRUE(feeds_refresh(bot));
+	TEST_ASSERT_EQUAL(1, feeds[0].events.len);
+	TEST_ASSERT_EQUAL_STRING("\"v1\"", feeds[0].val.etag);
+
+	/* So does something which isn't a calendar */
+	serve(&page, &v1);
+	make_stale();
+	TEST_ASSERT_TRUE(feeds_refresh(bot));
+	TEST_ASSERT_EQUAL(1, feeds[0].events.len);
+	TEST_ASSERT_EQUAL_STRING("\"v1\"", feeds[0].val.etag);
+
+	/*
+	 * A complete response with nothing in it keeps the events, but not
+	 * the validators, which describe what we discarded
+	 */
+	serve(&empty, &v1);
+	make_stale();
+	TEST_ASSERT_TRUE(feeds_refresh(bot));
+	TEST_ASSERT_EQUAL(1, feeds[0].events.len);
+	TEST_ASSERT_NULL(feeds[0].val.etag);
+
+	serve(&empty, &v1);
+	make_stale();
+	TEST_ASSERT_TRUE(feeds_refresh(bot));
+	TEST_ASSERT_EQUAL(0, HT_conditional("/a.ics"));
+}
+
+struct refresh {
+	bool err;
+	bool done;
+};
+
+static void refresh_thread(void *arg)
+{
+	struct refresh *r = arg;
+
+	r->err = feeds_refresh(bot);
+	r->done = true;
+	sc_lwt_set_state(runner, SC_LWT_RUNNABLE);
+}
+
+static void test_refresh_coalesce(void)
+{
+	struct HT_response slow = v1;
+	struct refresh r[3] = { 0 };
+
+	slow.delay_ms = 200;
+	serve(&slow, &slow);
+	for (int i = 0; i < 3; i++)
+		sc_lwt_create_task(cbot_get_lwt_ctx(bot), refresh_thread,
+		                   &r[i]);
+	for (int i = 0; i < 3; i++) {
+		while (!r[i].done) {
+			sc_lwt_set_state(runner, SC_LWT_BLOCKED);
+			sc_lwt_yield();
+		}
+		TEST_ASSERT_FALSE(r[i].err);
+	}
+	TEST_ASSERT_EQUAL(1, HT_requests("/a.ics"));
+	TEST_ASSERT_EQUAL(1, HT_requests("/b.ics"));
+}
+
+static void run_refresh_tests(void *arg)
+{
+	runner = sc_lwt_current();
+	RUN_TEST(test_refresh);
+	RUN_TEST(test_refresh_error);
+	RUN_TEST(test_refresh_coalesce);
+	/* Stop the curl thread */
+	sc_lwt_send_shutdown_signal();
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_time);
+	RUN_TEST(test_unfold);
+	RUN_TEST(test_last_line);
+	RUN_TEST(test_not_calendar);
+	RUN_TEST(test_escapes);
+	RUN_TEST(test_params);
+	RUN_TEST(test_valarm);
+	RUN_TEST(test_skipped);
+	RUN_TEST(test_search);
+
+	if (HT_start() < 0) {
+		perror("HT_start");
+		return 1;
+	}
+	bot = PT_bot_create("cbot");
+	cbot_curl_init(bot, NULL);
+	sc_list_init(&refresh_waiters);
+	sc_lwt_create_task(cbot_get_lwt_ctx(bot), run_refresh_tests, NULL);
+	sc_lwt_run(cbot_get_lwt_ctx(bot));
+	PT_bot_destroy(bot);
+	HT_stop();
+	return UNITY_END();
+}
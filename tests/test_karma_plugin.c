@@ -0,0 +1,143 @@
+/**
+ * test_karma_plugin.c: Unit tests for the karma plugin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <unity.h>
+
+#include "cbot/cbot.h"
+#include "plugintest.h"
+
+extern struct cbot_plugin_ops ops;
+
+struct cbot *bot;
+struct cbot_plugin *plugin;
+char tmpdir[] = "/tmp/cbot-test-karma-XXXXXX";
+
+void setUp(void)
+{
+	bot = PT_bot_create("TestBot");
+	TEST_ASSERT_NOT_NULL(bot);
+
+	plugin = PT_load_plugin(bot, &ops, "karma");
+	TEST_ASSERT_NOT_NULL(plugin);
+}
+
+void tearDown(void)
+{
+	if (plugin)
+		PT_unload_plugin(plugin);
+	if (bot)
+		PT_bot_destroy(bot);
+	unlink("karma.snapshot");
+}
+
+/* Ask the bot for a word's karma, and return its reply */
+static const char *check(const char *word)
+{
+	static char reply[256];
+	char query[128];
+	struct PT_message *msg;
+
+	PT_messages_clear(bot);
+	snprintf(query, sizeof(query), "TestBot: karma %s", word);
+	PT_inject_message(bot, "#test", "alice", query, false, false);
+	TEST_ASSERT_EQUAL_INT(1, PT_messages_count(bot));
+	msg = PT_messages_get(bot, 0);
+	snprintf(reply, sizeof(reply), "%s", msg->msg);
+	return reply;
+}
+
+static void test_increment_decrement(void)
+{
+	TEST_ASSERT_EQUAL_STRING("foo has no karma yet", check("foo"));
+	PT_inject_message(bot, "#test", "alice", "foo++", false, false);
+	PT_inject_message(bot, "#test", "bob", "yay foo++", false, false);
+	PT_inject_message(bot, "#test", "carol", "bar--", false, false);
+	TEST_ASSERT_EQUAL_STRING("foo has 2 karma", check("foo"));
+	TEST_ASSERT_EQUAL_STRING("bar has -1 karma", check("bar"));
+}
+
+static void test_many_words(void)
+{
+	char msg[32], word[16];
+	int i;
+
+	/* Enough entries to grow the table and heap several times */
+	for (i = 0; i < 1000; i++) {
+		snprintf(msg, sizeof(msg), "w%d++", i);
+		PT_inject_message(bot, "#test", "alice", msg, false, false);
+	}
+	for (i = 0; i < 1000; i += 3) {
+		snprintf(msg, sizeof(msg), "w%d++", i);
+		PT_inject_message(bot, "#test", "alice", msg, false, false);
+	}
+	for (i = 0; i < 1000; i += 7) {
+		snprintf(word, sizeof(word), "w%d", i);
+		snprintf(msg, sizeof(msg), "%s has %d karma", word,
+		         i % 3 ? 1 : 2);
+		TEST_ASSERT_EQUAL_STRING(msg, check(word));
+	}
+}
+
+static void test_forget_me(void)
+{
+	PT_inject_message(bot, "#test", "alice", "alice++", false, false);
+	PT_inject_message(bot, "#test", "alice", "bob++", false, false);
+	PT_inject_message(bot, "#test", "alice", "TestBot: forget me", false,
+	                  false);
+	TEST_ASSERT_EQUAL_STRING("alice has no karma yet", check("alice"));
+	TEST_ASSERT_EQUAL_STRING("bob has 1 karma", check("bob"));
+}
+
+static void test_no_snapshot(void)
+{
+	PT_inject_message(bot, "#test", "alice", "foo++", false, false);
+
+	/* Without a snapshot file configured, karma is not saved */
+	PT_unload_plugin(plugin);
+	TEST_ASSERT_EQUAL_INT(-1, access("karma.snapshot", F_OK));
+	plugin = PT_load_plugin(bot, &ops, "karma");
+	TEST_ASSERT_NOT_NULL(plugin);
+	TEST_ASSERT_EQUAL_STRING("foo has no karma yet", check("foo"));
+}
+
+static void test_snapshot(void)
+{
+	const char *conf = "snapshot = \"karma.snapshot\";";
+
+	PT_unload_plugin(plugin);
+	plugin = PT_load_plugin_conf(bot, &ops, "karma", conf);
+	TEST_ASSERT_NOT_NULL(plugin);
+	PT_inject_message(bot, "#test", "alice", "foo++", false, false);
+	PT_inject_message(bot, "#test", "alice", "bar--", false, false);
+
+	/* Unloading saves karma, and loading again restores it */
+	PT_unload_plugin(plugin);
+	TEST_ASSERT_EQUAL_INT(0, access("karma.snapshot", F_OK));
+	plugin = PT_load_plugin_conf(bot, &ops, "karma", conf);
+	TEST_ASSERT_NOT_NULL(plugin);
+
+	TEST_ASSERT_EQUAL_STRING("foo has 1 karma", check("foo"));
+	TEST_ASSERT_EQUAL_STRING("bar has -1 karma", check("bar"));
+}
+
+int main(int argc, char **argv)
+{
+	if (!mkdtemp(tmpdir) || chdir(tmpdir) < 0) {
+		perror("test_karma_plugin: temporary directory");
+		return EXIT_FAILURE;
+	}
+	UNITY_BEGIN();
+	RUN_TEST(test_increment_decrement);
+	RUN_TEST(test_many_words);
+	RUN_TEST(test_forget_me);
+	RUN_TEST(test_no_snapshot);
+	RUN_TEST(test_snapshot);
+	int rv = UNITY_END();
+	rmdir(tmpdir);
+	return rv;
+}
@@ -0,0 +1,423 @@
+/**
+ * test_log_archive.c: Unit tests for the log plugin's archive format
+ */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sc-lwt.h>
+#include <unity.h>
+#include <zlib.h>
+
+#include "cbot/cbot.h"
+#include "cbot/db.h"
+#include "plugintest.h"
+
+extern struct cbot_plugin_ops ops;
+
+struct cbot *bot;
+struct cbot_plugin *plugin;
+char tmpdir[] = "/tmp/cbot-test-arc-XXXXXX";
+char segment[64];
+
+void setUp(void)
+{
+	time_t now = time(NULL);
+	struct tm tm;
+
+	bot = PT_bot_create("TestBot");
+	TEST_ASSERT_NOT_NULL(bot);
+
+	localtime_r(&now, &tm);
+	strftime(segment, sizeof(segment), "#test-%Y-%m-%d.arc", &tm);
+}
+
+void tearDown(void)
+{
+	struct dirent *ent;
+	DIR *dir;
+
+	if (plugin)
+		PT_unload_plugin(plugin);
+	plugin = NULL;
+	if (bot)
+		PT_bot_destroy(bot);
+
+	/* Start each test with an empty directory, like the database */
+	dir = opendir(".");
+	while ((ent = readdir(dir)) != NULL)
+		if (ent->d_name[0] != '.')
+			unlink(ent->d_name);
+	closedir(dir);
+}
+
+static void load(const char *conf)
+{
+	plugin = PT_load_plugin_conf(bot, &ops, "log", conf);
+	TEST_ASSERT_NOT_NULL(plugin);
+}
+
+static void say(const char *channel, const char *user, const char *msg)
+{
+	PT_inject_message(bot, channel, user, msg, false, false);
+}
+
+/* Address a command to the bot, and return its only reply */
+static const char *ask(const char *channel, const char *user, const char *cmd)
+{
+	static char reply[1024];
+	char msg[256];
+
+	PT_messages_clear(bot);
+	snprintf(msg, sizeof(msg), "TestBot: %s", cmd);
+	say(channel, user, msg);
+	TEST_ASSERT_EQUAL_INT(1, PT_messages_count(bot));
+	snprintf(reply, sizeof(reply), "%s", PT_messages_get(bot, 0)->msg);
+	return reply;
+}
+
+/* Run import and reindex tasks, and return their final reply */
+static const char *finish_tasks(void)
+{
+	int n;
+
+	sc_lwt_run(cbot_get_lwt_ctx(bot));
+	n = PT_messages_count(bot);
+	TEST_ASSERT_GREATER_THAN(0, n);
+	return PT_messages_get(bot, n - 1)->msg;
+}
+
+static int count_lines(const char *s)
+{
+	int n = 0;
+
+	for (; *s; s++)
+		n += *s == '\n';
+	return n;
+}
+
+static int query_int(const char *sql)
+{
+	sqlite3_stmt *stmt;
+	int rv;
+
+	TEST_ASSERT_EQUAL(SQLITE_OK, sqlite3_prepare_v2(cbot_db_conn(bot), sql,
+	                                                -1, &stmt, NULL));
+	TEST_ASSERT_EQUAL(SQLITE_ROW, sqlite3_step(stmt));
+	rv = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	return rv;
+}
+
+/* Return the tokens indexed for a block, separated by spaces */
+static const char *block_tokens(int block)
+{
+	static char out[512];
+	sqlite3_stmt *stmt;
+
+	TEST_ASSERT_EQUAL(SQLITE_OK,
+	                  sqlite3_prepare_v2(cbot_db_conn(bot),
+	                                     "SELECT token FROM log_posting "
+	                                     "WHERE block = ? ORDER BY token;",
+	                                     -1, &stmt, NULL));
+	sqlite3_bind_int(stmt, 1, block);
+	out[0] = '\0';
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		if (out[0])
+			strcat(out, " ");
+		strcat(out, (const char *)sqlite3_column_text(stmt, 0));
+	}
+	sqlite3_finalize(stmt);
+	return out;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8 | p[3];
+}
+
+static void test_seal_block(void)
+{
+	unsigned char data[1024];
+	char raw[1024];
+	uLongf rawlen = sizeof(raw) - 1;
+	size_t n;
+	FILE *f;
+
+	load("format = \"archive\"; flush_size = 150;");
+	say("#test", "alice", "the quick brown fox jumps over the lazy dog");
+	/* Lines are collected until the block is big enough */
+	TEST_ASSERT_EQUAL_INT(-1, access(segment, F_OK));
+	say("#test", "bob", "pack my box with five dozen liquor jugs");
+
+	f = fopen(segment, "r");
+	TEST_ASSERT_NOT_NULL(f);
+	n = fread(data, 1, sizeof(data), f);
+	fclose(f);
+	TEST_ASSERT_GREATER_THAN(12, n);
+	TEST_ASSERT_EQUAL_MEMORY("CBLK", data, 4);
+	TEST_ASSERT_EQUAL(n - 12, get32(data + 8));
+	TEST_ASSERT_EQUAL(Z_OK, uncompress((Bytef *)raw, &rawlen, data + 12,
+	                                   n - 12));
+	TEST_ASSERT_EQUAL(get32(data + 4), rawlen);
+	raw[rawlen] = '\0';
+	TEST_ASSERT_EQUAL_INT(2, count_lines(raw));
+	TEST_ASSERT_NOT_NULL(strstr(raw, "\"username\": \"alice\", "
+	                                 "\"message\": \"the quick brown fox "
+	                                 "jumps over the lazy dog\"}\n"));
+	TEST_ASSERT_NOT_NULL(strstr(raw, "\"username\": \"bob\", "
+	                                 "\"message\": \"pack my box with "
+	                                 "five dozen liquor jugs\"}\n"));
+
+	TEST_ASSERT_EQUAL_INT(1, query_int("SELECT COUNT(*) FROM log_block "
+	                                   "WHERE channel = '#test' "
+	                                   "AND offset = 0 AND count = 2;"));
+}
+
+static void test_tokens(void)
+{
+	load("format = \"archive\"; flush_size = 1;");
+	/* Words are lowercased, and need at least two letters or digits */
+	say("#test", "Alice", "Don't STOP-believing x 2024 x2!");
+	TEST_ASSERT_EQUAL_STRING("u:alice w:2024 w:believing w:don w:stop w:x2",
+	                         block_tokens(1));
+	/* Long words are truncated, and repeated words indexed once */
+	say("#test", "bob",
+	    "abcdefghijklmnopqrstuvwxyz0123456789 again AGAIN");
+	TEST_ASSERT_EQUAL_STRING("u:bob w:abcdefghijklmnopqrstuvwxyz012345 "
+	                         "w:again",
+	                         block_tokens(2));
+}
+
+static void test_search(void)
+{
+	const char *reply;
+
+	load("format = \"archive\"; flush_size = 1;");
+	say("#test", "alice", "the quick brown fox");
+	say("#test", "bob", "a lazy dog sleeps");
+	say("#test", "alice", "another fox appears");
+	say("#test", "carol", "nothing to see here");
+
+	/* Every line went into its own block, and matches are newest first */
+	reply = ask("#test", "dave", "log search FOX");
+	TEST_ASSERT_EQUAL_INT(2, count_lines(reply));
+	TEST_ASSERT_NOT_NULL(strstr(reply, "<alice> another fox appears\n"));
+	TEST_ASSERT_NOT_NULL(strstr(reply, "<alice> the quick brown fox\n"));
+	TEST_ASSERT_TRUE(strstr(reply, "another") < strstr(reply, "quick"));
+
+	reply = ask("#test", "dave", "log search from:Bob");
+	TEST_ASSERT_EQUAL_INT(1, count_lines(reply));
+	TEST_ASSERT_NOT_NULL(strstr(reply, "<bob> a lazy dog sleeps\n"));
+
+	/* All the words must be in one line */
+	TEST_ASSERT_EQUAL_STRING("No matching messages in #test",
+	                         ask("#test", "dave", "log search fox dog"));
+	TEST_ASSERT_EQUAL_STRING(
+	        "No matching messages in #test",
+	        ask("#test", "dave", "log search until:2000-01-01 lazy"));
+	reply = ask("#test", "dave", "log search since:2000-01-01 lazy");
+	TEST_ASSERT_NOT_NULL(strstr(reply, "<bob> a lazy dog sleeps\n"));
+}
+
+static void test_search_errors(void)
+{
+	load("format = \"archive\";");
+	TEST_ASSERT_EQUAL_STRING(
+	        "since: expects a date like 2024-01-31",
+	        ask("#test", "dave", "log search since:2000-1"));
+	TEST_ASSERT_EQUAL_STRING(
+	        "until: expects a date like 2024-01-31",
+	        ask("#test", "dave", "log search until:soon"));
+	TEST_ASSERT_EQUAL_STRING(
+	        "give me some words, or from:USER, to search for",
+	        ask("#test", "dave", "log search ! x"));
+}
+
+static void test_search_limit(void)
+{
+	const char *reply;
+	char msg[32];
+	int i;
+
+	/* Two lines to a block, so the newest line is not yet sealed */
+	load("format = \"archive\"; flush_size = 150;");
+	for (i = 0; i < 7; i++) {
+		snprintf(msg, sizeof(msg), "word %d", i);
+		say("#test", "alice", msg);
+	}
+	TEST_ASSERT_EQUAL_INT(3, query_int("SELECT COUNT(*) FROM log_block;"));
+
+	reply = ask("#test", "bob", "log search word");
+	TEST_ASSERT_EQUAL_INT(5, count_lines(reply));
+	for (i = 6; i >= 2; i--) {
+		snprintf(msg, sizeof(msg), "<alice> word %d\n", i);
+		TEST_ASSERT_NOT_NULL(strstr(reply, msg));
+		reply = strstr(reply, msg);
+	}
+}
+
+static void test_other_channel(void)
+{
+	load("format = \"archive\"; flush_size = 1;");
+	say("#other", "dave", "secret plans");
+
+	TEST_ASSERT_EQUAL_STRING(
+	        "sorry, only admins may search other channels",
+	        ask("#test", "alice", "log search #other secret"));
+	PT_set_authorized(bot, true);
+	TEST_ASSERT_NOT_NULL(strstr(ask("#test", "alice",
+	                                "log search #other secret"),
+	                            "<dave> secret plans\n"));
+}
+
+static void test_import(void)
+{
+	const char *reply;
+	FILE *f;
+
+	f = fopen("#old-2020-01-02.log", "w");
+	TEST_ASSERT_NOT_NULL(f);
+	fputs("{\"timestamp\": 1577966400.000000, \"username\": \"carol\", "
+	      "\"message\": \"happy new year\"}\n"
+	      /* Older versions didn't quote the action key */
+	      "{\"timestamp\": 1577966460.000000, \"username\": \"carol\", "
+	      "\"message\": \"waves\", action: true}\n"
+	      "not json at all\n"
+	      "\n",
+	      f);
+	fclose(f);
+	load("format = \"archive\";");
+
+	TEST_ASSERT_EQUAL_STRING(
+	        "sorry, you're not authorized to do that!",
+	        ask("#old", "carol", "log import #old-2020-01-02.log"));
+	PT_set_authorized(bot, true);
+	TEST_ASSERT_EQUAL_STRING("expected a file named CHANNEL-YYYY-MM-DD.log",
+	                         ask("#old", "carol", "log import old.log"));
+	TEST_ASSERT_EQUAL_STRING(
+	        "importing #old-2020-01-02.log into the archive",
+	        ask("#old", "carol", "log import #old-2020-01-02.log"));
+	TEST_ASSERT_EQUAL_STRING("log: imported #old-2020-01-02.log: "
+	                         "2 messages imported, 1 lines skipped",
+	                         finish_tasks());
+	TEST_ASSERT_EQUAL_INT(0, access("#old-2020-01-02.arc", F_OK));
+
+	reply = ask("#old", "carol",
+	            "log search since:2020-01-01 until:2020-01-31 happy");
+	TEST_ASSERT_NOT_NULL(strstr(reply, "<carol> happy new year\n"));
+	reply = ask("#old", "carol", "log search waves");
+	TEST_ASSERT_NOT_NULL(strstr(reply, "* carol waves\n"));
+}
+
+static void test_reindex(void)
+{
+	char cmd[128], want[192];
+	const char *reply;
+
+	load("format = \"archive\"; flush_size = 1;");
+	say("#test", "alice", "first block");
+	say("#test", "bob", "second block");
+	say("#test", "carol", "third block");
+
+	/* As if indexing the second block had failed */
+	TEST_ASSERT_EQUAL(SQLITE_OK,
+	                  sqlite3_exec(cbot_db_conn(bot),
+	                               "DELETE FROM log_posting "
+	                               "WHERE block = 2; "
+	                               "DELETE FROM log_block WHERE id = 2;",
+	                               NULL, NULL, NULL));
+	TEST_ASSERT_EQUAL_STRING("No matching messages in #test",
+	                         ask("#test", "dave", "log search from:bob"));
+
+	snprintf(cmd, sizeof(cmd), "log reindex %s", segment);
+	TEST_ASSERT_EQUAL_STRING("sorry, you're not authorized to do that!",
+	                         ask("#test", "dave", cmd));
+	PT_set_authorized(bot, true);
+	snprintf(want, sizeof(want), "reindexing %s", segment);
+	TEST_ASSERT_EQUAL_STRING(want, ask("#test", "dave", cmd));
+	/* Three lines, the search, and both reindex commands */
+	snprintf(want, sizeof(want),
+	         "log: reindexed %s: 6 blocks, 1 newly indexed", segment);
+	TEST_ASSERT_EQUAL_STRING(want, finish_tasks());
+
+	reply = ask("#test", "dave", "log search from:bob");
+	TEST_ASSERT_EQUAL_INT(1, count_lines(reply));
+	TEST_ASSERT_NOT_NULL(strstr(reply, "<bob> second block\n"));
+	TEST_ASSERT_EQUAL_STRING("u:bob w:block w:second", block_tokens(7));
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/* Append a block header with the given lengths, and len bytes of junk */
+static void append_block(uint32_t raw_length, uint32_t length, size_t len)
+{
+	unsigned char hdr[12];
+	FILE *f;
+
+	memcpy(hdr, "CBLK", 4);
+	put32(hdr + 4, raw_length);
+	put32(hdr + 8, length);
+	f = fopen(segment, "a");
+	TEST_ASSERT_NOT_NULL(f);
+	fwrite(hdr, 1, sizeof(hdr), f);
+	while (len--)
+		fputc('x', f);
+	fclose(f);
+}
+
+static void test_reindex_corrupt(void)
+{
+	char cmd[128], want[192];
+
+	load("format = \"archive\"; flush_size = 1;");
+	say("#test", "alice", "only block");
+	PT_set_authorized(bot, true);
+	snprintf(cmd, sizeof(cmd), "log reindex %s", segment);
+
+	/* An uncompressed length beyond any block we'd write */
+	append_block(0xffffffff, 16, 16);
+	ask("#test", "dave", cmd);
+	snprintf(want, sizeof(want),
+	         "log: failed reindexing %s: 1 blocks, 0 newly indexed",
+	         segment);
+	TEST_ASSERT_EQUAL_STRING(want, finish_tasks());
+
+	/* A truncated block: the data runs past the end of the segment */
+	TEST_ASSERT_EQUAL(0, truncate(segment, query_int("SELECT length + 12 "
+	                                                 "FROM log_block;")));
+	append_block(100, 0x7fffffff, 16);
+	ask("#test", "dave", cmd);
+	TEST_ASSERT_EQUAL_STRING(want, finish_tasks());
+}
+
+int main(int argc, char **argv)
+{
+	if (!mkdtemp(tmpdir) || chdir(tmpdir) < 0) {
+		perror("test_log_archive: temporary directory");
+		return EXIT_FAILURE;
+	}
+	UNITY_BEGIN();
+	RUN_TEST(test_seal_block);
+	RUN_TEST(test_tokens);
+	RUN_TEST(test_search);
+	RUN_TEST(test_search_errors);
+	RUN_TEST(test_search_limit);
+	RUN_TEST(test_other_channel);
+	RUN_TEST(test_import);
+	RUN_TEST(test_reindex);
+	RUN_TEST(test_reindex_corrupt);
+	int rv = UNITY_END();
+	rmdir(tmpdir);
+	return rv;
+}
@@ -0,0 +1,109 @@
+/**
+ * test_log_plugin.c: Unit tests for the channel log plugin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <unity.h>
+
+#include "cbot/cbot.h"
+#include "plugintest.h"
+
+extern struct cbot_plugin_ops ops;
+
+struct cbot *bot;
+struct cbot_plugin *plugin;
+char tmpdir[] = "/tmp/cbot-test-log-XXXXXX";
+char logfile[64];
+
+void setUp(void)
+{
+	time_t now = time(NULL);
+	struct tm tm;
+
+	bot = PT_bot_create("TestBot");
+	TEST_ASSERT_NOT_NULL(bot);
+
+	plugin = PT_load_plugin(bot, &ops, "log");
+	TEST_ASSERT_NOT_NULL(plugin);
+
+	localtime_r(&now, &tm);
+	strftime(logfile, sizeof(logfile), "#test-%Y-%m-%d.log", &tm);
+}
+
+void tearDown(void)
+{
+	if (plugin)
+		PT_unload_plugin(plugin);
+	if (bot)
+		PT_bot_destroy(bot);
+	unlink(logfile);
+}
+
+/* Unload the plugin (flushing its buffers) and return the log contents */
+static char *read_log(void)
+{
+	static char contents[4096];
+	size_t n;
+	FILE *f;
+
+	PT_unload_plugin(plugin);
+	plugin = NULL;
+
+	f = fopen(logfile, "r");
+	TEST_ASSERT_NOT_NULL(f);
+	n = fread(contents, 1, sizeof(contents) - 1, f);
+	contents[n] = '\0';
+	fclose(f);
+	return contents;
+}
+
+static void test_buffered_until_flush(void)
+{
+	PT_inject_message(bot, "#test", "alice", "hello", false, false);
+	// The line is buffered rather than written immediately
+	TEST_ASSERT_EQUAL_INT(-1, access(logfile, F_OK));
+
+	char *log = read_log();
+	TEST_ASSERT_NOT_NULL(strstr(log, "\"username\": \"alice\", "
+	                                 "\"message\": \"hello\"}\n"));
+}
+
+static void test_escaping(void)
+{
+	PT_inject_message(bot, "#test", "bob", "say \"hi\" \\ then\nbye\t!",
+	                  false, false);
+
+	char *log = read_log();
+	TEST_ASSERT_NOT_NULL(strstr(log, "\"message\": \"say \\\"hi\\\" "
+	                                 "\\\\ then\\nbye\\t!\"}"));
+}
+
+static void test_action(void)
+{
+	PT_inject_message(bot, "#test", "carol", "waves", true, false);
+	PT_inject_message(bot, "#test", "carol", "hi", false, false);
+
+	char *log = read_log();
+	TEST_ASSERT_NOT_NULL(
+	        strstr(log, "\"message\": \"waves\", \"action\": true}\n"));
+	TEST_ASSERT_NOT_NULL(strstr(log, "\"message\": \"hi\"}\n"));
+}
+
+int main(int argc, char **argv)
+{
+	if (!mkdtemp(tmpdir) || chdir(tmpdir) < 0) {
+		perror("test_log_plugin: temporary directory");
+		return EXIT_FAILURE;
+	}
+	UNITY_BEGIN();
+	RUN_TEST(test_buffered_until_flush);
+	RUN_TEST(test_escaping);
+	RUN_TEST(test_action);
+	int rv = UNITY_END();
+	rmdir(tmpdir);
+	return rv;
+}
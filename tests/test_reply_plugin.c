@@ -0,0 +1,145 @@
+/**
+ * test_reply_plugin.c: Unit tests for the reply plugin
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include "cbot/cbot.h"
+#include "plugintest.h"
+
+extern struct cbot_plugin_ops ops;
+
+struct cbot *bot;
+struct cbot_plugin *plugin;
+
+static const char *config =
+        "responses = (\n"
+        "  { trigger = \"hello\"; response = \"hi {sender}\"; },\n"
+        "  { trigger = \"hel+o\"; response = \"also hello\"; },\n"
+        "  { trigger = \"shout\"; insensitive = true;\n"
+        "    response = \"no shouting\"; },\n"
+        "  { trigger = \"ping\"; addressed = true; response = \"pong\"; },\n"
+        "  { trigger = \"foo|bar\"; response = \"baz\"; },\n"
+        "  { trigger = \".*cookie.*\"; response = \"nom\"; },\n"
+        "  { trigger = \"colou?r\"; response = \"spelling\"; },\n"
+        "  { trigger = \"swap ([a-z]+) ([a-z]+)\";\n"
+        "    response = \"{cap:1} {cap:0}\"; },\n"
+        "  { trigger = \"broken\"; response = \"{nope}\"; }\n"
+        ");\n";
+
+void setUp(void)
+{
+	bot = PT_bot_create("TestBot");
+	TEST_ASSERT_NOT_NULL(bot);
+
+	plugin = PT_load_plugin_conf(bot, &ops, "reply", config);
+	TEST_ASSERT_NOT_NULL(plugin);
+}
+
+void tearDown(void)
+{
+	if (plugin)
+		PT_unload_plugin(plugin);
+	if (bot)
+		PT_bot_destroy(bot);
+}
+
+/* Send a channel message, and return the number of replies */
+static int say(const char *message)
+{
+	PT_messages_clear(bot);
+	PT_inject_message(bot, "#test", "alice", message, false, false);
+	return PT_messages_count(bot);
+}
+
+static const char *reply(int n)
+{
+	struct PT_message *msg = PT_messages_get(bot, n);
+	TEST_ASSERT_NOT_NULL(msg);
+	return msg->msg;
+}
+
+static void test_literal(void)
+{
+	TEST_ASSERT_EQUAL_INT(0, say("hello there"));
+	TEST_ASSERT_EQUAL_INT(0, say("help"));
+	TEST_ASSERT_EQUAL_INT(1, say("helllo"));
+	TEST_ASSERT_EQUAL_STRING("also hello", reply(0));
+}
+
+static void test_multiple_in_order(void)
+{
+	TEST_ASSERT_EQUAL_INT(2, say("hello"));
+	TEST_ASSERT_EQUAL_STRING("hi alice", reply(0));
+	TEST_ASSERT_EQUAL_STRING("also hello", reply(1));
+}
+
+static void test_insensitive(void)
+{
+	TEST_ASSERT_EQUAL_INT(1, say("SHOUT"));
+	TEST_ASSERT_EQUAL_STRING("no shouting", reply(0));
+	TEST_ASSERT_EQUAL_INT(0, say("HELLO"));
+}
+
+static void test_addressed(void)
+{
+	TEST_ASSERT_EQUAL_INT(0, say("ping"));
+	TEST_ASSERT_EQUAL_INT(1, say("TestBot: ping"));
+	TEST_ASSERT_EQUAL_STRING("pong", reply(0));
+}
+
+static void test_no_prefix(void)
+{
+	TEST_ASSERT_EQUAL_INT(1, say("foo"));
+	TEST_ASSERT_EQUAL_INT(1, say("bar"));
+	TEST_ASSERT_EQUAL_INT(1, say("have a cookie"));
+	TEST_ASSERT_EQUAL_STRING("nom", reply(0));
+	TEST_ASSERT_EQUAL_INT(1, say("color"));
+	TEST_ASSERT_EQUAL_INT(1, say("colour"));
+	TEST_ASSERT_EQUAL_STRING("spelling", reply(0));
+}
+
+static void test_captures(void)
+{
+	TEST_ASSERT_EQUAL_INT(1, say("swap foo bar"));
+	TEST_ASSERT_EQUAL_STRING("bar foo", reply(0));
+}
+
+static void test_invalid_response(void)
+{
+	TEST_ASSERT_EQUAL_INT(0, say("broken"));
+}
+
+static void test_hit_counts(void)
+{
+	struct sc_charbuf cb;
+
+	say("hello");
+	say("hello");
+	say("colour");
+	sc_cb_init(&cb, 256);
+	ops.help(plugin, &cb);
+	TEST_ASSERT_NOT_NULL(strstr(cb.buf, "- hello [2]\n"));
+	TEST_ASSERT_NOT_NULL(strstr(cb.buf, "- hel+o [2]\n"));
+	TEST_ASSERT_NOT_NULL(strstr(cb.buf, "- colou?r [1]\n"));
+	TEST_ASSERT_NOT_NULL(strstr(cb.buf, "- foo|bar [0]\n"));
+	TEST_ASSERT_NOT_NULL(
+	        strstr(cb.buf, "- ping (only when @mentioned) [0]\n"));
+	sc_cb_destroy(&cb);
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_literal);
+	RUN_TEST(test_multiple_in_order);
+	RUN_TEST(test_insensitive);
+	RUN_TEST(test_addressed);
+	RUN_TEST(test_no_prefix);
+	RUN_TEST(test_captures);
+	RUN_TEST(test_invalid_response);
+	RUN_TEST(test_hit_counts);
+	return UNITY_END();
+}
@@ -0,0 +1,193 @@
+/**
+ * test_sqlkarma_plugin.c: Unit tests for the sqlkarma plugin
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include "cbot/cbot.h"
+#include "plugintest.h"
+
+extern struct cbot_plugin_ops ops;
+
+struct cbot *bot;
+struct cbot_plugin *plugin;
+
+void setUp(void)
+{
+	bot = PT_bot_create("TestBot");
+	TEST_ASSERT_NOT_NULL(bot);
+
+	plugin = PT_load_plugin(bot, &ops, "sqlkarma");
+	TEST_ASSERT_NOT_NULL(plugin);
+}
+
+void tearDown(void)
+{
+	if (plugin)
+		PT_unload_plugin(plugin);
+	if (bot)
+		PT_bot_destroy(bot);
+}
+
+/* Ask the bot for a word's karma, and return its reply */
+static const char *check(const char *word)
+{
+	static char reply[256];
+	char query[128];
+	struct PT_message *msg;
+
+	PT_messages_clear(bot);
+	snprintf(query, sizeof(query), "TestBot: karma %s", word);
+	PT_inject_message(bot, "#test", "alice", query, false, false);
+	TEST_ASSERT_EQUAL_INT(1, PT_messages_count(bot));
+	msg = PT_messages_get(bot, 0);
+	snprintf(reply, sizeof(reply), "%s", msg->msg);
+	return reply;
+}
+
+static void test_single(void)
+{
+	PT_inject_message(bot, "#test", "alice", "cbot++", false, false);
+	PT_inject_message(bot, "#test", "alice", "well, bugs--", false, false);
+	TEST_ASSERT_EQUAL_STRING("cbot has 1 karma", check("cbot"));
+	TEST_ASSERT_EQUAL_STRING("bugs has -1 karma", check("bugs"));
+}
+
+static void test_multiple_per_line(void)
+{
+	PT_inject_message(bot, "#test", "alice", "foo++ bar-- and foo++ too",
+	                  false, false);
+	PT_inject_message(bot, "#test", "alice", "a++b--", false, false);
+	TEST_ASSERT_EQUAL_STRING("foo has 2 karma", check("foo"));
+	TEST_ASSERT_EQUAL_STRING("bar has -1 karma", check("bar"));
+	TEST_ASSERT_EQUAL_STRING("a has 1 karma", check("a"));
+	TEST_ASSERT_EQUAL_STRING("b has -1 karma", check("b"));
+}
+
+static void test_not_karma(void)
+{
+	PT_inject_message(bot, "#test", "alice", "1 + 1 - 2 = 0 -- ++ x+y",
+	                  false, false);
+	TEST_ASSERT_EQUAL_STRING("x+y has no karma yet", check("x+y"));
+	TEST_ASSERT_EQUAL_STRING("1 has no karma yet", check("1"));
+}
+
+static void test_operator_run(void)
+{
+	/* The last two characters of the run are the operator */
+	PT_inject_message(bot, "#test", "alice", "c+++ x-y--", false, false);
+	TEST_ASSERT_EQUAL_STRING("c+ has 1 karma", check("c+"));
+	TEST_ASSERT_EQUAL_STRING("x-y has -1 karma", check("x-y"));
+}
+
+/* Ask the bot for the top karma list, and return its replies joined by ", " */
+static const char *top(void)
+{
+	static char reply[256];
+	int i, n;
+
+	PT_messages_clear(bot);
+	PT_inject_message(bot, "#test", "alice", "TestBot: karma", false,
+	                  false);
+	reply[0] = '\0';
+	n = PT_messages_count(bot);
+	for (i = 0; i < n; i++) {
+		if (i)
+			strcat(reply, ", ");
+		strcat(reply, PT_messages_get(bot, i)->msg);
+	}
+	return reply;
+}
+
+static void set(const char *word, int karma)
+{
+	char msg[64];
+
+	snprintf(msg, sizeof(msg), "TestBot: set-karma %s %d", word, karma);
+	PT_inject_message(bot, "#test", "admin", msg, false, false);
+}
+
+static void test_top_cache(void)
+{
+	PT_set_authorized(bot, true);
+	set("a", 10);
+	set("b", 8);
+	set("c", 6);
+	set("d", 4);
+	set("e", 2);
+	TEST_ASSERT_EQUAL_STRING("a: 10, b: 8, c: 6, d: 4, e: 2", top());
+
+	/* Below the cutoff, and then past it */
+	PT_inject_message(bot, "#test", "alice", "f++", false, false);
+	TEST_ASSERT_EQUAL_STRING("a: 10, b: 8, c: 6, d: 4, e: 2", top());
+	PT_inject_message(bot, "#test", "alice", "f++ f++", false, false);
+	TEST_ASSERT_EQUAL_STRING("a: 10, b: 8, c: 6, d: 4, f: 3", top());
+
+	/* Moving within the list */
+	PT_inject_message(bot, "#test", "alice", "a--", false, false);
+	set("b", 12);
+	TEST_ASSERT_EQUAL_STRING("b: 12, a: 9, c: 6, d: 4, f: 3", top());
+
+	/* Dropping below an entry outside the list */
+	set("d", 1);
+	TEST_ASSERT_EQUAL_STRING("b: 12, a: 9, c: 6, f: 3, e: 2", top());
+	PT_inject_message(bot, "#test", "alice", "d++ d++ d++ d++", false,
+	                  false);
+	TEST_ASSERT_EQUAL_STRING("b: 12, a: 9, c: 6, d: 5, f: 3", top());
+}
+
+static void test_top_delete(void)
+{
+	PT_set_authorized(bot, true);
+	set("x", 1);
+	set("y", 2);
+	TEST_ASSERT_EQUAL_STRING("y: 2, x: 1", top());
+	/* With nothing outside the list, the entry is simply removed */
+	PT_inject_message(bot, "#test", "y", "TestBot: forget me", false,
+	                  false);
+	TEST_ASSERT_EQUAL_STRING("x: 1", top());
+
+	set("a", 10);
+	set("b", 8);
+	set("c", 6);
+	set("d", 4);
+	set("e", 2);
+	TEST_ASSERT_EQUAL_STRING("a: 10, b: 8, c: 6, d: 4, e: 2", top());
+	/* Otherwise, the next entry takes its place */
+	PT_inject_message(bot, "#test", "c", "TestBot: forget me", false,
+	                  false);
+	TEST_ASSERT_EQUAL_STRING("a: 10, b: 8, d: 4, e: 2, x: 1", top());
+	PT_inject_message(bot, "#test", "x", "TestBot: forget me", false,
+	                  false);
+	TEST_ASSERT_EQUAL_STRING("a: 10, b: 8, d: 4, e: 2", top());
+}
+
+static void test_top_reload(void)
+{
+	PT_inject_message(bot, "#test", "alice", "p++ p++ q++ r--", false,
+	                  false);
+	TEST_ASSERT_EQUAL_STRING("p: 2, q: 1, r: -1", top());
+
+	/* The database is the truth: a new plugin instance reads it back */
+	PT_unload_plugin(plugin);
+	plugin = PT_load_plugin(bot, &ops, "sqlkarma");
+	TEST_ASSERT_NOT_NULL(plugin);
+	PT_inject_message(bot, "#test", "alice", "r++ r++ r++ r++", false,
+	                  false);
+	TEST_ASSERT_EQUAL_STRING("r: 3, p: 2, q: 1", top());
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_single);
+	RUN_TEST(test_multiple_per_line);
+	RUN_TEST(test_not_karma);
+	RUN_TEST(test_operator_run);
+	RUN_TEST(test_top_cache);
+	RUN_TEST(test_top_delete);
+	RUN_TEST(test_top_reload);
+	return UNITY_END();
+}
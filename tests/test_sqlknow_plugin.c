@@ -0,0 +1,208 @@
+/**
+ * test_sqlknow_plugin.c: Unit tests for the sqlknow plugin
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include "cbot/cbot.h"
+#include "cbot/db.h"
+#include "plugintest.h"
+
+extern struct cbot_plugin_ops ops;
+
+struct cbot *bot;
+struct cbot_plugin *plugin;
+
+void setUp(void)
+{
+	bot = PT_bot_create("TestBot");
+	TEST_ASSERT_NOT_NULL(bot);
+
+	plugin = PT_load_plugin(bot, &ops, "sqlknow");
+	TEST_ASSERT_NOT_NULL(plugin);
+
+	PT_inject_message(bot, "#test", "alice",
+	                  "TestBot: know that python is a snake language",
+	                  false, false);
+	PT_inject_message(bot, "#test", "alice",
+	                  "TestBot: know that pythonic code is "
+	                  "idiomatic python",
+	                  false, false);
+	PT_inject_message(bot, "#test", "alice",
+	                  "TestBot: know that cbot is the best bot", false,
+	                  false);
+}
+
+void tearDown(void)
+{
+	if (plugin)
+		PT_unload_plugin(plugin);
+	if (bot)
+		PT_bot_destroy(bot);
+}
+
+/* Send an addressed message, and return the single reply */
+static const char *ask(const char *question)
+{
+	static char reply[512];
+	char message[256];
+	struct PT_message *msg;
+
+	PT_messages_clear(bot);
+	snprintf(message, sizeof(message), "TestBot: %s", question);
+	PT_inject_message(bot, "#test", "bob", message, false, false);
+	TEST_ASSERT_EQUAL_INT(1, PT_messages_count(bot));
+	msg = PT_messages_get(bot, 0);
+	snprintf(reply, sizeof(reply), "%s", msg->msg);
+	return reply;
+}
+
+static void test_exact(void)
+{
+	TEST_ASSERT_EQUAL_STRING("cbot is the best bot", ask("what is cbot"));
+}
+
+static void test_search_ranked(void)
+{
+	/* A match in the key ranks above a match in the value */
+	const char *reply = ask("what do you know about Python?");
+	const char *key = strstr(reply, "python is a snake language");
+	const char *value = strstr(reply, "pythonic code is idiomatic python");
+	TEST_ASSERT_NOT_NULL(key);
+	TEST_ASSERT_NOT_NULL(value);
+	TEST_ASSERT_TRUE(key < value);
+	TEST_ASSERT_NULL(strstr(reply, "cbot"));
+}
+
+static void test_suggestion(void)
+{
+	TEST_ASSERT_EQUAL_STRING("Sorry, I don't know anything about the "
+	                         "bot. Did you mean: cbot?",
+	                         ask("what is the bot"));
+}
+
+static void test_complete(void)
+{
+	TEST_ASSERT_EQUAL_STRING("pythonic code", ask("complete pythonic c"));
+	TEST_ASSERT_NOT_NULL(strstr(ask("complete pyt"), "python"));
+	TEST_ASSERT_EQUAL_STRING("I don't know anything starting with zzz",
+	                         ask("complete zzz"));
+}
+
+static void test_index_follows_updates(void)
+{
+	PT_inject_message(bot, "#test", "alice",
+	                  "TestBot: know that cbot is a chat bot in C", false,
+	                  false);
+	TEST_ASSERT_EQUAL_STRING("cbot is a chat bot in C",
+	                         ask("what do you know about chat"));
+	/* The old value is no longer indexed */
+	TEST_ASSERT_EQUAL_STRING("I don't know anything about best",
+	                         ask("what do you know about best"));
+}
+
+static int schema_version(void)
+{
+	sqlite3_stmt *stmt;
+	int rv;
+
+	TEST_ASSERT_EQUAL(SQLITE_OK,
+	                  sqlite3_prepare_v2(cbot_db_conn(bot),
+	                                     "SELECT version "
+	                                     "FROM cbot_schema_registry "
+	                                     "WHERE name = 'knowledge';",
+	                                     -1, &stmt, NULL));
+	TEST_ASSERT_EQUAL(SQLITE_ROW, sqlite3_step(stmt));
+	rv = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	return rv;
+}
+
+static void test_migrate(void)
+{
+	const char *reply;
+
+	/* Start over with a version 0 table, as older versions created it */
+	PT_unload_plugin(plugin);
+	plugin = NULL;
+	TEST_ASSERT_EQUAL(
+	        SQLITE_OK,
+	        sqlite3_exec(cbot_db_conn(bot),
+	                     "DROP TABLE knowledge_fts; "
+	                     "DROP TABLE knowledge; "
+	                     "CREATE TABLE knowledge ( "
+	                     "  key TEXT NOT NULL UNIQUE, "
+	                     "  value TEXT NOT NULL, "
+	                     "  nick TEXT NOT NULL, "
+	                     "  change_count INT NOT NULL "
+	                     "); "
+	                     "INSERT INTO knowledge VALUES "
+	                     "  ('sqlite', 'a small database', 'carol', 2), "
+	                     "  ('vacuum', 'cleans up the database', 'dave', 1); "
+	                     "UPDATE cbot_schema_registry SET version = 0 "
+	                     "WHERE name = 'knowledge';",
+	                     NULL, NULL, NULL));
+	plugin = PT_load_plugin(bot, &ops, "sqlknow");
+	TEST_ASSERT_NOT_NULL(plugin);
+	TEST_ASSERT_EQUAL_INT(1, schema_version());
+
+	/* Existing entries are kept, and indexed */
+	TEST_ASSERT_EQUAL_STRING("sqlite is a small database",
+	                         ask("what is sqlite"));
+	reply = ask("what do you know about database");
+	TEST_ASSERT_NOT_NULL(strstr(reply, "sqlite is a small database"));
+	TEST_ASSERT_NOT_NULL(strstr(reply, "vacuum is cleans up the database"));
+	TEST_ASSERT_EQUAL_STRING("vacuum", ask("complete vac"));
+
+	/* And the triggers keep the index up to date */
+	PT_inject_message(bot, "#test", "alice",
+	                  "TestBot: know that vacuum is an empty space", false,
+	                  false);
+	TEST_ASSERT_EQUAL_STRING("sqlite is a small database",
+	                         ask("what do you know about database"));
+}
+
+static void test_without_fts(void)
+{
+	PT_unload_plugin(plugin);
+	plugin = PT_load_plugin_conf(bot, &ops, "sqlknow", "fts = false;");
+	TEST_ASSERT_NOT_NULL(plugin);
+
+	/* Exact lookups and updates still work */
+	PT_inject_message(bot, "#test", "alice",
+	                  "TestBot: know that sqlite is a small database",
+	                  false, false);
+	TEST_ASSERT_EQUAL_STRING("sqlite is a small database",
+	                         ask("what is sqlite"));
+	TEST_ASSERT_EQUAL_STRING("cbot is the best bot", ask("what is cbot"));
+	/* But there are no suggestions, and no searches */
+	TEST_ASSERT_EQUAL_STRING("Sorry, I don't know anything about the bot",
+	                         ask("what is the bot"));
+	PT_messages_clear(bot);
+	PT_inject_message(bot, "#test", "bob",
+	                  "TestBot: what do you know about database?", false,
+	                  false);
+	TEST_ASSERT_EQUAL_INT(0, PT_messages_count(bot));
+
+	/* Once it's enabled again, the index catches up */
+	PT_unload_plugin(plugin);
+	plugin = PT_load_plugin(bot, &ops, "sqlknow");
+	TEST_ASSERT_NOT_NULL(plugin);
+	TEST_ASSERT_EQUAL_STRING("sqlite is a small database",
+	                         ask("what do you know about database"));
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_exact);
+	RUN_TEST(test_search_ranked);
+	RUN_TEST(test_suggestion);
+	RUN_TEST(test_complete);
+	RUN_TEST(test_index_follows_updates);
+	RUN_TEST(test_migrate);
+	RUN_TEST(test_without_fts);
+	return UNITY_END();
+}
@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <unity.h>
+
+#include "../src/cbot_private.h"
+
+static struct cbot *bot;
+static char path[] = "/tmp/cbot-trace-XXXXXX";
+
+void setUp(void)
+{
+	int fd = mkstemp(path);
+	TEST_ASSERT(fd >= 0);
+	close(fd);
+	bot = cbot_create();
+}
+
+void tearDown(void)
+{
+	unlink(path);
+	strcpy(path, "/tmp/cbot-trace-XXXXXX");
+	cbot_delete(bot);
+}
+
+static void test_round_trip(void)
+{
+	struct cbot_trace_reader *r;
+	struct cbot_trace_event ev;
+	char long_message[1000];
+	uint64_t last;
+
+	memset(long_message, 'x', sizeof(long_message) - 1);
+	long_message[sizeof(long_message) - 1] = '\0';
+
+	TEST_ASSERT_EQUAL(0, cbot_trace_open(bot, path));
+	cbot_trace_message(bot, "#chan", "alice", "hello", false, false);
+	cbot_trace_message(bot, "bob", "bob", long_message, true, true);
+	cbot_trace_user(bot, "#chan", "carol", CBOT_PART);
+	cbot_trace_nick(bot, "carol", "dave");
+	cbot_trace_close(bot);
+
+	r = cbot_trace_reader_open(path);
+	TEST_ASSERT_NOT_NULL(r);
+
+	TEST_ASSERT_EQUAL(1, cbot_trace_read(r, &ev));
+	TEST_ASSERT_EQUAL(CBOT_TRACE_MESSAGE, ev.kind);
+	TEST_ASSERT_EQUAL_STRING("#chan", ev.channel);
+	TEST_ASSERT_EQUAL_STRING("alice", ev.user);
+	TEST_ASSERT_EQUAL_STRING("hello", ev.message);
+	TEST_ASSERT_FALSE(ev.action);
+	TEST_ASSERT_FALSE(ev.is_dm);
+	last = ev.ns;
+
+	TEST_ASSERT_EQUAL(1, cbot_trace_read(r, &ev));
+	TEST_ASSERT_EQUAL(CBOT_TRACE_MESSAGE, ev.kind);
+	TEST_ASSERT_EQUAL_STRING("bob", ev.channel);
+	TEST_ASSERT_EQUAL_STRING(long_message, ev.message);
+	TEST_ASSERT_TRUE(ev.action);
+	TEST_ASSERT_TRUE(ev.is_dm);
+	TEST_ASSERT(ev.ns >= last);
+
+	TEST_ASSERT_EQUAL(1, cbot_trace_read(r, &ev));
+	TEST_ASSERT_EQUAL(CBOT_TRACE_USER, ev.kind);
+	TEST_ASSERT_EQUAL(CBOT_PART, ev.type);
+	TEST_ASSERT_EQUAL_STRING("#chan", ev.channel);
+	TEST_ASSERT_EQUAL_STRING("carol", ev.user);
+
+	TEST_ASSERT_EQUAL(1, cbot_trace_read(r, &ev));
+	TEST_ASSERT_EQUAL(CBOT_TRACE_NICK, ev.kind);
+	TEST_ASSERT_EQUAL_STRING("carol", ev.user);
+	TEST_ASSERT_EQUAL_STRING("dave", ev.message);
+
+	TEST_ASSERT_EQUAL(0, cbot_trace_read(r, &ev));
+	cbot_trace_reader_close(r);
+}
+
+static void test_truncated(void)
+{
+	struct cbot_trace_reader *r;
+	struct cbot_trace_event ev;
+
+	TEST_ASSERT_EQUAL(0, cbot_trace_open(bot, path));
+	cbot_trace_message(bot, "#chan", "alice", "hello", false, false);
+	cbot_trace_close(bot);
+	TEST_ASSERT_EQUAL(0, truncate(path, 16 + 5));
+
+	r = cbot_trace_reader_open(path);
+	TEST_ASSERT_NOT_NULL(r);
+	TEST_ASSERT_EQUAL(-1, cbot_trace_read(r, &ev));
+	cbot_trace_reader_close(r);
+}
+
+static void test_corrupt_length(void)
+{
+	struct cbot_trace_reader *r;
+	struct cbot_trace_event ev;
+	FILE *f;
+	int i;
+
+	TEST_ASSERT_EQUAL(0, cbot_trace_open(bot, path));
+	cbot_trace_close(bot);
+
+	/* A message whose channel claims to be nearly 2^63 bytes long */
+	f = fopen(path, "ab");
+	TEST_ASSERT_NOT_NULL(f);
+	putc(CBOT_TRACE_MESSAGE, f);
+	putc(0, f);
+	for (i = 0; i < 8; i++)
+		putc(0xFF, f);
+	putc(0x7F, f);
+	fputs("#chan", f);
+	fclose(f);
+
+	r = cbot_trace_reader_open(path);
+	TEST_ASSERT_NOT_NULL(r);
+	TEST_ASSERT_EQUAL(-1, cbot_trace_read(r, &ev));
+	cbot_trace_reader_close(r);
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_round_trip);
+	RUN_TEST(test_truncated);
+	RUN_TEST(test_corrupt_length);
+	return UNITY_END();
+}